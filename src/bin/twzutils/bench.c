@@ -23,10 +23,15 @@ void timespec_diff(struct timespec *start, struct timespec *stop, struct timespe
 	return;
 }
 
-void do_test(char *mem, long stride, int w)
+/* touch this much of the object, so that strides of up to 2 MiB hit many different pages (and TLB
+ * entries) without needing a multi-GB object */
+#define BENCH_SPAN (256ul * 1024 * 1024)
+#define BENCH_ITERS 100000000ul
+
+void do_test(char *mem, long stride, int w, unsigned long iters)
 {
-	for(unsigned long i = 0; i < 1000000000ul; i++) {
-		char *x = mem + (i * stride) % (1024 * 1024 * 1024 - OBJ_NULLPAGE_SIZE);
+	for(unsigned long i = 0; i < iters; i++) {
+		char *x = mem + (i * stride) % BENCH_SPAN;
 		char r = 0;
 		if(w)
 			*x = stride;
@@ -36,26 +41,51 @@ void do_test(char *mem, long stride, int w)
 	}
 }
 
+static double run_test(char *mem, long stride, int w)
+{
+	struct timespec st, en, df;
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	do_test(mem, stride, w, BENCH_ITERS);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+	timespec_diff(&st, &en, &df);
+	return df.tv_sec + (double)df.tv_nsec / 1000000000.0;
+}
+
+/* TLB-bound strided access over an object backed by small pages, and then over one backed by 2 MiB
+ * frames (TWZ_OC_LARGEPAGES). */
 int main()
 {
-	twzobj obj;
-	if(twz_object_new(&obj, NULL, NULL, OBJ_VOLATILE, TWZ_OC_DFL_READ | TWZ_OC_DFL_WRITE) < 0)
+	twzobj small, large;
+	if(twz_object_new(&small, NULL, NULL, OBJ_VOLATILE, TWZ_OC_DFL_READ | TWZ_OC_DFL_WRITE) < 0)
+		abort();
+	if(twz_object_new(&large,
+	     NULL,
+	     NULL,
+	     OBJ_VOLATILE,
+	     TWZ_OC_DFL_READ | TWZ_OC_DFL_WRITE | TWZ_OC_LARGEPAGES)
+	   < 0)
 		abort();
 
-	// char *mem = twz_object_base(&obj);
+	char *smem = (char *)twz_object_base(&small);
+	char *lmem = (char *)twz_object_base(&large);
 
-	struct timespec st, en, df;
+	/* populate both objects first, so we measure translation and not faults */
+	for(size_t off = 0; off < BENCH_SPAN; off += 0x1000) {
+		smem[off] = 1;
+		lmem[off] = 1;
+	}
 
-	for(int i = 0; i < 80; i++) {
-		clock_gettime(CLOCK_MONOTONIC, &st);
-		for(long i = 0; i < 1000000000l; i++)
-			asm volatile("" ::"m"(i) : "memory");
-		//	do_test(mem, 1ul << (i / 4 + 1), (i / 2) % 2);
-		clock_gettime(CLOCK_MONOTONIC, &en);
-		timespec_diff(&st, &en, &df);
-		printf("stride %ld, w=%d: %lf seconds\n",
-		  1ul << (i / 4 + 1),
-		  (i / 2) % 2,
-		  df.tv_sec + (double)df.tv_nsec / 1000000000.0);
+	for(long stride = 64; stride <= 2 * 1024 * 1024; stride *= 2) {
+		for(int w = 0; w < 2; w++) {
+			double s = run_test(smem, stride, w);
+			double l = run_test(lmem, stride, w);
+			printf("stride %8ld, w=%d: 4K pages %lf s, 2M pages %lf s (%.2fx)\n",
+			  stride,
+			  w,
+			  s,
+			  l,
+			  l > 0 ? s / l : 0.0);
+		}
 	}
+	return 0;
 }
@@ -0,0 +1,57 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* An exec-heavy loop, like a shell script that keeps spawning a tiny program: fork, exec the
+ * program (by default busybox's true), and wait for it, over and over. execve loads every ELF
+ * segment with sys_ocopy, so this is mostly a measure of how much object_copy (and the TLB
+ * shootdowns it causes) costs. Usage: execbench [iterations] [program]. */
+
+#define EXECBENCH_ITERS 1000
+
+int main(int argc, char **argv)
+{
+	long iters = argc > 1 ? strtol(argv[1], NULL, 0) : EXECBENCH_ITERS;
+	char *prog = argc > 2 ? argv[2] : "/usr/bin/true";
+	if(iters <= 0) {
+		fprintf(stderr, "usage: execbench [iterations] [program]\n");
+		return 1;
+	}
+
+	struct timespec st, en;
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	for(long i = 0; i < iters; i++) {
+		pid_t pid = fork();
+		if(pid == -1) {
+			perror("fork");
+			return 1;
+		}
+		if(!pid) {
+			execv(prog, (char *[]){ prog, NULL });
+			_exit(127);
+		}
+		int status;
+		if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "execbench: %s failed on iteration %ld\n", prog, i);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	double secs = (en.tv_sec - st.tv_sec) + (en.tv_nsec - st.tv_nsec) / 1000000000.0;
+	printf("%ld execs of %s in %lf s: %.1f execs/s, %.1f us per exec\n",
+	  iters,
+	  prog,
+	  secs,
+	  iters / secs,
+	  secs * 1000000.0 / iters);
+	return 0;
+}
@@ -16,6 +16,7 @@
 #include <twz/twztry.h>
 #include <unistd.h>
 static bool opt_meta = false, opt_data = false, opt_kernel = false, opt_kpage = false;
+static bool opt_sctx = false;
 
 static char *cache_mode_str[] = {
 	[OC_CM_WB] = "wb",
@@ -58,8 +59,8 @@ static int do_object_kernel(twzobj *obj)
 static int do_object_kpage(twzobj *obj)
 {
 	printf("   page# flags level cowcount\n");
+	struct kernel_ostat_page st = {};
 	for(size_t i = 0; i < OBJ_MAXSIZE / 0x1000; i++) {
-		struct kernel_ostat_page st;
 		if(twz_object_kstat_page(obj, i, &st) == 0) {
 			if(st.flags & OS_PAGE_EXIST) {
 				char ff[3], *ffp = ff;
@@ -70,6 +71,31 @@ static int do_object_kpage(twzobj *obj)
 			}
 		}
 	}
+	printf("faults: %ld (%ld pages mapped by fault-around)\n", st.obj_faults, st.obj_fault_around);
+	return 0;
+}
+
+static int do_object_ksctx(twzobj *obj)
+{
+	struct kernel_ostat_sctx st;
+	int r;
+
+	if((r = twz_object_kstat_sctx(obj, &st))) {
+		fprintf(stderr, "ostat: not a security context\n");
+		return 0;
+	}
+
+	uint64_t hits = st.pcpu_hits + st.hits;
+	printf("PERMISSION CACHE\n");
+	printf(" lookups  pcpu-hit   ctx-hit      miss  hit%% #inval #entries\n");
+	printf("%8ld  %8ld  %8ld  %8ld  %3ld%% %6ld %8ld\n",
+	  st.lookups,
+	  st.pcpu_hits,
+	  st.hits,
+	  st.misses,
+	  st.lookups ? hits * 100 / st.lookups : 0,
+	  st.invalidations,
+	  st.entries);
 	return 0;
 }
 
@@ -184,6 +210,9 @@ static int do_object(char *name)
 		if(opt_kpage) {
 			ret = do_object_kpage(&obj);
 		}
+		if(opt_sctx) {
+			ret = do_object_ksctx(&obj);
+		}
 	}
 	twzcatch_all
 	{
@@ -203,12 +232,13 @@ static void usage(void)
 	fprintf(stderr, "       -d   Show data\n");
 	fprintf(stderr, "       -k   Show kernel info\n");
 	fprintf(stderr, "       -p   Show kernel pages info\n");
+	fprintf(stderr, "       -s   Show security context permission cache info\n");
 }
 
 int main(int argc, char **argv)
 {
 	int c;
-	while((c = getopt(argc, argv, "mdkp")) != EOF) {
+	while((c = getopt(argc, argv, "mdkps")) != EOF) {
 		switch(c) {
 			case 'm':
 				opt_meta = true;
@@ -222,6 +252,9 @@ int main(int argc, char **argv)
 			case 'p':
 				opt_kpage = true;
 				break;
+			case 's':
+				opt_sctx = true;
+				break;
 			default:
 				usage();
 				exit(1);
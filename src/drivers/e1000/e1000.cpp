@@ -391,6 +391,8 @@ void e1000c_interrupt(e1000_controller *nc)
 void e1000_wait_for_event(e1000_controller *nc)
 {
 	kso_set_name(NULL, "e1000.event_handler");
+	/* interrupt latency matters more here than fairness with CPU-bound threads */
+	sys_thrd_ctl(THRD_CTL_SET_SCHED, THRD_SCHED_DRIVER);
 	struct device_repr *repr = twz_device_getrepr(&nc->ctrl_obj);
 	struct sys_thread_sync_args sa[MAX_DEVICE_INTERRUPTS + 1];
 	twz_thread_sync_init(&sa[0], THREAD_SYNC_SLEEP, &repr->syncs[DEVICE_SYNC_IOV_FAULT], 0);
@@ -658,6 +658,8 @@ void nvmeq_interrupt(nvme_controller *nc, nvme_queue *q)
 void nvme_wait_for_event(nvme_controller *nc)
 {
 	kso_set_name(NULL, "nvme.event_handler");
+	/* interrupt latency matters more here than fairness with CPU-bound threads */
+	sys_thrd_ctl(THRD_CTL_SET_SCHED, THRD_SCHED_DRIVER);
 	struct device_repr *repr = twz_device_getrepr(&nc->co);
 	struct sys_thread_sync_args sa[MAX_DEVICE_INTERRUPTS + 1];
 	twz_thread_sync_init(&sa[0], THREAD_SYNC_SLEEP, &repr->syncs[DEVICE_SYNC_IOV_FAULT], 0);
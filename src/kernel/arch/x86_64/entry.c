@@ -20,15 +20,17 @@ void x86_64_signal_eoi(void);
 /* NOTE: Twizzler's TLB shootdown method leaves a lot to be desired. However, remember that our goal
  * is _not_ to research good TLB shootdown algs (at least, not yet ;) ). */
 void x86_64_ipi_tlb_shootdown(void)
+{
+	/* the ranges to flush are in our mailbox (see arch_mm_objspace_invalidate_batch) */
+	x86_64_shootdown_drain();
+}
+
+void x86_64_tlb_flush_all(void)
 {
 	asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3; mfence;" ::: "memory", "rax");
 	int x;
 	/* TODO: better invalidation scheme */
-	/* TODO: separate IPI for this? */
 	asm volatile("invept %0, %%rax" ::"m"(x), "r"(0));
-	if(current_processor)
-		current_processor->stats.shootdowns++;
-	processor_ipi_finish();
 }
 
 void x86_64_ipi_resume(void)
@@ -244,6 +246,8 @@ __noinstrument void arch_thread_resume(struct thread *thread, uint64_t timeout)
 
 	if(old && old != thread) {
 		asm volatile("xsave (%0)" ::"r"(old->arch.xsave_run->start), "a"(7), "d"(0) : "memory");
+		/* old's state is now entirely in its thread structure, so it may run elsewhere */
+		old->on_cpu = false;
 	}
 
 	if(!thread->arch.fpu_init) {
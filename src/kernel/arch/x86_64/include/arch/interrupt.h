@@ -8,6 +8,8 @@
 	__orderedafter(MADT_INITIALIZER_ORDER) + __orderedafter(PROCESSOR_INITIALIZER_ORDER)
 
 void x86_64_ipi_tlb_shootdown(void);
+void x86_64_shootdown_drain(void);
+void x86_64_tlb_flush_all(void);
 void x86_64_ipi_resume(void);
 void x86_64_ipi_halt(void);
 void x86_64_signal_eoi(void);
@@ -86,3 +86,23 @@ void table_level_destroy(struct table_level *tl);
 #define PDPT_IDX(v) (((v) >> 30) & 0x1FF)
 #define PD_IDX(v) (((v) >> 21) & 0x1FF)
 #define PT_IDX(v) (((v) >> 12) & 0x1FF)
+
+/* Zero a region (len must be a multiple of 64) using non-temporal stores, so that background
+ * zeroing doesn't evict useful data from the caches. */
+static inline void arch_mm_zero_nontemporal(void *addr, size_t len)
+{
+	uint64_t *p = addr;
+	for(size_t i = 0; i < len / sizeof(uint64_t); i += 8) {
+		asm volatile("movnti %1, 0(%0);"
+		             "movnti %1, 8(%0);"
+		             "movnti %1, 16(%0);"
+		             "movnti %1, 24(%0);"
+		             "movnti %1, 32(%0);"
+		             "movnti %1, 40(%0);"
+		             "movnti %1, 48(%0);"
+		             "movnti %1, 56(%0);" ::"r"(&p[i]),
+		             "r"(0ul)
+		             : "memory");
+	}
+	asm volatile("sfence" ::: "memory");
+}
@@ -1,9 +1,24 @@
 #pragma once
 
 #include <arch/memory.h>
+#include <lib/list.h>
+#include <processor.h>
+
+#define OBJSPACE_CPUMASK_WORDS ((PROCESSOR_MAX_CPUS + 63) / 64)
+
 struct arch_object_space {
 	struct table_level root;
+	struct list entry;
+	/* CPUs that may have translations from this space cached: set when a CPU loads the space, and
+	 * cleared when the CPU flushes everything while running a different space */
+	_Atomic uint64_t cpus[OBJSPACE_CPUMASK_WORDS];
 };
 struct arch_objspace_region {
 	struct table_level table;
+	/* if non-zero, the region is mapped by a single 2 MiB EPT entry (this one, modulo each space's
+	 * permissions) instead of through table */
+	uint64_t large;
 };
+
+struct object_space;
+void x86_64_objspace_activate(struct object_space *space);
@@ -122,6 +122,7 @@ __attribute__((const, always_inline)) static inline struct thread *__x86_64_get_
 
 struct processor;
 void arch_processor_reset_current_thread(struct processor *proc);
+void arch_processor_release_current_thread(struct processor *proc);
 
 #define current_thread __x86_64_get_current_thread()
 
@@ -144,6 +144,12 @@ void x86_64_invvpid(uint64_t type, uint64_t addr);
 #define EPT_MEMTYPE_UC (0)
 #define EPT_IGNORE_PAT (1 << 6)
 #define EPT_LARGEPAGE (1 << 7)
+#define EPT_ACCESSED (1 << 8)
+#define EPT_DIRTY (1 << 9)
+
+/* EPTP: WB paging structures, 4-level walk, and accessed/dirty flags enabled (the object space
+ * code relies on the dirty flag to tell if a page was ever written). */
+#define EPTP_FLAGS (6 | (3 << 3) | (1 << 6))
 
 #define RECUR_ATTR_MASK (EPT_READ | EPT_WRITE | EPT_EXEC)
 
@@ -1,4 +1,6 @@
+#include <arch/interrupt.h>
 #include <arch/x86_64-vmx.h>
+#include <lib/iter.h>
 #include <memory.h>
 #include <object.h>
 #include <objspace.h>
@@ -23,11 +25,119 @@ size_t arch_mm_objspace_region_size(void)
 
 extern struct object_space _bootstrap_object_space;
 
+/* all object spaces, so that a region's large mapping can be found (and broken up) in each one */
+static DECLARE_LIST(all_spaces);
+static struct spinlock all_spaces_lock = SPINLOCK_INIT;
+
+#define EPT_PERM_MASK (EPT_READ | EPT_WRITE | EPT_EXEC | (1 << 10))
+
 void arch_objspace_region_init(struct objspace_region *region)
 {
 	/* TODO: need arch_destroy */
 	region->arch.table.flags = TABLE_OSPACE;
 	region->arch.table.lock = RWLOCK_INIT;
+	region->arch.large = 0;
+}
+
+static uint64_t __page_memtype(struct page *page)
+{
+	switch(PAGE_CACHE_TYPE(page)) {
+		default:
+		case PAGE_CACHE_WB:
+			return EPT_MEMTYPE_WB;
+		case PAGE_CACHE_UC:
+			return EPT_MEMTYPE_UC;
+		case PAGE_CACHE_WT:
+			return EPT_MEMTYPE_WT;
+		case PAGE_CACHE_WC:
+			return EPT_MEMTYPE_WC;
+	}
+}
+
+static struct table_level *__space_pd(struct object_space *space, uintptr_t addr)
+{
+	struct table_level *table = &space->arch.root;
+	if(!table->children || !(table = table->children[PML4_IDX(addr)]))
+		return NULL;
+	if(!table->children || !(table = table->children[PDPT_IDX(addr)]))
+		return NULL;
+	return table;
+}
+
+/* Stop mapping a region with a large entry: every space that has the large entry gets pointed back
+ * at the region's table, and (if fill) the table is populated with the small pages of the frame.
+ * If any space wrote to the frame, the dirty bit carries over to the small entries (or, if not
+ * filling, is reported for the whole region in dirty). Must hold the region's lock for writing. */
+static void __region_demote(struct objspace_region *region, bool fill, uint64_t *dirty)
+{
+	uint64_t large = region->arch.large;
+	uintptr_t phys = large & EPT_PAGE_MASK;
+	uint64_t was_dirty = 0;
+	table_realize(&region->arch.table);
+
+	spinlock_acquire_save(&all_spaces_lock);
+	foreach(e, list, &all_spaces) {
+		struct object_space *space = list_entry(e, struct object_space, arch.entry);
+		struct rwlock_result res = rwlock_wlock(&space->arch.root.lock, RWLOCK_RECURSE);
+		struct table_level *pd = __space_pd(space, region->addr);
+		int idx = PD_IDX(region->addr);
+		if(pd && !pd->children[idx] && (pd->table[idx] & EPT_LARGEPAGE)
+		   && (pd->table[idx] & EPT_PAGE_MASK) == phys) {
+			was_dirty |= pd->table[idx] & EPT_DIRTY;
+			pd->table[idx] = region->arch.table.phys | (pd->table[idx] & EPT_PERM_MASK);
+			pd->children[idx] = &region->arch.table;
+		}
+		rwlock_wunlock(&res);
+	}
+	spinlock_release_restore(&all_spaces_lock);
+
+	region->arch.large = 0;
+	size_t nr = mm_objspace_region_size() / mm_page_size(0);
+	if(fill) {
+		uint64_t flags = (large & ~(EPT_PAGE_MASK | EPT_LARGEPAGE | EPT_ACCESSED)) | was_dirty;
+		for(size_t i = 0; i < nr; i++) {
+			region->arch.table.table[i] = flags | (phys + i * mm_page_size(0));
+		}
+		region->arch.table.count = nr;
+	} else if(was_dirty && dirty) {
+		for(size_t i = 0; i < OBJSPACE_DIRTY_WORDS; i++)
+			dirty[i] = ~0ul;
+	}
+	arch_mm_objspace_invalidate(NULL, region->addr, mm_objspace_region_size(), 0);
+}
+
+/* Map the whole region with one 2 MiB entry for the frame described by pages (as returned by
+ * mm_page_alloc_large). Spaces pick up the large entry when they next call
+ * arch_objspace_region_map. */
+void arch_objspace_region_map_large(struct objspace_region *region,
+  struct page *pages,
+  uint64_t flags)
+{
+	uint64_t mapflags = EPT_IGNORE_PAT | EPT_LARGEPAGE | __page_memtype(pages);
+	mapflags |= (flags & MAP_READ) ? EPT_READ : 0;
+	mapflags |= (flags & MAP_WRITE) ? EPT_WRITE : 0;
+	mapflags |= (flags & MAP_EXEC) ? EPT_EXEC | (1 << 10) : 0;
+	if(flags & PAGE_MAP_COW)
+		mapflags &= ~EPT_WRITE;
+
+	struct rwlock_result res = rwlock_wlock(&region->arch.table.lock, 0);
+	if(region->arch.large) {
+		rwlock_wunlock(&res);
+		return;
+	}
+	table_realize(&region->arch.table);
+	/* any small entries left over map pages of this frame; keep their dirty state */
+	size_t nr = mm_objspace_region_size() / mm_page_size(0);
+	for(size_t i = 0; i < nr; i++) {
+		uint64_t entry = region->arch.table.table[i];
+		if((entry & EPT_DIRTY) && (entry & EPT_PAGE_MASK) == mm_page_addr(&pages[i]))
+			mm_page_mark_dirty(&pages[i]);
+		region->arch.table.table[i] = 0;
+	}
+	region->arch.table.count = 0;
+	region->arch.large = mapflags | mm_page_addr(pages);
+	rwlock_wunlock(&res);
+	arch_mm_objspace_invalidate(NULL, region->addr, mm_objspace_region_size(), 0);
 }
 
 void arch_objspace_print_mapping(struct object_space *space, uintptr_t virt)
@@ -98,21 +208,18 @@ void arch_objspace_map(struct object_space *space,
 		uint64_t cf = EPT_MEMTYPE_WB;
 		if(pages) {
 			addr = mm_page_addr(pages[i]);
-			switch(PAGE_CACHE_TYPE(pages[i])) {
-				case PAGE_CACHE_WB:
-				default:
-					break;
-				case PAGE_CACHE_UC:
-					cf = EPT_MEMTYPE_UC;
-					break;
-				case PAGE_CACHE_WT:
-					cf = EPT_MEMTYPE_WT;
-					break;
-				case PAGE_CACHE_WC:
-					cf = EPT_MEMTYPE_WC;
-					break;
-			}
+			cf = __page_memtype(pages[i]);
 		} else if(mapflags & MAP_ZERO) {
+			/* use a 2 MiB frame (mapped by a single PD entry) whenever a whole one fits */
+			size_t nr = mm_page_size(1) / mm_page_size(0);
+			if(!(virt & (mm_page_size(1) - 1)) && count - i >= nr
+			   && (addr = mm_page_alloc_large_addr(PAGE_ZERO))) {
+				table_map(
+				  &arch->root, virt, addr, 1, flags | cf, EPT_WRITE | EPT_READ | EPT_EXEC, true);
+				i += nr - 1;
+				virt += mm_page_size(1) - mm_page_size(0);
+				continue;
+			}
 			addr = mm_page_alloc_addr(PAGE_ZERO);
 		} else if(!(mapflags & MAP_TABLE_PREALLOC)) {
 			panic("invalid page mapping strategy");
@@ -137,6 +244,8 @@ void arch_objspace_unmap(struct object_space *space, uintptr_t addr, size_t nrpa
 	}
 }
 
+/* Returns true if entry idx was already in use: the caller must invalidate it, unless
+ * PAGE_MAP_NOREPLACE was given (in which case it was left alone). */
 bool arch_objspace_region_map_page(struct objspace_region *region,
   size_t idx,
   struct page *page,
@@ -144,59 +253,83 @@ bool arch_objspace_region_map_page(struct objspace_region *region,
 {
 	assert(idx < 512);
 	/* TODO: do we want to ignore PAT? */
-	uint64_t mapflags = EPT_IGNORE_PAT;
+	uint64_t mapflags = EPT_IGNORE_PAT | __page_memtype(page);
 	mapflags |= (flags & MAP_READ) ? EPT_READ : 0;
 	mapflags |= (flags & MAP_WRITE) ? EPT_WRITE : 0;
 	mapflags |= (flags & MAP_EXEC) ? EPT_EXEC | (1 << 10) : 0;
 
-	switch(PAGE_CACHE_TYPE(page)) {
-		case PAGE_CACHE_WB:
-			mapflags |= EPT_MEMTYPE_WB;
-			break;
-		case PAGE_CACHE_UC:
-			mapflags |= EPT_MEMTYPE_UC;
-			break;
-		case PAGE_CACHE_WT:
-			mapflags |= EPT_MEMTYPE_WT;
-			break;
-		case PAGE_CACHE_WC:
-			mapflags |= EPT_MEMTYPE_WC;
-			break;
-	}
-
 	if(flags & PAGE_MAP_COW)
 		mapflags &= ~EPT_WRITE;
 
 	struct rwlock_result res = rwlock_wlock(&region->arch.table.lock, 0);
+	if(region->arch.large) {
+		if(flags & PAGE_MAP_NOREPLACE) {
+			rwlock_wunlock(&res);
+			return true;
+		}
+		/* one page of the region is changing (e.g. breaking COW); go back to small pages */
+		__region_demote(region, true, NULL);
+	}
 	table_realize(&region->arch.table);
 	bool ret = true;
-	if(region->arch.table.table[idx] == 0) {
+	uint64_t old = region->arch.table.table[idx];
+	if(old && (flags & PAGE_MAP_NOREPLACE)) {
+		rwlock_wunlock(&res);
+		return true;
+	}
+	if(old == 0) {
 		region->arch.table.count++;
 		ret = false;
+	} else if((old & EPT_PAGE_MASK) == mm_page_addr(page)) {
+		/* remapping the same page (e.g. changing permissions); don't lose the dirty bit */
+		mapflags |= old & EPT_DIRTY;
 	}
 	region->arch.table.table[idx] = mapflags | mm_page_addr(page);
 	rwlock_wunlock(&res);
 	return ret;
 }
 
-void arch_objspace_region_cow(struct objspace_region *region, size_t start, size_t len)
+static inline void __report_dirty(uint64_t entry, uint64_t *dirty, size_t i)
+{
+	if(dirty && (entry & EPT_DIRTY)) {
+		dirty[i / 64] |= 1ul << (i % 64);
+	}
+}
+
+/* Both of these optionally report which entries had the EPT dirty bit set in the dirty bitmap (bit
+ * i corresponds to entry start + i). Since write access is taken away, the dirty bit is cleared as
+ * it is reported (it can't get set again until the page is re-mapped writable). */
+void arch_objspace_region_cow(struct objspace_region *region,
+  size_t start,
+  size_t len,
+  uint64_t *dirty)
 {
 	struct rwlock_result res = rwlock_wlock(&region->arch.table.lock, 0);
+	if(region->arch.large)
+		__region_demote(region, true, NULL);
 	if(region->arch.table.table == NULL) {
 		rwlock_wunlock(&res);
 		return;
 	}
 
 	for(size_t i = 0; i < len; i++) {
-		region->arch.table.table[i + start] &= ~EPT_WRITE;
+		__report_dirty(region->arch.table.table[i + start], dirty, i);
+		region->arch.table.table[i + start] &= ~(EPT_WRITE | EPT_DIRTY);
 	}
 
 	rwlock_wunlock(&res);
 }
 
-void arch_objspace_region_unmap(struct objspace_region *region, size_t start, size_t len)
+void arch_objspace_region_unmap(struct objspace_region *region,
+  size_t start,
+  size_t len,
+  uint64_t *dirty)
 {
 	struct rwlock_result res = rwlock_wlock(&region->arch.table.lock, 0);
+	if(region->arch.large) {
+		bool all = start == 0 && len == mm_objspace_region_size() / mm_page_size(0);
+		__region_demote(region, !all, dirty);
+	}
 	if(region->arch.table.table == NULL) {
 		rwlock_wunlock(&res);
 		return;
@@ -206,6 +339,7 @@ void arch_objspace_region_unmap(struct objspace_region *region, size_t start, si
 		if(region->arch.table.table[i + start]) {
 			region->arch.table.count--;
 		}
+		__report_dirty(region->arch.table.table[i + start], dirty, i);
 		region->arch.table.table[i + start] = 0;
 		assert(region->arch.table.children[i + start] == NULL);
 	}
@@ -234,6 +368,8 @@ void arch_objspace_region_map(struct object_space *space,
 	mapflags |= (flags & MAP_WRITE) ? EPT_WRITE : 0;
 	mapflags |= (flags & MAP_EXEC) ? EPT_EXEC | (1 << 10) : 0;
 
+	/* lock order: region, then space (the same as __region_demote) */
+	struct rwlock_result rres = rwlock_rlock(&region->arch.table.lock, 0);
 	struct rwlock_result res = rwlock_wlock(&table->lock, RWLOCK_RECURSE);
 	table = table_get_next_level(
 	  table, pml4_idx, EPT_READ | EPT_WRITE | EPT_EXEC | (1 << 10), true, NULL);
@@ -242,9 +378,16 @@ void arch_objspace_region_map(struct object_space *space,
 	table_realize(&region->arch.table);
 	if(!table->table[pd_idx])
 		table->count++;
-	table->table[pd_idx] = region->arch.table.phys | mapflags;
-	table->children[pd_idx] = &region->arch.table;
+	if(region->arch.large) {
+		uint64_t large = region->arch.large;
+		table->table[pd_idx] = (large & ~EPT_PERM_MASK) | (large & mapflags);
+		table->children[pd_idx] = NULL;
+	} else {
+		table->table[pd_idx] = region->arch.table.phys | mapflags;
+		table->children[pd_idx] = &region->arch.table;
+	}
 	rwlock_wunlock(&res);
+	rwlock_runlock(&rres);
 }
 
 uintptr_t arch_mm_objspace_get_phys(struct object_space *space, uintptr_t oaddr)
@@ -257,17 +400,207 @@ uintptr_t arch_mm_objspace_get_phys(struct object_space *space, uintptr_t oaddr)
 	if(!table_readmap(&arch->root, oaddr, &entry, &level)) {
 		return (uintptr_t)-1;
 	}
+	if(level > 0) {
+		/* large entry; add in the offset of the small page within it */
+		return (entry & EPT_PAGE_MASK & ~(mm_page_size(level) - 1))
+		       + (oaddr & (mm_page_size(level) - 1) & ~(mm_page_size(0) - 1));
+	}
 	return entry & EPT_PAGE_MASK;
 }
 
+/* TLB shootdowns. Other CPUs post the ranges a CPU needs to flush to its mailbox, and then send
+ * it an IPI, but only if it may have translations for the ranges (see arch_object_space.cpus),
+ * doesn't have an IPI on the way already, and isn't idle. Idle CPUs only touch the kernel part of
+ * the object space, so they can flush object ranges on their way out of the idle loop instead. */
+struct shootdown_mailbox {
+	struct spinlock lock;
+	struct objspace_invl invl;
+	bool pending;
+	bool lazy;
+	struct object_space *space;
+} __attribute__((aligned(64)));
+
+static struct shootdown_mailbox mailboxes[PROCESSOR_MAX_CPUS];
+
+static inline void __cpumask_set(_Atomic uint64_t *mask, unsigned int id)
+{
+	atomic_fetch_or(&mask[id / 64], 1ul << (id % 64));
+}
+
+static inline void __cpumask_clear(_Atomic uint64_t *mask, unsigned int id)
+{
+	atomic_fetch_and(&mask[id / 64], ~(1ul << (id % 64)));
+}
+
+/* the current CPU is switching to space */
+void x86_64_objspace_activate(struct object_space *space)
+{
+	struct processor *proc = current_processor;
+	__cpumask_set(space->arch.cpus, proc->id);
+	mailboxes[proc->id].space = space;
+}
+
+static void __invl_local(struct objspace_invl *invl)
+{
+	if(invl->all) {
+		x86_64_tlb_flush_all();
+		return;
+	}
+	for(size_t i = 0; i < invl->count; i++) {
+		x86_64_invvpid(invl->ranges[i].start, invl->ranges[i].len);
+	}
+}
+
+/* Flush whatever has been posted to this CPU's mailbox. Called with interrupts disabled. */
+void x86_64_shootdown_drain(void)
+{
+	struct processor *proc = current_processor;
+	if(!proc)
+		return;
+	struct shootdown_mailbox *mb = &mailboxes[proc->id];
+	struct objspace_invl invl;
+	spinlock_acquire_save(&mb->lock);
+	invl = mb->invl;
+	mb->invl.count = 0;
+	mb->invl.all = false;
+	mb->pending = false;
+	spinlock_release_restore(&mb->lock);
+	if(!invl.all && !invl.count)
+		return;
+	__invl_local(&invl);
+	proc->stats.shootdowns++;
+	if(invl.all) {
+		/* nothing cached from any other space any more */
+		spinlock_acquire_save(&all_spaces_lock);
+		foreach(e, list, &all_spaces) {
+			struct object_space *space = list_entry(e, struct object_space, arch.entry);
+			if(space != mb->space)
+				__cpumask_clear(space->arch.cpus, proc->id);
+		}
+		spinlock_release_restore(&all_spaces_lock);
+	}
+}
+
+/* Called by the scheduler as this CPU enters (idle = true) and leaves the idle loop. */
+void arch_mm_objspace_idle(bool idle)
+{
+	struct processor *proc = current_processor;
+	struct shootdown_mailbox *mb = &mailboxes[proc->id];
+	spinlock_acquire_save(&mb->lock);
+	mb->lazy = idle;
+	bool work = mb->invl.all || mb->invl.count;
+	spinlock_release_restore(&mb->lock);
+	if(!idle && work) {
+		bool fl = arch_interrupt_set(false);
+		x86_64_shootdown_drain();
+		proc->stats.shootdown_lazy++;
+		arch_interrupt_set(fl);
+	}
+}
+
+/* OR into mask the CPUs of every space that maps a region touched by invl */
+static void __invl_targets(struct objspace_invl *invl, uint64_t *mask)
+{
+	spinlock_acquire_save(&all_spaces_lock);
+	foreach(e, list, &all_spaces) {
+		struct object_space *space = list_entry(e, struct object_space, arch.entry);
+		bool maps = false;
+		for(size_t i = 0; i < invl->count && !maps; i++) {
+			uintptr_t start = align_down(invl->ranges[i].start, mm_objspace_region_size());
+			for(uintptr_t a = start; a < invl->ranges[i].start + invl->ranges[i].len;
+			    a += mm_objspace_region_size()) {
+				struct table_level *pd = __space_pd(space, a);
+				if(pd && pd->table[PD_IDX(a)]) {
+					maps = true;
+					break;
+				}
+			}
+		}
+		if(maps) {
+			for(size_t w = 0; w < OBJSPACE_CPUMASK_WORDS; w++)
+				mask[w] |= space->arch.cpus[w];
+		}
+	}
+	spinlock_release_restore(&all_spaces_lock);
+}
+
+/* Invalidate every range in invl, here and on each other CPU that may have them cached (see
+ * struct shootdown_mailbox). */
+void arch_mm_objspace_invalidate_batch(struct object_space *space __unused,
+  struct objspace_invl *invl)
+{
+	if(!invl->all && !invl->count)
+		return;
+	bool fl = arch_interrupt_set(false);
+	__invl_local(invl);
+
+	/* the kernel part of the object space is shared by every space, and used while idle */
+	bool kernel = invl->all;
+	for(size_t i = 0; i < invl->count; i++) {
+		if(invl->ranges[i].start < arch_mm_objspace_kernel_size())
+			kernel = true;
+	}
+	uint64_t mask[OBJSPACE_CPUMASK_WORDS] = {};
+	if(kernel) {
+		for(size_t w = 0; w < OBJSPACE_CPUMASK_WORDS; w++)
+			mask[w] = ~0ul;
+	} else {
+		__invl_targets(invl, mask);
+	}
+
+	struct processor *self = current_processor;
+	for(unsigned int id = 0; id < PROCESSOR_MAX_CPUS; id++) {
+		struct processor *proc = processor_get(id);
+		if(!proc || proc == self || !(proc->flags & PROCESSOR_UP))
+			continue;
+		if(!(mask[id / 64] & (1ul << (id % 64)))) {
+			if(self)
+				self->stats.shootdown_avoided++;
+			continue;
+		}
+		struct shootdown_mailbox *mb = &mailboxes[id];
+		spinlock_acquire_save(&mb->lock);
+		if(invl->all) {
+			mb->invl.all = true;
+		} else {
+			for(size_t i = 0; i < invl->count; i++)
+				objspace_invl_add(&mb->invl, invl->ranges[i].start, invl->ranges[i].len);
+		}
+		bool send = !mb->pending && (kernel || !mb->lazy);
+		if(send)
+			mb->pending = true;
+		spinlock_release_restore(&mb->lock);
+		if(send)
+			arch_processor_send_ipi(id, PROCESSOR_IPI_SHOOTDOWN, 0);
+		if(self) {
+			if(send)
+				self->stats.shootdown_ipis++;
+			else
+				self->stats.shootdown_avoided++;
+		}
+	}
+	arch_interrupt_set(fl);
+}
+
 void arch_mm_objspace_invalidate(struct object_space *space, uintptr_t start, size_t len, int flags)
 {
-	/* TODO: take space into account */
-	if(space == NULL)
-		space = &_bootstrap_object_space;
-	x86_64_invvpid(start, len);
-	processor_send_ipi(
-	  PROCESSOR_IPI_DEST_OTHERS, PROCESSOR_IPI_SHOOTDOWN, NULL, PROCESSOR_IPI_NOWAIT);
+	if(flags & INVL_SELF) {
+		x86_64_invvpid(start, len);
+		return;
+	}
+	struct objspace_invl invl = {};
+	if(len >= arch_mm_objspace_max_address())
+		invl.all = true;
+	else
+		objspace_invl_add(&invl, start, len);
+	arch_mm_objspace_invalidate_batch(space, &invl);
+}
+
+static void __space_register(struct object_space *space)
+{
+	spinlock_acquire_save(&all_spaces_lock);
+	list_insert(&all_spaces, &space->arch.entry);
+	spinlock_release_restore(&all_spaces_lock);
 }
 
 void arch_object_space_init_bootstrap(struct object_space *space)
@@ -275,6 +608,7 @@ void arch_object_space_init_bootstrap(struct object_space *space)
 	space->arch.root.flags = TABLE_OSPACE;
 	space->arch.root.lock = RWLOCK_INIT;
 	table_realize(&space->arch.root);
+	__space_register(space);
 
 	int pml4_max = PML4_IDX(arch_mm_objspace_kernel_size() - 1) + 1;
 	int pdpt_max = PDPT_IDX(arch_mm_objspace_kernel_size() - 1) + 1;
@@ -321,9 +655,13 @@ void arch_object_space_init(struct object_space *space)
 			space->arch.root.table[pml4] = _bootstrap_object_space.arch.root.table[pml4];
 		}
 	}
+	__space_register(space);
 }
 
 void arch_object_space_fini(struct object_space *space)
 {
+	spinlock_acquire_save(&all_spaces_lock);
+	list_remove(&space->arch.entry);
+	spinlock_release_restore(&all_spaces_lock);
 	table_level_destroy(&space->arch.root);
 }
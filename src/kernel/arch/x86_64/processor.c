@@ -6,7 +6,7 @@
 
 #include <arch/secctx.h>
 #include <arch/x86_64-msr.h>
-#include <clksrc.h>
+#include <kheap.h>
 #include <processor.h>
 #include <vmm.h>
 void arch_processor_reset_current_thread(struct processor *proc)
@@ -16,6 +16,20 @@ void arch_processor_reset_current_thread(struct processor *proc)
 	arch_mm_switch_context(NULL);
 }
 
+/* save the current thread's extended state and detach it from this processor, after which it may
+ * be resumed on another one */
+void arch_processor_release_current_thread(struct processor *proc)
+{
+	struct thread *old = proc->arch.curr;
+	if(old) {
+		asm volatile("xsave (%0)" ::"r"(old->arch.xsave_run->start), "a"(7), "d"(0) : "memory");
+	}
+	arch_processor_reset_current_thread(proc);
+	if(old) {
+		old->on_cpu = false;
+	}
+}
+
 void arch_processor_enumerate()
 {
 	/* this is handled by initializers in madt.c */
@@ -74,11 +88,12 @@ void arch_processor_scheduler_wakeup(struct processor *proc)
 __noinstrument void arch_processor_halt(struct processor *proc)
 {
 	if(x86_features.features & X86_FEATURE_MWAIT) {
+		/* stay in a shallow C-state for the first couple of idle periods, then go deeper. The
+		 * scheduler has already armed the countdown for the next timer (if any), and a wakeup
+		 * writes to the monitored flags, so there is no need to poll here. */
 		long mw = 0;
 		if(proc->arch.mwait_info++ > 1) {
 			mw = 0x20;
-		} else {
-			clksrc_set_interrupt_countdown(100000, false);
 		}
 
 		if(proc->flags & PROCESSOR_HASWORK)
@@ -214,7 +214,7 @@ static void vmx_handle_rootcall(struct processor *proc)
 	proc->arch.vcpu_state_regs[REG_RAX] = 0;
 	switch(fn) {
 		case VMX_RC_SWITCHEPT: {
-			vmcs_writel(VMCS_EPT_PTR, (uintptr_t)a0 | (3 << 3) | 6 | (1 << 6));
+			vmcs_writel(VMCS_EPT_PTR, (uintptr_t)a0 | EPTP_FLAGS);
 		} break;
 		case VMX_RC_INVVPID: {
 			// printk("INVVPID type %ld\n", a0);
@@ -664,7 +664,7 @@ static void vtx_setup_vcpu(struct processor *proc)
 		vmcs_writel(VMCS_VMFUNC_CONTROLS, 1 /* enable EPT-switching */);
 		uintptr_t el_phys;
 		mm_early_alloc(&el_phys, (void **)&proc->arch.eptp_list, 0x1000, 0x1000);
-		proc->arch.eptp_list[0] = _bootstrap_object_space.arch.root.phys | (3 << 3) | 6;
+		proc->arch.eptp_list[0] = _bootstrap_object_space.arch.root.phys | EPTP_FLAGS;
 		vmcs_writel(VMCS_EPTP_LIST, el_phys);
 	}
 
@@ -677,8 +677,7 @@ static void vtx_setup_vcpu(struct processor *proc)
 	vmcs_writel(VMCS_HOST_RIP, (uintptr_t)vmexit_point);
 	vmcs_writel(VMCS_HOST_RSP, (uintptr_t)proc->arch.vcpu_state_regs);
 
-	vmcs_writel(
-	  VMCS_EPT_PTR, (uintptr_t)_bootstrap_object_space.arch.root.phys | (3 << 3) | 6 | (1 << 6));
+	vmcs_writel(VMCS_EPT_PTR, (uintptr_t)_bootstrap_object_space.arch.root.phys | EPTP_FLAGS);
 	proc->arch.veinfo->lock = 0;
 }
 
@@ -748,10 +747,10 @@ void x86_64_switch_ept(uintptr_t root)
 				printk(" :: %d test %lx %lx\n",
 				  i,
 				  current_processor->arch.eptp_list[i],
-				  root | (3 << 3) | 6);
+				  root | EPTP_FLAGS);
 			}
 #endif
-			if(current_processor->arch.eptp_list[i] == (root | (3 << 3) | 6)) {
+			if(current_processor->arch.eptp_list[i] == (root | EPTP_FLAGS)) {
 				index = i;
 				break;
 			}
@@ -763,10 +762,10 @@ void x86_64_switch_ept(uintptr_t root)
 			x86_64_rootcall(VMX_RC_SWITCHEPT, root, 0, 0);
 			/* TODO (perf): add to trusted list */
 #if 1
-			//	printk(" :: trying to add %lx\n", root | (3 << 3) | 6);
+			//	printk(" :: trying to add %lx\n", root | EPTP_FLAGS);
 			for(int i = 0; i < 512; i++) {
 				if(current_processor->arch.eptp_list[i] == 0) {
-					current_processor->arch.eptp_list[i] = root | (3 << 3) | 6;
+					current_processor->arch.eptp_list[i] = root | EPTP_FLAGS;
 					break;
 				}
 			}
@@ -781,6 +780,7 @@ void x86_64_switch_ept(uintptr_t root)
 void x86_64_secctx_switch(struct sctx *s)
 {
 	struct object_space *space = s ? s->space : &_bootstrap_object_space;
+	x86_64_objspace_activate(space);
 	x86_64_switch_ept(space->arch.root.phys);
 }
 
@@ -84,11 +84,14 @@ static void __find_callback(struct thread *thread, void *data)
 }
 
 #include <object.h>
+#include <page.h>
 #include <slab.h>
 static bool debug_process_line(char *line)
 {
 	if(!strcmp(line, "info mem")) {
 		mm_print_stats();
+	} else if(!strcmp(line, "info pages")) {
+		mm_page_print_stats();
 	} else if(!strcmp(line, "info slab")) {
 		slabcache_all_print_stats();
 	} else if(!strcmp(line, "info cpus")) {
@@ -98,6 +101,8 @@ static bool debug_process_line(char *line)
 		printk("Current Thread: %ld\n", current_thread ? current_thread->id : -1);
 	} else if(!strcmp(line, "info objs")) {
 		obj_print_stats();
+	} else if(!strcmp(line, "info locks")) {
+		spinlock_print_lockstat();
 	} else if(!strcmp(line, "bt")) {
 		debug_print_backtrace();
 	} else if(!strcmp(line, "ubt")) {
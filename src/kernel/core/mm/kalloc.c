@@ -8,25 +8,49 @@
 struct header {
 	uint32_t canary;
 	int32_t size_class;
+	/* the requested length (including the header) */
+	size_t len;
+};
+
+/* large allocations (size_class == -1) come straight from kheap, and keep their run just before
+ * the header */
+struct large_header {
 	struct kheap_run *run;
+	struct header hdr;
 };
 
-#define NR_CACHES 8
+/* Size classes (which include the header) are spaced 16 bytes apart up to 128 bytes, and then
+ * four classes per power of two (quarter-power spacing) up to 3.5KB. Larger allocations come
+ * directly from kheap: a whole-page object would waste half of a two-page slab, while kheap only
+ * rounds up to the page. */
+#define NR_TINY_CACHES 8
+#define TINY_SPACING 16
+#define TINY_MAX (NR_TINY_CACHES * TINY_SPACING)
+#define CLASSES_PER_GROUP 4
+#define NR_GROUPS 5
+#define NR_CACHES (NR_TINY_CACHES + NR_GROUPS * CLASSES_PER_GROUP - 1)
+
+_Static_assert(TINY_MAX == 128, "get_class assumes the first group starts at 2^7 bytes");
 
 static struct slabcache caches[NR_CACHES];
 
 static size_t get_size(int i)
 {
-	return (1 << (i + 4)) + 16;
+	if(i < NR_TINY_CACHES)
+		return (i + 1) * TINY_SPACING;
+	i -= NR_TINY_CACHES;
+	size_t base = (size_t)TINY_MAX << (i / CLASSES_PER_GROUP);
+	return base + (i % CLASSES_PER_GROUP + 1) * (base / CLASSES_PER_GROUP);
 }
 
 static int get_class(size_t len)
 {
-	for(int i = 0; i < NR_CACHES; i++) {
-		if(get_size(i) > len)
-			return i;
-	}
-	return -1;
+	if(len <= TINY_MAX)
+		return (len + TINY_SPACING - 1) / TINY_SPACING - 1;
+	/* len is in (2^lg, 2^(lg+1)], which is split into four classes */
+	int lg = 63 - __builtin_clzl(len - 1);
+	int class = NR_TINY_CACHES + (lg - 7) * CLASSES_PER_GROUP + (((len - 1) >> (lg - 2)) & 3);
+	return class < NR_CACHES ? class : -1;
 }
 
 void kalloc_system_init(void)
@@ -42,26 +66,28 @@ void *kalloc(size_t len, int flags)
 	len += sizeof(struct header);
 	int class = get_class(len);
 	if(class == -1) {
-		struct kheap_run *run = kheap_allocate(len);
-		struct header *hdr = run->start;
-		hdr->run = run;
-		hdr->size_class = -1;
-		hdr->canary = CANARY;
-		return (void *)(hdr + 1);
+		/* kheap always hands out zero'd runs, so we don't need to honor KALLOC_ZERO here */
+		struct kheap_run *run = kheap_allocate(len + offsetof(struct large_header, hdr));
+		struct large_header *lh = run->start;
+		lh->run = run;
+		lh->hdr.size_class = -1;
+		lh->hdr.canary = CANARY;
+		lh->hdr.len = len;
+		return (void *)(&lh->hdr + 1);
 	}
 	struct header *obj = slabcache_alloc(&caches[class], NULL);
 	obj->canary = CANARY;
 	obj->size_class = class;
-	/* TODO: don't always zero */
-	// if(flags & KALLOC_ZERO)
-	memset((void *)(obj + 1), 0, len - sizeof(struct header));
+	obj->len = len;
+	if(flags & KALLOC_ZERO)
+		memset((void *)(obj + 1), 0, len - sizeof(struct header));
 	assert(is_aligned(obj + 1, 8));
 	return (void *)(obj + 1);
 }
 
 void *kcalloc(size_t a, size_t b, int flags)
 {
-	void *p = kalloc(a * b, flags);
+	void *p = kalloc(a * b, flags | KALLOC_ZERO);
 	return p;
 }
 
@@ -71,20 +97,40 @@ void *krealloc(void *p, size_t len, int flags)
 		return kalloc(len, flags);
 	struct header *hdr = (void *)((char *)p - sizeof(struct header));
 	assert(hdr->canary == CANARY);
-	size_t oldsz = get_size(hdr->size_class);
+	size_t newlen = len + sizeof(struct header);
+	size_t oldlen = hdr->len;
+	bool fits;
+	if(hdr->size_class == -1) {
+		/* stay in place if the new size still needs kheap and fits in the run */
+		struct kheap_run *run = container_of(hdr, struct large_header, hdr)->run;
+		size_t oldsz = run->nr_pages * mm_page_size(0) - offsetof(struct large_header, hdr);
+		fits = newlen <= oldsz && get_class(newlen) == -1;
+	} else {
+		/* stay in place if the new size maps to the same class */
+		fits = get_class(newlen) == hdr->size_class;
+	}
+	if(fits) {
+		/* what lies past the old length may be left over from before a shrink */
+		if((flags & KALLOC_ZERO) && newlen > oldlen)
+			memset((char *)hdr + oldlen, 0, newlen - oldlen);
+		hdr->len = newlen;
+		return p;
+	}
 
-	void *newreg = kalloc(len, flags);
-	size_t copy_len = oldsz;
-	if(len < oldsz)
+	void *newreg = kalloc(len, flags & ~KALLOC_ZERO);
+	size_t copy_len = oldlen - sizeof(struct header);
+	if(len < copy_len)
 		copy_len = len;
 	memcpy(newreg, p, copy_len);
+	if((flags & KALLOC_ZERO) && len > copy_len)
+		memset((char *)newreg + copy_len, 0, len - copy_len);
 	kfree(p);
 	return newreg;
 }
 
 void *krecalloc(void *p, size_t a, size_t b, int flags)
 {
-	return krealloc(p, a * b, flags);
+	return krealloc(p, a * b, flags | KALLOC_ZERO);
 }
 
 void kfree(void *p)
@@ -92,7 +138,7 @@ void kfree(void *p)
 	struct header *hdr = (void *)((char *)p - sizeof(struct header));
 	assert(hdr->canary == CANARY);
 	if(hdr->size_class == -1) {
-		kheap_free(hdr->run);
+		kheap_free(container_of(hdr, struct large_header, hdr)->run);
 	} else {
 		slabcache_free(&caches[hdr->size_class], hdr, NULL);
 	}
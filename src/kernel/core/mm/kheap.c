@@ -2,6 +2,7 @@
 #include <memory.h>
 #include <objspace.h>
 #include <page.h>
+#include <slab.h>
 #include <spinlock.h>
 #include <vmm.h>
 
@@ -83,6 +84,10 @@ static void *kheap_allocate_from_end(void)
 		 * require a small amount of emergency memory to allocate for extending the mappings */
 		panic("out of kheap memory");
 	}
+	/* running low on never-used kheap space; ask the slab allocator to give back empty slabs */
+	if((uintptr_t)p >= kheap_end - KHEAP_SIZE / 4) {
+		slabcache_reap_request();
+	}
 	uintptr_t oaddr = ((uintptr_t)p - kheap_start) + kheap_oaddr_start;
 	mm_objspace_kernel_fill(oaddr,
 	  NULL,
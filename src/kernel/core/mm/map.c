@@ -385,8 +385,10 @@ static bool _vm_view_invl(struct object *obj, struct kso_invl_args *invl)
 
 static void __view_ctor(struct object *obj)
 {
-	struct kso_view *kv = obj->kso_data = kalloc(sizeof(struct kso_view), 0);
+	struct kso_view *kv = obj->kso_data = kalloc(sizeof(struct kso_view), KALLOC_ZERO);
 	list_init(&kv->contexts);
+	/* every thread of a process faults through its view, and it's rarely written */
+	obj_set_read_mostly(obj);
 }
 
 static void __view_dtor(struct object *obj)
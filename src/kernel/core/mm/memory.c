@@ -122,7 +122,8 @@ POST_INIT(__init_mem_object, NULL);
 
 void mm_update_stats(void)
 {
-	/* TODO A */
+	/* TODO A: the memory stats device (and so mm_page_collect_stats) needs porting to the new device
+	 * tree first; until then, the page counters are only shown by "info pages" in the debugger */
 #if 0
 	if(msh) {
 		pmap_collect_stats(&mm_stats);
@@ -150,6 +151,7 @@ void mm_update_stats(void)
 		mm_stats.memalloc_free = ma_free;
 
 		msh->stats = mm_stats;
+		mm_page_collect_stats(msh);
 	}
 #endif
 }
@@ -169,7 +171,11 @@ void *mm_early_ptov(uintptr_t phys)
 	return (void *)(phys += PHYSICAL_MAP_START);
 }
 
-uintptr_t mm_region_alloc_raw(size_t len, size_t align, int flags)
+static uintptr_t __region_alloc(size_t len,
+  size_t align,
+  int flags,
+  uintptr_t *pad,
+  size_t *padlen)
 {
 	assert(len);
 	align = (align == 0) ? 8 : align;
@@ -182,6 +188,10 @@ uintptr_t mm_region_alloc_raw(size_t len, size_t align, int flags)
 		bool is_allocable =
 		  reg->type == MEMORY_AVAILABLE && reg->subtype == MEMORY_AVAILABLE_VOLATILE;
 		if((is_bootstrap || !(flags & REGION_ALLOC_BOOTSTRAP)) && is_allocable && has_space) {
+			if(pad) {
+				*pad = reg->start;
+				*padlen = extra;
+			}
 			reg->start = align_up(reg->start, align);
 			uintptr_t alloc = reg->start;
 			reg->start += len;
@@ -195,6 +205,19 @@ uintptr_t mm_region_alloc_raw(size_t len, size_t align, int flags)
 	return 0;
 }
 
+uintptr_t mm_region_alloc_raw(size_t len, size_t align, int flags)
+{
+	return __region_alloc(len, align, flags, NULL, NULL);
+}
+
+/* like mm_region_alloc_raw, but the padding skipped to reach the alignment is handed back to the
+ * caller (as [*pad, *pad + *padlen)) instead of being lost. */
+uintptr_t mm_region_alloc_aligned(size_t len, size_t align, uintptr_t *pad, size_t *padlen)
+{
+	*padlen = 0;
+	return __region_alloc(len, align, 0, pad, padlen);
+}
+
 void mm_early_alloc(uintptr_t *phys, void **virt, size_t len, size_t align)
 {
 	uintptr_t alloc = mm_region_alloc_raw(len, align, REGION_ALLOC_BOOTSTRAP);
@@ -134,19 +134,53 @@ struct omap *mm_objspace_get_object_map(struct object *obj, size_t page)
 	return omap;
 }
 
-static void mm_objspace_clear_region(struct objspace_region *region)
+/* is the objspace region holding this page of obj mapped anywhere? */
+bool mm_objspace_object_mapped(struct object *obj, size_t page)
 {
-	arch_objspace_region_unmap(region, 0, mm_objspace_region_size() / mm_page_size(0));
-	arch_mm_objspace_invalidate(NULL, region->addr, mm_objspace_region_size() / mm_page_size(0), 0);
+	size_t regnr = page / (mm_objspace_region_size() / mm_page_size(0));
+	spinlock_acquire_save(&obj->lock);
+	struct rbnode *node = rb_search(&obj->omap_root, regnr, struct omap, objnode, omap_compar_key);
+	spinlock_release_restore(&obj->lock);
+	return node != NULL;
+}
+
+static void mm_objspace_clear_region(struct omap *omap)
+{
+	struct objspace_region *region = omap->region;
+	size_t nrpages = mm_objspace_region_size() / mm_page_size(0);
+	uint64_t dirty[OBJSPACE_DIRTY_WORDS] = {};
+	arch_objspace_region_unmap(region, 0, nrpages, dirty);
+	arch_mm_objspace_invalidate(NULL, region->addr, nrpages * mm_page_size(0), 0);
+	object_mark_pages_dirty(omap->obj, omap->regnr * nrpages, nrpages, dirty);
 }
 
 void omap_free(struct omap *omap)
 {
 	assert(omap->refs == 0);
-	mm_objspace_clear_region(omap->region);
+	mm_objspace_clear_region(omap);
 	slabcache_free(&sc_omap, omap, NULL);
 }
 
+void objspace_invl_add(struct objspace_invl *invl, uintptr_t start, size_t len)
+{
+	if(invl->all || len == 0)
+		return;
+	if(invl->count > 0) {
+		struct objspace_invl_range *last = &invl->ranges[invl->count - 1];
+		if(last->start + last->len == start) {
+			last->len += len;
+			return;
+		}
+	}
+	if(invl->count == OBJSPACE_INVL_MAX_RANGES) {
+		invl->all = true;
+		return;
+	}
+	invl->ranges[invl->count].start = start;
+	invl->ranges[invl->count].len = len;
+	invl->count++;
+}
+
 uintptr_t mm_objspace_get_phys(struct object_space *space, uintptr_t oaddr)
 {
 	return arch_mm_objspace_get_phys(space, oaddr);
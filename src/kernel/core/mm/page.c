@@ -4,19 +4,48 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <kalloc.h>
 #include <memory.h>
 #include <objspace.h>
 #include <page.h>
+#include <processor.h>
 #include <stdatomic.h>
 #include <tmpmap.h>
+#include <twz/sys/dev/memory.h>
 #include <vmm.h>
 
-/* TODO: percpu? finer locking? */
+/* Each CPU keeps a small cache of free pages (both dirty and zero'd), so that most page
+ * allocations and frees never touch the global lists or their lock. Caches are refilled from, and
+ * drained to, the global lists in batches. A CPU cache is only touched by its own CPU with
+ * interrupts disabled. */
+#define PAGE_CPU_BATCH 16
+#define PAGE_CPU_HIGH 64
+
+/* number of pre-zero'd pages the idle loop tries to keep in the global zero list (can be changed
+ * with KCONF_PAGEZERO_WATERMARK), and how many pages it zeroes between checks for work. */
+#define PAGE_ZERO_WATERMARK_DEFAULT 1024
+#define PAGE_IDLE_ZERO_BATCH 16
+
+struct page_cpu_cache {
+	struct page *list, *zlist;
+	size_t count, zcount;
+	struct page_cpu_stats stats;
+} __attribute__((aligned(64)));
+
+static struct page_cpu_cache page_cpu_caches[PROCESSOR_MAX_CPUS];
 
 static struct page *page_list = NULL;
 static struct page *pagezero_list = NULL;
+static size_t pagezero_count = 0;
+static _Atomic size_t pagezero_watermark = PAGE_ZERO_WATERMARK_DEFAULT;
 static struct page *pagestruct_list = NULL;
 
+/* free 2 MiB frames. A frame is described by an array of PAGES_PER_LARGE struct pages (one per
+ * small page, all marked PAGE_HUGE) that stays with the frame; the list links the first of each. */
+static struct page *pagelarge_list = NULL;
+static size_t pagelarge_count = 0;
+static _Atomic size_t pagelarge_inuse = 0;
+
 static struct spinlock lock = SPINLOCK_INIT;
 
 #define INITIAL_ALLOC_SIZE 4096
@@ -133,6 +162,7 @@ struct page *mm_page_fake_create(uintptr_t phys, int flags)
 	struct page *page = get_new_page_struct();
 	spinlock_release_restore(&lock);
 	page_make_addr(page, phys, flags | PAGE_FAKE);
+	page->refs = 1;
 	return page;
 }
 
@@ -164,6 +194,7 @@ void mm_page_write(struct page *page, void *data, size_t len)
 		len = mm_page_size(0);
 	if(unlikely(len == 0))
 		return;
+	mm_page_mark_dirty(page);
 	if(mm_page_addr(page) < MEMORY_BOOTSTRAP_MAX) {
 		memcpy(mm_early_ptov(mm_page_addr(page)), 0, len);
 		return;
@@ -176,6 +207,7 @@ void mm_page_write(struct page *page, void *data, size_t len)
 struct page *mm_page_clone(struct page *page)
 {
 	struct page *newpage = mm_page_alloc(0);
+	mm_page_mark_dirty(newpage);
 	void *srcaddr = NULL;
 	void *dstaddr = NULL;
 	if(mm_page_addr(page) < MEMORY_BOOTSTRAP_MAX) {
@@ -224,6 +256,7 @@ static struct page *__do_mm_page_alloc(int flags)
 	if(flags & PAGE_ZERO) {
 		if(!pagelist_empty(&pagezero_list)) {
 			struct page *ret = pagelist_pop(&pagezero_list);
+			pagezero_count--;
 			return RET(flags, ret);
 		}
 	}
@@ -239,6 +272,7 @@ static struct page *__do_mm_page_alloc(int flags)
 			page = fallback_page_alloc();
 		} else {
 			page = pagelist_pop(&pagezero_list);
+			pagezero_count--;
 		}
 	} else {
 		page = pagelist_pop(&page_list);
@@ -248,14 +282,114 @@ static struct page *__do_mm_page_alloc(int flags)
 	return RET(flags, page);
 }
 
-void mm_page_free(struct page *page)
+static inline struct page_cpu_cache *__page_cpu_cache(void)
+{
+	int64_t id = arch_processor_current_id();
+	if(id < 0 || id >= PROCESSOR_MAX_CPUS)
+		return NULL;
+	return &page_cpu_caches[id];
+}
+
+/* move up to nr pages from a global list to a CPU-local list. Must hold lock. */
+static size_t __page_list_move(struct page **to, struct page **from, size_t nr)
+{
+	size_t i;
+	for(i = 0; i < nr && !pagelist_empty(from); i++) {
+		pagelist_add(to, pagelist_pop(from));
+	}
+	return i;
+}
+
+static struct page *__page_cpu_take(struct page_cpu_cache *pc, int flags)
+{
+	/* same preference as the global allocator: zero'd pages for PAGE_ZERO requests, and dirty
+	 * pages otherwise, so we don't waste zero'd pages on callers that don't need them. */
+	if((flags & PAGE_ZERO) && pc->zcount) {
+		pc->zcount--;
+		return pagelist_pop(&pc->zlist);
+	}
+	if(pc->count) {
+		pc->count--;
+		return pagelist_pop(&pc->list);
+	}
+	if(pc->zcount) {
+		pc->zcount--;
+		return pagelist_pop(&pc->zlist);
+	}
+	return NULL;
+}
+
+static void __page_cpu_refill(struct page_cpu_cache *pc, int flags)
+{
+	spinlock_acquire_save_recur(&lock);
+	size_t nr;
+	if(flags & PAGE_ZERO) {
+		nr = __page_list_move(&pc->zlist, &pagezero_list, PAGE_CPU_BATCH);
+		pc->zcount += nr;
+		pagezero_count -= nr;
+	}
+	if(pc->zcount == 0) {
+		pc->count += __page_list_move(&pc->list, &page_list, PAGE_CPU_BATCH);
+	}
+	if(pc->count == 0 && pc->zcount == 0) {
+		nr = __page_list_move(&pc->zlist, &pagezero_list, PAGE_CPU_BATCH);
+		pc->zcount += nr;
+		pagezero_count -= nr;
+	}
+	spinlock_release_restore(&lock);
+	pc->stats.refill++;
+}
+
+static void __page_cpu_drain(struct page_cpu_cache *pc)
+{
+	spinlock_acquire_save_recur(&lock);
+	if(pc->count > PAGE_CPU_HIGH - PAGE_CPU_BATCH)
+		pc->count -= __page_list_move(&page_list, &pc->list, PAGE_CPU_BATCH);
+	if(pc->zcount > PAGE_CPU_HIGH - PAGE_CPU_BATCH) {
+		size_t nr = __page_list_move(&pagezero_list, &pc->zlist, PAGE_CPU_BATCH);
+		pc->zcount -= nr;
+		pagezero_count += nr;
+	}
+	spinlock_release_restore(&lock);
+	pc->stats.drain++;
+}
+
+void mm_page_mark_dirty(struct page *page)
 {
-	/* TODO: determine if page is zero or not (with MMU dirty bit) */
 	page_clear_flags(page, PAGE_ZERO);
+}
+
+void mm_page_free(struct page *page)
+{
+	/* a tracked page that was never written is still zero; anything else might not be. */
+	if(!(mm_page_flags(page) & PAGE_TRACKED))
+		page_clear_flags(page, PAGE_ZERO);
+	/* a small page from a frame that's freed on its own just becomes a regular small page */
+	page_clear_flags(page, PAGE_TRACKED | PAGE_HUGE);
+
+	bool fl = arch_interrupt_set(0);
+	struct page_cpu_cache *pc = __page_cpu_cache();
+	if(pc) {
+		if(mm_page_flags(page) & PAGE_ZERO) {
+			pagelist_add(&pc->zlist, page);
+			pc->zcount++;
+			pc->stats.free_clean++;
+		} else {
+			pagelist_add(&pc->list, page);
+			pc->count++;
+		}
+		pc->stats.free++;
+		if(pc->count > PAGE_CPU_HIGH || pc->zcount > PAGE_CPU_HIGH)
+			__page_cpu_drain(pc);
+		arch_interrupt_set(fl);
+		return;
+	}
+	arch_interrupt_set(fl);
 
 	spinlock_acquire_save(&lock);
 	if(mm_page_flags(page) & PAGE_ZERO) {
 		pagelist_add(&pagezero_list, page);
+		pagezero_count++;
 	} else {
 		pagelist_add(&page_list, page);
 	}
@@ -264,12 +398,48 @@ void mm_page_free(struct page *page)
 
 struct page *mm_page_alloc(int flags)
 {
-	spinlock_acquire_save_recur(&lock);
-	struct page *page = __do_mm_page_alloc(flags);
-	spinlock_release_restore(&lock);
-	if((flags & PAGE_ZERO) && !(mm_page_flags(page) & PAGE_ZERO)) {
+	struct page *page = NULL;
+	bool fl = arch_interrupt_set(0);
+	struct page_cpu_cache *pc = __page_cpu_cache();
+	if(pc) {
+		page = __page_cpu_take(pc, flags);
+		if(!page
+		   || ((flags & PAGE_ZERO) && !(mm_page_flags(page) & PAGE_ZERO)
+		       && !pagelist_empty(&pagezero_list))) {
+			/* either we're empty, or we're about to zero a page by hand while the global zero list
+			 * has pages (unlocked peek; it's only a hint). Pull in a batch first. */
+			if(page) {
+				pagelist_add(&pc->list, page);
+				pc->count++;
+			}
+			__page_cpu_refill(pc, flags);
+			page = __page_cpu_take(pc, flags);
+		}
+		if(page)
+			pc->stats.alloc++;
+	}
+
+	if(!page) {
+		/* global lists are empty too (or we have no CPU yet); allocate a new page */
+		spinlock_acquire_save_recur(&lock);
+		page = __do_mm_page_alloc(flags);
+		spinlock_release_restore(&lock);
+	}
+	bool need_zero = (flags & PAGE_ZERO) && !(mm_page_flags(page) & PAGE_ZERO);
+	if(pc && (flags & PAGE_ZERO)) {
+		if(need_zero)
+			pc->stats.zero_miss++;
+		else
+			pc->stats.zero_hit++;
+	}
+	arch_interrupt_set(fl);
+
+	if(need_zero) {
 		mm_page_zero(page);
 	}
+	if(flags & PAGE_TRACKED)
+		page_set_flags(page, PAGE_TRACKED);
+	page->refs = 1;
 	return page;
 }
 
@@ -284,12 +454,225 @@ uintptr_t mm_page_alloc_addr(int flags)
 	return (uintptr_t)p;
 }
 
+/* Hand the memory in [start, start + len) to the small-page free list. Must hold lock. */
+static void __page_add_free_range(uintptr_t start, size_t len)
+{
+	for(uintptr_t a = align_up(start, mm_page_size(0)); a + mm_page_size(0) <= start + len;
+	    a += mm_page_size(0)) {
+		struct page *page = get_new_page_struct();
+		page_make_addr(page, a, PAGE_CACHE_WB);
+		pagelist_add(&page_list, page);
+	}
+}
+
+static uintptr_t __page_alloc_large_raw(void)
+{
+	/* don't leak the alignment padding; it's perfectly good memory for small pages */
+	uintptr_t pad;
+	size_t padlen;
+	spinlock_acquire_save_recur(&lock);
+	uintptr_t addr = mm_region_alloc_aligned(mm_page_size(1), mm_page_size(1), &pad, &padlen);
+	if(addr && padlen)
+		__page_add_free_range(pad, padlen);
+	spinlock_release_restore(&lock);
+	return addr;
+}
+
+#define PAGE_LARGE_ZERO_CHUNK 32
+
+static void mm_page_zero_large(uintptr_t addr)
+{
+	if(addr + mm_page_size(1) <= MEMORY_BOOTSTRAP_MAX) {
+		memset(mm_early_ptov(addr), 0, mm_page_size(1));
+		atomic_thread_fence(memory_order_seq_cst);
+		return;
+	}
+	struct page pg[PAGE_LARGE_ZERO_CHUNK];
+	struct page *pages[PAGE_LARGE_ZERO_CHUNK];
+	for(size_t off = 0; off < mm_page_size(1); off += PAGE_LARGE_ZERO_CHUNK * mm_page_size(0)) {
+		for(size_t i = 0; i < PAGE_LARGE_ZERO_CHUNK; i++) {
+			page_make_addr(&pg[i], addr + off + i * mm_page_size(0), PAGE_CACHE_WB);
+			pages[i] = &pg[i];
+		}
+		void *vaddr = tmpmap_map_pages(pages, PAGE_LARGE_ZERO_CHUNK);
+		memset(vaddr, 0, PAGE_LARGE_ZERO_CHUNK * mm_page_size(0));
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* Allocate a physically contiguous, 2 MiB aligned frame. Returns an array of PAGES_PER_LARGE struct
+ * pages, one for each small page in the frame, or NULL (rather than falling back to small pages) if
+ * no frame is available. Supports PAGE_ZERO and PAGE_TRACKED, applied to every small page. */
+struct page *mm_page_alloc_large(int flags)
+{
+	spinlock_acquire_save_recur(&lock);
+	struct page *pages = pagelist_pop(&pagelarge_list);
+	if(pages)
+		pagelarge_count--;
+	spinlock_release_restore(&lock);
+
+	bool zero;
+	if(pages) {
+		zero = !!(mm_page_flags(pages) & PAGE_ZERO);
+	} else {
+		uintptr_t addr = __page_alloc_large_raw();
+		if(!addr)
+			return NULL;
+		pages = kalloc(sizeof(struct page) * PAGES_PER_LARGE, 0);
+		page_make_addr(pages, addr, 0);
+		zero = false;
+	}
+	pagelarge_inuse++;
+
+	if((flags & PAGE_ZERO) && !zero) {
+		mm_page_zero_large(mm_page_addr(pages));
+		zero = true;
+	}
+	uint64_t pflags = PAGE_CACHE_WB | PAGE_HUGE | (zero ? PAGE_ZERO : 0) | (flags & PAGE_TRACKED);
+	uintptr_t addr = mm_page_addr(pages);
+	for(size_t i = 0; i < PAGES_PER_LARGE; i++) {
+		page_make_addr(&pages[i], addr + i * mm_page_size(0), pflags);
+		pages[i].next = NULL;
+		pages[i].refs = 1;
+	}
+	return pages;
+}
+
+/* a frame for the kernel's own use, that will never be freed */
+uintptr_t mm_page_alloc_large_addr(int flags)
+{
+	uintptr_t addr = __page_alloc_large_raw();
+	if(addr && (flags & PAGE_ZERO))
+		mm_page_zero_large(addr);
+	return addr;
+}
+
+/* Free a whole frame from mm_page_alloc_large. If every small page in it is tracked and still zero,
+ * the frame is kept as zero'd. (Small pages from a frame may also be freed individually with
+ * mm_page_free, after which the frame can no longer be freed as a whole.) */
+void mm_page_free_large(struct page *pages)
+{
+	bool zero = true;
+	for(size_t i = 0; i < PAGES_PER_LARGE; i++) {
+		uint64_t fl = mm_page_flags(&pages[i]);
+		if(!(fl & PAGE_TRACKED) || !(fl & PAGE_ZERO))
+			zero = false;
+	}
+	page_make_addr(pages, mm_page_addr(pages), PAGE_CACHE_WB | PAGE_HUGE | (zero ? PAGE_ZERO : 0));
+	spinlock_acquire_save_recur(&lock);
+	pagelist_add(&pagelarge_list, pages);
+	pagelarge_count++;
+	spinlock_release_restore(&lock);
+	pagelarge_inuse--;
+}
+
+static struct page *_Atomic shared_zero_page = NULL;
+static _Atomic uint64_t shared_zero_maps = 0;
+
+/* A single zero'd page, mapped read-only (COW) for reads of object pages that have never been
+ * written, so that they don't need memory of their own. It must never be written or freed. */
+struct page *mm_page_shared_zero(void)
+{
+	struct page *page = shared_zero_page;
+	if(unlikely(!page)) {
+		struct page *exp = NULL;
+		page = mm_page_alloc(PAGE_ZERO);
+		if(!atomic_compare_exchange_strong(&shared_zero_page, &exp, page)) {
+			mm_page_free(page);
+			page = exp;
+		}
+	}
+	shared_zero_maps++;
+	return page;
+}
+
+/* drop a reference to a page, freeing it when the last one goes */
+void mm_page_put(struct page *page)
+{
+	if(atomic_fetch_sub(&page->refs, 1) == 1)
+		mm_page_free(page);
+}
+
+/* fill in the per-CPU page allocator counters of the memory stats device. Note that the device
+ * itself (see __init_mem_object and mm_update_stats) is compiled out until the system bus is
+ * ported to the new device tree, so for now the counters are only visible through "info pages"
+ * (mm_page_print_stats). */
+void mm_page_collect_stats(struct memory_stats_header *msh)
+{
+	uint64_t alloc = 0, free = 0;
+	for(int i = 0; i < PROCESSOR_MAX_CPUS && i < MEMORY_STATS_MAX_CPUS; i++) {
+		msh->page_cpu_stats[i] = page_cpu_caches[i].stats;
+		alloc += page_cpu_caches[i].stats.alloc;
+		free += page_cpu_caches[i].stats.free;
+	}
+	msh->stats.page_alloc = alloc;
+	msh->stats.page_free = free;
+}
+
 void mm_page_print_stats(void)
 {
-	/* TODO (low): print page stats */
+	printk("page allocator (per-cpu):\n");
+	for(int i = 0; i < PROCESSOR_MAX_CPUS; i++) {
+		struct page_cpu_cache *pc = &page_cpu_caches[i];
+		if(!pc->stats.alloc && !pc->stats.free)
+			continue;
+		printk("  cpu %2d: alloc %ld, free %ld, refill %ld, drain %ld (cached %ld, %ld zero)\n",
+		  i,
+		  pc->stats.alloc,
+		  pc->stats.free,
+		  pc->stats.refill,
+		  pc->stats.drain,
+		  pc->count,
+		  pc->zcount);
+		printk("          zero pool: %ld hit, %ld miss; %ld pages zeroed while idle\n",
+		  pc->stats.zero_hit,
+		  pc->stats.zero_miss,
+		  pc->stats.idle_zeroed);
+		printk("          %ld pages freed clean\n", pc->stats.free_clean);
+	}
+	printk("  global zero list: %ld pages (watermark %ld)\n", pagezero_count, pagezero_watermark);
+	printk("  2M frames: %ld in use, %ld free\n", pagelarge_inuse, pagelarge_count);
+	printk("  shared zero page: mapped %ld times\n", shared_zero_maps);
+}
+
+size_t mm_page_set_zero_watermark(long nr)
+{
+	if(nr < 0)
+		return pagezero_watermark;
+	return atomic_exchange(&pagezero_watermark, nr);
 }
 
+/* Called from the idle loop: move dirty pages from the global list to the zero list, zeroing them
+ * with non-temporal stores, until the zero list reaches the watermark or this CPU gets work. */
 void mm_page_idle_zero(void)
 {
-	/* TODO (opt): background-zero pages */
+	struct processor *proc = current_processor;
+	struct page_cpu_cache *pc = __page_cpu_cache();
+	if(!proc || !pc)
+		return;
+	while(pagezero_count < pagezero_watermark) {
+		if(processor_has_threads(proc) || (proc->flags & PROCESSOR_HASWORK))
+			break;
+		struct page *pages[PAGE_IDLE_ZERO_BATCH];
+		size_t nr = 0;
+		spinlock_acquire_save(&lock);
+		while(nr < PAGE_IDLE_ZERO_BATCH && !pagelist_empty(&page_list)) {
+			pages[nr++] = pagelist_pop(&page_list);
+		}
+		spinlock_release_restore(&lock);
+		if(nr == 0)
+			break;
+
+		void *vaddr = tmpmap_map_pages(pages, nr);
+		arch_mm_zero_nontemporal(vaddr, nr * mm_page_size(0));
+
+		spinlock_acquire_save(&lock);
+		for(size_t i = 0; i < nr; i++) {
+			page_set_flags(pages[i], PAGE_ZERO);
+			pagelist_add(&pagezero_list, pages[i]);
+		}
+		pagezero_count += nr;
+		spinlock_release_restore(&lock);
+		pc->stats.idle_zeroed += nr;
+	}
 }
@@ -4,15 +4,24 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <clksrc.h>
 #include <debug.h>
 #include <kheap.h>
+#include <lib/iter.h>
 #include <memory.h>
+#include <processor.h>
 #include <slab.h>
-/* TODO (minor): optimization: we could try to fit several slabs in a
- * single page if the object size is small enough (sz*64 < PAGE_SIZE/2)
- */
+/* Slabs track free objects with a multi-word bitmap (a set bit is a free slot), so a single page
+ * can hold up to SLAB_MAX_OBJ small objects instead of fragmenting into many small slabs. */
 
 static DECLARE_LIST(all_slabs);
+static DECLARE_SPINLOCK(all_slabs_lock);
+
+/* reap caches from the idle loop at most this often (ns), unless kheap asks for memory */
+#define SLAB_REAP_INTERVAL 1000000000ul
+/* number of empty slabs and empty magazines each cache keeps when reaped */
+#define SLAB_REAP_KEEP_EMPTY 1
+#define SLAB_REAP_KEEP_MAGAZINES 2
 
 static inline size_t __slab_size(size_t sz, size_t nr_obj)
 {
@@ -26,24 +35,19 @@ static inline size_t slab_size(struct slabcache *sc, size_t sz)
 	if(sc->__cached_nr_obj) {
 		return __slab_size(sz, sc->__cached_nr_obj);
 	}
-	size_t frag[129];
-	for(int i = 0; i < 65; i++) {
-		if(i < 1) {
-			frag[i] = ~0;
-			continue;
-		}
-		size_t x = __slab_size(sz, i);
-		if(x > mm_page_size(0) * 2) {
-			frag[i] = ~0;
-		} else {
-			frag[i] = x - (sizeof(struct slab) + i * sz);
-		}
-	}
-
+	/* pick the number of objects that wastes the least space, limited to slabs of at most two
+	 * pages. Ties go to the smaller slab. */
+	size_t best_frag = ~0ul;
 	int best = 1;
-	for(int i = 0; i < 65; i++) {
-		if(frag[i] < frag[best])
+	for(int i = 1; i <= SLAB_MAX_OBJ; i++) {
+		size_t x = __slab_size(sz, i);
+		if(x > mm_page_size(0) * 2)
+			break;
+		size_t frag = x - (sizeof(struct slab) + i * sz);
+		if(frag < best_frag) {
+			best_frag = frag;
 			best = i;
+		}
 	}
 
 	sc->__cached_nr_obj = best;
@@ -52,17 +56,39 @@ static inline size_t slab_size(struct slabcache *sc, size_t sz)
 
 #define is_empty(x) ((x).next == &(x))
 
-#define first_set_bit(x) __builtin_ctzll(x)
-#define num_set(x) (unsigned long)__builtin_popcountll(x)
 static inline size_t obj_per_slab(struct slabcache *sc, size_t sz)
 {
 	size_t n = (slab_size(sc, sz) - sizeof(struct slab)) / sz;
-	if(n > 64)
-		n = 64;
+	if(n > SLAB_MAX_OBJ)
+		n = SLAB_MAX_OBJ;
 	assert(n > 0);
 	return n;
 }
 
+/* find (and clear) the first free slot. The hint is the lowest word that may contain a set bit,
+ * so a mostly-full slab doesn't rescan its leading words on every allocation. */
+static inline int slab_bitmap_take(struct slab *s)
+{
+	for(unsigned int w = s->hint; w < SLAB_ALLOC_WORDS; w++) {
+		if(s->alloc[w]) {
+			int bit = __builtin_ctzll(s->alloc[w]);
+			s->alloc[w] &= ~(1ull << bit);
+			s->hint = w;
+			return w * 64 + bit;
+		}
+	}
+	panic("slab %p has no free slots (nr_free=%d)", s, s->nr_free);
+}
+
+static inline void slab_bitmap_put(struct slab *s, int slot)
+{
+	unsigned int w = slot / 64;
+	assert(!(s->alloc[w] & (1ull << (slot % 64))));
+	s->alloc[w] |= 1ull << (slot % 64);
+	if(w < s->hint)
+		s->hint = w;
+}
+
 static inline void add_to_list(struct slab *list, struct slab *s)
 {
 	s->next = list->next;
@@ -82,13 +108,15 @@ static struct slab *new_slab(struct slabcache *c)
 	struct kheap_run *run = kheap_allocate(slab_size(c, c->sz));
 	struct slab *s = run->start;
 	s->run = run;
-	s->alloc = 0;
 	s->slabcache = c;
 	s->canary = SLAB_CANARY;
+	s->hint = 0;
+	s->nr_free = obj_per_slab(c, c->sz);
+	memset(s->alloc, 0, sizeof(s->alloc));
 	assert(c->canary == SLAB_CANARY);
 
 	for(unsigned int i = 0; i < obj_per_slab(c, c->sz); i++) {
-		s->alloc |= ((unsigned __int128)1ull << i);
+		s->alloc[i / 64] |= 1ull << (i % 64);
 		char *obj = s->data + i * c->sz;
 		memset(obj, 0, c->sz);
 		if(c->init) {
@@ -101,24 +129,31 @@ static struct slab *new_slab(struct slabcache *c)
 
 static void *alloc_slab(struct slab *s, int new)
 {
-	assert(s->alloc);
+	assert(s->nr_free);
 	assert(s->canary == SLAB_CANARY);
-	int slot = first_set_bit(s->alloc);
-
-	s->alloc &= ~((unsigned __int128)1ul << slot);
+	int slot = slab_bitmap_take(s);
+	s->nr_free--;
 
 	char *ret = s->data + s->slabcache->sz * slot;
 
-	if(num_set(s->alloc) == 0) {
-		del_from_list(s);
-		add_to_list(&s->slabcache->full, s);
-		s->slabcache->stats.partial--;
-		s->slabcache->stats.full++;
-	} else if(num_set(s->alloc) == obj_per_slab(s->slabcache, s->slabcache->sz) - 1) {
+	/* a slab that holds a single object goes straight from empty (or new) to full */
+	bool was_empty = s->nr_free == obj_per_slab(s->slabcache, s->slabcache->sz) - 1;
+	if(was_empty) {
+		/* a new slab isn't on any list yet */
 		if(!new) {
 			del_from_list(s);
 			s->slabcache->stats.empty--;
+			if(s->slabcache->stats.empty < s->slabcache->stats.empty_min)
+				s->slabcache->stats.empty_min = s->slabcache->stats.empty;
 		}
+	} else if(s->nr_free == 0) {
+		del_from_list(s);
+		s->slabcache->stats.partial--;
+	}
+	if(s->nr_free == 0) {
+		add_to_list(&s->slabcache->full, s);
+		s->slabcache->stats.full++;
+	} else if(was_empty) {
 		add_to_list(&s->slabcache->partial, s);
 		s->slabcache->stats.partial++;
 	}
@@ -134,14 +169,15 @@ static void *alloc_slab(struct slab *s, int new)
 static void __slab_second_init(struct slabcache *c)
 {
 	if(!atomic_exchange(&c->__init, true)) {
+		spinlock_acquire_save(&all_slabs_lock);
 		list_insert(&all_slabs, &c->entry);
+		spinlock_release_restore(&all_slabs_lock);
 	}
 }
 
-void *slabcache_alloc(struct slabcache *c, void *data)
+static void *__slabcache_alloc(struct slabcache *c)
 {
 	struct slab *s;
-	assert(c->canary == SLAB_CANARY);
 	int new = 0;
 	bool fl = spinlock_acquire(&c->lock);
 	__slab_second_init(c);
@@ -158,25 +194,21 @@ void *slabcache_alloc(struct slabcache *c, void *data)
 
 	void *ret = alloc_slab(s, new);
 	assert(s->slabcache);
-	spinlock_release(&c->lock, fl);
-	c->stats.current_alloced++;
 	c->stats.total_alloced++;
-	if(c->ctor)
-		c->ctor(data, ret);
+	spinlock_release(&c->lock, fl);
 	return ret;
 }
 
-void slabcache_free(struct slabcache *sc, void *obj, void *data)
+static inline struct slabmarker *__obj_marker(struct slabcache *sc, void *obj)
 {
 	size_t raw_sz = sc->sz - sizeof(struct slabmarker);
-	struct slabmarker *mk = (void *)((char *)obj + raw_sz);
-	assert(mk->marker_magic == SLAB_MARKER_MAGIC);
+	return (void *)((char *)obj + raw_sz);
+}
 
+static void __slabcache_free(struct slabcache *sc, void *obj)
+{
+	struct slabmarker *mk = __obj_marker(sc, obj);
 	struct slab *s = (struct slab *)((char *)obj - (sc->sz * mk->slot + sizeof(struct slab)));
-	mk->marker_magic = 0;
-
-	if(sc->dtor)
-		sc->dtor(data, obj);
 
 	if(s->canary != SLAB_CANARY) {
 		panic("SC FREE CANARY MISMATCH: %lx: %p -> %p\n", s->canary, obj, s);
@@ -186,41 +218,367 @@ void slabcache_free(struct slabcache *sc, void *obj, void *data)
 	assert(s->slabcache->canary == SLAB_CANARY);
 
 	bool fl = spinlock_acquire(&s->slabcache->lock);
-	s->alloc |= ((unsigned __int128)1ull << slot);
-	if(num_set(s->alloc) == obj_per_slab(s->slabcache, s->slabcache->sz)) {
+	slab_bitmap_put(s, slot);
+	s->nr_free++;
+	bool now_empty = s->nr_free == obj_per_slab(s->slabcache, s->slabcache->sz);
+	if(s->nr_free == 1) {
+		del_from_list(s);
+		sc->stats.full--;
+	} else if(now_empty) {
 		del_from_list(s);
-		add_to_list(&s->slabcache->empty, s);
 		sc->stats.partial--;
+	}
+	if(now_empty) {
+		add_to_list(&s->slabcache->empty, s);
 		sc->stats.empty++;
-	} else if(num_set(s->alloc) == 1) {
-		del_from_list(s);
+	} else if(s->nr_free == 1) {
 		add_to_list(&s->slabcache->partial, s);
 		sc->stats.partial++;
-		sc->stats.full--;
 	}
-	spinlock_release(&s->slabcache->lock, fl);
-	sc->stats.current_alloced--;
 	sc->stats.total_freed++;
+	spinlock_release(&s->slabcache->lock, fl);
+}
+
+/* Magazine layer. Magazines themselves come from sc_magazine, which has no magazine layer of its
+ * own. The depot (the per-cache lists of full and empty magazines) is protected by depot_lock,
+ * while each CPU's loaded and previous magazines are only ever touched by that CPU with interrupts
+ * disabled. */
+static DECLARE_SLABCACHE_FLAGS(sc_magazine,
+  sizeof(struct slab_magazine),
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  SLABCACHE_NO_MAGAZINE);
+
+static inline struct slab_cpu_cache *__slab_cpu_cache(struct slabcache *c)
+{
+	if(c->flags & SLABCACHE_NO_MAGAZINE)
+		return NULL;
+	int64_t id = arch_processor_current_id();
+	if(id < 0 || id >= PROCESSOR_MAX_CPUS)
+		return NULL;
+	return &c->cpu[id];
+}
+
+static inline void __depot_push(struct slab_magazine **list, size_t *nr, struct slab_magazine *m)
+{
+	m->next = *list;
+	*list = m;
+	(*nr)++;
+}
+
+static inline struct slab_magazine *__depot_pop(struct slab_magazine **list, size_t *nr)
+{
+	struct slab_magazine *m = *list;
+	if(m) {
+		*list = m->next;
+		m->next = NULL;
+		(*nr)--;
+	}
+	return m;
+}
+
+static void *__magazine_alloc(struct slabcache *c)
+{
+	void *ret = NULL;
+	bool fl = arch_interrupt_set(0);
+	struct slab_cpu_cache *cc = __slab_cpu_cache(c);
+	if(!cc)
+		goto out;
+
+	if(cc->loaded && cc->loaded->rounds) {
+		ret = cc->loaded->objs[--cc->loaded->rounds];
+		goto hit;
+	}
+	if(cc->previous && cc->previous->rounds) {
+		struct slab_magazine *tmp = cc->loaded;
+		cc->loaded = cc->previous;
+		cc->previous = tmp;
+		ret = cc->loaded->objs[--cc->loaded->rounds];
+		goto hit;
+	}
+
+	spinlock_acquire_save(&c->depot_lock);
+	struct slab_magazine *full = __depot_pop(&c->depot_full, &c->depot_nr_full);
+	if(c->depot_nr_full < c->depot_full_min)
+		c->depot_full_min = c->depot_nr_full;
+	if(full) {
+		if(cc->previous)
+			__depot_push(&c->depot_empty, &c->depot_nr_empty, cc->previous);
+		cc->previous = cc->loaded;
+		cc->loaded = full;
+	}
+	spinlock_release_restore(&c->depot_lock);
+	if(full) {
+		ret = cc->loaded->objs[--cc->loaded->rounds];
+		goto hit;
+	}
+	cc->alloc_misses++;
+	goto out;
+
+hit:
+	cc->alloc_hits++;
+out:
+	arch_interrupt_set(fl);
+	return ret;
+}
+
+static bool __magazine_free(struct slabcache *c, void *obj)
+{
+	bool fl = arch_interrupt_set(0);
+	struct slab_cpu_cache *cc = __slab_cpu_cache(c);
+	if(!cc) {
+		arch_interrupt_set(fl);
+		return false;
+	}
+
+	while(true) {
+		if(cc->loaded && cc->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+			cc->loaded->objs[cc->loaded->rounds++] = obj;
+			break;
+		}
+		if(cc->previous && cc->previous->rounds < SLAB_MAGAZINE_SIZE) {
+			struct slab_magazine *tmp = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+			cc->loaded->objs[cc->loaded->rounds++] = obj;
+			break;
+		}
+
+		spinlock_acquire_save(&c->depot_lock);
+		struct slab_magazine *empty = __depot_pop(&c->depot_empty, &c->depot_nr_empty);
+		if(empty) {
+			if(cc->previous)
+				__depot_push(&c->depot_full, &c->depot_nr_full, cc->previous);
+			cc->previous = cc->loaded;
+			cc->loaded = empty;
+		}
+		spinlock_release_restore(&c->depot_lock);
+		if(empty)
+			continue;
+
+		/* no empty magazines in the depot; allocate one with interrupts back on, and retry. We
+		 * cannot change CPUs here, since we don't return to userspace. */
+		arch_interrupt_set(fl);
+		struct slab_magazine *m = __slabcache_alloc(&sc_magazine);
+		m->rounds = 0;
+		fl = arch_interrupt_set(0);
+		spinlock_acquire_save(&c->depot_lock);
+		__depot_push(&c->depot_empty, &c->depot_nr_empty, m);
+		spinlock_release_restore(&c->depot_lock);
+		cc->free_misses++;
+	}
+	cc->free_hits++;
+	arch_interrupt_set(fl);
+	return true;
+}
+
+void *slabcache_alloc(struct slabcache *c, void *data)
+{
+	assert(c->canary == SLAB_CANARY);
+	void *ret = __magazine_alloc(c);
+	if(ret) {
+		__obj_marker(c, ret)->marker_magic = SLAB_MARKER_MAGIC;
+	} else {
+		ret = __slabcache_alloc(c);
+	}
+	if(c->ctor)
+		c->ctor(data, ret);
+	return ret;
+}
+
+void slabcache_free(struct slabcache *sc, void *obj, void *data)
+{
+	struct slabmarker *mk = __obj_marker(sc, obj);
+	assert(mk->marker_magic == SLAB_MARKER_MAGIC);
+	mk->marker_magic = 0;
+
+	if(sc->dtor)
+		sc->dtor(data, obj);
+
+	if(!__magazine_free(sc, obj))
+		__slabcache_free(sc, obj);
 }
 
 static void destroy_slab(struct slab *s)
 {
-	panic("NI");
-	assert(num_set(s->alloc) == obj_per_slab(s->slabcache, s->slabcache->sz));
-	for(unsigned int i = 0; i < obj_per_slab(s->slabcache, s->slabcache->sz); i++) {
-		if(s->slabcache->fini) {
-			char *obj = s->data + i * s->slabcache->sz;
-			if(s->slabcache->fini)
-				s->slabcache->fini(s->slabcache->ptr, obj);
+	struct slabcache *c = s->slabcache;
+	assert(s->nr_free == obj_per_slab(c, c->sz));
+	if(c->fini) {
+		for(unsigned int i = 0; i < obj_per_slab(c, c->sz); i++) {
+			char *obj = s->data + i * c->sz;
+			c->fini(c->ptr, obj);
+		}
+	}
+	s->canary = 0;
+	kheap_free(s->run);
+}
+
+/* Return the objects in the depot's full magazines to the slab layer. Only magazines that sat in
+ * the depot for the whole interval since the last reap (the depot's minimum) are drained, so that
+ * the working set of a busy cache stays in its magazines. */
+static void __slabcache_reap_depot(struct slabcache *c)
+{
+	struct slab_magazine *full = NULL, *empty = NULL;
+	spinlock_acquire_save(&c->depot_lock);
+	size_t nr = c->depot_full_min;
+	while(nr--) {
+		struct slab_magazine *m = __depot_pop(&c->depot_full, &c->depot_nr_full);
+		if(!m)
+			break;
+		m->next = full;
+		full = m;
+	}
+	while(c->depot_nr_empty > SLAB_REAP_KEEP_MAGAZINES) {
+		struct slab_magazine *m = __depot_pop(&c->depot_empty, &c->depot_nr_empty);
+		m->next = empty;
+		empty = m;
+	}
+	c->depot_full_min = c->depot_nr_full;
+	spinlock_release_restore(&c->depot_lock);
+
+	while(full) {
+		struct slab_magazine *m = full;
+		full = m->next;
+		for(size_t i = 0; i < m->rounds; i++) {
+			__slabcache_free(c, m->objs[i]);
 		}
+		m->next = empty;
+		empty = m;
+	}
+	while(empty) {
+		struct slab_magazine *m = empty;
+		empty = m->next;
+		__slabcache_free(&sc_magazine, m);
 	}
 }
 
+/* Give this CPU's loaded and previous magazines back to the depot if they haven't been used since
+ * the last check (or if force is set), so that a CPU that has gone idle doesn't pin their objects
+ * forever. The depot reap then frees them like any other idle magazine. Only the owning CPU may
+ * touch its magazines, so each CPU does this for itself, from its idle loop. */
+static void __slabcache_drain_cpu(struct slabcache *c, bool force)
+{
+	bool fl = arch_interrupt_set(0);
+	struct slab_cpu_cache *cc = __slab_cpu_cache(c);
+	if(cc && (cc->loaded || cc->previous)) {
+		size_t ops = cc->alloc_hits + cc->alloc_misses + cc->free_hits + cc->free_misses;
+		if(force || ops == cc->drain_ops) {
+			spinlock_acquire_save(&c->depot_lock);
+			struct slab_magazine *mags[2] = { cc->loaded, cc->previous };
+			for(int i = 0; i < 2; i++) {
+				if(!mags[i])
+					continue;
+				if(mags[i]->rounds)
+					__depot_push(&c->depot_full, &c->depot_nr_full, mags[i]);
+				else
+					__depot_push(&c->depot_empty, &c->depot_nr_empty, mags[i]);
+			}
+			cc->loaded = cc->previous = NULL;
+			spinlock_release_restore(&c->depot_lock);
+		}
+		cc->drain_ops = ops;
+	}
+	arch_interrupt_set(fl);
+}
+
 void slabcache_reap(struct slabcache *c)
 {
-	for(struct slab *s = c->empty.next; s != &c->empty; s = s->next) {
+	if(!(c->flags & SLABCACHE_NO_MAGAZINE)) {
+		__slabcache_reap_depot(c);
+	}
+
+	if(c->flags & SLABCACHE_TYPESAFE) {
+		return;
+	}
+
+	struct slab *list = NULL;
+	bool fl = spinlock_acquire(&c->lock);
+	/* hysteresis: only destroy slabs that stayed empty since the last reap, and always keep a
+	 * few around so that a cache that is oscillating doesn't thrash kheap. */
+	size_t nr = c->stats.empty_min;
+	nr = nr > SLAB_REAP_KEEP_EMPTY ? nr - SLAB_REAP_KEEP_EMPTY : 0;
+	while(nr-- && !is_empty(c->empty)) {
+		struct slab *s = c->empty.prev;
+		del_from_list(s);
+		c->stats.empty--;
+		c->stats.total_slabs--;
+		s->next = list;
+		list = s;
+	}
+	c->stats.empty_min = c->stats.empty;
+	spinlock_release(&c->lock, fl);
+
+	size_t slabsz = slab_size(c, c->sz);
+	while(list) {
+		struct slab *s = list;
+		list = s->next;
 		destroy_slab(s);
+		c->stats.reclaimed_slabs++;
+		c->stats.reclaimed_bytes += slabsz;
+	}
+}
+
+void slabcache_reap_all(void)
+{
+	/* caches are never removed from all_slabs, so we only need the lock to walk to the next entry;
+	 * we can't hold it while reaping, since fini callbacks may allocate. */
+	struct list *e = &all_slabs;
+	while(true) {
+		spinlock_acquire_save(&all_slabs_lock);
+		e = e->next;
+		spinlock_release_restore(&all_slabs_lock);
+		if(e == &all_slabs)
+			break;
+		slabcache_reap(list_entry(e, struct slabcache, entry));
+	}
+}
+
+static void slabcache_drain_cpu_all(bool force)
+{
+	struct list *e = &all_slabs;
+	while(true) {
+		spinlock_acquire_save(&all_slabs_lock);
+		e = e->next;
+		spinlock_release_restore(&all_slabs_lock);
+		if(e == &all_slabs)
+			break;
+		struct slabcache *c = list_entry(e, struct slabcache, entry);
+		if(!(c->flags & SLABCACHE_NO_MAGAZINE))
+			__slabcache_drain_cpu(c, force);
+	}
+}
+
+static _Atomic bool reap_requested = false;
+static _Atomic bool reap_running = false;
+static _Atomic uint64_t reap_last = 0;
+/* when this CPU last looked for idle magazines of its own */
+static DECLARE_PER_CPU(uint64_t, slab_drain_last) = 0;
+
+void slabcache_reap_request(void)
+{
+	reap_requested = true;
+}
+
+void slabcache_idle_reap(void)
+{
+	uint64_t now = clksrc_get_nanoseconds();
+	uint64_t *drain_last = per_cpu_get(slab_drain_last);
+	if(reap_requested || now >= *drain_last + SLAB_REAP_INTERVAL) {
+		/* every CPU does this for itself, while only one of them reaps the depots and slabs */
+		*drain_last = now;
+		slabcache_drain_cpu_all(reap_requested);
 	}
+	if(!reap_requested && now < reap_last + SLAB_REAP_INTERVAL)
+		return;
+	if(atomic_exchange(&reap_running, true))
+		return;
+	reap_requested = false;
+	reap_last = now;
+	slabcache_reap_all();
+	reap_running = false;
 }
 
 static void init_list(struct slab *s)
@@ -231,22 +589,50 @@ static void init_list(struct slab *s)
 
 void slabcache_print_stats(struct slabcache *sc)
 {
-	printk("slabcache %s: size=%lx, slabsz=%lx, nrobj=%d\n",
+	printk("slabcache %s: size=%lx, slabsz=%lx, nrobj=%ld\n",
 	  sc->name,
 	  sc->sz,
 	  slab_size(sc, sc->sz),
-	  sc->__cached_nr_obj);
+	  obj_per_slab(sc, sc->sz));
 	printk("  total_slabs: %ld (%ld empty, %ld partial, %ld full)\n",
 	  sc->stats.total_slabs,
 	  sc->stats.empty,
 	  sc->stats.partial,
 	  sc->stats.full);
-	printk(
-	  "  total_alloced: %ld, total_freed: %ld\n", sc->stats.total_alloced, sc->stats.total_freed);
+	size_t alloc_hits = 0, alloc_misses = 0, free_hits = 0, free_misses = 0;
+	for(int i = 0; i < PROCESSOR_MAX_CPUS; i++) {
+		alloc_hits += sc->cpu[i].alloc_hits;
+		alloc_misses += sc->cpu[i].alloc_misses;
+		free_hits += sc->cpu[i].free_hits;
+		free_misses += sc->cpu[i].free_misses;
+	}
+	size_t total_alloced = sc->stats.total_alloced + alloc_hits;
+	size_t total_freed = sc->stats.total_freed + free_hits;
+	sc->stats.current_alloced = total_alloced - total_freed;
+	printk("  total_alloced: %ld, total_freed: %ld\n", total_alloced, total_freed);
 	printk("  current_alloced: %ld\n", sc->stats.current_alloced);
+	size_t slabsz = slab_size(sc, sc->sz);
+	size_t live = sc->stats.current_alloced * (sc->sz - sizeof(struct slabmarker));
+	size_t backing = sc->stats.total_slabs * slabsz;
+	printk("  memory: %ld bytes in slabs, %ld bytes per object, %ld%% overhead\n",
+	  backing,
+	  slabsz / obj_per_slab(sc, sc->sz),
+	  live ? ((backing - live) * 100) / live : 0);
+	printk("  reclaimed: %ld bytes (%ld slabs)\n",
+	  sc->stats.reclaimed_bytes,
+	  sc->stats.reclaimed_slabs);
+	if(!(sc->flags & SLABCACHE_NO_MAGAZINE)) {
+		printk("  magazine: alloc %ld hit / %ld miss, free %ld hit / %ld miss, depot %ld full / %ld "
+		       "empty\n",
+		  alloc_hits,
+		  alloc_misses,
+		  free_hits,
+		  free_misses,
+		  sc->depot_nr_full,
+		  sc->depot_nr_empty);
+	}
 }
 
-#include <lib/iter.h>
 void slabcache_all_print_stats(void)
 {
 	foreach(e, list, &all_slabs) {
@@ -278,6 +664,8 @@ void slabcache_init(struct slabcache *c,
 	c->init = init;
 	c->fini = fini;
 	c->lock = SPINLOCK_INIT;
+	c->depot_lock = SPINLOCK_INIT;
+	c->flags = 0;
 	c->canary = SLAB_CANARY;
 
 	init_list(&c->empty);
@@ -285,6 +673,10 @@ void slabcache_init(struct slabcache *c,
 	init_list(&c->partial);
 
 	memset(&c->stats, 0, sizeof(c->stats));
+	memset(c->cpu, 0, sizeof(c->cpu));
+	c->depot_full = c->depot_empty = NULL;
+	c->depot_nr_full = c->depot_nr_empty = 0;
+	c->depot_full_min = 0;
 
 	c->name = name;
 }
@@ -18,7 +18,7 @@
 
 static void __kso_device_ctor(struct object *obj)
 {
-	struct device *dev = obj->kso_data = kalloc(sizeof(struct device), 0);
+	struct device *dev = obj->kso_data = kalloc(sizeof(struct device), KALLOC_ZERO);
 	dev->root = obj;
 	dev->flags = 0;
 }
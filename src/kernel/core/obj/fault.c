@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <clksrc.h>
 #include <objspace.h>
 #include <page.h>
 #include <pager.h>
@@ -163,22 +164,29 @@ static bool __objspace_fault_calculate_perms(struct object *o,
 	return true;
 }
 
-static void object_map_page(struct object *obj, size_t pagenr, struct page *page, uint64_t flags)
+/* returns true if a new entry was installed for pagenr */
+static bool object_map_page(struct object *obj, size_t pagenr, struct page *page, uint64_t flags)
 {
 	struct omap *omap = mm_objspace_get_object_map(obj, pagenr);
 	assert(omap);
+	size_t idx = pagenr % (mm_objspace_region_size() / mm_page_size(0));
+	bool existed = false;
+	if(flags & PAGE_MAP_LARGE) {
+		/* the page structs of a frame are contiguous, so this is the first page of the region */
+		arch_objspace_region_map_large(omap->region, page - idx, flags & ~PAGE_MAP_LARGE);
+	}
 	arch_objspace_region_map(
 	  current_thread->active_sc->space, omap->region, flags & (MAP_READ | MAP_WRITE | MAP_EXEC));
-	if(arch_objspace_region_map_page(
-	     omap->region, pagenr % (mm_objspace_region_size() / mm_page_size(0)), page, flags)) {
-		arch_mm_objspace_invalidate(NULL,
-		  omap->region->addr + (pagenr % (mm_objspace_region_size() / mm_page_size(0))),
-		  mm_page_size(0),
-		  0);
+	if(!(flags & PAGE_MAP_LARGE)) {
+		existed = arch_objspace_region_map_page(omap->region, idx, page, flags);
+		if(existed && !(flags & PAGE_MAP_NOREPLACE))
+			arch_mm_objspace_invalidate(
+			  NULL, omap->region->addr + idx * mm_page_size(0), mm_page_size(0), 0);
 	}
 	/* TODO: would like a better system for this */
 	assert(omap->refs > 1);
 	omap->refs--;
+	return !existed;
 }
 
 static void __op_fault_callback(struct object *obj,
@@ -190,9 +198,56 @@ static void __op_fault_callback(struct object *obj,
 	uint64_t mapflags = MAP_READ | MAP_WRITE | MAP_EXEC;
 	if(cbfl & PAGE_MAP_COW)
 		mapflags |= PAGE_MAP_COW;
+	if(cbfl & PAGE_MAP_LARGE)
+		mapflags |= PAGE_MAP_LARGE;
 	object_map_page(obj, pagenr, page, mapflags);
 }
 
+static void __op_fault_around_callback(struct object *obj,
+  size_t pagenr,
+  struct page *page,
+  void *data,
+  uint64_t cbfl)
+{
+	size_t *mapped = data;
+	uint64_t mapflags = MAP_READ | MAP_WRITE | MAP_EXEC | PAGE_MAP_NOREPLACE;
+	if(cbfl & PAGE_MAP_COW)
+		mapflags |= PAGE_MAP_COW;
+	if(object_map_page(obj, pagenr, page, mapflags))
+		(*mapped)++;
+}
+
+/* Fault-around: when faults to an object walk it in one direction, also map the resident pages
+ * ahead of the fault. The window doubles while the pattern holds (a fault landing just past the
+ * pages mapped by the last one) and drops back to zero on any other access. */
+#define FAULT_AROUND_MIN 4
+#define FAULT_AROUND_MAX 64
+
+static void object_fault_around(struct object *obj, size_t pagenr)
+{
+	size_t last = atomic_exchange(&obj->fault_last, pagenr);
+	uint32_t window = obj->fault_window;
+	long dir = 0;
+	if(pagenr > last && pagenr - last <= window + 1) {
+		dir = 1;
+	} else if(pagenr < last && last - pagenr <= window + 1) {
+		dir = -1;
+	}
+	if(!dir) {
+		obj->fault_window = 0;
+		return;
+	}
+	window = window ? window * 2 : FAULT_AROUND_MIN;
+	if(window > FAULT_AROUND_MAX)
+		window = FAULT_AROUND_MAX;
+	obj->fault_window = window;
+
+	size_t mapped = 0;
+	object_operate_around_page(obj, pagenr, dir, window, __op_fault_around_callback, &mapped);
+	obj->nr_fault_around += mapped;
+	object_stats.fault_around += mapped;
+}
+
 static struct object *fault_get_object(uintptr_t vaddr)
 {
 	return vm_context_lookup_object(current_thread->ctx, vaddr);
@@ -227,7 +282,19 @@ void kernel_objspace_fault_entry(uintptr_t ip, uintptr_t loaddr, uintptr_t vaddr
 	int opflags = 0;
 	if(flags & OBJSPACE_FAULT_WRITE) {
 		opflags |= OP_LP_DO_COPY;
+	} else {
+		/* reads of never-written pages share the zero page; the first write allocates a page */
+		opflags |= OP_LP_ZERO_PAGE;
 	}
+	uint64_t start = clksrc_get_nanoseconds();
 	object_operate_on_locked_page(obj, pagenr, opflags, __op_fault_callback, NULL);
+	object_fault_around(obj, pagenr);
+	obj->nr_faults++;
+	uint64_t ns = clksrc_get_nanoseconds() - start;
+	object_stats.faults++;
+	object_stats.fault_ns += ns;
+	uint64_t max = object_stats.fault_ns_max;
+	while(ns > max && !atomic_compare_exchange_weak(&object_stats.fault_ns_max, &max, ns))
+		;
 	obj_put(obj);
 }
@@ -50,7 +50,12 @@ static size_t cow_range(struct object *dest,
 #define OP_INVL 1
 #define OP_COW 2
 
-static void object_op_on_pages(struct object *obj, size_t pagenr, size_t pgcount, int type)
+/* unmap or COW the pages of obj that are mapped, adding the affected object space to invl */
+static void object_op_on_pages(struct object *obj,
+  size_t pagenr,
+  size_t pgcount,
+  int type,
+  struct objspace_invl *invl)
 {
 	while(pgcount) {
 		size_t omapnr = pagenr / (mm_objspace_region_size() / mm_page_size(0));
@@ -68,16 +73,21 @@ static void object_op_on_pages(struct object *obj, size_t pagenr, size_t pgcount
 
 			if(node) {
 				struct omap *omap = rb_entry(node, struct omap, objnode);
+				uint64_t dirty[OBJSPACE_DIRTY_WORDS] = {};
 				switch(type) {
 					case OP_INVL:
-						arch_objspace_region_unmap(omap->region, s, l);
+						arch_objspace_region_unmap(omap->region, s, l, dirty);
 						break;
 					case OP_COW:
-						arch_objspace_region_cow(omap->region, s, l);
+						arch_objspace_region_cow(omap->region, s, l, dirty);
 						break;
 					default:
 						panic("invalid op type");
 				}
+				object_mark_pages_dirty(
+				  obj, omap->regnr * (mm_objspace_region_size() / mm_page_size(0)) + s, l, dirty);
+				objspace_invl_add(
+				  invl, omap->region->addr + s * mm_page_size(0), l * mm_page_size(0));
 				pgcount -= l;
 				pagenr += l;
 
@@ -109,6 +119,7 @@ void object_copy(struct object *dest, struct object_copy_spec *specs, size_t cou
 	/* TODO (high): when discovering an empty srcrange, need to create one and a dummy pagevec to
 	 * share */
 	struct rwlock_result dres = rwlock_wlock(&dest->rwlock, 0);
+	struct objspace_invl invl = {};
 	size_t nrpages = 0;
 	for(size_t i = 0; i < count; i++) {
 		struct object_copy_spec *spec = &specs[i];
@@ -129,6 +140,9 @@ void object_copy(struct object *dest, struct object_copy_spec *specs, size_t cou
 		  IDPR(spec->src->id));
 #endif
 		struct rwlock_result sres = rwlock_wlock(&spec->src->rwlock, 0);
+		/* unmap dest before its old ranges are tossed, so that the pages get their dirty state
+		 * before they are freed */
+		object_op_on_pages(dest, spec->start_dst, spec->length, OP_INVL, &invl);
 		for(size_t j = 0; j < spec->length;) {
 			size_t srcpg = spec->start_src + j;
 			size_t dstpg = spec->start_dst + j;
@@ -151,11 +165,27 @@ void object_copy(struct object *dest, struct object_copy_spec *specs, size_t cou
 			size_t x = cow_range(dest, srcrange, dstpg, srcpg, rem);
 			j += x;
 		}
-		object_op_on_pages(spec->src, spec->start_src, spec->length, OP_COW);
-		object_op_on_pages(dest, spec->start_dst, spec->length, OP_INVL);
+		object_op_on_pages(spec->src, spec->start_src, spec->length, OP_COW, &invl);
 		rwlock_wunlock(&sres);
 	}
-	/* TODO (opt): don't invalidate the whole address space */
-	arch_mm_objspace_invalidate(NULL, 0, 0xffffffffffffffff, 0);
+	/* only the parts of dest and the sources that were actually mapped need invalidating; if
+	 * neither was mapped, this is free */
+	arch_mm_objspace_invalidate_batch(NULL, &invl);
+	for(size_t i = 0; i < count; i++) {
+		obj_hash_invalidate(dest, specs[i].start_dst, specs[i].length);
+	}
 	rwlock_wunlock(&dres);
+	/* copying adjacent source ranges leaves adjacent dest ranges sharing a pagevec */
+	object_queue_coalesce(dest);
+}
+
+/* Write-protect every mapped page of obj, collecting the pages' dirty bits, so that the next
+ * write to each page is noticed (by the dirty bit) again. */
+void object_collect_dirty(struct object *obj)
+{
+	struct objspace_invl invl = {};
+	struct rwlock_result rwres = rwlock_wlock(&obj->rwlock, 0);
+	object_op_on_pages(obj, 0, OBJ_MAXSIZE / mm_page_size(0), OP_COW, &invl);
+	arch_mm_objspace_invalidate_batch(NULL, &invl);
+	rwlock_wunlock(&rwres);
 }
@@ -25,38 +25,41 @@
 #include <twz/sys/syscall.h>
 
 static _Atomic size_t obj_count = 0;
-static struct rbroot obj_tree = RBINIT;
 
-static struct spinlock objlock = SPINLOCK_INIT;
+struct object_stats object_stats = {};
 
 void obj_print_stats(void)
 {
 	printk("KNOWN OBJECTS: %ld\n", obj_count);
+	uint64_t faults = object_stats.faults;
+	printk("faults: %ld, avg %ld ns, max %ld ns\n",
+	  faults,
+	  faults ? object_stats.fault_ns / faults : 0,
+	  object_stats.fault_ns_max);
+	obj_table_print_stats();
+	printk("fault-around: %ld pages mapped\n", object_stats.fault_around);
+	printk("ranges: %ld live; %ld extended, %ld merged\n",
+	  object_stats.ranges,
+	  object_stats.range_extends,
+	  object_stats.range_merges);
+	printk("id hash: %ld tree leaves hashed, %ld reused\n",
+	  object_stats.hash_leaves,
+	  object_stats.hash_leaves_cached);
+	printk("cow: %ld pages copied, %ld ranges cloned (%ld pages shared)\n",
+	  object_stats.cow_copies,
+	  object_stats.range_clones,
+	  object_stats.pages_shared);
 }
 
-static int __obj_compar_key(struct object *a, objid_t b)
-{
-	if(a->id > b)
-		return 1;
-	else if(a->id < b)
-		return -1;
-	return 0;
-}
-
-static int __obj_compar(struct object *a, struct object *b)
-{
-	return __obj_compar_key(a, b->id);
-}
 
 static void _obj_init(void *_u, void *ptr)
 {
 	(void)_u;
 	struct object *obj = ptr;
 	obj->lock = SPINLOCK_INIT;
-	obj->tslock = SPINLOCK_INIT;
+	rwlock_init(&obj->rwlock);
 	obj->omap_root = RBINIT;
 	obj->range_tree = RBINIT;
-	obj->tstable_root = RBINIT;
 	obj->page_requests_root = RBINIT;
 	obj->kso_type = KSO_NONE;
 }
@@ -70,6 +73,23 @@ void obj_init(struct object *obj)
 	obj->ties_root = RBINIT;
 	obj->range_tree = RBINIT;
 	list_init(&obj->sleepers);
+	obj->fault_last = 0;
+	obj->fault_window = 0;
+	obj->nr_faults = 0;
+	obj->nr_fault_around = 0;
+	obj->hash = NULL;
+	obj->hash_gen = 0;
+}
+
+/* Put the object's contents lock in per-CPU mode. Faults and reads on the object from different
+ * CPUs then no longer contend, but writes (copy-on-write, object_copy, etc) must check every CPU,
+ * so this is for objects that are shared widely and seldom written: libraries, views, namespaces.
+ */
+void obj_set_read_mostly(struct object *obj)
+{
+	if(atomic_fetch_or(&obj->flags, OF_READMOSTLY) & OF_READMOSTLY)
+		return;
+	rwlock_set_percpu(&obj->rwlock);
 }
 
 static void _obj_dtor(void *_u, void *ptr)
@@ -79,7 +99,14 @@ static void _obj_dtor(void *_u, void *ptr)
 	assert(krc_iszero(&obj->refs));
 }
 
-static DECLARE_SLABCACHE(sc_objs, sizeof(struct object), _obj_init, NULL, _obj_dtor, NULL, NULL);
+static DECLARE_SLABCACHE_FLAGS(sc_objs,
+  sizeof(struct object),
+  _obj_init,
+  NULL,
+  _obj_dtor,
+  NULL,
+  NULL,
+  SLABCACHE_TYPESAFE);
 
 static inline struct object *__obj_alloc(enum kso_type ksot, objid_t id)
 {
@@ -98,52 +125,139 @@ struct object *obj_create(uint128_t id, enum kso_type ksot)
 {
 	struct object *obj = __obj_alloc(ksot, id);
 	if(id) {
-		spinlock_acquire_save(&objlock);
-		if(rb_search(&obj_tree, id, struct object, node, __obj_compar_key)) {
-			panic("duplicate object created");
-		}
-		rb_insert(&obj_tree, obj, struct object, node, __obj_compar);
-		spinlock_release_restore(&objlock);
+		obj_table_insert(obj);
 	}
 	return obj;
 }
 
 void obj_assign_id(struct object *obj, objid_t id)
 {
-	spinlock_acquire_save(&objlock);
 	if(obj->id) {
 		panic("tried to reassign object ID");
 	}
-	if(rb_search(&obj_tree, id, struct object, node, __obj_compar_key)) {
-		panic("duplicate object created");
-	}
 	obj->id = id;
-	rb_insert(&obj_tree, obj, struct object, node, __obj_compar);
-	spinlock_release_restore(&objlock);
+	obj_table_insert(obj);
 }
 
 struct object *obj_lookup(uint128_t id, int flags)
 {
-	spinlock_acquire_save(&objlock);
-	struct rbnode *node = rb_search(&obj_tree, id, struct object, node, __obj_compar_key);
+	struct object *obj = obj_table_lookup(id);
+	if(!obj)
+		return NULL;
+
+	if((obj->flags & OF_HIDDEN) && !(flags & OBJ_LOOKUP_HIDDEN)) {
+		obj_put(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+/* Objects with MIP_HASHTREE hash each page of their data separately, and the ID covers the page
+ * digests instead of the data. We keep the digests of full pages, and throw one away when its page
+ * may have changed: the kernel's own writes report that directly, and writes through mappings are
+ * found from the dirty bits, which are collected (and cleared) before each recomputation. Every
+ * change also bumps hash_gen, so a digest computed while the object changed isn't kept. */
+struct objhash {
+	size_t nr;
+	uint64_t *valid;
+	unsigned char (*leaf)[32];
+};
 
-	struct object *obj = node ? rb_entry(node, struct object, node) : NULL;
-	if(node) {
-		krc_get(&obj->refs);
-		spinlock_release_restore(&objlock);
+#define OBJ_HASH_PAGE0 (OBJ_NULLPAGE_SIZE / MI_HASHTREE_LEAF)
+
+static void obj_hash_free(struct object *obj)
+{
+	if(obj->hash) {
+		kfree(obj->hash->valid);
+		kfree(obj->hash->leaf);
+		kfree(obj->hash);
+		obj->hash = NULL;
+	}
+}
+
+void obj_hash_invalidate(struct object *obj, size_t pagenr, size_t len)
+{
+	obj->hash_gen++;
+	if(!obj->hash || pagenr + len <= OBJ_HASH_PAGE0)
+		return;
+	spinlock_acquire_save(&obj->lock);
+	struct objhash *hash = obj->hash;
+	if(hash) {
+		size_t start = pagenr < OBJ_HASH_PAGE0 ? 0 : pagenr - OBJ_HASH_PAGE0;
+		size_t end = pagenr + len - OBJ_HASH_PAGE0;
+		for(size_t i = start; i < end && i < hash->nr; i++) {
+			hash->valid[i / 64] &= ~(1ul << (i % 64));
+		}
+	}
+	spinlock_release_restore(&obj->lock);
+}
+
+/* make room for nr leaves in obj's digest cache */
+static void obj_hash_reserve(struct object *obj, size_t nr)
+{
+	if(obj->hash && obj->hash->nr >= nr)
+		return;
+	struct objhash *new = kalloc(sizeof(*new), 0);
+	new->nr = nr;
+	new->valid = kcalloc((nr + 63) / 64, sizeof(uint64_t), 0);
+	new->leaf = kcalloc(nr, sizeof(new->leaf[0]), 0);
+
+	spinlock_acquire_save(&obj->lock);
+	struct objhash *old = obj->hash;
+	if(old && old->nr >= nr) {
+		/* lost a race with someone else growing it */
+		spinlock_release_restore(&obj->lock);
+		kfree(new->valid);
+		kfree(new->leaf);
+		kfree(new);
+		return;
+	}
+	if(old) {
+		memcpy(new->valid, old->valid, ((old->nr + 63) / 64) * sizeof(uint64_t));
+		memcpy(new->leaf, old->leaf, old->nr * sizeof(old->leaf[0]));
+	}
+	obj->hash = new;
+	spinlock_release_restore(&obj->lock);
+	if(old) {
+		kfree(old->valid);
+		kfree(old->leaf);
+		kfree(old);
+	}
+}
 
+static void obj_hash_leaf(struct object *obj, size_t i, size_t len, unsigned char *out)
+{
+	bool full = len == MI_HASHTREE_LEAF;
+	if(full) {
 		spinlock_acquire_save(&obj->lock);
-		if((obj->flags & OF_HIDDEN) && !(flags & OBJ_LOOKUP_HIDDEN)) {
+		struct objhash *hash = obj->hash;
+		if(i < hash->nr && (hash->valid[i / 64] & (1ul << (i % 64)))) {
+			memcpy(out, hash->leaf[i], 32);
 			spinlock_release_restore(&obj->lock);
-			obj_put(obj);
-			return NULL;
+			object_stats.hash_leaves_cached++;
+			return;
+		}
+		spinlock_release_restore(&obj->lock);
+	}
+
+	uint64_t gen = obj->hash_gen;
+	char buf[MI_HASHTREE_LEAF];
+	obj_read_data(obj, i * MI_HASHTREE_LEAF, len, buf);
+	_Alignas(16) blake2b_state S;
+	blake2b_init_leaf(&S, 32, MI_HASHTREE_LEAF, i);
+	blake2b_update(&S, buf, len);
+	blake2b_final(&S, out, 32);
+	object_stats.hash_leaves++;
+
+	if(full) {
+		spinlock_acquire_save(&obj->lock);
+		struct objhash *hash = obj->hash;
+		if(gen == obj->hash_gen && i < hash->nr) {
+			memcpy(hash->leaf[i], out, 32);
+			hash->valid[i / 64] |= 1ul << (i % 64);
 		}
 		spinlock_release_restore(&obj->lock);
-	} else {
-		spinlock_release_restore(&objlock);
-		return NULL;
 	}
-	return obj;
 }
 
 static void _obj_release(void *_obj)
@@ -159,11 +273,19 @@ static void _obj_release(void *_obj)
 
 		obj_tie_free(obj);
 
-		assert(rb_empty(&obj->tstable_root));
 		assert(rb_empty(&obj->page_requests_root));
 		assert(rb_empty(&obj->ties_root));
 
 		struct rbnode *next;
+		/* unmap first: freeing the omaps collects the dirty bits for our pages, which needs to
+		 * happen before the ranges (and thus the pages) are freed. */
+		for(struct rbnode *node = rb_first(&obj->omap_root); node; node = next) {
+			next = rb_next(node);
+			struct omap *omap = rb_entry(node, struct omap, objnode);
+			rb_delete(node, &obj->omap_root);
+			omap_free(omap);
+		}
+
 		/* TODO: we could collect all the nodes in a vector, reset the tree, and then free() them,
 		 * that way we don't need to call rb_delete for each one */
 		for(struct rbnode *node = rb_first(&obj->range_tree); node; node = next) {
@@ -174,13 +296,6 @@ static void _obj_release(void *_obj)
 			range_free(range);
 		}
 
-		for(struct rbnode *node = rb_first(&obj->omap_root); node; node = next) {
-			next = rb_next(node);
-			struct omap *omap = rb_entry(node, struct omap, objnode);
-			rb_delete(node, &obj->omap_root);
-			omap_free(omap);
-		}
-
 		assert(rb_empty(&obj->range_tree));
 		assert(rb_empty(&obj->omap_root));
 
@@ -192,6 +307,8 @@ static void _obj_release(void *_obj)
 		}
 
 		object_kso_dir_destroy(obj);
+		obj_hash_free(obj);
+		rwlock_fini(&obj->rwlock);
 
 		obj_count--;
 		slabcache_free(&sc_objs, obj, NULL);
@@ -200,13 +317,15 @@ static void _obj_release(void *_obj)
 
 void obj_put(struct object *o)
 {
-	if(krc_put_locked(&o->refs, &objlock)) {
-		if(o->flags & OF_DELETE) {
-			rb_delete(&o->node, &obj_tree);
-		}
-		spinlock_release_restore(&objlock);
-		_obj_release(o);
+	if(krc_put_unless_one(&o->refs))
+		return;
+	if(!o->id) {
+		if(krc_put(&o->refs))
+			_obj_release(o);
+		return;
 	}
+	if(obj_table_put(o))
+		_obj_release(o);
 }
 
 bool obj_get_pflags(struct object *obj, uint32_t *pf)
@@ -252,18 +371,33 @@ objid_t obj_compute_id(struct object *obj)
 		size_t slen = mi.sz;
 		if(slen > OBJ_TOPDATA)
 			slen = OBJ_TOPDATA;
-		for(size_t s = 0; s < slen; s += mm_page_size(0)) {
-			size_t rem = mm_page_size(0);
-			if(s + mm_page_size(0) > slen) {
-				rem = slen - s;
+		if(mi.p_flags & MIP_HASHTREE) {
+			size_t nr = (slen + MI_HASHTREE_LEAF - 1) / MI_HASHTREE_LEAF;
+			object_collect_dirty(obj);
+			obj_hash_reserve(obj, nr);
+			for(size_t i = 0; i < nr; i++) {
+				size_t len = MI_HASHTREE_LEAF;
+				if((i + 1) * MI_HASHTREE_LEAF > slen)
+					len = slen - i * MI_HASHTREE_LEAF;
+				unsigned char leaf[32];
+				obj_hash_leaf(obj, i, len, leaf);
+				blake2b_update(&S, leaf, sizeof(leaf));
+				tl += len;
+			}
+		} else {
+			for(size_t s = 0; s < slen; s += mm_page_size(0)) {
+				size_t rem = mm_page_size(0);
+				if(s + mm_page_size(0) > slen) {
+					rem = slen - s;
+				}
+				assert(rem <= mm_page_size(0));
+
+				char buf[rem];
+				obj_read_data(obj, s, rem, buf);
+
+				blake2b_update(&S, buf, rem);
+				tl += rem;
 			}
-			assert(rem <= mm_page_size(0));
-
-			char buf[rem];
-			obj_read_data(obj, s, rem, buf);
-
-			blake2b_update(&S, buf, rem);
-			tl += rem;
 		}
 		size_t mdbottom = OBJ_METAPAGE_SIZE + sizeof(struct fotentry) * mi.fotentries;
 		size_t pos = OBJ_MAXSIZE - (OBJ_NULLPAGE_SIZE + mdbottom);
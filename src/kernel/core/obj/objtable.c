@@ -0,0 +1,193 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <kalloc.h>
+#include <object.h>
+#include <spinlock.h>
+
+/* Objects with an ID are kept in a hash table of singly-linked chains. Lookups walk a chain
+ * without locking and take a reference with krc_get_unless_zero; anything that modifies a chain
+ * (and the final put of an object, which may unlink it) holds that bucket's lock. Since the walk
+ * is unlocked it may see an object being freed and reused, so object memory is type-stable
+ * (SLABCACHE_TYPESAFE), a match is re-checked once the reference is held, and a miss (or an object
+ * whose count is zero) is retried under the bucket lock.
+ *
+ * The table grows by locking every bucket of the old one and rehashing. Writers re-check that the
+ * table they locked a bucket in is still current. Old bucket arrays are never freed, since a
+ * lookup may still be walking one; they add up to less than the current one. */
+struct obj_bucket {
+	struct spinlock lock;
+	struct object *_Atomic head;
+};
+
+struct obj_table {
+	size_t mask;
+	struct obj_bucket *buckets;
+	struct obj_table *retired;
+};
+
+#define OBJ_TABLE_INITIAL 256
+#define OBJ_TABLE_MAX (1ul << 20)
+/* load factor (objects per bucket) at which the table grows */
+#define OBJ_TABLE_LOAD 2
+/* give up on a lock-free walk after this many links (it may have wandered onto a recycled
+ * object's chain) */
+#define OBJ_LOOKUP_MAX_WALK 32
+
+static struct obj_bucket obj_buckets_initial[OBJ_TABLE_INITIAL];
+static struct obj_table obj_table_initial = {
+	.mask = OBJ_TABLE_INITIAL - 1,
+	.buckets = obj_buckets_initial,
+};
+static struct obj_table *_Atomic obj_table = &obj_table_initial;
+static _Atomic size_t obj_table_count = 0;
+static DECLARE_SPINLOCK(obj_table_grow_lock);
+
+static inline struct obj_bucket *obj_table_bucket(struct obj_table *t, objid_t id)
+{
+	uint64_t h = ((uint64_t)id ^ (uint64_t)(id >> 64)) * 0x9e3779b97f4a7c15ul;
+	return &t->buckets[(h >> 32) & t->mask];
+}
+
+/* lock the bucket that id belongs in, in the current table */
+static struct obj_bucket *obj_table_lock(objid_t id)
+{
+	while(true) {
+		struct obj_table *t = obj_table;
+		struct obj_bucket *b = obj_table_bucket(t, id);
+		spinlock_acquire_save(&b->lock);
+		if(t == obj_table)
+			return b;
+		spinlock_release_restore(&b->lock);
+	}
+}
+
+static struct object *obj_table_find_locked(struct obj_bucket *b, objid_t id)
+{
+	for(struct object *o = b->head; o; o = o->hnext) {
+		if(o->id == id)
+			return o;
+	}
+	return NULL;
+}
+
+static void obj_table_unlink_locked(struct obj_bucket *b, struct object *obj)
+{
+	struct object *_Atomic *pp = &b->head;
+	while(*pp && *pp != obj)
+		pp = &(*pp)->hnext;
+	assert(*pp == obj);
+	*pp = obj->hnext;
+	obj_table_count--;
+}
+
+static void obj_table_grow(void)
+{
+	struct obj_table *old = obj_table;
+	size_t nr = (old->mask + 1) * 2;
+	if(nr > OBJ_TABLE_MAX)
+		return;
+	struct obj_table *t = kalloc(sizeof(*t), 0);
+	t->buckets = kcalloc(nr, sizeof(struct obj_bucket), 0);
+	t->mask = nr - 1;
+
+	spinlock_acquire_save(&obj_table_grow_lock);
+	if(old != obj_table) {
+		spinlock_release_restore(&obj_table_grow_lock);
+		kfree(t->buckets);
+		kfree(t);
+		return;
+	}
+	for(size_t i = 0; i <= old->mask; i++) {
+		/* interrupts are already off (from obj_table_grow_lock), so nothing is lost here */
+		spinlock_acquire_save(&old->buckets[i].lock);
+	}
+	/* readers still walking the old chains may miss an object while it moves, and will retry
+	 * under a bucket lock, which waits for us. */
+	for(size_t i = 0; i <= old->mask; i++) {
+		struct object *next;
+		for(struct object *o = old->buckets[i].head; o; o = next) {
+			next = o->hnext;
+			struct obj_bucket *b = obj_table_bucket(t, o->id);
+			o->hnext = b->head;
+			b->head = o;
+		}
+	}
+	t->retired = old;
+	obj_table = t;
+	for(size_t i = old->mask + 1; i > 0; i--) {
+		spinlock_release_restore(&old->buckets[i - 1].lock);
+	}
+	spinlock_release_restore(&obj_table_grow_lock);
+}
+
+void obj_table_insert(struct object *obj)
+{
+	struct obj_bucket *b = obj_table_lock(obj->id);
+	if(obj_table_find_locked(b, obj->id)) {
+		panic("duplicate object created");
+	}
+	obj->hnext = b->head;
+	b->head = obj;
+	size_t count = ++obj_table_count;
+	spinlock_release_restore(&b->lock);
+
+	if(count > (obj_table->mask + 1) * OBJ_TABLE_LOAD)
+		obj_table_grow();
+}
+
+static struct object *obj_table_lookup_lockfree(objid_t id)
+{
+	struct obj_table *t = obj_table;
+	struct object *o = obj_table_bucket(t, id)->head;
+	for(size_t n = 0; o && n < OBJ_LOOKUP_MAX_WALK; o = o->hnext, n++) {
+		if(o->id != id)
+			continue;
+		if(!krc_get_unless_zero(&o->refs))
+			return NULL;
+		/* the object may have been freed and reused since we found it */
+		if(o->id == id)
+			return o;
+		obj_put(o);
+		return NULL;
+	}
+	return NULL;
+}
+
+struct object *obj_table_lookup(objid_t id)
+{
+	struct object *obj = obj_table_lookup_lockfree(id);
+	if(obj)
+		return obj;
+	object_stats.lookup_slow++;
+	/* an object whose count dropped to zero stays in the table (unless it's being deleted, which
+	 * unlinks it under this lock), so it may be revived here */
+	struct obj_bucket *b = obj_table_lock(id);
+	obj = obj_table_find_locked(b, id);
+	if(obj)
+		krc_get(&obj->refs);
+	spinlock_release_restore(&b->lock);
+	return obj;
+}
+
+bool obj_table_put(struct object *obj)
+{
+	/* the ID is stable while we hold a reference */
+	struct obj_bucket *b = obj_table_lock(obj->id);
+	bool last = krc_put(&obj->refs);
+	if(last && (obj->flags & OF_DELETE))
+		obj_table_unlink_locked(b, obj);
+	spinlock_release_restore(&b->lock);
+	return last;
+}
+
+void obj_table_print_stats(void)
+{
+	printk("object table: %ld buckets, %ld objects (%ld slow lookups)\n",
+	  obj_table->mask + 1,
+	  obj_table_count,
+	  object_stats.lookup_slow);
+}
@@ -1,5 +1,6 @@
 #include <__mm_bits.h>
 #include <object.h>
+#include <page.h>
 #include <pagevec.h>
 #include <range.h>
 void object_insert_page(struct object *obj, size_t pagenr, struct page *page)
@@ -21,10 +22,54 @@ void object_insert_page(struct object *obj, size_t pagenr, struct page *page)
 	}
 
 	pagevec_set_page(range->pv, pvidx, page);
+	obj_hash_invalidate(obj, pagenr, 1);
 
 	rwlock_wunlock(&rwres);
 }
 
+/* Clear PAGE_ZERO on each page in [pagenr, pagenr + len) whose bit is set in the dirty bitmap (as
+ * filled in by arch_objspace_region_unmap or _cow), and drop its cached hash. Caller must hold the
+ * object's rwlock (or be tearing the object down). */
+void object_mark_pages_dirty(struct object *obj, size_t pagenr, size_t len, uint64_t *dirty)
+{
+	for(size_t i = 0; i < len; i++) {
+		if(!(dirty[i / 64] & (1ul << (i % 64))))
+			continue;
+		struct range *range = object_find_range(obj, pagenr + i);
+		if(!range || !range->pv)
+			continue;
+		pagevec_lock(range->pv);
+		struct page *page = pagevec_lookup_page(range->pv, range_pv_idx(range, pagenr + i));
+		if(page)
+			mm_page_mark_dirty(page);
+		pagevec_unlock(range->pv);
+		obj_hash_invalidate(obj, pagenr + i, 1);
+	}
+}
+
+/* For objects that asked for large pages: back the whole 2 MiB region around pagenr with one
+ * frame, if none of the region is populated yet. Caller must hold the object's rwlock (write). */
+static struct range *object_add_large_range(struct object *obj, size_t pagenr)
+{
+	size_t start = align_down(pagenr, PAGES_PER_LARGE);
+	struct range *next = object_find_next_range(obj, start);
+	if(next && next->start < start + PAGES_PER_LARGE)
+		return NULL;
+	struct pagevec *pv = pagevec_new_large();
+	if(!pv)
+		return NULL;
+	return object_add_range(obj, pv, start, PAGES_PER_LARGE, 0);
+}
+
+/* can the region containing pagenr be mapped with a single large mapping? */
+static bool range_maps_large(struct range *range, size_t pagenr)
+{
+	size_t start = align_down(pagenr, PAGES_PER_LARGE);
+	if(range->start > start || range->start + range->len < start + PAGES_PER_LARGE)
+		return false;
+	return pagevec_has_large(range->pv, range_pv_idx(range, start));
+}
+
 int object_operate_on_locked_page(struct object *obj,
   size_t pagenr,
   int flags,
@@ -34,16 +79,32 @@ int object_operate_on_locked_page(struct object *obj,
 	uint64_t cb_fl = 0;
 	struct rwlock_result rwres = rwlock_rlock(&obj->rwlock, 0);
 	struct range *range = object_find_range(obj, pagenr);
+	if(obj->flags & (OF_PAGER | OF_LARGEPAGES)) {
+		/* a missing page in a paged object may just not have been paged in yet, and large-page
+		 * objects want their frames allocated up front */
+		flags &= ~OP_LP_ZERO_PAGE;
+	}
 	if(!range) {
 		if(flags & OP_LP_ZERO_OK) {
 			fn(obj, pagenr, NULL, data, cb_fl);
 			rwlock_runlock(&rwres);
 			return 0;
 		}
+		if(flags & OP_LP_ZERO_PAGE) {
+			fn(obj, pagenr, mm_page_shared_zero(), data, PAGE_MAP_COW);
+			rwlock_runlock(&rwres);
+			return 0;
+		}
 		rwres = rwlock_upgrade(&rwres, 0);
-		size_t off;
-		struct pagevec *pv = object_new_pagevec(obj, pagenr, &off);
-		range = object_add_range(obj, pv, pagenr, pagevec_len(pv) - off, off);
+		if(obj->flags & OF_LARGEPAGES)
+			range = object_add_large_range(obj, pagenr);
+		if(!range)
+			range = object_extend_range(obj, pagenr);
+		if(!range) {
+			size_t off;
+			struct pagevec *pv = object_new_pagevec(obj, pagenr, &off);
+			range = object_add_range(obj, pv, pagenr, pagevec_len(pv) - off, off);
+		}
 		rwres = rwlock_downgrade(&rwres);
 	}
 
@@ -52,6 +113,23 @@ int object_operate_on_locked_page(struct object *obj,
 	struct page *page;
 	struct pagevec *locked_pv = range->pv;
 	pagevec_lock(locked_pv);
+	if((flags & OP_LP_ZERO_PAGE) && !pagevec_lookup_page(range->pv, pvidx)) {
+		fn(obj, pagenr, mm_page_shared_zero(), data, PAGE_MAP_COW);
+		pagevec_unlock(locked_pv);
+		rwlock_runlock(&rwres);
+		return 0;
+	}
+	if(range->pv->refs > 1 && (flags & OP_LP_DO_COPY)) {
+		/* move this range to a pagevec of its own (sharing the pages), so that only the page
+		 * being written needs to be copied, below */
+		rwres = rwlock_upgrade(&rwres, 0);
+		range_clone(range);
+		pagevec_unlock(locked_pv);
+		locked_pv = range->pv;
+		pagevec_lock(locked_pv);
+		rwres = rwlock_downgrade(&rwres);
+		pvidx = range_pv_idx(range, pagenr);
+	}
 	int ret = pagevec_get_page(range->pv, pvidx, &page, GET_PAGE_BLOCK);
 
 	if(ret == GET_PAGE_BLOCK) {
@@ -59,22 +137,19 @@ int object_operate_on_locked_page(struct object *obj,
 		/* TODO: return a "def resched" thing */
 	} else {
 		if(range->pv->refs > 1) {
+			cb_fl |= PAGE_MAP_COW;
+		} else if(mm_page_shared(page)) {
 			if(flags & OP_LP_DO_COPY) {
-				rwres = rwlock_upgrade(&rwres, 0);
-				range = range_split(range, pagenr - range->start);
-				range_clone(range);
-				pagevec_unlock(locked_pv);
-				locked_pv = range->pv;
-				pagevec_lock(locked_pv);
-				rwres = rwlock_downgrade(&rwres);
-
-				pvidx = range_pv_idx(range, pagenr);
-				ret = pagevec_get_page(range->pv, pvidx, &page, GET_PAGE_BLOCK);
-				assert(ret == 0);
+				page = pagevec_unshare_page(range->pv, pvidx);
+				object_stats.cow_copies++;
 			} else {
 				cb_fl |= PAGE_MAP_COW;
 			}
 		}
+		if(!(cb_fl & PAGE_MAP_COW) && (mm_page_flags(page) & PAGE_HUGE)
+		   && range_maps_large(range, pagenr)) {
+			cb_fl |= PAGE_MAP_LARGE;
+		}
 		fn(obj, pagenr, page, data, cb_fl);
 	}
 	pagevec_unlock(range->pv);
@@ -83,3 +158,47 @@ int object_operate_on_locked_page(struct object *obj,
 
 	return 0;
 }
+
+/* Call fn on up to nr pages next to pagenr (after it if dir > 0, before it if dir < 0) that are
+ * already resident, without allocating or copying anything. Stops at the edge of pagenr's range
+ * or of its objspace region, and does nothing if the region is mapped large. Returns the number of
+ * pages given to fn. */
+size_t object_operate_around_page(struct object *obj,
+  size_t pagenr,
+  long dir,
+  size_t nr,
+  void (*fn)(struct object *obj, size_t pagenr, struct page *page, void *data, uint64_t cb_fl),
+  void *data)
+{
+	size_t count = 0;
+	struct rwlock_result rwres = rwlock_rlock(&obj->rwlock, 0);
+	struct range *range = object_find_range(obj, pagenr);
+	if(!range || !range->pv || range_maps_large(range, pagenr)) {
+		rwlock_runlock(&rwres);
+		return 0;
+	}
+
+	size_t lo = align_down(pagenr, PAGES_PER_LARGE);
+	size_t hi = lo + PAGES_PER_LARGE;
+	if(lo < range->start)
+		lo = range->start;
+	if(hi > range->start + range->len)
+		hi = range->start + range->len;
+	pagevec_lock(range->pv);
+	bool cow = range->pv->refs > 1;
+	for(size_t i = 1; i <= nr; i++) {
+		size_t p = pagenr + dir * (long)i;
+		if(p < lo || p >= hi)
+			break;
+		struct page *page = pagevec_lookup_page(range->pv, range_pv_idx(range, p));
+		if(!page)
+			continue;
+		uint64_t cb_fl = (cow || mm_page_shared(page)) ? PAGE_MAP_COW : 0;
+		fn(obj, p, page, data, cb_fl);
+		count++;
+	}
+	pagevec_unlock(range->pv);
+
+	rwlock_runlock(&rwres);
+	return count;
+}
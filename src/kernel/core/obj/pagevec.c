@@ -3,6 +3,149 @@
 #include <pagevec.h>
 #include <slab.h>
 #include <spinlock.h>
+#include <stdatomic.h>
+
+#define PV_NODE_MASK (PV_NODE_ENTRIES - 1)
+#define PV_HEIGHT_MASK 7ul
+
+struct pv_node {
+	_Atomic(void *) slots[PV_NODE_ENTRIES];
+};
+
+struct pv_leaf {
+	struct page_entry entries[PV_NODE_ENTRIES];
+};
+
+static inline void *__pv_root(struct pagevec *pv, unsigned *height)
+{
+	uintptr_t root = atomic_load_explicit(&pv->root, memory_order_acquire);
+	*height = root & PV_HEIGHT_MASK;
+	return (void *)(root & ~PV_HEIGHT_MASK);
+}
+
+static inline void __pv_set_root(struct pagevec *pv, void *node, unsigned height)
+{
+	atomic_store_explicit(&pv->root, (uintptr_t)node | height, memory_order_release);
+}
+
+/* find the entry for idx without allocating; NULL if the leaf covering idx doesn't exist */
+static struct page_entry *__pv_lookup(struct pagevec *pv, size_t idx)
+{
+	unsigned height;
+	void *node = __pv_root(pv, &height);
+	if(!node || (idx >> (height * PV_NODE_SHIFT)))
+		return NULL;
+	for(; height > 1; height--) {
+		struct pv_node *n = node;
+		node = atomic_load_explicit(
+		  &n->slots[(idx >> ((height - 1) * PV_NODE_SHIFT)) & PV_NODE_MASK], memory_order_acquire);
+		if(!node)
+			return NULL;
+	}
+	return &((struct pv_leaf *)node)->entries[idx & PV_NODE_MASK];
+}
+
+/* find the entry for idx, growing the tree as needed. Caller must hold the lock. */
+static struct page_entry *__pv_slot(struct pagevec *pv, size_t idx)
+{
+	unsigned height;
+	void *node = __pv_root(pv, &height);
+	if(!node) {
+		node = kalloc(sizeof(struct pv_leaf), KALLOC_ZERO);
+		height = 1;
+		__pv_set_root(pv, node, height);
+	}
+	while(idx >> (height * PV_NODE_SHIFT)) {
+		assert(height < PV_MAX_HEIGHT);
+		struct pv_node *n = kalloc(sizeof(struct pv_node), KALLOC_ZERO);
+		atomic_store_explicit(&n->slots[0], node, memory_order_relaxed);
+		node = n;
+		__pv_set_root(pv, node, ++height);
+	}
+	for(; height > 1; height--) {
+		struct pv_node *n = node;
+		_Atomic(void *) *slot = &n->slots[(idx >> ((height - 1) * PV_NODE_SHIFT)) & PV_NODE_MASK];
+		node = atomic_load_explicit(slot, memory_order_relaxed);
+		if(!node) {
+			node = kalloc(height == 2 ? sizeof(struct pv_leaf) : sizeof(struct pv_node), KALLOC_ZERO);
+			atomic_store_explicit(slot, node, memory_order_release);
+		}
+	}
+	if(idx >= pv->len)
+		pv->len = idx + 1;
+	return &((struct pv_leaf *)node)->entries[idx & PV_NODE_MASK];
+}
+
+static void __pv_set(struct pagevec *pv, size_t idx, struct page *page)
+{
+	struct page_entry *entry = __pv_slot(pv, idx);
+	atomic_store_explicit((_Atomic(struct page *) *)&entry->page, page, memory_order_release);
+}
+
+/* call fn on each populated entry with an index in [lo, hi), in index order */
+static void __pv_walk(struct pagevec *pv,
+  void *node,
+  unsigned height,
+  size_t base,
+  size_t lo,
+  size_t hi,
+  void (*fn)(struct pagevec *, size_t, struct page_entry *, void *),
+  void *data)
+{
+	size_t span = 1ul << ((height - 1) * PV_NODE_SHIFT);
+	for(size_t i = 0; i < PV_NODE_ENTRIES; i++) {
+		size_t idx = base + i * span;
+		if(idx >= hi)
+			break;
+		if(idx + span <= lo)
+			continue;
+		if(height == 1) {
+			struct page_entry *entry = &((struct pv_leaf *)node)->entries[i];
+			if(entry->page)
+				fn(pv, idx, entry, data);
+		} else {
+			void *child = atomic_load_explicit(
+			  &((struct pv_node *)node)->slots[i], memory_order_relaxed);
+			if(child)
+				__pv_walk(pv, child, height - 1, idx, lo, hi, fn, data);
+		}
+	}
+}
+
+static void __pv_foreach(struct pagevec *pv,
+  size_t lo,
+  size_t hi,
+  void (*fn)(struct pagevec *, size_t, struct page_entry *, void *),
+  void *data)
+{
+	unsigned height;
+	void *node = __pv_root(pv, &height);
+	if(node)
+		__pv_walk(pv, node, height, 0, lo, hi, fn, data);
+}
+
+static void __pv_destroy_node(void *node, unsigned height)
+{
+	if(height > 1) {
+		for(size_t i = 0; i < PV_NODE_ENTRIES; i++) {
+			void *child = atomic_load_explicit(
+			  &((struct pv_node *)node)->slots[i], memory_order_relaxed);
+			if(child)
+				__pv_destroy_node(child, height - 1);
+		}
+	}
+	kfree(node);
+}
+
+static void __pv_destroy(struct pagevec *pv)
+{
+	unsigned height;
+	void *node = __pv_root(pv, &height);
+	if(node)
+		__pv_destroy_node(node, height);
+	__pv_set_root(pv, NULL, 0);
+	pv->len = 0;
+}
 
 static void __pagevec_init(void *d __unused, void *obj)
 {
@@ -14,7 +157,8 @@ static void __pagevec_init(void *d __unused, void *obj)
 static void __pagevec_ctor(void *d __unused, void *obj)
 {
 	struct pagevec *pv = obj;
-	vector_init(&pv->pages, sizeof(struct page_entry), _Alignof(struct page_entry));
+	pv->root = 0;
+	pv->len = 0;
 	pv->refs = 0;
 }
 
@@ -22,7 +166,7 @@ static void __pagevec_dtor(void *d __unused, void *obj)
 {
 	struct pagevec *pv = obj;
 	assert(list_empty(&pv->ranges));
-	vector_destroy(&pv->pages);
+	__pv_destroy(pv);
 }
 
 static DECLARE_SLABCACHE(sc_pagevec,
@@ -33,30 +177,45 @@ static DECLARE_SLABCACHE(sc_pagevec,
   NULL,
   NULL);
 
+struct pv_move {
+	struct pagevec *dest;
+	size_t base;
+};
+
+static void __pv_move_entry(struct pagevec *pv, size_t idx, struct page_entry *entry, void *data)
+{
+	struct pv_move *move = data;
+	__pv_set(move->dest, move->base + idx, entry->page);
+	entry->page = NULL;
+}
+
+/* move b's pages onto the end of a. b is left empty. */
 void pagevec_combine(struct pagevec *a, struct pagevec *b)
 {
 	assert(a->refs <= 1 && b->refs <= 1);
-	vector_concat(&a->pages, &b->pages);
+	struct pv_move move = { .dest = a, .base = a->len };
+	__pv_foreach(b, 0, SIZE_MAX, __pv_move_entry, &move);
+	a->len = move.base + b->len;
 	/* NOTE: caller must deal with b (free it, possibly?) */
 }
 
 void pagevec_append_page(struct pagevec *pv, struct page *page)
 {
-	struct page_entry entry = {
-		.page = page,
-	};
-	vector_push(&pv->pages, &entry);
+	if(page)
+		__pv_set(pv, pv->len, page);
+	else
+		pv->len++;
 }
 
 size_t pagevec_len(struct pagevec *pv)
 {
-	return pv->pages.length;
+	return pv->len;
 }
 
 struct pagevec *object_new_pagevec(struct object *obj, size_t idx, size_t *off)
 {
 	struct pagevec *pv = slabcache_alloc(&sc_pagevec, NULL);
-	pagevec_append_page(pv, NULL);
+	pv->len = 1;
 	*off = 0;
 	return pv;
 }
@@ -66,17 +225,60 @@ struct pagevec *pagevec_new(void)
 	return slabcache_alloc(&sc_pagevec, NULL);
 }
 
+/* a pagevec backed by a single (zero'd) 2 MiB frame, or NULL if no frame is available */
+struct pagevec *pagevec_new_large(void)
+{
+	struct page *pages = mm_page_alloc_large(PAGE_ZERO | PAGE_TRACKED);
+	if(!pages)
+		return NULL;
+	struct pagevec *pv = slabcache_alloc(&sc_pagevec, NULL);
+	for(size_t i = 0; i < PAGES_PER_LARGE; i++) {
+		__pv_set(pv, i, &pages[i]);
+	}
+	return pv;
+}
+
+/* do entries [idx, idx + PAGES_PER_LARGE) hold, in order, an entire frame from
+ * mm_page_alloc_large, none of whose pages are shared with another pagevec? */
+bool pagevec_has_large(struct pagevec *pv, size_t idx)
+{
+	struct page_entry *first = __pv_lookup(pv, idx);
+	if(!first || !first->page || !(mm_page_flags(first->page) & PAGE_HUGE)
+	   || (mm_page_addr(first->page) & (mm_page_size(1) - 1)) || mm_page_shared(first->page)) {
+		return false;
+	}
+	struct page_entry *entry = first;
+	for(size_t i = 1; i < PAGES_PER_LARGE; i++) {
+		/* entries within a leaf are contiguous; only walk the tree when crossing into the next */
+		if(((idx + i) & PV_NODE_MASK) == 0)
+			entry = __pv_lookup(pv, idx + i);
+		else
+			entry++;
+		if(!entry || entry->page != first->page + i || mm_page_shared(entry->page))
+			return false;
+	}
+	return true;
+}
+
+static void __pv_free_entry(struct pagevec *pv, size_t idx, struct page_entry *entry, void *data)
+{
+	size_t *skip = data;
+	if(idx < *skip)
+		return;
+	if(pagevec_has_large(pv, idx)) {
+		mm_page_free_large(entry->page);
+		*skip = idx + PAGES_PER_LARGE;
+	} else {
+		mm_page_put(entry->page);
+	}
+}
+
 void pagevec_free(struct pagevec *pv)
 {
 	assert(pv->refs == 0);
 	assert(list_empty(&pv->ranges));
-	void *r;
-	while((r = vector_pop(&pv->pages))) {
-		struct page_entry *entry = r;
-		if(entry->page) {
-			mm_page_free(entry->page);
-		}
-	}
+	size_t skip = 0;
+	__pv_foreach(pv, 0, SIZE_MAX, __pv_free_entry, &skip);
 	slabcache_free(&sc_pagevec, pv, NULL);
 }
 
@@ -92,29 +294,70 @@ void pagevec_unlock(struct pagevec *pv)
 
 void pagevec_set_page(struct pagevec *pv, size_t idx, struct page *page)
 {
-	struct page_entry ne = {
-		.page = page,
-	};
 	spinlock_acquire_save(&pv->lock);
-	vector_set_grow(&pv->pages, idx, &ne);
+	__pv_set(pv, idx, page);
 	spinlock_release_restore(&pv->lock);
 }
 
 int pagevec_get_page(struct pagevec *pv, size_t idx, struct page **page, int flags)
 {
-	struct page_entry *entry = vector_get(&pv->pages, idx);
-	if(!entry) {
-		struct page_entry newentry = {
-			.page = mm_page_alloc(PAGE_ZERO),
-		};
-		vector_set_grow(&pv->pages, idx, &newentry);
-		*page = newentry.page;
-		return 0;
-	} else if(!entry->page) {
-		entry->page = mm_page_alloc(PAGE_ZERO);
-		*page = entry->page;
+	struct page_entry *entry = __pv_lookup(pv, idx);
+	if(!entry || !entry->page) {
+		*page = mm_page_alloc(PAGE_ZERO | PAGE_TRACKED);
+		__pv_set(pv, idx, *page);
 		return 0;
 	}
 	*page = entry->page;
 	return 0;
 }
+
+/* like pagevec_get_page, but never allocates; returns NULL for holes. Safe to call without the
+ * lock, though the result may then be stale. */
+struct page *pagevec_lookup_page(struct pagevec *pv, size_t idx)
+{
+	struct page_entry *entry = __pv_lookup(pv, idx);
+	return entry ? atomic_load_explicit((_Atomic(struct page *) *)&entry->page,
+	                 memory_order_acquire)
+	             : NULL;
+}
+
+struct pv_share {
+	struct pagevec *dest;
+	size_t off;
+	size_t count;
+};
+
+static void __pv_share_entry(struct pagevec *pv, size_t idx, struct page_entry *entry, void *data)
+{
+	struct pv_share *share = data;
+	__pv_set(share->dest, idx - share->off, mm_page_get(entry->page));
+	share->count++;
+}
+
+/* Fill a new pagevec with the pages of src in [off, off + len), at [0, len), sharing them rather
+ * than copying: each page gains a reference, and is copied on the first write through either
+ * pagevec (pagevec_unshare_page). Caller must hold src's lock. Returns the number of pages shared.
+ */
+size_t pagevec_share_pages(struct pagevec *dest, struct pagevec *src, size_t off, size_t len)
+{
+	struct pv_share share = { .dest = dest, .off = off };
+	__pv_foreach(src, off, off + len, __pv_share_entry, &share);
+	if(dest->len < len)
+		dest->len = len;
+	return share.count;
+}
+
+/* Make the page at idx private to pv, copying it if other pagevecs share it. Caller must hold the
+ * lock, and the page must exist. */
+struct page *pagevec_unshare_page(struct pagevec *pv, size_t idx)
+{
+	struct page_entry *entry = __pv_lookup(pv, idx);
+	assert(entry && entry->page);
+	struct page *page = entry->page;
+	if(!mm_page_shared(page))
+		return page;
+	struct page *copy = mm_page_clone(page);
+	__pv_set(pv, idx, copy);
+	mm_page_put(page);
+	return copy;
+}
@@ -1,6 +1,8 @@
+#include <__mm_bits.h>
 #include <object.h>
 #include <page.h>
 #include <pagevec.h>
+#include <processor.h>
 #include <range.h>
 #include <slab.h>
 
@@ -58,10 +60,10 @@ struct range *object_find_next_range(struct object *obj, size_t pagenr)
 void range_free(struct range *range)
 {
 	assert(range->pv == NULL);
+	object_stats.ranges--;
 	slabcache_free(&sc_range, range, NULL);
 }
 
-#include <processor.h>
 struct range *object_add_range(struct object *obj,
   struct pagevec *pv,
   size_t start,
@@ -69,6 +71,7 @@ struct range *object_add_range(struct object *obj,
   size_t off)
 {
 	struct range *r = slabcache_alloc(&sc_range, NULL);
+	object_stats.ranges++;
 	r->pv = pv;
 	r->obj = obj;
 	r->pv_offset = off;
@@ -141,17 +144,14 @@ struct range *range_split(struct range *range, size_t rp)
 	}
 }
 
+/* Give a range its own pagevec. The pages themselves stay shared with the old pagevec until one of
+ * them writes to a page (see pagevec_unshare_page), so this costs a reference per present page
+ * rather than a copy of the whole range. Caller must hold the old pagevec's lock. */
 void range_clone(struct range *range)
 {
 	struct pagevec *pv = pagevec_new();
-	for(size_t i = 0; i < range->len; i++) {
-		struct page *page;
-		int r = pagevec_get_page(range->pv, i + range->pv_offset, &page, 0);
-		assert(r == 0 && page); // TODO
-		                        /* TODO: we could map all the pages at once, too */
-		page = mm_page_clone(page);
-		pagevec_set_page(pv, i, page);
-	}
+	object_stats.range_clones++;
+	object_stats.pages_shared += pagevec_share_pages(pv, range->pv, range->pv_offset, range->len);
 	range_toss(range);
 	range->pv_offset = 0;
 	pv->refs = 1;
@@ -159,6 +159,99 @@ void range_clone(struct range *range)
 	list_insert(&pv->ranges, &range->entry);
 }
 
+/* Grow the range ending just before pagenr to cover it, if that range has its pagevec to itself and
+ * the pagevec has nothing at the matching index. This keeps a run of faults on fresh pages from
+ * creating a one-page range each. Caller must hold the object's rwlock (write). */
+struct range *object_extend_range(struct object *obj, size_t pagenr)
+{
+	if(pagenr == 0)
+		return NULL;
+	struct range *prev = object_find_range(obj, pagenr - 1);
+	if(!prev || !prev->pv)
+		return NULL;
+	size_t pvidx = range_pv_idx(prev, pagenr);
+	if(pvidx > PAGEVEC_MAX_IDX)
+		return NULL;
+	pagevec_lock(prev->pv);
+	bool ok = prev->pv->refs == 1 && !pagevec_lookup_page(prev->pv, pvidx);
+	if(ok)
+		prev->len++;
+	pagevec_unlock(prev->pv);
+	if(ok)
+		object_stats.range_extends++;
+	return ok ? prev : NULL;
+}
+
+/* Merge adjacent ranges that are contiguous views of the same pagevec (as left behind by
+ * object_copy and range splitting). Caller must hold the object's rwlock (write). Returns the
+ * number of ranges removed. */
+size_t object_coalesce_ranges(struct object *obj)
+{
+	size_t merged = 0;
+	struct rbnode *node = rb_first(&obj->range_tree);
+	while(node) {
+		struct rbnode *nextnode = rb_next(node);
+		if(!nextnode)
+			break;
+		struct range *range = rb_entry(node, struct range, node);
+		struct range *next = rb_entry(nextnode, struct range, node);
+		if(range->pv && next->pv == range->pv && next->start == range->start + range->len
+		   && next->pv_offset == range->pv_offset + range->len) {
+			rb_delete(nextnode, &obj->range_tree);
+			range->len += next->len;
+			range_toss(next);
+			range_free(next);
+			merged++;
+			continue;
+		}
+		node = nextnode;
+	}
+	object_stats.range_merges += merged;
+	return merged;
+}
+
+static DECLARE_LIST(coalesce_list);
+static struct spinlock coalesce_lock = SPINLOCK_INIT;
+
+/* ask the idle loop to coalesce obj's ranges */
+void object_queue_coalesce(struct object *obj)
+{
+	if(atomic_fetch_or(&obj->flags, OF_COALESCE) & OF_COALESCE)
+		return;
+	krc_get(&obj->refs);
+	spinlock_acquire_save(&coalesce_lock);
+	list_insert(&coalesce_list, &obj->coalesce_entry);
+	spinlock_release_restore(&coalesce_lock);
+}
+
+/* Called from the idle loop: coalesce the ranges of queued objects until the queue is empty or
+ * this CPU gets work. Objects whose lock is contended are left for next time. */
+void object_idle_coalesce(void)
+{
+	struct processor *proc = current_processor;
+	if(!proc)
+		return;
+	while(!processor_has_threads(proc) && !(proc->flags & PROCESSOR_HASWORK)) {
+		spinlock_acquire_save(&coalesce_lock);
+		struct list *e = list_dequeue(&coalesce_list);
+		spinlock_release_restore(&coalesce_lock);
+		if(!e)
+			break;
+		struct object *obj = list_entry(e, struct object, coalesce_entry);
+		struct rwlock_result rwres = rwlock_wlock(&obj->rwlock, RWLOCK_TRY);
+		if(rwres.res != RWLOCK_GOT) {
+			spinlock_acquire_save(&coalesce_lock);
+			list_insert(&coalesce_list, &obj->coalesce_entry);
+			spinlock_release_restore(&coalesce_lock);
+			break;
+		}
+		obj->flags &= ~OF_COALESCE;
+		object_coalesce_ranges(obj);
+		rwlock_wunlock(&rwres);
+		obj_put(obj);
+	}
+}
+
 size_t range_pv_idx(struct range *range, size_t idx)
 {
 	return (idx - range->start) + range->pv_offset;
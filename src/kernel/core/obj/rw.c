@@ -24,7 +24,9 @@ static void do_io(struct object *obj, size_t pagenr, struct page *page, void *da
 		if(io->dir == READ) {
 			memcpy(io->ptr, (char *)addr + io->off, io->len);
 		} else if(io->dir == WRITE) {
+			mm_page_mark_dirty(page);
 			memcpy((char *)addr + io->off, io->ptr, io->len);
+			obj_hash_invalidate(obj, pagenr, 1);
 		} else {
 			panic("unknown IO direction");
 		}
@@ -90,16 +92,18 @@ struct atomic_op {
 	uint64_t value;
 };
 
-static void do_atomic(struct object *obj __unused,
-  size_t pagenr __unused,
+static void do_atomic(struct object *obj,
+  size_t pagenr,
   struct page *page,
   void *data,
   uint64_t flags __unused)
 {
 	struct atomic_op *op = data;
+	mm_page_mark_dirty(page);
 	void *addr = tmpmap_map_pages(&page, 1);
 	_Atomic uint64_t *ptr = (_Atomic uint64_t *)((char *)addr + op->pgoff);
 	atomic_store(ptr, op->value);
+	obj_hash_invalidate(obj, pagenr, 1);
 }
 
 void obj_write_data_atomic64(struct object *obj, size_t off, uint64_t val)
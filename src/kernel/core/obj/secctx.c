@@ -6,6 +6,7 @@
 
 #include <kalloc.h>
 #include <kso.h>
+#include <lib/blake2.h>
 #include <object.h>
 #include <objspace.h>
 #include <page.h>
@@ -22,10 +23,25 @@
 #define EPRINTK(...)
 
 extern struct object_space _bootstrap_object_space;
+
+/* Cache generations are drawn from one global counter, so no two contexts (nor two generations of
+ * one context) ever share a value. Per-CPU entries left by a freed context thus never match a new
+ * one at the same address, even if its slab was destroyed and recreated in between. */
+static _Atomic uint64_t sctx_next_gen = 0;
+
+static uint64_t sctx_new_gen(void)
+{
+	return atomic_fetch_add(&sctx_next_gen, 1) + 1;
+}
+
 static void _sc_init(void *_x __unused, void *ptr)
 {
 	struct sctx *sc = ptr;
 	sc->space = object_space_alloc();
+	for(size_t i = 0; i < SCTX_CACHE_BUCKETS; i++)
+		sc->cache[i] = NULL;
+	sc->cache_lock = SPINLOCK_INIT;
+	sc->cache_gen = sctx_new_gen();
 }
 
 static void _sc_ctor(void *_obj, void *ptr)
@@ -37,6 +53,7 @@ static void _sc_ctor(void *_obj, void *ptr)
 		krc_get(&obj->refs);
 	sc->obj = obj;
 	sc->superuser = false;
+	sc->stats = (struct sctx_cache_stats){};
 }
 
 static void _sc_dtor(void *_x __unused, void *ptr)
@@ -64,72 +81,113 @@ struct sctx *secctx_alloc(struct object *obj)
 
 void secctx_free(struct sctx *s)
 {
+	secctx_cache_invalidate(s);
 	return slabcache_free(&sc_sc, s, NULL);
 }
 
-static void __secctx_krc_put(void *_sc)
+/* Permission lookups are cached at two levels. Each context keeps a hash table of the
+ * permissions and gates it grants per target object, filled by walking the context. In front of
+ * that, each CPU has a small direct-mapped cache of final answers keyed by (context, target,
+ * gate offset). The per-CPU cache is only touched with interrupts disabled (under the thread's
+ * sc_lock) and is never flushed; its entries record the context's cache_gen and are ignored once
+ * that moves on. */
+#define SCTX_PCPU_CACHE_SIZE 128
+
+struct sctx_pcpu_entry {
+	struct sctx *sc;
+	uint64_t gen;
+	objid_t id;
+	size_t ipoff;
+	uint32_t perms;
+	bool ingate;
+};
+
+struct sctx_pcpu_cache {
+	struct sctx_pcpu_entry ent[SCTX_PCPU_CACHE_SIZE];
+};
+
+static DECLARE_PER_CPU(struct sctx_pcpu_cache, sctx_pcpu_cache) = {};
+
+static inline uint64_t __sctx_id_hash(objid_t id)
 {
-	struct sctx *sc = _sc;
-	if(sc->obj) {
-		obj_put(sc->obj);
-		sc->obj = NULL;
+	return ((uint64_t)id ^ (uint64_t)(id >> 64)) * 0x9e3779b97f4a7c15ul;
+}
+
+static struct sctx_pcpu_entry *sctx_pcpu_slot(struct sctx *sc, objid_t id, size_t ipoff)
+{
+	uint64_t h = (__sctx_id_hash(id) ^ ((uintptr_t)sc >> 4) ^ ipoff) * 0x9e3779b97f4a7c15ul;
+	struct sctx_pcpu_cache *pc = per_cpu_get(sctx_pcpu_cache);
+	return &pc->ent[h >> (64 - 7)];
+}
+
+_Static_assert(SCTX_PCPU_CACHE_SIZE == 1 << 7, "sctx_pcpu_slot assumes 128 entries");
+
+static void sctx_cache_free_entry(struct sctx_cache_entry *scce)
+{
+	if(scce->gates) {
+		kfree(scce->gates);
 	}
+	slabcache_free(&sc_sctx_ce, scce, NULL);
+}
 
-	/* TODO (leak) there's a small leak in cache entries. */
-	struct rbnode *next;
-	for(struct rbnode *node = rb_first(&sc->cache); node; node = next) {
-		struct sctx_cache_entry *scce = rb_entry(node, struct sctx_cache_entry, node);
-		if(scce->gates) {
-			kfree(scce->gates);
+/* drop everything cached for this context, both in its own table and (by bumping the generation)
+ * in every CPU's cache. */
+void secctx_cache_invalidate(struct sctx *sc)
+{
+	spinlock_acquire_save(&sc->cache_lock);
+	sc->cache_gen = sctx_new_gen();
+	sc->stats.invalidations++;
+	for(size_t i = 0; i < SCTX_CACHE_BUCKETS; i++) {
+		struct sctx_cache_entry *scce, *next;
+		for(scce = sc->cache[i]; scce; scce = next) {
+			next = scce->next;
+			sctx_cache_free_entry(scce);
 		}
-		next = rb_next(node);
-		rb_delete(&scce->node, &sc->cache);
-		slabcache_free(&sc_sctx_ce, scce, NULL);
+		sc->cache[i] = NULL;
 	}
+	spinlock_release_restore(&sc->cache_lock);
 }
 
-static int __sctx_ce_compar_key(struct sctx_cache_entry *a, objid_t b)
+void secctx_get_stats(struct sctx *sc, struct kernel_ostat_sctx *st)
 {
-	if(a->id > b)
-		return 1;
-	else if(a->id < b)
-		return -1;
-	return 0;
+	st->lookups = sc->stats.lookups;
+	st->pcpu_hits = sc->stats.pcpu_hits;
+	st->hits = sc->stats.hits;
+	st->misses = sc->stats.misses;
+	st->invalidations = sc->stats.invalidations;
+	st->entries = 0;
+	spinlock_acquire_save(&sc->cache_lock);
+	for(size_t i = 0; i < SCTX_CACHE_BUCKETS; i++) {
+		for(struct sctx_cache_entry *scce = sc->cache[i]; scce; scce = scce->next)
+			st->entries++;
+	}
+	spinlock_release_restore(&sc->cache_lock);
 }
 
-static int __sctx_ce_compar(struct sctx_cache_entry *a, struct sctx_cache_entry *b)
+static void __secctx_krc_put(void *_sc)
 {
-	return __sctx_ce_compar_key(a, b->id);
+	struct sctx *sc = _sc;
+	if(sc->obj) {
+		obj_put(sc->obj);
+		sc->obj = NULL;
+	}
+	secctx_cache_invalidate(sc);
 }
 
-static void sctx_cache_delete(struct sctx *sc, objid_t id)
+static struct sctx_cache_entry **sctx_cache_bucket(struct sctx *sc, objid_t id)
 {
-	printk("[sctx] cache try-delete " IDFMT "\n", IDPR(id));
-	struct rbnode *node =
-	  rb_search(&sc->cache, id, struct sctx_cache_entry, node, __sctx_ce_compar_key);
-	if(node) {
-		printk("[sctx] cache delete " IDFMT "\n", IDPR(id));
-		struct sctx_cache_entry *scce = rb_entry(node, struct sctx_cache_entry, node);
-		if(scce->gates) {
-			kfree(scce->gates);
-		}
-		slabcache_free(&sc_sctx_ce, scce, NULL);
-	}
+	return &sc->cache[__sctx_id_hash(id) >> (64 - 6)];
 }
 
+_Static_assert(SCTX_CACHE_BUCKETS == 1 << 6, "sctx_cache_bucket assumes 64 buckets");
+
 static struct sctx_cache_entry *sctx_cache_lookup(struct sctx *sc, objid_t id)
 {
-	// printk("[sctx] cache lookup " IDFMT "\n", IDPR(id));
-	struct rbnode *node =
-	  rb_search(&sc->cache, id, struct sctx_cache_entry, node, __sctx_ce_compar_key);
-	struct sctx_cache_entry *scce = node ? rb_entry(node, struct sctx_cache_entry, node) : NULL;
-	if(scce) {
-		// printk("[sctx] cache found " IDFMT ": %x (%ld gates)\n",
-		// IDPR(id),
-		// scce->perms,
-		// scce->gate_count);
+	for(struct sctx_cache_entry *scce = *sctx_cache_bucket(sc, id); scce; scce = scce->next) {
+		if(scce->id == id)
+			return scce;
 	}
-	return scce;
+	return NULL;
 }
 
 static void sctx_cache_insert(struct sctx *sc,
@@ -138,13 +196,14 @@ static void sctx_cache_insert(struct sctx *sc,
   struct scgates *gates,
   size_t gc)
 {
-	// printk("[sctx] cache insert " IDFMT ": %x (%ld gates)\n", IDPR(id), perms, gc);
 	struct sctx_cache_entry *ce = slabcache_alloc(&sc_sctx_ce, NULL);
+	struct sctx_cache_entry **bucket = sctx_cache_bucket(sc, id);
 	ce->id = id;
 	ce->perms = perms;
 	ce->gates = gates;
 	ce->gate_count = gc;
-	rb_insert(&sc->cache, ce, struct sctx_cache_entry, node, __sctx_ce_compar);
+	ce->next = *bucket;
+	*bucket = ce;
 }
 
 #include <tomcrypt.h>
@@ -191,20 +250,50 @@ static objid_t __verify_get_object_kuid(objid_t target)
 	return mi.kuid;
 }
 
-static unsigned char *__verify_load_keydata(struct object *ko, uint32_t etype, size_t *kdout)
+/* Verifying a capability or delegation means hashing it, decoding its signer's key, and running
+ * the signature check, all of which would otherwise be repeated every time a context's permission
+ * cache is refilled. Decoded keys are cached per key object, and successful verifications are
+ * remembered by a digest of (hash, signature, key). A key entry is re-checked against the key
+ * object's contents on each use; if they changed, the key is decoded again under a new serial,
+ * which retires every verification made with the old one.
+ *
+ * verify_lock only covers the lookups and inserts. Decoding a key and checking a signature take
+ * milliseconds of bignum work, so they run without it, on a reference to the decoded key; their
+ * result is cached only if the key's slot still holds the same serial afterwards. */
+#define VERIFY_KEY_CACHE_SIZE 16
+#define VERIFY_SIG_CACHE_SIZE 256
+/* key objects with more key text than this are rejected */
+#define VERIFY_KEY_MAX 4096
+
+struct verify_key {
+	struct krc refs;
+	objid_t kuid;
+	uint32_t etype;
+	uint64_t serial;
+	/* key text as last read from the key object */
+	char *raw;
+	size_t rawlen;
+	dsa_key dk;
+};
+
+struct verify_sig {
+	unsigned char digest[32];
+	uint64_t serial;
+};
+
+static struct verify_key *verify_keys[VERIFY_KEY_CACHE_SIZE];
+static struct verify_sig verify_sigs[VERIFY_SIG_CACHE_SIZE];
+static struct spinlock verify_lock = SPINLOCK_INIT;
+static uint64_t verify_serial = 0;
+
+static unsigned char *__verify_decode_keydata(char *k, size_t len, size_t *kdout)
 {
-	panic("A");
-	struct key_hdr *hdr = NULL; // obj_get_kbase(ko);
-	if(hdr->type != etype) {
-		EPRINTK("hdr->type != cap->etype\n");
+	char *nl = strnchr(k, '\n', len);
+	if(!nl)
+		return NULL;
+	char *end = strnchr(nl, '-', len - (nl - k));
+	if(!end)
 		return NULL;
-	}
-
-	/* TODO: actually look at the data pointer, because this sucks lol */
-	void *kd = (char *)hdr + sizeof(*hdr);
-	char *k = kd;
-	char *nl = strnchr(k, '\n', 4096 /* TODO */);
-	char *end = strnchr(nl, '-', 4096 /* TODO */);
 	nl++;
 	size_t sz = end - nl;
 	k = nl;
@@ -223,6 +312,134 @@ static unsigned char *__verify_load_keydata(struct object *ko, uint32_t etype, s
 	return keydata;
 }
 
+static void __verify_key_put(struct verify_key *vk)
+{
+	if(krc_put(&vk->refs)) {
+		dsa_free(&vk->dk);
+		kfree(vk->raw);
+		kfree(vk);
+	}
+}
+
+static struct verify_key **__verify_key_slot(objid_t kuid)
+{
+	uint64_t h = ((uint64_t)kuid ^ (uint64_t)(kuid >> 64)) * 0x9e3779b97f4a7c15ul;
+	return &verify_keys[h % VERIFY_KEY_CACHE_SIZE];
+}
+
+/* decode the key text raw (taking ownership of it) into a new entry with one reference */
+static struct verify_key *__verify_key_decode(objid_t kuid, uint32_t etype, char *raw, size_t len)
+{
+	size_t kdout;
+	unsigned char *keydata = __verify_decode_keydata(raw, len, &kdout);
+	if(!keydata) {
+		kfree(raw);
+		return NULL;
+	}
+
+	struct verify_key *vk = kalloc(sizeof(*vk), KALLOC_ZERO);
+	ltc_mp = ltm_desc;
+	int e;
+	switch(etype) {
+		case SCENC_DSA:
+			if((e = dsa_import(keydata, kdout, &vk->dk)) != CRYPT_OK) {
+				printk("dsa import error: %s\n", error_to_string(e));
+				dsa_free(&vk->dk);
+				kfree(vk);
+				vk = NULL;
+			}
+			break;
+		default:
+			kfree(vk);
+			vk = NULL;
+			break;
+	}
+	kfree(keydata);
+	if(!vk) {
+		kfree(raw);
+		return NULL;
+	}
+
+	krc_init(&vk->refs);
+	vk->kuid = kuid;
+	vk->etype = etype;
+	vk->raw = raw;
+	vk->rawlen = len;
+	return vk;
+}
+
+/* Get a reference to the decoded key for ko, decoding it if it isn't cached or the key object has
+ * changed since it was. A freshly decoded key is cached under a new serial, unless another CPU
+ * replaced the slot meanwhile; it then has serial 0, and verifications made with it aren't
+ * cached. */
+static struct verify_key *__verify_get_key(struct object *ko, uint32_t etype)
+{
+	struct key_hdr hdr;
+	obj_read_data(ko, 0, sizeof(hdr), &hdr);
+	if(hdr.type != etype) {
+		EPRINTK("hdr->type != cap->etype\n");
+		return NULL;
+	}
+	if(hdr.keydatalen > VERIFY_KEY_MAX) {
+		EPRINTK("key object " IDFMT " is too large\n", IDPR(ko->id));
+		return NULL;
+	}
+
+	/* TODO: actually look at the data pointer, because this sucks lol */
+	size_t len = hdr.keydatalen;
+	char *raw = kalloc(len + 1, 0);
+	obj_read_data(ko, sizeof(hdr), len, raw);
+	raw[len] = 0;
+
+	struct verify_key **slot = __verify_key_slot(ko->id);
+	spinlock_acquire_save(&verify_lock);
+	struct verify_key *vk = *slot;
+	if(vk && vk->kuid == ko->id && vk->etype == etype && vk->rawlen == len
+	   && !memcmp(vk->raw, raw, len)) {
+		krc_get(&vk->refs);
+		spinlock_release_restore(&verify_lock);
+		kfree(raw);
+		return vk;
+	}
+	uint64_t seen = vk ? vk->serial : 0;
+	spinlock_release_restore(&verify_lock);
+
+	vk = __verify_key_decode(ko->id, etype, raw, len);
+	if(!vk)
+		return NULL;
+
+	spinlock_acquire_save(&verify_lock);
+	struct verify_key *old = *slot;
+	if((old ? old->serial : 0) == seen) {
+		vk->serial = ++verify_serial;
+		/* the cache's reference, and ours */
+		krc_get(&vk->refs);
+		*slot = vk;
+	} else {
+		old = NULL;
+	}
+	spinlock_release_restore(&verify_lock);
+	if(old)
+		__verify_key_put(old);
+	return vk;
+}
+
+static void __verify_sig_digest(unsigned char *hash,
+  size_t hashlen,
+  char *sig,
+  size_t slen,
+  struct verify_key *vk,
+  unsigned char *digest)
+{
+	blake2b_state S;
+	blake2b_init(&S, 32);
+	blake2b_update(&S, hash, hashlen);
+	blake2b_update(&S, sig, slen);
+	blake2b_update(&S, &vk->kuid, sizeof(vk->kuid));
+	blake2b_update(&S, &vk->etype, sizeof(vk->etype));
+	blake2b_final(&S, digest, 32);
+}
+
 static bool __verify_region(void *item,
   void *data,
   char *sig,
@@ -246,13 +463,24 @@ static bool __verify_region(void *item,
 		return false;
 	}
 
-	size_t kdout;
-	unsigned char *keydata = __verify_load_keydata(ko, etype, &kdout);
+	struct verify_key *vk = __verify_get_key(ko, etype);
 	obj_put(ko);
-	if(!keydata) {
+	if(!vk) {
 		return false;
 	}
 
+	unsigned char digest[32];
+	__verify_sig_digest(hash, hashlen, sig, slen, vk, digest);
+	struct verify_sig *vs = &verify_sigs[*(uint64_t *)digest % VERIFY_SIG_CACHE_SIZE];
+	spinlock_acquire_save(&verify_lock);
+	bool cached = vk->serial && vs->serial == vk->serial
+	              && !memcmp(vs->digest, digest, sizeof(digest));
+	spinlock_release_restore(&verify_lock);
+	if(cached) {
+		__verify_key_put(vk);
+		return true;
+	}
+
 	/*
 	printk("SIG: ");
 	for(int i = 0; i < cap->slen; i++) {
@@ -266,37 +494,35 @@ static bool __verify_region(void *item,
 	printk("\n");
 	*/
 
-	dsa_key dk;
-	ltc_mp = ltm_desc;
-
 	int e;
 	bool ret = false;
 	switch(etype) {
-		case SCENC_DSA:
-			if((e = dsa_import(keydata, kdout, &dk)) != CRYPT_OK) {
-				printk("dsa import error: %s\n", error_to_string(e));
-				dsa_free(&dk);
-				break;
-			}
+		case SCENC_DSA: {
 			int stat = 0;
-			if((e = dsa_verify_hash((unsigned char *)sig, slen, hash, hashlen, &stat, &dk))
+			if((e = dsa_verify_hash((unsigned char *)sig, slen, hash, hashlen, &stat, &vk->dk))
 			   != CRYPT_OK) {
 				printk("dsa verify error: %s\n", error_to_string(e));
-				dsa_free(&dk);
 				break;
 			}
-			dsa_free(&dk);
 			if(!stat) {
 				EPRINTK("verification failed\n");
-				ret = false;
+				break;
 			}
 			ret = true;
-			break;
+		} break;
 		default:
-			ret = false;
 			break;
 	}
-	kfree(keydata);
+	if(ret && vk->serial) {
+		/* only if the key wasn't replaced (and its serial retired) while we were checking */
+		spinlock_acquire_save(&verify_lock);
+		if(*__verify_key_slot(vk->kuid) == vk) {
+			memcpy(vs->digest, digest, sizeof(digest));
+			vs->serial = vk->serial;
+		}
+		spinlock_release_restore(&verify_lock);
+	}
+	__verify_key_put(vk);
 	return ret;
 }
 
@@ -489,49 +715,24 @@ static void __append_gatelist(struct scgates **gl, size_t *count, size_t *pos, s
 	(*gl)[*pos] = *gate;
 	(*pos)++;
 }
-/* given a security context, obj, and a target object, lookup the permissions that this context
- * has for accessing this object. This is a logical or of all the capabilities and delegations
- * for the target in this context.
- *
- * If ipoff is non-zero, also check if ipoff exists within a gate of this object. If any cap
- * provides a gate that matches ipoff, it's ok. */
-static void __lookup_perms(struct sctx *sc,
+/* walk a security context for the permissions it grants on target: a logical or of all the
+ * capabilities and delegations for the target in this context, along with the gates they allow
+ * execution through. The returned gate list is owned by the caller. */
+static void __lookup_perms_walk(struct sctx *sc,
   struct object *target,
-  size_t ipoff,
   uint32_t *p,
-  bool *ingate)
+  struct scgates **gates,
+  size_t *gate_count)
 {
 	/* TODO: A*/
-	if(p)
-		*p = SCP_EXEC | SCP_READ | SCP_WRITE | SCP_USE | SCP_DEL;
-	if(ingate)
-		*ingate = true;
+	*p = SCP_EXEC | SCP_READ | SCP_WRITE | SCP_USE | SCP_DEL;
+	*gates = NULL;
+	*gate_count = 0;
 	return;
-	/* first try the cache */
-	spinlock_acquire_save(&sc->cache_lock);
-	struct sctx_cache_entry *scce = sctx_cache_lookup(sc, target->id);
-	if(scce) {
-		*p = scce->perms;
-		if(ingate) {
-			*ingate = ipoff == 0;
-			for(size_t i = 0; i < scce->gate_count; i++) {
-				EPRINTK("    - __in_gate: %d\n", __in_gate(&scce->gates[i], ipoff));
-				*ingate = *ingate || __in_gate(&scce->gates[i], ipoff);
-			}
-			if(scce->gate_count == 0 && (scce->perms & SCP_EXEC)) {
-				*ingate = true;
-			}
-		}
-		spinlock_release_restore(&sc->cache_lock);
-		return;
-	}
-	spinlock_release_restore(&sc->cache_lock);
-	panic("A");
 	char *kbase = NULL; // obj_get_kbase(sc->obj);
 	struct secctx *ctx = (void *)kbase;
 
 	uint32_t perms = 0;
-	bool gatesok = ipoff == 0;
 	size_t slot = target->id % ctx->nbuckets;
 	struct scgates *gatelist = NULL;
 	size_t gatecount = 0, gatepos = 0;
@@ -563,20 +764,14 @@ static void __lookup_perms(struct sctx *sc,
 			}
 			/* TODO: only do this if the gate is meaningful */
 			//		printk("have gate: %x %x %x\n", gs.offset, gs.length, gs.align);
+			/* we first have to limit the gate from the cap by the "gatemask" of the bucket.
+			 * This isn't as trivial as a logical and, so see the above function. An ungated
+			 * executable grant leaves gs covering the whole object. */
 			if(b->flags & SCF_GATE) {
 				__limit_gates(&gs, &b->gatemask);
-			} else if(b->pmask & SCP_EXEC) {
-				gatesok = true;
 			}
 			//		printk("Setting gate: %x %x %x\n", gs.offset, gs.length, gs.align);
 			__append_gatelist(&gatelist, &gatecount, &gatepos, &gs);
-			if(ipoff) {
-				/* we first have to limit the gate from the cap by the "gatemask" of the bucket.
-				 * This isn't as trivial as a logical and, so see the above function */
-				if(__in_gate(&gs, ipoff))
-					gatesok = true;
-				EPRINTK("    - checked gates: %d\n", gatesok);
-			}
 		}
 
 		slot = b->chain;
@@ -594,22 +789,90 @@ static void __lookup_perms(struct sctx *sc,
 	dfl = ((dfl & ~ctx->gmask) | (dfl & dfl_remask)) & ~dfl_mask;
 	EPRINTK("    - DFL: %x\n", dfl);
 	if(dfl & MIP_DFL_EXEC) {
-		gatesok = true;
+		struct scgates gs = { .offset = 0, .length = ~0, .align = 0 };
+		__append_gatelist(&gatelist, &gatecount, &gatepos, &gs);
 	}
 
-	if(p) {
-		*p = perms | dfl;
+	*p = perms | dfl;
+	*gates = gatelist;
+	*gate_count = gatepos;
+}
+
+static bool __sctx_ce_ingate(struct sctx_cache_entry *scce, size_t ipoff)
+{
+	if(ipoff == 0)
+		return true;
+	if(scce->gate_count == 0 && (scce->perms & SCP_EXEC))
+		return true;
+	for(size_t i = 0; i < scce->gate_count; i++) {
+		EPRINTK("    - __in_gate: %d\n", __in_gate(&scce->gates[i], ipoff));
+		if(__in_gate(&scce->gates[i], ipoff))
+			return true;
 	}
-	if(ingate) {
-		*ingate = gatesok;
+	return false;
+}
+
+/* given a security context, obj, and a target object, lookup the permissions that this context
+ * has for accessing this object.
+ *
+ * If ipoff is non-zero, also check if ipoff exists within a gate of this object. If any cap
+ * provides a gate that matches ipoff, it's ok. Must be called with interrupts disabled. */
+static void __lookup_perms(struct sctx *sc,
+  struct object *target,
+  size_t ipoff,
+  uint32_t *p,
+  bool *ingate)
+{
+	sc->stats.lookups++;
+	uint64_t gen = sc->cache_gen;
+	struct sctx_pcpu_entry *pe = sctx_pcpu_slot(sc, target->id, ipoff);
+	if(pe->sc == sc && pe->gen == gen && pe->id == target->id && pe->ipoff == ipoff) {
+		sc->stats.pcpu_hits++;
+		*p = pe->perms;
+		if(ingate)
+			*ingate = pe->ingate;
+		return;
 	}
 
+	uint32_t perms;
+	bool gok;
 	spinlock_acquire_save(&sc->cache_lock);
-	if(sctx_cache_lookup(sc, target->id)) {
-		sctx_cache_delete(sc, target->id);
+	struct sctx_cache_entry *scce = sctx_cache_lookup(sc, target->id);
+	if(scce) {
+		sc->stats.hits++;
+		perms = scce->perms;
+		gok = __sctx_ce_ingate(scce, ipoff);
+		spinlock_release_restore(&sc->cache_lock);
+	} else {
+		spinlock_release_restore(&sc->cache_lock);
+		sc->stats.misses++;
+
+		struct scgates *gatelist;
+		size_t gatecount;
+		__lookup_perms_walk(sc, target, &perms, &gatelist, &gatecount);
+
+		struct sctx_cache_entry tmp = {
+			.perms = perms, .gates = gatelist, .gate_count = gatecount
+		};
+		gok = __sctx_ce_ingate(&tmp, ipoff);
+
+		/* don't publish a result computed against a context that changed under us */
+		spinlock_acquire_save(&sc->cache_lock);
+		if(sc->cache_gen == gen && !sctx_cache_lookup(sc, target->id)) {
+			sctx_cache_insert(sc, target->id, perms, gatelist, gatecount);
+			gatelist = NULL;
+		}
+		spinlock_release_restore(&sc->cache_lock);
+		if(gatelist)
+			kfree(gatelist);
 	}
-	sctx_cache_insert(sc, target->id, perms | dfl, gatelist, gatepos);
-	spinlock_release_restore(&sc->cache_lock);
+
+	*pe = (struct sctx_pcpu_entry){
+		.sc = sc, .gen = gen, .id = target->id, .ipoff = ipoff, .perms = perms, .ingate = gok
+	};
+	*p = perms;
+	if(ingate)
+		*ingate = gok;
 }
 
 #if 0
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <clksrc.h>
 #include <init.h>
 #include <kalloc.h>
 #include <memory.h>
@@ -17,6 +18,8 @@ static struct processor processors[PROCESSOR_MAX_CPUS];
 
 static struct processor *proc_bsp = NULL;
 static _Atomic unsigned int processor_count = 0;
+/* one more than the highest registered processor ID */
+static unsigned int processor_id_bound = 0;
 extern int initial_boot_stack;
 extern int kernel_data_percpu_load;
 extern int kernel_data_percpu_length;
@@ -47,6 +50,8 @@ void processor_register(bool bsp, unsigned int id)
 
 	struct processor *proc = &processors[id];
 	proc->id = id;
+	if(id >= processor_id_bound)
+		processor_id_bound = id + 1;
 	if(bsp) {
 		assert(proc_bsp == NULL);
 		proc->flags = PROCESSOR_BSP;
@@ -59,7 +64,7 @@ void processor_register(bool bsp, unsigned int id)
 		memcpy(proc->percpu, &kernel_data_percpu_load, percpu_length);
 	}
 	proc->flags |= PROCESSOR_REGISTERED;
-	list_init(&proc->runqueue);
+	runqueue_init(&proc->runqueue);
 	proc->sched_lock = SPINLOCK_INIT;
 }
 
@@ -72,6 +77,16 @@ __orderedinitializer(PROCESSOR_INITIALIZER_ORDER) static void processor_init(voi
 	arch_processor_enumerate();
 }
 
+struct processor *processor_get(unsigned int id)
+{
+	return id < PROCESSOR_MAX_CPUS ? &processors[id] : NULL;
+}
+
+unsigned int processor_nr_ids(void)
+{
+	return processor_id_bound;
+}
+
 void processor_barrier(_Atomic unsigned int *here)
 {
 	unsigned int backoff = 1;
@@ -96,8 +111,9 @@ void processor_send_ipi(int destid, int vector, void *arg, int flags)
 		arch_processor_relax();
 	}
 
+	/* an arg has to outlive every receiver's use of it, which we only know for waited-on IPIs */
+	__ipi_arg = (flags & PROCESSOR_IPI_NOWAIT) ? NULL : arg;
 	if(!(flags & PROCESSOR_IPI_NOWAIT)) {
-		__ipi_arg = arg;
 		__ipi_flags = flags;
 		__ipi_barrier = 0;
 	}
@@ -165,13 +181,23 @@ void processor_print_stats(struct processor *proc)
 	printk("  int_intr   : %-ld\n", proc->stats.int_intr);
 	printk("  running    : %-ld\n", proc->stats.running);
 	printk("  sctx_switch: %-ld\n", proc->stats.sctx_switch);
-	printk("  shootdowns : %-ld\n", proc->stats.shootdowns);
+	printk("  shootdowns : %-ld (%ld lazy)\n", proc->stats.shootdowns, proc->stats.shootdown_lazy);
+	printk("  sd ipis    : %-ld sent, %ld avoided\n",
+	  proc->stats.shootdown_ipis,
+	  proc->stats.shootdown_avoided);
 	printk("  syscalls   : %-ld\n", proc->stats.syscalls);
+	printk("  migrations : %-ld in (%ld stolen), %ld pushed\n",
+	  proc->stats.migrations,
+	  proc->stats.steals,
+	  proc->stats.pushes);
+	printk("  handoffs   : %-ld\n", proc->stats.handoffs);
 	spinlock_acquire_save(&proc->sched_lock);
 	printk("  THREADS\n");
-	foreach(e, list, &proc->runqueue) {
-		struct thread *t = list_entry(e, struct thread, rq_entry);
-		printk("    %ld: %d\n", t->id, t->state);
+	for(int l = 0; l < RUNQUEUE_LEVELS; l++) {
+		foreach(e, list, &proc->runqueue.levels[l]) {
+			struct thread *t = list_entry(e, struct thread, rq_entry);
+			printk("    %ld: %d (level %d)\n", t->id, t->state, l);
+		}
 	}
 	spinlock_release_restore(&proc->sched_lock);
 }
@@ -189,7 +215,8 @@ static void __do_processor_attach_thread(struct processor *proc, struct thread *
 {
 	spinlock_acquire_save(&proc->sched_lock);
 	thread->processor = proc;
-	list_insert(&proc->runqueue, &thread->rq_entry);
+	runqueue_insert(&proc->runqueue, thread);
+	proc->flags |= PROCESSOR_HASWORK;
 	spinlock_release_restore(&proc->sched_lock);
 	proc->load++;
 	proc->stats.running++;
@@ -198,28 +225,199 @@ static void __do_processor_attach_thread(struct processor *proc, struct thread *
 	}
 }
 
+/* the least busy processor in affinity, or NULL if none of them are up */
+static struct processor *processor_least_loaded(uint64_t affinity)
+{
+	struct processor *best = NULL;
+	for(int i = 0; i < PROCESSOR_MAX_CPUS; i++) {
+		struct processor *proc = &processors[i];
+		if(!(proc->flags & PROCESSOR_UP) || !thread_affinity_has(affinity, i))
+			continue;
+		if(!best || proc->stats.running < best->stats.running
+		   || (proc->stats.running == best->stats.running && proc->load < best->load)) {
+			best = proc;
+		}
+	}
+	return best;
+}
+
 void processor_attach_thread(struct processor *proc, struct thread *thread)
 {
 	if(proc == NULL) {
-		proc = current_processor;
-		for(int i = 0; i < PROCESSOR_MAX_CPUS; i++) {
-			if((processors[i].flags & PROCESSOR_UP) && processors[i].load < proc->load) {
-				proc = &processors[i];
-			}
-		}
+		proc = processor_least_loaded(thread->affinity);
+		if(!proc)
+			proc = current_processor;
 	}
+	thread->wait_start = clksrc_get_nanoseconds();
 	// printk("processor load: %ld %d\n", proc->load, list_empty(&proc->runqueue));
 	__do_processor_attach_thread(proc, thread);
 }
 
+/* Threads start on the least loaded CPU they may run on, and are later moved between CPUs in two
+ * ways: an idle CPU steals a waiting thread from the busiest runqueue, and every BALANCE_INTERVAL
+ * a CPU with more runnable threads than another by at least two pushes one over. A thread is only
+ * moved while no CPU holds its state (on_cpu is clear), which also means it isn't running. */
+#define BALANCE_INTERVAL 100000000ul
+
+/* move thread from from's runqueue to to's. Fails if the thread was taken by someone else, stopped
+ * being runnable, or is loaded on a CPU. */
+static bool processor_migrate_thread(struct thread *thread,
+  struct processor *from,
+  struct processor *to)
+{
+	spinlock_acquire_save(&from->sched_lock);
+	if(thread->processor != from || thread->state != THREADSTATE_RUNNING || thread->on_cpu
+	   || !thread_may_run_on(thread, to->id)) {
+		spinlock_release_restore(&from->sched_lock);
+		return false;
+	}
+	runqueue_remove(&from->runqueue, thread);
+	from->stats.running--;
+	from->load--;
+	thread->processor = to;
+	spinlock_release_restore(&from->sched_lock);
+
+	to->stats.migrations++;
+	__do_processor_attach_thread(to, thread);
+	return true;
+}
+
+/* find a thread on from's runqueue that could move to to. Called with from's sched_lock held. */
+static struct thread *__find_migratable(struct processor *from, struct processor *to)
+{
+	/* the least urgent threads lose the least by moving */
+	for(int l = RUNQUEUE_LEVELS - 1; l >= 0; l--) {
+		foreach(e, list, &from->runqueue.levels[l]) {
+			struct thread *t = list_entry(e, struct thread, rq_entry);
+			if(t->state == THREADSTATE_RUNNING && !t->on_cpu && thread_may_run_on(t, to->id))
+				return t;
+		}
+	}
+	return NULL;
+}
+
+static bool __processor_pull_from(struct processor *proc, struct processor *from)
+{
+	spinlock_acquire_save(&from->sched_lock);
+	struct thread *t = __find_migratable(from, proc);
+	spinlock_release_restore(&from->sched_lock);
+	return t && processor_migrate_thread(t, from, proc);
+}
+
+/* called by an idle processor: take a waiting thread from the busiest other runqueue */
+bool processor_steal_thread(struct processor *proc)
+{
+	struct processor *busiest = NULL;
+	for(int i = 0; i < PROCESSOR_MAX_CPUS; i++) {
+		struct processor *p = &processors[i];
+		if(p == proc || !(p->flags & PROCESSOR_UP) || p->stats.running < 2)
+			continue;
+		if(!busiest || p->stats.running > busiest->stats.running)
+			busiest = p;
+	}
+	if(busiest && __processor_pull_from(proc, busiest)) {
+		proc->stats.steals++;
+		return true;
+	}
+	return false;
+}
+
+/* periodically called by each processor: if some CPU has at least two fewer runnable threads than
+ * this one, hand it a waiting thread. */
+void processor_balance(struct processor *proc)
+{
+	uint64_t now = clksrc_get_nanoseconds();
+	if(now < proc->next_balance)
+		return;
+	proc->next_balance = now + BALANCE_INTERVAL;
+
+	struct processor *idlest = NULL;
+	for(int i = 0; i < PROCESSOR_MAX_CPUS; i++) {
+		struct processor *p = &processors[i];
+		if(p == proc || !(p->flags & PROCESSOR_UP))
+			continue;
+		if(!idlest || p->stats.running < idlest->stats.running)
+			idlest = p;
+	}
+	if(!idlest || idlest->stats.running + 2 > proc->stats.running)
+		return;
+
+	spinlock_acquire_save(&proc->sched_lock);
+	struct thread *t = __find_migratable(proc, idlest);
+	spinlock_release_restore(&proc->sched_lock);
+	if(t && processor_migrate_thread(t, proc, idlest)) {
+		proc->stats.pushes++;
+	}
+}
+
+/* the current thread may no longer run here (its affinity changed). Save it and move it to a CPU
+ * it may run on. */
+void processor_push_current_thread(struct processor *proc)
+{
+	struct thread *t = current_thread;
+	struct processor *to = processor_least_loaded(t->affinity);
+	if(!to)
+		return;
+	arch_processor_release_current_thread(proc);
+	if(processor_migrate_thread(t, proc, to)) {
+		proc->stats.pushes++;
+	}
+}
+
+/* t was just woken by the current thread, which is giving up the rest of its timeslice to it: bring
+ * t here if it may run here, and make it the next thread to run, at least as urgently as the
+ * current one. */
+void processor_handoff(struct thread *t)
+{
+	struct processor *proc = current_processor;
+	struct processor *from = t->processor;
+	if(from != proc && !processor_migrate_thread(t, from, proc))
+		return;
+	spinlock_acquire_save(&proc->sched_lock);
+	if(t->processor == proc && t->state == THREADSTATE_RUNNING && !t->on_cpu) {
+		runqueue_remove(&proc->runqueue, t);
+		if(t->priority < current_thread->priority)
+			t->priority = current_thread->priority;
+		t->timeslice_expire = current_thread->timeslice_expire;
+		current_thread->timeslice_expire = 0;
+		runqueue_insert_next(&proc->runqueue, t);
+		proc->stats.handoffs++;
+	}
+	spinlock_release_restore(&proc->sched_lock);
+}
+
+int processor_set_affinity(struct thread *thread, uint64_t mask)
+{
+	if(!processor_least_loaded(mask))
+		return -EINVAL;
+	/* if the thread is running on a CPU it may no longer use, the scheduler moves it the next
+	 * time it runs there */
+	thread->affinity = mask;
+	return 0;
+}
+
+int processor_set_sched(struct thread *thread, int level)
+{
+	if(level != THRD_SCHED_NORMAL && (level < 0 || level >= THRD_SCHED_FIXED_LEVELS))
+		return -EINVAL;
+	struct processor *proc = thread->processor;
+	spinlock_acquire_save(&proc->sched_lock);
+	thread->sched_fixed = level;
+	if(thread->state == THREADSTATE_RUNNING && thread->processor == proc) {
+		runqueue_update(&proc->runqueue, thread);
+	}
+	spinlock_release_restore(&proc->sched_lock);
+	return 0;
+}
+
 void processor_percpu_regions_init(void)
 {
 	size_t percpu_length = (size_t)&kernel_data_percpu_length;
 	printk("[cpu] loading percpu data from %p, length %ld bytes\n",
 	  &kernel_data_percpu_load,
 	  percpu_length);
-	if(percpu_length > mm_page_size(0))
-		panic("TODO: large percpu");
+	/* the region may span several pages (the sctx permission cache alone is a few KB); both the
+	 * early allocator and kalloc (for the secondaries) handle that */
 	mm_early_alloc(NULL, &bsp_percpu_region, percpu_length, 16);
 	memcpy(bsp_percpu_region, &kernel_data_percpu_load, percpu_length);
 }
@@ -1,4 +1,5 @@
 #include <interrupt.h>
+#include <kalloc.h>
 #include <processor.h>
 #include <rwlock.h>
 #include <stdatomic.h>
@@ -10,6 +11,69 @@
 void rwlock_init(struct rwlock *rw)
 {
 	rw->readers = rw->writers = 0;
+	rw->pcpu = NULL;
+}
+
+static struct rwlock_cpu *__rwlock_pcpu(struct rwlock *rw)
+{
+	void *p = atomic_load(&rw->pcpu);
+	/* kalloc only aligns to 8 bytes */
+	return p ? (struct rwlock_cpu *)align_up((uintptr_t)p, sizeof(struct rwlock_cpu)) : NULL;
+}
+
+void rwlock_set_percpu(struct rwlock *rw)
+{
+	if(atomic_load(&rw->pcpu))
+		return;
+	/* one count per CPU in the machine, plus one to leave room for alignment */
+	void *p = kcalloc(processor_nr_ids() + 1, sizeof(struct rwlock_cpu), 0);
+	/* readers remember which count they're in and writers drain all of them, so readers already
+	 * in the shared count don't need to be waited for */
+	void *expect = NULL;
+	if(!atomic_compare_exchange_strong(&rw->pcpu, &expect, p))
+		kfree(p);
+}
+
+void rwlock_fini(struct rwlock *rw)
+{
+	assert(rw->readers == 0 && rw->writers == 0);
+	void *p = atomic_exchange(&rw->pcpu, NULL);
+	if(p)
+		kfree(p);
+}
+
+/* the reader count for this CPU to use. Interrupts are off while a read lock is held, so the
+ * reader stays on this CPU until it releases it. Early in boot, before processors have IDs, readers
+ * use the shared count, which writers check too. */
+static _Atomic int32_t *__rwlock_reader_count(struct rwlock *rw, int16_t *cpu)
+{
+	struct rwlock_cpu *pcpu = __rwlock_pcpu(rw);
+	struct processor *proc = processor_get_current();
+	if(!pcpu || !proc || proc->id >= processor_nr_ids()) {
+		*cpu = -1;
+		return &rw->readers;
+	}
+	*cpu = proc->id;
+	return &pcpu[*cpu].readers;
+}
+
+static _Atomic int32_t *__rwlock_held_count(struct rwlock_result *rr)
+{
+	return rr->cpu < 0 ? &rr->lock->readers : &__rwlock_pcpu(rr->lock)[rr->cpu].readers;
+}
+
+static bool __rwlock_has_readers(struct rwlock *rw)
+{
+	if(atomic_load(&rw->readers))
+		return true;
+	struct rwlock_cpu *pcpu = __rwlock_pcpu(rw);
+	if(pcpu) {
+		for(unsigned int i = 0; i < processor_nr_ids(); i++) {
+			if(atomic_load(&pcpu[i].readers))
+				return true;
+		}
+	}
+	return false;
 }
 
 struct rwlock_result __rwlock_rlock(struct rwlock *rw, int flags, const char *file, int line)
@@ -19,12 +83,15 @@ struct rwlock_result __rwlock_rlock(struct rwlock *rw, int flags, const char *fi
 #endif
 	register int set = arch_interrupt_set(0);
 	uint32_t tries = 0;
+	int16_t cpu;
+	_Atomic int32_t *count;
 	while(1) {
-		atomic_fetch_add(&rw->readers, 1);
+		count = __rwlock_reader_count(rw, &cpu);
+		atomic_fetch_add(count, 1);
 		if(atomic_load(&rw->writers) == 0) {
 			break;
 		}
-		atomic_fetch_sub(&rw->readers, 1);
+		atomic_fetch_sub(count, 1);
 		while(atomic_load(&rw->writers)) {
 			for(size_t p = 0; p < 100; p++)
 				asm("pause");
@@ -41,8 +108,9 @@ struct rwlock_result __rwlock_rlock(struct rwlock *rw, int flags, const char *fi
 		.int_flag = set,
 		.res = RWLOCK_GOT,
 		.write = 0,
+		.cpu = cpu,
 	};
-	assert(rw->readers > 0 && rw->writers >= 0);
+	assert(*count > 0 && rw->writers >= 0);
 	return res;
 
 timeout:
@@ -87,8 +155,8 @@ struct rwlock_result __rwlock_upgrade(struct rwlock_result *rr,
 		} else {
 			/* we've blocked writers, now. Wait for all readers to drain after we release our read
 			 * lock */
-			atomic_fetch_sub(&rr->lock->readers, 1);
-			while(atomic_load(&rr->lock->readers)) {
+			atomic_fetch_sub(__rwlock_held_count(rr), 1);
+			while(__rwlock_has_readers(rr->lock)) {
 				for(size_t p = 0; p < 100; p++)
 					asm("pause");
 				tries++;
@@ -128,15 +196,18 @@ struct rwlock_result __rwlock_downgrade(struct rwlock_result *rr, const char *fi
 #endif
 	assert(rr->write);
 	/* always succeeds */
-	atomic_fetch_add(&rr->lock->readers, 1);
+	int16_t cpu;
+	_Atomic int32_t *count = __rwlock_reader_count(rr->lock, &cpu);
+	atomic_fetch_add(count, 1);
 	atomic_fetch_sub(&rr->lock->writers, 1);
 	struct rwlock_result res = {
 		.lock = rr->lock,
 		.int_flag = rr->int_flag,
 		.res = RWLOCK_GOT,
 		.write = 0,
+		.cpu = cpu,
 	};
-	assert(rr->lock->readers > 0 && rr->lock->writers >= 0);
+	assert(*count > 0 && rr->lock->writers >= 0);
 	return res;
 }
 
@@ -170,7 +241,7 @@ struct rwlock_result __rwlock_wlock(struct rwlock *rw, int flags, const char *fi
 				}
 			}
 		} else {
-			while(atomic_load(&rw->readers)) {
+			while(__rwlock_has_readers(rw)) {
 				for(size_t p = 0; p < 100; p++)
 					asm("pause");
 				tries++;
@@ -222,7 +293,8 @@ void __rwlock_runlock(struct rwlock_result *rr, const char *file, int line)
 	printk("runlock lock %p: %s:%d\n", rr->lock, file, line);
 #endif
 	assert(!rr->write);
-	assert(rr->lock->readers > 0);
-	atomic_fetch_sub(&rr->lock->readers, 1);
+	_Atomic int32_t *count = __rwlock_held_count(rr);
+	assert(*count > 0);
+	atomic_fetch_sub(count, 1);
 	arch_interrupt_set(rr->int_flag);
 }
@@ -11,9 +11,11 @@
 #include <lib/iter.h>
 #include <limits.h>
 #include <object.h>
+#include <objspace.h>
 #include <page.h>
 #include <pager.h>
 #include <processor.h>
+#include <slab.h>
 #include <thread.h>
 #include <time.h>
 #include <vmm.h>
@@ -32,6 +34,13 @@ static void thread_resume(struct thread *thr, uint64_t timeout)
 
 #define min(a, b) ({ ((a) < (b) ? (a) : (b)); })
 
+/* the countdown to run a thread for: until the end of its timeslice or the next timer, whichever
+ * comes first (rem_time is 0 when there are no timers) */
+static inline uint64_t __resume_timeout(uint64_t slice, uint64_t rem_time)
+{
+	return rem_time ? min(slice, rem_time) : slice;
+}
+
 __noinstrument void thread_schedule_resume_proc(struct processor *proc)
 {
 	uint64_t ji = clksrc_get_nanoseconds();
@@ -55,10 +64,18 @@ __noinstrument void thread_schedule_resume_proc(struct processor *proc)
 	while(true) {
 		pager_idle_task();
 		uint64_t rem_time = timer_check_timers();
+		processor_balance(proc);
+		if(current_thread && current_thread->state == THREADSTATE_RUNNING
+		   && !thread_may_run_on(current_thread, proc->id)) {
+			processor_push_current_thread(proc);
+		}
 		spinlock_acquire(&proc->sched_lock);
 
+		/* keep running the current thread if it has time left, unless a thread at a better level
+		 * is waiting */
 		if(current_thread && current_thread->timeslice_expire > (ji + TIMESLICE_GIVEUP)
-		   && current_thread->state == THREADSTATE_RUNNING) {
+		   && current_thread->state == THREADSTATE_RUNNING
+		   && runqueue_best_level(&proc->runqueue) >= current_thread->rq_level) {
 #if 0
 			printk("resuming current: %ld (%ld)\n",
 			  current_thread->id,
@@ -67,9 +84,8 @@ __noinstrument void thread_schedule_resume_proc(struct processor *proc)
 			spinlock_release(&proc->sched_lock, 0);
 			// clksrc_set_interrupt_countdown(current_thread->timeslice_expire - ji, false);
 
-			uint64_t timeout = current_thread->timeslice_expire - ji;
-			timeout = min(timeout, rem_time);
-			thread_resume(current_thread, timeout);
+			thread_resume(current_thread,
+			  __resume_timeout(current_thread->timeslice_expire - ji, rem_time));
 		}
 		if(current_thread && current_thread->state == THREADSTATE_PAUSING) {
 			current_thread->state = THREADSTATE_RUNNING;
@@ -85,8 +101,11 @@ __noinstrument void thread_schedule_resume_proc(struct processor *proc)
 			  current_thread->arch.was_syscall ? current_thread->arch.syscall.rax
 			                                   : current_thread->arch.exception.int_no);
 #endif
+			/* used up its timeslice: lose the boost from waking up, quickly */
 			if(current_thread->priority > 1)
-				current_thread->priority--;
+				current_thread->priority -= current_thread->priority / 2;
+			if(current_thread->state == THREADSTATE_RUNNING)
+				runqueue_update(&proc->runqueue, current_thread);
 		}
 
 		//	if(current_thread && current_thread->state == THREADSTATE_RUNNING) {
@@ -94,11 +113,11 @@ __noinstrument void thread_schedule_resume_proc(struct processor *proc)
 		//	} else if(current_thread && current_thread->state == THREADSTATE_BLOCKING) {
 		//		current_thread->state = THREADSTATE_BLOCKED;
 		//	}
-		struct list *ent = list_dequeue(&proc->runqueue);
-		if(ent) {
-			bool empty = list_empty(&proc->runqueue);
-			struct thread *next = list_entry(ent, struct thread, rq_entry);
-			list_insert(&proc->runqueue, &next->rq_entry);
+		struct thread *next = runqueue_next(&proc->runqueue);
+		if(next) {
+			bool empty = proc->runqueue.nr == 1;
+			/* claim next's state before anyone can steal it */
+			next->on_cpu = true;
 			spinlock_release(&proc->sched_lock, 0);
 
 			if(next->timeslice_expire < ji)
@@ -129,14 +148,24 @@ __noinstrument void thread_schedule_resume_proc(struct processor *proc)
 			  empty);
 			if(next != current_thread) {
 				proc->stats.thr_switch++;
+				if(current_thread && current_thread->state == THREADSTATE_RUNNING)
+					current_thread->wait_start = ji;
+				if(next->wait_start && next->wait_start < ji) {
+					uint64_t wait = ji - next->wait_start;
+					next->wait_total += wait;
+					next->nr_waits++;
+					if(wait > next->wait_max)
+						next->wait_max = wait;
+				}
+				next->wait_start = 0;
 			}
 
-			uint64_t timeout = next->timeslice_expire - ji;
-			timeout = min(timeout, rem_time);
-			thread_resume(next, empty ? rem_time : timeout);
+			thread_resume(
+			  next, empty ? rem_time : __resume_timeout(next->timeslice_expire - ji, rem_time));
 		} else {
 			proc->flags &= ~PROCESSOR_HASWORK;
 			spinlock_release(&proc->sched_lock, 1);
+			arch_mm_objspace_idle(true);
 
 			processor_update_stats();
 			mm_update_stats();
@@ -147,17 +176,21 @@ __noinstrument void thread_schedule_resume_proc(struct processor *proc)
 				proc->flags |= PROCESSOR_HASWORK;
 			}
 			mm_page_idle_zero();
+			object_idle_coalesce();
+			slabcache_idle_reap();
+			processor_steal_thread(proc);
 			rem_time = timer_check_timers();
 			spinlock_acquire(&proc->sched_lock);
 			if(!processor_has_threads(proc) && !(proc->flags & PROCESSOR_HASWORK)) {
 				spinlock_release(&proc->sched_lock, 0);
-				if(rem_time > 0) {
-					clksrc_set_interrupt_countdown(rem_time, false);
-				}
+				/* the one interrupt we need while idle is for the next timer. If there are none, this
+				 * disarms the countdown, so a leftover timeslice does not wake us up for nothing. */
+				clksrc_set_interrupt_countdown(rem_time, false);
 				arch_processor_halt(proc);
 			} else {
 				spinlock_release(&proc->sched_lock, 1);
 			}
+			arch_mm_objspace_idle(false);
 		}
 	}
 }
@@ -192,7 +225,7 @@ __noinstrument void thread_schedule_resume(void)
 
 static void __thr_ctor(struct object *obj)
 {
-	obj->kso_data = kalloc(sizeof(struct kso_throbj), 0);
+	obj->kso_data = kalloc(sizeof(struct kso_throbj), KALLOC_ZERO);
 }
 
 static void __thr_dtor(struct object *obj)
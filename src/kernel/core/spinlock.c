@@ -16,135 +16,203 @@ static __inline__ unsigned long long krdtsc(void)
 	return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
 }
 
-int __spinlock_try_acquire(struct spinlock *lock, const char *f __unused, int l __unused)
-{
-	register bool set = arch_interrupt_set(0);
+#if CONFIG_LOCKSTAT
 
-	uint32_t our_ticket = atomic_fetch_add(&lock->next_ticket, 1);
-	size_t tries = 0;
-	while(1) {
-		uint32_t cur = atomic_load(&lock->current_ticket);
-		if(cur == our_ticket) {
-			break;
-		}
-		//	if(f)
-		//		printk("-----> %d %d %s %d\n", our_ticket, cur, f, l);
-		if(our_ticket > cur) {
-			uint32_t diff = our_ticket - cur;
-			//	if(f)
-			//		printk(":: %d %d %s %d\n", our_ticket, cur, f, l);
-			while(diff--) {
-				for(int i = 0; i < 100; i++) {
-					arch_processor_relax();
-				}
+/* Statistics for each place a lock is acquired from, keyed by file and line, in a fixed-size open
+ * addressing table. Sites are only ever added. */
+#define LOCKSTAT_SITES 1024
+
+struct lockstat_site {
+	const char *_Atomic file;
+	_Atomic int line;
+	_Atomic uint64_t acquires;
+	_Atomic uint64_t contended;
+	_Atomic uint64_t max_hold;
+};
+
+static struct lockstat_site lockstat_sites[LOCKSTAT_SITES];
+static _Atomic uint64_t lockstat_dropped;
+
+static struct lockstat_site *lockstat_site_get(const char *f, int l)
+{
+	uint64_t h = (((uintptr_t)f >> 3) ^ (uint64_t)l * 0x9e3779b97f4a7c15ul) * 0x9e3779b97f4a7c15ul;
+	for(int i = 0; i < LOCKSTAT_SITES; i++) {
+		struct lockstat_site *site = &lockstat_sites[(h + i) % LOCKSTAT_SITES];
+		const char *sf = atomic_load(&site->file);
+		if(!sf) {
+			const char *expect = NULL;
+			if(atomic_compare_exchange_strong(&site->file, &expect, f)) {
+				site->line = l;
+				return site;
 			}
+			sf = expect;
 		}
-		if(tries++ > 5) {
-			return 0;
-		}
+		/* a site being filled in may not have its line yet; that only costs a duplicate entry */
+		if(sf == f && site->line == l)
+			return site;
 	}
+	lockstat_dropped++;
+	return NULL;
+}
 
-#if CONFIG_DEBUG_LOCKS
+static void lockstat_acquired(struct spinlock *lock, const char *f, int l, bool contended)
+{
+	struct lockstat_site *site = f ? lockstat_site_get(f, l) : NULL;
+	lock->site = site;
+	if(!site)
+		return;
+	site->acquires++;
+	if(contended)
+		site->contended++;
+	lock->acquired_at = krdtsc();
+}
+
+static void lockstat_released(struct spinlock *lock)
+{
+	struct lockstat_site *site = lock->site;
+	if(!site)
+		return;
+	uint64_t hold = krdtsc() - lock->acquired_at;
+	uint64_t max = atomic_load(&site->max_hold);
+	while(hold > max && !atomic_compare_exchange_weak(&site->max_hold, &max, hold))
+		;
+	lock->site = NULL;
+}
+
+void spinlock_print_lockstat(void)
+{
+	printk("%-40s %12s %12s %14s\n", "lock site", "acquires", "contended", "max hold (cyc)");
+	for(int i = 0; i < LOCKSTAT_SITES; i++) {
+		struct lockstat_site *site = &lockstat_sites[i];
+		if(!site->file || !site->contended)
+			continue;
+		printk("%32s:%-7d %12ld %12ld %14ld\n",
+		  site->file,
+		  site->line,
+		  site->acquires,
+		  site->contended,
+		  site->max_hold);
+	}
+	if(lockstat_dropped)
+		printk("(%ld acquisitions from sites that did not fit)\n", lockstat_dropped);
+}
+
+#else
+
+void spinlock_print_lockstat(void)
+{
+	printk("lockstat: not enabled in this kernel (CONFIG_LOCKSTAT)\n");
+}
+
+#endif
+
+static void __spinlock_set_holder(struct spinlock *lock, const char *f __unused, int l __unused)
+{
+#if CONFIG_DEBUG_LOCKS || CONFIG_LOCKSTAT
 	lock->holder_file = f;
 	lock->holder_line = l;
 	lock->holder_thread = current_thread;
 #endif
-
-	lock->holder = our_ticket;
-
-	return set ? 3 : 1;
 }
 
-bool __spinlock_acquire(struct spinlock *lock, int flags, const char *f __unused, int l __unused)
+int __spinlock_try_acquire(struct spinlock *lock, const char *f __unused, int l __unused)
 {
 	register bool set = arch_interrupt_set(0);
 
-	if(!set && (flags & 1) && lock->owner && lock->recur_count > 0) {
-		void *p = processor_get_current();
-		if(p && lock->owner == p) {
-			lock->recur_count++;
-			return false;
-		}
+	struct processor *proc = processor_get_current();
+	struct spinlock_node *expect = NULL;
+	/* the lock's node is always unlinked (next == NULL) while the lock is free */
+	if(!atomic_compare_exchange_strong(&lock->tail, &expect, &lock->holder)) {
+		arch_interrupt_set(set);
+		return 0;
 	}
 
-	long long a = krdtsc();
+	__spinlock_set_holder(lock, f, l);
+#if CONFIG_LOCKSTAT
+	lockstat_acquired(lock, f, l, false);
+#endif
 
-	uint32_t our_ticket = atomic_fetch_add(&lock->next_ticket, 1);
-	size_t tries = 0;
-	while(1) {
-		uint32_t cur = atomic_load(&lock->current_ticket);
-		if(cur == our_ticket) {
-			break;
-		}
-		//	if(f)
-		//		printk("-----> %d %d %s %d\n", our_ticket, cur, f, l);
-		if(our_ticket > cur) {
-			uint32_t diff = our_ticket - cur;
-			//	if(f)
-			//		printk(":: %d %d %s %d\n", our_ticket, cur, f, l);
-			while(diff--) {
-				for(int i = 0; i < 100; i++) {
-					arch_processor_relax();
-				}
-			}
-		}
-		tries++;
+	lock->owner = proc;
+	lock->recur_count = 0;
+
+	return set ? 3 : 1;
+}
+
+static void __spinlock_wait(struct spinlock *lock,
+  struct spinlock_node *node,
+  const char *f __unused,
+  int l __unused)
+{
+	size_t tries __unused = 0;
+	while(atomic_load_explicit(&node->locked, memory_order_acquire)) {
+		arch_processor_relax();
 #if CONFIG_DEBUG_LOCKS
-		if(tries >= 100000ul && f) {
+		if(++tries >= 100000000ul && f) {
 			panic("POTENTIAL DEADLOCK in cpu %ld trying to acquire %s:%d (held from %s:%d by "
-			      "cpu %ld) :: %d %d\n",
+			      "cpu %ld)\n",
 			  current_thread ? (long)current_thread->processor->id : -1,
 			  f ? f : "??",
 			  l,
 			  lock->holder_file,
 			  lock->holder_line,
-			  lock->holder_thread ? (long)lock->holder_thread->processor->id : -1,
-			  our_ticket,
-			  cur);
+			  lock->holder_thread ? (long)lock->holder_thread->processor->id : -1);
 		}
 #endif
 	}
+}
 
-#if 0
-	while(atomic_fetch_or_explicit(&lock->data, 1, memory_order_acquire) & 1) {
-		while(atomic_load_explicit(&lock->data, memory_order_acquire)) {
-			arch_processor_relax();
-#if CONFIG_DEBUG_LOCKS
-			if(count++ == 100000000ul && f) {
-				panic("POTENTIAL DEADLOCK in cpu %ld trying to acquire %s:%d (held from %s:%d by "
-				      "cpu %ld)\n",
-				  current_thread ? (long)current_thread->processor->id : -1,
-				  f ? f : "??",
-				  l,
-				  lock->holder_file,
-				  lock->holder_line,
-				  lock->holder_thread ? (long)lock->holder_thread->processor->id : -1);
+bool __spinlock_acquire(struct spinlock *lock, int flags, const char *f __unused, int l __unused)
+{
+	register bool set = arch_interrupt_set(0);
+
+	struct processor *proc = processor_get_current();
+	if(!set && (flags & 1) && lock->owner && lock->recur_count > 0) {
+		if(proc && lock->owner == proc) {
+			lock->recur_count++;
+			return false;
+		}
+	}
+
+	/* uncontended: take the lock straight onto its own node */
+	struct spinlock_node *prev = NULL;
+	bool contended __unused = false;
+	if(!atomic_compare_exchange_strong(&lock->tail, &prev, &lock->holder)) {
+		struct spinlock_node node __attribute__((aligned(64))) = { .next = NULL, .locked = true };
+		prev = atomic_exchange(&lock->tail, &node);
+		if(prev) {
+			/* queue up behind prev, and wait for it to pass the lock on to us */
+			contended = true;
+			atomic_store(&prev->next, &node);
+			__spinlock_wait(lock, &node, f, l);
+		}
+		/* we hold the lock, so move off our stack node onto the lock's node. Anyone who queued
+		 * behind us is passed on to the lock's node; otherwise it becomes the tail. */
+		struct spinlock_node *next = atomic_load(&node.next);
+		if(!next) {
+			struct spinlock_node *expect = &node;
+			if(!atomic_compare_exchange_strong(&lock->tail, &expect, &lock->holder)) {
+				/* someone is just now adding themselves behind our node */
+				while(!(next = atomic_load(&node.next))) {
+					arch_processor_relax();
+				}
 			}
-#endif
 		}
+		if(next)
+			atomic_store(&lock->holder.next, next);
 	}
-#endif
 
-#if CONFIG_DEBUG_LOCKS
-	lock->holder_file = f;
-	lock->holder_line = l;
-	lock->holder_thread = current_thread;
+	__spinlock_set_holder(lock, f, l);
+#if CONFIG_LOCKSTAT
+	lockstat_acquired(lock, f, l, contended);
 #endif
 
-	lock->holder = our_ticket;
-
-	lock->owner = processor_get_current();
+	lock->owner = proc;
 	if(flags & 1) {
 		lock->recur_count = 1;
 	} else {
 		lock->recur_count = 0;
 	}
 
-	long long b = krdtsc();
-	if(b - a > 1000000 && f) {
-		// printk("LONG WAIT: %s %d :: %ld\n", f, l, b - a);
-	}
-
 	return set;
 }
 
@@ -157,22 +225,40 @@ void __spinlock_release(struct spinlock *lock, bool flags, const char *f, int l)
 	if(lock->owner != processor_get_current()) {
 		panic("diff in holder: %p %p\n", lock->holder_thread, current_thread);
 	}
-	lock->holder_file = NULL;
-	lock->holder_line = 0;
-	lock->holder_thread = NULL;
 #endif
 	if(lock->owner && lock->recur_count) {
 		lock->recur_count--;
 		if(lock->recur_count > 0)
 			return;
 	}
+#if CONFIG_LOCKSTAT
+	lockstat_released(lock);
+#endif
+#if CONFIG_DEBUG_LOCKS || CONFIG_LOCKSTAT
+	lock->holder_file = NULL;
+	lock->holder_line = 0;
+	lock->holder_thread = NULL;
+#endif
 	lock->owner = NULL;
 	lock->recur_count = 0;
-	// atomic_store_explicit(&lock->data, 0, memory_order_release);
-	uint32_t hold = atomic_load(&lock->holder);
-	uint32_t cur = atomic_fetch_add(&lock->current_ticket, 1);
-	if(cur != hold) {
+
+	if(!lock->tail) {
 		panic("spinlock released while not held %s %d\n", f, l);
 	}
+	struct spinlock_node *next = atomic_load(&lock->holder.next);
+	if(!next) {
+		/* no one queued behind us, unless someone is just now adding themselves */
+		struct spinlock_node *expect = &lock->holder;
+		if(atomic_compare_exchange_strong(&lock->tail, &expect, NULL)) {
+			arch_interrupt_set(flags);
+			return;
+		}
+		while(!(next = atomic_load(&lock->holder.next))) {
+			arch_processor_relax();
+		}
+	}
+	/* the tail is past the lock's node now, so no one else writes it until it's the tail again */
+	atomic_store(&lock->holder.next, NULL);
+	atomic_store_explicit(&next->locked, false, memory_order_release);
 	arch_interrupt_set(flags);
 }
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <page.h>
 #include <queue.h>
 #include <rand.h>
 #include <syscall.h>
@@ -29,6 +30,10 @@ long syscall_kconf(int cmd, long arg)
 			}
 			return reset_code;
 			break;
+		case KCONF_PAGEZERO_WATERMARK:
+			/* arg < 0 reads the watermark; otherwise, set it and return the old value */
+			return mm_page_set_zero_watermark(arg);
+			break;
 		default:
 			ret = arch_syscall_kconf(cmd, arg);
 	}
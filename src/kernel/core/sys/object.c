@@ -8,9 +8,13 @@
 #include <kso.h>
 #include <nvdimm.h>
 #include <object.h>
+#include <objspace.h>
 #include <page.h>
+#include <pagevec.h>
 #include <processor.h>
 #include <rand.h>
+#include <range.h>
+#include <secctx.h>
 #include <syscall.h>
 #include <twz/meta.h>
 #include <twz/sys/sctx.h>
@@ -66,9 +70,6 @@ long syscall_ostat(uint64_t idlo, uint64_t idhi, int stat_type, uint64_t arg, vo
 {
 	objid_t id = MKID(idhi, idlo);
 
-	/* TODO (med): implement object stat */
-	return -ENOSYS;
-#if 0
 	struct object *obj = obj_lookup(id, OBJ_LOOKUP_HIDDEN);
 	if(!obj) {
 		return -ENOENT;
@@ -88,9 +89,6 @@ long syscall_ostat(uint64_t idlo, uint64_t idhi, int stat_type, uint64_t arg, vo
 			os->flags |= (obj->flags & OF_HIDDEN) ? OS_FLAGS_HIDDEN : 0;
 			os->flags |= (obj->flags & OF_PAGER) ? OS_FLAGS_PAGER : 0;
 			os->flags |= (obj->flags & OF_ALLOC) ? OS_FLAGS_ALLOC : 0;
-			if(obj->sourced_from) {
-				os->flags = OS_FLAGS_SOURCED;
-			}
 
 			os->cache_mode = obj->cache_mode;
 			os->kso_type = obj->kso_type;
@@ -101,18 +99,8 @@ long syscall_ostat(uint64_t idlo, uint64_t idhi, int stat_type, uint64_t arg, vo
 			}
 			spinlock_release_restore(&obj->sleepers_lock);
 			os->nr_sleepers = c;
-			c = 0;
-			spinlock_acquire_save(&obj->lock);
-			foreach(e, list, &obj->derivations) {
-				c++;
-			}
-			spinlock_release_restore(&obj->lock);
-			os->nr_derivations = c;
-			if(obj->preg) {
-				os->nvreg = obj->preg->mono_id;
-			} else {
-				os->nvreg = 0;
-			}
+			os->nr_derivations = 0;
+			os->nvreg = 0;
 		} break;
 		case OS_TYPE_PAGE: {
 			struct kernel_ostat_page *os = p;
@@ -121,28 +109,50 @@ long syscall_ostat(uint64_t idlo, uint64_t idhi, int stat_type, uint64_t arg, vo
 				break;
 			}
 
-			struct objpage *opage = NULL;
-			enum obj_get_page_result gpr =
-			  obj_get_page(obj, (arg * mm_page_size(0)) % OBJ_MAXSIZE, &opage, OBJ_GET_PAGE_TEST);
-			assert(gpr == GETPAGE_OK || gpr == GETPAGE_NOENT);
-			if(gpr == GETPAGE_OK) {
-				os->flags = OS_PAGE_EXIST;
-				os->flags |= (opage->flags & OBJPAGE_MAPPED) ? OS_PAGE_MAPPED : 0;
-				os->flags |= (opage->flags & OBJPAGE_COW) ? OS_PAGE_COW : 0;
-				os->pgnr = opage->idx;
-				if(opage->page) {
-					os->level = opage->page->level;
-					os->cowcount = opage->page->cowcount;
+			size_t pagenr = arg % (OBJ_MAXSIZE / mm_page_size(0));
+			os->pgnr = pagenr;
+			os->flags = 0;
+			os->cowcount = 0;
+			os->level = 0;
+			struct rwlock_result rwres = rwlock_rlock(&obj->rwlock, 0);
+			struct range *range = object_find_range(obj, pagenr);
+			if(range && range->pv) {
+				pagevec_lock(range->pv);
+				struct page *page = pagevec_lookup_page(range->pv, range_pv_idx(range, pagenr));
+				if(page) {
+					os->flags |= OS_PAGE_EXIST;
+					if(range->pv->refs > 1 || mm_page_shared(page))
+						os->flags |= OS_PAGE_COW;
+					os->cowcount = page->refs - 1;
+					os->level = (mm_page_flags(page) & PAGE_HUGE) ? 1 : 0;
 				}
-				objpage_release(opage, 0);
-			} else if(gpr == GETPAGE_NOENT) {
-				os->flags = 0;
+				pagevec_unlock(range->pv);
 			}
+			rwlock_runlock(&rwres);
+			if(mm_objspace_object_mapped(obj, pagenr))
+				os->flags |= OS_PAGE_MAPPED;
+			os->obj_faults = obj->nr_faults;
+			os->obj_fault_around = obj->nr_fault_around;
 		} break;
+		case OS_TYPE_SCTX: {
+			struct kernel_ostat_sctx *os = p;
+			if(!verify_user_pointer(os, sizeof(*os))) {
+				ret = -EINVAL;
+				break;
+			}
+			struct sctx *sc = object_get_kso_data_checked(obj, KSO_SECCTX);
+			if(!sc) {
+				ret = -EINVAL;
+				break;
+			}
+			secctx_get_stats(sc, os);
+		} break;
+		default:
+			ret = -EINVAL;
+			break;
 	}
 	obj_put(obj);
-#endif
-	return 0;
+	return ret;
 }
 
 /* TODO (breaking): change interface to copy_args list */
@@ -420,6 +430,12 @@ long syscall_ocreate(uint64_t kulo,
 		}
 	}
 	o = obj_create(0, ksot);
+	if(flags & TWZ_SYS_OC_LARGEPAGES) {
+		o->flags |= OF_LARGEPAGES;
+	}
+	if(flags & TWZ_SYS_OC_READMOSTLY) {
+		obj_set_read_mostly(o);
+	}
 
 	if(srcid) {
 		struct object_copy_spec spec = {
@@ -533,6 +549,7 @@ long syscall_opin(uint64_t lo, uint64_t hi, uint64_t *addr, int flags)
 
 #include <device.h>
 #include <page.h>
+#include <pagevec.h>
 long syscall_octl(uint64_t lo, uint64_t hi, int op, long arg1, long arg2, long arg3)
 {
 	/* TODO (breaking): change this interface to operate on ranges of address in objects, and
@@ -164,6 +164,8 @@ long syscall_thread_spawn(uint64_t tidlo,
 	arch_thread_prep_start(
 	  t, start, tsa->arg, stack_base, tsa->stack_size, tls_base, tsa->thrd_ctrl);
 
+	t->affinity = current_thread ? current_thread->affinity : THREAD_AFFINITY_ALL;
+	t->sched_fixed = current_thread ? current_thread->sched_fixed : THRD_SCHED_NORMAL;
 	t->state = THREADSTATE_RUNNING;
 	processor_attach_thread(NULL, t);
 
@@ -176,6 +178,14 @@ long syscall_thread_spawn(uint64_t tidlo,
 	return 0;
 }
 
+static bool thread_is_superuser(struct thread *thr)
+{
+	spinlock_acquire_save(&thr->sc_lock);
+	bool su = thr->active_sc && thr->active_sc->superuser;
+	spinlock_release_restore(&thr->sc_lock);
+	return su;
+}
+
 long syscall_thrd_ctl(int op, long arg)
 {
 	if(op <= THRD_CTL_ARCH_MAX) {
@@ -191,6 +201,25 @@ long syscall_thrd_ctl(int op, long arg)
 			}
 			thread_exit();
 			break;
+		case THRD_CTL_SET_AFFINITY:
+			ret = processor_set_affinity(current_thread, arg);
+			break;
+		case THRD_CTL_GET_AFFINITY:
+			if(!verify_user_pointer((void *)arg, sizeof(uint64_t))) {
+				ret = -EINVAL;
+				break;
+			}
+			*(uint64_t *)arg = current_thread->affinity;
+			break;
+		case THRD_CTL_SET_SCHED:
+			/* a thread at a fixed level runs ahead of every normal thread on its CPU for as long
+			 * as it likes, so only a superuser context may pick one */
+			if(arg != THRD_SCHED_NORMAL && !thread_is_superuser(current_thread)) {
+				ret = -EPERM;
+				break;
+			}
+			ret = processor_set_sched(current_thread, arg);
+			break;
 		default:
 			ret = -EINVAL;
 	}
@@ -9,44 +9,34 @@
 #include <memory.h>
 #include <object.h>
 #include <processor.h>
-#include <slab.h>
 #include <syscall.h>
 #include <vmm.h>
 
 #define MAX_SLEEPS 1024
 
-struct thread_list {
-	struct thread *thread;
-	struct list entry;
-};
-
-static DECLARE_SLABCACHE(sc_tlist, sizeof(struct thread_list), NULL, NULL, NULL, NULL, NULL);
-
-struct syncpoint {
-	struct object *obj;
-	size_t off;
-	int flags;
-	struct krc refs;
+/* Sleeping threads wait in a global hash table of queues, keyed by the (object, offset) of the word
+ * they sleep on, with a lock per bucket. The wait queue entries are the sleep_entries of the
+ * sleeping thread, so sleeping does not allocate. A queued entry holds a reference to its object,
+ * so the key cannot be reused while anyone waits on it.
+ *
+ * A sleeper raises its bucket's waiter count before it checks the word, and a waker checks the
+ * count only after the word has been changed (the caller changes it before waking). So a waker that
+ * sees no waiters can return without taking the lock: anyone about to sleep will see the new
+ * value. */
+#define SYNC_HASH_BITS 10
 
+struct sync_bucket {
 	struct spinlock lock;
+	_Atomic unsigned long nr_waiters;
 	struct list waiters;
-	struct rbnode node;
-};
-
-static DECLARE_SLABCACHE(sc_syncpoint, sizeof(struct syncpoint), NULL, NULL, NULL, NULL, NULL);
+} __attribute__((aligned(64)));
 
-static int __sp_compar_key(struct syncpoint *a, size_t n)
-{
-	if(a->off > n)
-		return 1;
-	else if(a->off < n)
-		return -1;
-	return 0;
-}
+static struct sync_bucket sync_table[1ul << SYNC_HASH_BITS];
 
-static int __sp_compar(struct syncpoint *a, struct syncpoint *b)
+static struct sync_bucket *sync_bucket_get(struct object *obj, size_t off)
 {
-	return __sp_compar_key(a, b->off);
+	uint64_t h = ((uintptr_t)obj ^ (off * 0x9e3779b97f4a7c15ul)) * 0x9e3779b97f4a7c15ul;
+	return &sync_table[h >> (64 - SYNC_HASH_BITS)];
 }
 
 /* TODO: do we need to make sure that this is enough syncronization. Do we need
@@ -54,107 +44,175 @@ static int __sp_compar(struct syncpoint *a, struct syncpoint *b)
 
 /* TODO: determine if timeout occurred */
 
-static struct syncpoint *sp_lookup(struct object *obj, size_t off, bool create)
+#define SLEEP_32BIT 1
+#define SLEEP_DONTCHECK 2
+
+static void __sync_dequeue(struct sync_bucket *sb, struct sleep_entry *se)
 {
-	spinlock_acquire_save(&obj->tslock);
-	struct rbnode *node =
-	  rb_search(&obj->tstable_root, off, struct syncpoint, node, __sp_compar_key);
-	struct syncpoint *sp = node ? rb_entry(node, struct syncpoint, node) : NULL;
-	if(!sp || !krc_get_unless_zero(&sp->refs)) {
-		if(!create) {
-			spinlock_release_restore(&obj->tslock);
-			return NULL;
-		}
-		sp = slabcache_alloc(&sc_syncpoint, NULL);
-		krc_get(&obj->refs);
-		sp->obj = obj;
-		sp->off = off;
-		sp->flags = 0;
-		krc_init(&sp->refs);
-		list_init(&sp->waiters);
-		rb_insert(&obj->tstable_root, sp, struct syncpoint, node, __sp_compar);
-	}
-	spinlock_release_restore(&obj->tslock);
-	return sp;
+	list_remove(&se->entry);
+	se->queued = false;
+	sb->nr_waiters--;
 }
 
-static void _sp_release(void *_sp)
+static void __sync_enqueue(struct sync_bucket *sb, struct sleep_entry *se)
 {
-	struct syncpoint *sp = _sp;
-	spinlock_acquire_save(&sp->obj->tslock);
-	rb_delete(&sp->node, &sp->obj->tstable_root);
-	spinlock_release_restore(&sp->obj->tslock);
-	struct object *obj = sp->obj;
-	sp->obj = NULL;
-	obj_put(obj);
-	assert(list_empty(&sp->waiters));
-	slabcache_free(&sc_syncpoint, sp, NULL);
+	sb->nr_waiters++;
+	list_insert(sb->waiters.prev, &se->entry);
+	se->queued = true;
 }
 
-#define SLEEP_32BIT 1
-#define SLEEP_DONTCHECK 2
+/* take sleep entry se off its queue (if a waker has not already done so) and drop its reference */
+static void sync_sleep_clear(struct sleep_entry *se)
+{
+	struct sync_bucket *sb;
+	while(true) {
+		sb = se->bucket;
+		if(!sb)
+			return;
+		spinlock_acquire_save(&sb->lock);
+		/* a requeue may have moved us before we got the lock */
+		if(se->bucket == sb)
+			break;
+		spinlock_release_restore(&sb->lock);
+	}
+	if(se->queued)
+		__sync_dequeue(sb, se);
+	spinlock_release_restore(&sb->lock);
+	se->bucket = NULL;
+	obj_put(se->obj);
+	se->obj = NULL;
+}
 
-static struct thread_list *sp_sleep_prep(struct syncpoint *sp,
-  long *addr,
-  long val,
-  int flags,
-  int *result)
+/* queue the current thread on (obj, off) using sleep entry idx, and mark it as sleeping. Returns
+ * whether the word still holds val (and so whether the thread should actually sleep). */
+static int sync_sleep_prep(struct object *obj, size_t off, long *addr, long val, int idx, int flags)
 {
-	struct thread_list *tl = slabcache_alloc(&sc_tlist, NULL);
-	spinlock_acquire_save(&sp->lock);
-	thread_sleep(current_thread, 0);
+	struct sleep_entry *se = &current_thread->sleep_entries[idx];
+	struct sync_bucket *sb = sync_bucket_get(obj, off);
+	sync_sleep_clear(se);
+	krc_get(&obj->refs);
+	se->thread = current_thread;
+	se->obj = obj;
+	se->off = off;
+	se->bucket = sb;
 
-	tl->thread = current_thread;
-	list_insert(&sp->waiters, &tl->entry);
+	spinlock_acquire_save(&sb->lock);
+	thread_sleep(current_thread, 0);
+	__sync_enqueue(sb, se);
 
 	/* TODO: verify that addr is a valid address that we can access */
 	int r = (flags & SLEEP_DONTCHECK)
 	        || ((flags & SLEEP_32BIT) ? (atomic_load((_Atomic int *)addr) == (int)val)
 	                                  : (atomic_load((_Atomic long *)addr) == val));
-	spinlock_release_restore(&sp->lock);
-	*result = r;
-	return tl;
+	spinlock_release_restore(&sb->lock);
+	return r;
 }
 
-static int sp_sleep(struct syncpoint *sp, long *addr, long val, int idx, int flags)
+static int sync_sleep(struct object *obj, size_t off, long *addr, long val, int idx, int flags)
 {
-	int r;
-	struct thread_list *tl = sp_sleep_prep(sp, addr, val, flags, &r);
-	if(!r) {
-		spinlock_acquire_save(&sp->lock);
-		list_remove(&tl->entry);
+	if(!sync_sleep_prep(obj, off, addr, val, idx, flags)) {
+		sync_sleep_clear(&current_thread->sleep_entries[idx]);
 		thread_wake(current_thread);
-		spinlock_release_restore(&sp->lock);
-		krc_put_call(sp, refs, _sp_release);
-	} else {
-		current_thread->sleep_entries[idx].tl = tl;
-		current_thread->sleep_entries[idx].sp = sp;
 	}
 	return 0;
 }
 
-static int sp_wake(struct syncpoint *sp, long arg)
+static void __sync_wake_entry(struct sync_bucket *sb, struct sleep_entry *se, bool handoff)
+{
+	__sync_dequeue(sb, se);
+	se->thread->sleep_restart = true;
+	thread_wake(se->thread);
+	/* the entry can't go away while we hold the bucket lock (see sync_sleep_clear), so neither can
+	 * its thread */
+	if(handoff && se->thread != current_thread)
+		processor_handoff(se->thread);
+}
+
+/* wake up to arg threads sleeping on (obj, off), or all of them if arg is negative. Woken threads
+ * are taken off the queue, so that a later wake goes to someone else. If handoff is set, the first
+ * thread woken gets the rest of the current thread's timeslice. */
+static int sync_wake(struct object *obj, size_t off, long arg, bool handoff)
 {
-	if(!sp) {
+	struct sync_bucket *sb = sync_bucket_get(obj, off);
+	/* pairs with the increment in sync_sleep_prep; the caller's store to the word must be visible
+	 * before we look */
+	atomic_thread_fence(memory_order_seq_cst);
+	if(arg == 0 || !sb->nr_waiters)
 		return 0;
-	}
-	spinlock_acquire_save(&sp->lock);
+	spinlock_acquire_save(&sb->lock);
 	struct list *next;
 	int count = 0;
-	for(struct list *e = list_iter_start(&sp->waiters); e != list_iter_end(&sp->waiters);
+	for(struct list *e = list_iter_start(&sb->waiters); e != list_iter_end(&sb->waiters);
 	    e = next) {
 		next = list_iter_next(e);
-		struct thread_list *tl = list_entry(e, struct thread_list, entry);
+		struct sleep_entry *se = list_entry(e, struct sleep_entry, entry);
+		if(se->obj != obj || se->off != off)
+			continue;
 		if(arg == 0)
 			break;
 		else if(arg > 0)
 			arg--;
 
-		tl->thread->sleep_restart = true;
-		thread_wake(tl->thread);
+		__sync_wake_entry(sb, se, handoff && count == 0);
 		count++;
 	}
-	spinlock_release_restore(&sp->lock);
+	spinlock_release_restore(&sb->lock);
+
+	return count;
+}
+
+/* wake up to nr_wake threads sleeping on (obj, off) (all of them if negative), and move the rest
+ * to sleep on (obj2, off2) instead, without waking them. Returns the number woken. */
+static int sync_requeue(struct object *obj,
+  size_t off,
+  long nr_wake,
+  struct object *obj2,
+  size_t off2)
+{
+	if(obj == obj2 && off == off2)
+		return sync_wake(obj, off, nr_wake, false);
+	struct sync_bucket *sb = sync_bucket_get(obj, off);
+	struct sync_bucket *sb2 = sync_bucket_get(obj2, off2);
+	atomic_thread_fence(memory_order_seq_cst);
+	if(!sb->nr_waiters)
+		return 0;
+	/* always take the lower bucket's lock first */
+	struct sync_bucket *first = sb < sb2 ? sb : sb2;
+	struct sync_bucket *second = sb < sb2 ? sb2 : sb;
+	spinlock_acquire_save(&first->lock);
+	if(second != first)
+		spinlock_acquire_save(&second->lock);
+	struct list *next;
+	int count = 0;
+	size_t moved = 0;
+	for(struct list *e = list_iter_start(&sb->waiters); e != list_iter_end(&sb->waiters);
+	    e = next) {
+		next = list_iter_next(e);
+		struct sleep_entry *se = list_entry(e, struct sleep_entry, entry);
+		if(se->obj != obj || se->off != off)
+			continue;
+		if(nr_wake != 0) {
+			if(nr_wake > 0)
+				nr_wake--;
+			__sync_wake_entry(sb, se, false);
+			count++;
+			continue;
+		}
+		/* the entry's reference moves to the new object; the old ones are dropped below */
+		__sync_dequeue(sb, se);
+		krc_get(&obj2->refs);
+		se->obj = obj2;
+		se->off = off2;
+		se->bucket = sb2;
+		__sync_enqueue(sb2, se);
+		moved++;
+	}
+	if(second != first)
+		spinlock_release_restore(&second->lock);
+	spinlock_release_restore(&first->lock);
+	/* the caller holds a reference to obj too, so these never free it */
+	while(moved--)
+		obj_put(obj);
 
 	return count;
 }
@@ -163,30 +221,14 @@ void thread_onresume_clear_other_sleeps(struct thread *thr)
 {
 	/* TODO: optimization to try to elide this? */
 	for(size_t i = 0; i < thr->sleep_count; i++) {
-		struct syncpoint *op = thr->sleep_entries[i].sp;
-		struct thread_list *tl = thr->sleep_entries[i].tl;
-		if(op) {
-			spinlock_acquire_save(&op->lock);
-			list_remove(&tl->entry);
-			spinlock_release_restore(&op->lock);
-			krc_put_call(op, refs, _sp_release);
-			thr->sleep_entries[i].sp = NULL;
-		}
+		sync_sleep_clear(&thr->sleep_entries[i]);
 	}
 }
 
 void thread_sync_uninit_thread(struct thread *thr)
 {
 	for(size_t i = 0; i < thr->sleep_count; i++) {
-		struct syncpoint *op = thr->sleep_entries[i].sp;
-		struct thread_list *tl = thr->sleep_entries[i].tl;
-		if(op) {
-			spinlock_acquire_save(&op->lock);
-			list_remove(&tl->entry);
-			spinlock_release_restore(&op->lock);
-			krc_put_call(op, refs, _sp_release);
-			thr->sleep_entries[i].sp = NULL;
-		}
+		sync_sleep_clear(&thr->sleep_entries[i]);
 	}
 
 	if(thr->sleep_entries) {
@@ -196,57 +238,53 @@ void thread_sync_uninit_thread(struct thread *thr)
 	thr->sleep_count = 0;
 }
 
-static long thread_sync_single_norestore(int operation, long *addr, long arg, int idx, int flags)
+static long thread_sync_single_norestore(int operation,
+  long *addr,
+  long arg,
+  long *addr2,
+  int idx,
+  int flags)
 {
-	objid_t id;
-	uint64_t off;
-	// long long a, b, c, d, e, f;
-	// a = krdtsc();
+	uint64_t off, off2;
 	struct object *obj = vm_vaddr_lookup_obj(addr, &off);
 	if(!obj) {
 		return -EFAULT;
 	}
-	// c = krdtsc();
-	struct syncpoint *sp = sp_lookup(obj, off, operation == THREAD_SYNC_SLEEP);
-	// d = krdtsc();
 	long ret = -EINVAL;
+	struct object *obj2;
 	switch(operation) {
-		int result;
-		struct thread_list *tl;
 		case THREAD_SYNC_SLEEP:
-			tl = sp_sleep_prep(sp, addr, arg, flags, &result);
-			ret = result;
-			current_thread->sleep_entries[idx].sp = sp;
-			current_thread->sleep_entries[idx].tl = tl;
+			ret = sync_sleep_prep(obj, off, addr, arg, idx, flags);
 			break;
 		case THREAD_SYNC_WAKE:
-			ret = sp_wake(sp, arg);
-			if(sp)
-				krc_put_call(sp, refs, _sp_release);
+		case THREAD_SYNC_WAKE_AND_YIELD:
+			ret = sync_wake(obj, off, arg, operation == THREAD_SYNC_WAKE_AND_YIELD);
+			break;
+		case THREAD_SYNC_REQUEUE:
+			obj2 = vm_vaddr_lookup_obj(addr2, &off2);
+			if(!obj2) {
+				ret = -EFAULT;
+				break;
+			}
+			ret = sync_requeue(obj, off, arg, obj2, off2);
+			obj_put(obj2);
 			break;
 		default:
 			break;
 	}
-	// e = krdtsc();
 	obj_put(obj);
-	// f = krdtsc();
-	// if(operation == THREAD_SYNC_WAKE)
-	//	printk("tssnr: %ld %ld %ld %ld %ld -> %ld\n", b - a, c - b, d - c, e - d, f - e, ret);
 	return ret;
 }
 
 long thread_wake_object(struct object *obj, size_t offset, long arg)
 {
-	struct syncpoint *sp = sp_lookup(obj, offset, false);
-	if(!sp)
-		return 0;
-	long c = sp_wake(sp, arg);
-	krc_put_call(sp, refs, _sp_release);
-	return c;
+	return sync_wake(obj, offset, arg, false);
 }
 
 static void __thread_init_sync(size_t count)
 {
+	/* entries are only queued while the thread sleeps, so none are in use here and the array may
+	 * move */
 	if(!current_thread->sleep_entries) {
 		current_thread->sleep_entries = kcalloc(count, sizeof(struct sleep_entry), 0);
 		current_thread->sleep_count = count;
@@ -260,10 +298,9 @@ static void __thread_init_sync(size_t count)
 
 long thread_sleep_on_object(struct object *obj, size_t offset, long arg, bool dont_check)
 {
-	struct syncpoint *sp = sp_lookup(obj, offset, true);
 	__thread_init_sync(1);
 	spinlock_acquire_save(&current_thread->lock);
-	if(current_thread->sleep_entries[0].sp) {
+	if(current_thread->sleep_entries[0].bucket) {
 		spinlock_release_restore(&current_thread->lock);
 		return 0;
 	}
@@ -271,7 +308,7 @@ long thread_sleep_on_object(struct object *obj, size_t offset, long arg, bool do
 	if(!dont_check) {
 		panic("NI - in-kernel sleep on object with addr check");
 	}
-	return sp_sleep(sp, NULL, arg, 0, SLEEP_DONTCHECK);
+	return sync_sleep(obj, offset, NULL, arg, 0, SLEEP_DONTCHECK);
 }
 
 long thread_sync_single(int operation, long *addr, long arg, bool bits32)
@@ -281,18 +318,28 @@ long thread_sync_single(int operation, long *addr, long arg, bool bits32)
 	if(!obj) {
 		return -EFAULT;
 	}
-	struct syncpoint *sp = sp_lookup(obj, off, operation == THREAD_SYNC_SLEEP);
-	obj_put(obj);
+	long ret = -EINVAL;
 	switch(operation) {
 		case THREAD_SYNC_SLEEP:
 			__thread_init_sync(1);
-			return sp_sleep(sp, addr, arg, 0, bits32 ? SLEEP_32BIT : 0);
+			ret = sync_sleep(obj, off, addr, arg, 0, bits32 ? SLEEP_32BIT : 0);
+			break;
 		case THREAD_SYNC_WAKE:
-			return sp_wake(sp, arg);
+			ret = sync_wake(obj, off, arg, false);
+			break;
 		default:
 			break;
 	}
-	return -EINVAL;
+	obj_put(obj);
+	return ret;
+}
+
+__initializer static void __init_sync_table(void)
+{
+	for(size_t i = 0; i < (1ul << SYNC_HASH_BITS); i++) {
+		sync_table[i].lock = SPINLOCK_INIT;
+		list_init(&sync_table[i].waiters);
+	}
 }
 
 static void __thread_sync_timer(void *a)
@@ -328,20 +375,27 @@ long syscall_thread_sync(size_t count, struct sys_thread_sync_args *args, struct
 		if(args[i].op == THREAD_SYNC_SLEEP && timeout && !armed_sleep) {
 			armed_sleep = true;
 			uint64_t timeout_nsec = timeout->tv_nsec + timeout->tv_sec * 1000000000ul;
-			timer_add(
-			  &current_thread->sleep_timer, timeout_nsec, __thread_sync_timer, current_thread);
+			/* a timeout may run a little long, so let it coalesce with its neighbours */
+			timer_add_slack(&current_thread->sleep_timer,
+			  timeout_nsec,
+			  timeout_nsec / 16,
+			  __thread_sync_timer,
+			  current_thread);
 		}
 		void *addr = args[i].addr;
+		void *addr2 = args[i].addr2;
 		int r;
-		if(!verify_user_pointer(addr, sizeof(void *))) {
+		if(!verify_user_pointer(addr, sizeof(void *))
+		   || (args[i].op == THREAD_SYNC_REQUEUE && !verify_user_pointer(addr2, sizeof(void *)))) {
 			r = ret = -EINVAL;
 		} else {
-			if(args[i].op == THREAD_SYNC_WAKE) {
+			if(args[i].op != THREAD_SYNC_SLEEP) {
 				was_wake_op = true;
 			}
 			r = thread_sync_single_norestore(args[i].op,
 			  addr,
 			  args[i].arg,
+			  addr2,
 			  i,
 			  (args[i].flags & THREAD_SYNC_32BIT) ? SLEEP_32BIT : 0);
 			if(r)
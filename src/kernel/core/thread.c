@@ -1,3 +1,4 @@
+#include <clksrc.h>
 #include <kalloc.h>
 #include <kso.h>
 #include <lib/iter.h>
@@ -26,6 +27,10 @@ static void _thread_ctor(void *_data __unused, void *ptr)
 	thr->id = ++_internal_tid_counter;
 	thr->state = THREADSTATE_INITING;
 	thr->priority = 10;
+	thr->sched_fixed = THRD_SCHED_NORMAL;
+	thr->wait_total = thr->wait_max = thr->nr_waits = 0;
+	thr->affinity = THREAD_AFFINITY_ALL;
+	thr->on_cpu = false;
 	assert(list_empty(&thr->become_stack));
 	arch_thread_ctor(thr);
 }
@@ -87,14 +92,10 @@ static struct spinlock allthreads_lock = SPINLOCK_INIT;
 void thread_sleep(struct thread *t, int flags)
 {
 	(void)flags;
-	t->priority *= 20;
-	if(t->priority > 1000) {
-		t->priority = 1000;
-	}
 	spinlock_acquire_save(&t->processor->sched_lock);
 	if(t->state != THREADSTATE_BLOCKED) {
 		t->state = THREADSTATE_BLOCKED;
-		list_remove(&t->rq_entry);
+		runqueue_remove(&t->processor->runqueue, t);
 		t->processor->stats.running--;
 	}
 	spinlock_release_restore(&t->processor->sched_lock);
@@ -118,7 +119,13 @@ void thread_wake(struct thread *t)
 		  offsetof(struct twzthread_repr, syncs[THRD_SYNC_STATE]) + OBJ_NULLPAGE_SIZE,
 		  INT_MAX);
 
-		list_insert(&t->processor->runqueue, &t->rq_entry);
+		/* threads that sleep are likely interactive, so they come back at a better level */
+		t->priority *= 20;
+		if(t->priority > THREAD_PRIORITY_MAX) {
+			t->priority = THREAD_PRIORITY_MAX;
+		}
+		t->wait_start = clksrc_get_nanoseconds();
+		runqueue_insert(&t->processor->runqueue, t);
 		t->processor->stats.running++;
 		t->processor->flags |= PROCESSOR_HASWORK;
 		if(t->processor != current_processor) {
@@ -142,7 +149,9 @@ struct thread *thread_create(void)
 void thread_exit(void)
 {
 	timer_remove(&current_thread->sleep_timer);
-	list_remove(&current_thread->rq_entry);
+	spinlock_acquire_save(&current_processor->sched_lock);
+	runqueue_remove(&current_processor->runqueue, current_thread);
+	spinlock_release_restore(&current_processor->sched_lock);
 	current_thread->processor->stats.running--;
 	current_thread->state = THREADSTATE_EXITED;
 	assert(current_processor->load > 0);
@@ -199,6 +208,14 @@ void thread_print_all_threads(void)
 		printk("thread %ld\n", t->id);
 		printk("  CPU: %d\n", t->processor ? (int)t->processor->id : -1);
 		printk("  state: %d\n", t->state);
+		printk("  sched: level %d%s, priority %d\n",
+		  t->rq_level,
+		  t->sched_fixed == THRD_SCHED_NORMAL ? "" : " (fixed)",
+		  t->priority);
+		printk("  waits: %ld, avg %ld ns, max %ld ns\n",
+		  t->nr_waits,
+		  t->nr_waits ? t->wait_total / t->nr_waits : 0,
+		  t->wait_max);
 		printk("  ctx: %p\n", t->ctx);
 		arch_thread_print_info(t);
 		spinlock_release_restore(&t->lock);
@@ -11,92 +11,216 @@
 #include <thread.h>
 #include <time.h>
 
-/* TODO (perf): change timer system to heap */
+/* Each CPU has a hierarchical timer wheel. Time is counted in ticks of 2^TW_TICK_SHIFT ns. Level n
+ * has 64 buckets, each 8^n ticks wide, and holds the timers expiring between 63*8^(n-1) and
+ * 63*8^n ticks after the wheel's clock. A timer's expiry is rounded up to the end of its bucket, so
+ * it never fires early, and fires at most about 1/8 of its duration late. Timers are not cascaded
+ * down the levels: a bucket is expired as a whole when the clock reaches its end, which coalesces
+ * all the timers in it into one wakeup. Adding and removing timers is O(1), and the next expiry is
+ * found from a bitmap of the non-empty buckets of each level. */
 
-static DECLARE_PER_CPU(struct rbroot, timer_root) = RBINIT;
-static DECLARE_PER_CPU(struct spinlock, timer_lock) = SPINLOCK_INIT;
+#define TW_TICK_SHIFT 16
+#define TW_LVL_BITS 6
+#define TW_LVL_SIZE (1ul << TW_LVL_BITS)
+#define TW_LVL_MASK (TW_LVL_SIZE - 1)
+#define TW_LVL_CLK_SHIFT 3
+#define TW_LVL_CLK_MASK ((1ul << TW_LVL_CLK_SHIFT) - 1)
+#define TW_LEVELS 6
 
-static int __timer_compar_key(struct timer *a, dur_nsec b)
+#define TW_LVL_SHIFT(n) ((n)*TW_LVL_CLK_SHIFT)
+#define TW_LVL_GRAN(n) (1ul << TW_LVL_SHIFT(n))
+#define TW_LVL_START(n) ((TW_LVL_SIZE - 1) << (((n)-1) * TW_LVL_CLK_SHIFT))
+
+/* timers further out than the last level reaches (about 135 seconds) are parked at its far end,
+ * and added again when that bucket expires */
+#define TW_CUTOFF TW_LVL_START(TW_LEVELS)
+#define TW_MAX_DELTA (TW_CUTOFF - TW_LVL_GRAN(TW_LEVELS - 1))
+
+#define TW_NONE (~0ul)
+
+_Static_assert(TW_LVL_SIZE == 64, "timer wheel levels use a single-word bitmap");
+
+struct timer_wheel {
+	struct spinlock lock;
+	/* the next tick to expire */
+	uint64_t clk;
+	/* no bucket expires before this tick (it may be early after a timer is removed) */
+	uint64_t next_expiry;
+	uint64_t pending[TW_LEVELS];
+	struct timer *buckets[TW_LEVELS * TW_LVL_SIZE];
+};
+
+static DECLARE_PER_CPU(struct timer_wheel, timer_wheel) = {
+	.lock = SPINLOCK_INIT,
+	.next_expiry = TW_NONE,
+};
+
+static unsigned int __tw_bucket(uint64_t expires, unsigned int lvl, uint64_t *bucket_expiry)
 {
-	if(a->time > b)
-		return 1;
-	else if(a->time < b)
-		return -1;
-	/* timers can never be equal. Break ties. */
-	return 1;
+	/* round up, so that neither a timer added part way through a tick nor the truncation at the
+	 * outer levels makes it fire early */
+	expires = (expires >> TW_LVL_SHIFT(lvl)) + 1;
+	*bucket_expiry = expires << TW_LVL_SHIFT(lvl);
+	return lvl * TW_LVL_SIZE + (expires & TW_LVL_MASK);
 }
 
-static int __timer_compar(struct timer *a, struct timer *b)
+static unsigned int __tw_index(uint64_t expires, uint64_t clk, uint64_t *bucket_expiry)
 {
-	return __timer_compar_key(a, b->time);
+	if(expires < clk)
+		expires = clk;
+	uint64_t delta = expires - clk;
+	if(delta >= TW_CUTOFF) {
+		expires = clk + TW_MAX_DELTA;
+		delta = TW_MAX_DELTA;
+	}
+	unsigned int lvl = 0;
+	while(lvl < TW_LEVELS - 1 && delta >= TW_LVL_START(lvl + 1))
+		lvl++;
+	return __tw_bucket(expires, lvl, bucket_expiry);
 }
 
-void timer_add(struct timer *t, dur_nsec time, void (*fn)(void *), void *data)
+static void __tw_enqueue(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t bucket_expiry;
+	unsigned int idx = __tw_index(t->time >> TW_TICK_SHIFT, w->clk, &bucket_expiry);
+	struct timer **head = &w->buckets[idx];
+	t->next = *head;
+	if(t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+	t->bucket = idx;
+	w->pending[idx / TW_LVL_SIZE] |= 1ul << (idx % TW_LVL_SIZE);
+	if(bucket_expiry < w->next_expiry)
+		w->next_expiry = bucket_expiry;
+}
+
+static void __tw_unlink(struct timer_wheel *w, struct timer *t)
+{
+	*t->pprev = t->next;
+	if(t->next)
+		t->next->pprev = t->pprev;
+	if(!w->buckets[t->bucket])
+		w->pending[t->bucket / TW_LVL_SIZE] &= ~(1ul << (t->bucket % TW_LVL_SIZE));
+	t->next = NULL;
+	t->pprev = NULL;
+	t->active = false;
+}
+
+/* the first tick at or after the clock at which a non-empty bucket expires */
+static uint64_t __tw_next_expiry(struct timer_wheel *w)
+{
+	uint64_t next = TW_NONE;
+	for(unsigned int lvl = 0; lvl < TW_LEVELS; lvl++) {
+		uint64_t bm = w->pending[lvl];
+		if(!bm)
+			continue;
+		/* the position of the first bucket boundary at or after the clock */
+		uint64_t lclk = (w->clk + TW_LVL_GRAN(lvl) - 1) >> TW_LVL_SHIFT(lvl);
+		unsigned int pos = lclk & TW_LVL_MASK;
+		if(pos)
+			bm = (bm >> pos) | (bm << (TW_LVL_SIZE - pos));
+		uint64_t exp = (lclk + __builtin_ctzl(bm)) << TW_LVL_SHIFT(lvl);
+		if(exp < next)
+			next = exp;
+	}
+	return next;
+}
+
+/* expire every bucket that ends at tick clk, which must be no later than now */
+static void __tw_expire(struct timer_wheel *w, uint64_t clk, uint64_t now)
 {
-	struct rbroot *timer_root = per_cpu_get(timer_root);
-	struct spinlock *timer_lock = per_cpu_get(timer_lock);
+	w->clk = clk + 1;
+	for(unsigned int lvl = 0; lvl < TW_LEVELS; lvl++) {
+		unsigned int idx = lvl * TW_LVL_SIZE + (clk & TW_LVL_MASK);
+		struct timer *t = w->buckets[idx];
+		w->buckets[idx] = NULL;
+		w->pending[lvl] &= ~(1ul << (idx % TW_LVL_SIZE));
+		while(t) {
+			struct timer *next = t->next;
+			t->next = NULL;
+			t->pprev = NULL;
+			if(t->time > now) {
+				/* parked past the end of the wheel */
+				__tw_enqueue(w, t);
+			} else {
+				t->active = false;
+				t->fn(t->data);
+			}
+			t = next;
+		}
+		/* the buckets of the next level only end on a multiple of its granularity */
+		if(clk & TW_LVL_CLK_MASK)
+			break;
+		clk >>= TW_LVL_CLK_SHIFT;
+	}
+}
+
+void timer_add_slack(struct timer *t,
+  dur_nsec time,
+  dur_nsec slack,
+  void (*fn)(void *),
+  void *data)
+{
+	if(t->active)
+		timer_remove(t);
+	struct timer_wheel *w = per_cpu_get(timer_wheel);
+	uint64_t now = clksrc_get_nanoseconds();
 	t->fn = fn;
 	t->data = data;
-	t->time = time + clksrc_get_nanoseconds();
-	spinlock_acquire_save(timer_lock);
+	t->time = time + now;
+	if(slack >= (1ul << TW_TICK_SHIFT)) {
+		uint64_t gran = 1ul << (63 - __builtin_clzl(slack));
+		t->time = align_up(t->time, gran);
+	}
+	spinlock_acquire_save(&w->lock);
 	if(!t->active) {
-		rb_insert(timer_root, t, struct timer, node, __timer_compar);
+		/* if the wheel has fallen behind (because nothing needed it to tick), catch its clock up so
+		 * that the timer is placed relative to now, not to when the clock last moved */
+		uint64_t now_tick = now >> TW_TICK_SHIFT;
+		if(w->clk < now_tick && w->next_expiry > now_tick)
+			w->clk = now_tick;
+		__tw_enqueue(w, t);
+		t->cpu = current_processor->id;
 		t->active = true;
 	}
-	spinlock_release_restore(timer_lock);
+	spinlock_release_restore(&w->lock);
+}
+
+void timer_add(struct timer *t, dur_nsec time, void (*fn)(void *), void *data)
+{
+	timer_add_slack(t, time, 0, fn, data);
 }
 
 void timer_remove(struct timer *t)
 {
-	struct rbroot *timer_root = per_cpu_get(timer_root);
-	struct spinlock *timer_lock = per_cpu_get(timer_lock);
-	spinlock_acquire_save(timer_lock);
+	/* the timer's owner may have migrated since adding it, so use the wheel it was added to */
+	struct processor *proc = processor_get(t->cpu);
+	struct timer_wheel *w = __per_cpu_var_lea(timer_wheel, proc);
+	spinlock_acquire_save(&w->lock);
 	if(t->active) {
-		rb_delete(&t->node, timer_root);
-		t->active = false;
+		__tw_unlink(w, t);
 	}
-	spinlock_release_restore(timer_lock);
+	spinlock_release_restore(&w->lock);
 }
 
 uint64_t timer_check_timers(void)
 {
-	uint64_t ret = 0;
-	struct rbroot *timer_root = per_cpu_get(timer_root);
-	struct spinlock *timer_lock = per_cpu_get(timer_lock);
-	spinlock_acquire_save(timer_lock);
-	struct rbnode *node = rb_first(timer_root);
-	if(node) {
-		struct timer *t = rb_entry(node, struct timer, node);
-		assert(t->active);
-		uint64_t now = clksrc_get_nanoseconds();
-		if(now >= t->time) {
-			rb_delete(&t->node, timer_root);
-			t->active = false;
-			t->fn(t->data);
-		} else {
-			ret = t->time - now;
-		}
-		spinlock_release_restore(timer_lock);
-	} else {
-		spinlock_release_restore(timer_lock);
+	struct timer_wheel *w = per_cpu_get(timer_wheel);
+	spinlock_acquire_save(&w->lock);
+	uint64_t now = clksrc_get_nanoseconds();
+	uint64_t now_tick = now >> TW_TICK_SHIFT;
+	/* jump straight to each tick with work to do, rather than stepping through the idle ones */
+	while(w->next_expiry <= now_tick) {
+		if(w->next_expiry >= w->clk)
+			__tw_expire(w, w->next_expiry, now);
+		w->next_expiry = __tw_next_expiry(w);
 	}
+	if(w->clk <= now_tick)
+		w->clk = now_tick + 1;
+	uint64_t ret = 0;
+	if(w->next_expiry != TW_NONE)
+		ret = (w->next_expiry << TW_TICK_SHIFT) - now;
+	spinlock_release_restore(&w->lock);
 	return ret;
 }
-
-#if 0
-static void check_timers(void)
-{
-	spinlock_acquire_save(&timers_list_lock);
-	struct list *entry = list_iter_start(&timers);
-	if(entry != list_iter_end(&timers)) {
-		struct timer *t = list_entry(entry, struct timer, entry);
-		if(t->time < cur_time) {
-			list_remove(&t->entry);
-			spinlock_release_restore(&timers_list_lock);
-			t->fn(t->data);
-			return;
-		}
-	}
-	spinlock_release_restore(&timers_list_lock);
-}
-#endif
@@ -13,3 +13,6 @@
 #define PAGEVEC_MAX_IDX 4096
 
 #define PAGE_MAP_COW 1
+#define PAGE_MAP_LARGE 2
+/* leave an existing mapping alone instead of replacing it */
+#define PAGE_MAP_NOREPLACE 4
@@ -13,16 +13,17 @@
  * uninitialized. */
 void *kalloc(size_t sz, int flags);
 
-/** Similar to kalloc, but allocate num * sz bytes. */
+/** Similar to kalloc, but allocate num * sz bytes. The memory is always zero'd. */
 void *kcalloc(size_t num, size_t sz, int flags);
 
 /** Reallocate a region of memory.
  * @param p Existing allocated region. If NULL, this acts like kalloc.
  * @param sz New size. If larger, the new memory will be zero'd or not depending on flags.
  * @param flags bitwise or of KALLOC_*.
- * @return Reallocated region of memory. Not guaranteed to be the same address as p. */
+ * @return Reallocated region of memory. Not guaranteed to be the same address as p, but if the
+ * new size falls in the same size class as the old one, the region is resized in place. */
 void *krealloc(void *p, size_t sz, int flags);
-/* Similar to krealloc, except num * sz for allocation size. */
+/* Similar to krealloc, except num * sz for allocation size. New memory is always zero'd. */
 void *krecalloc(void *p, size_t num, size_t sz, int flags);
 /** Free an allocation. */
 void kfree(void *p);
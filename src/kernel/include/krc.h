@@ -31,6 +31,21 @@ static inline bool krc_get_unless_zero(struct krc *k)
 	}
 }
 
+/* drop a reference, unless it's the last one (returns false without touching the count) */
+static inline bool krc_put_unless_one(struct krc *k)
+{
+	int64_t c = k->count;
+	while(true) {
+		assert(c > 0);
+		if(c == 1) {
+			return false;
+		}
+		if(likely(atomic_compare_exchange_weak(&k->count, &c, c - 1))) {
+			return true;
+		}
+	}
+}
+
 static inline bool krc_put(struct krc *k)
 {
 	assert(k->count > 0);
@@ -51,9 +66,9 @@ static inline bool __krc_put_call(struct krc *k, void (*_fn)(void *k), void *o)
 
 static inline bool krc_put_locked(struct krc *k, struct spinlock *lock)
 {
-	assert(k->count > 0);
-
-	/* TODO: optimize via dec_if_not_one */
+	if(krc_put_unless_one(k)) {
+		return false;
+	}
 
 	spinlock_acquire_save(lock);
 	bool r = atomic_fetch_sub(&k->count, 1) == 1;
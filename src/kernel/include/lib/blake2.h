@@ -134,6 +134,7 @@ int blake2b_init_key(blake2b_state *S, size_t outlen, const void *key, size_t ke
 int blake2b_init_param(blake2b_state *S, const blake2b_param *P);
 int blake2b_update(blake2b_state *S, const void *in, size_t inlen);
 int blake2b_final(blake2b_state *S, void *out, size_t outlen);
+int blake2b_init_leaf(blake2b_state *S, size_t outlen, uint32_t leaf_length, uint64_t offset);
 
 int blake2sp_init(blake2sp_state *S, size_t outlen);
 int blake2sp_init_key(blake2sp_state *S, size_t outlen, const void *key, size_t keylen);
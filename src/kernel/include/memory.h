@@ -47,6 +47,7 @@ void mm_init_region(struct memregion *reg,
 
 #define REGION_ALLOC_BOOTSTRAP 1
 uintptr_t mm_region_alloc_raw(size_t len, size_t align, int flags);
+uintptr_t mm_region_alloc_aligned(size_t len, size_t align, uintptr_t *pad, size_t *padlen);
 void mm_early_alloc(uintptr_t *phys, void **virt, size_t len, size_t align);
 void *mm_early_ptov(uintptr_t phys);
 
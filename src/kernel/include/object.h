@@ -34,6 +34,12 @@ struct object_tie {
 #define OF_HIDDEN 0x100
 #define OF_PAGER 0x200
 #define OF_PARTIAL 0x400
+#define OF_LARGEPAGES 0x800
+/* queued for object_idle_coalesce */
+#define OF_COALESCE 0x1000
+/* read-mostly: the contents lock is in per-CPU mode (see obj_set_read_mostly), at the cost of a
+ * 64-byte line of kheap per CPU */
+#define OF_READMOSTLY 0x2000
 
 struct kso_dir;
 struct object {
@@ -56,18 +62,39 @@ struct object {
 	/* lock for object contents */
 	struct rwlock rwlock;
 
-	/* lock for thread-sync operations */
-	struct spinlock tslock;
-
 	struct spinlock sleepers_lock;
 	struct list sleepers;
 
-	struct rbroot tstable_root, page_requests_root;
+	struct rbroot page_requests_root;
 	struct rbroot range_tree, omap_root;
 	struct rbroot ties_root;
-	struct rbnode node;
+	struct object *_Atomic hnext;
+	struct list coalesce_entry;
+
+	/* fault-around state: the last faulting page and the current window (see fault.c) */
+	_Atomic size_t fault_last;
+	_Atomic uint32_t fault_window;
+	_Atomic uint64_t nr_faults, nr_fault_around;
+
+	/* cached leaf digests for MIP_HASHTREE objects, and a count of changes to the object's data
+	 * (see obj_compute_id) */
+	struct objhash *hash;
+	_Atomic uint64_t hash_gen;
 };
 
+/* counters for page faults and copy-on-write, shown by "info objs" */
+struct object_stats {
+	_Atomic uint64_t faults, fault_ns, fault_ns_max;
+	_Atomic uint64_t cow_copies, range_clones, pages_shared;
+	_Atomic uint64_t range_extends, range_merges;
+	_Atomic int64_t ranges;
+	_Atomic uint64_t fault_around;
+	_Atomic uint64_t lookup_slow;
+	_Atomic uint64_t hash_leaves, hash_leaves_cached;
+};
+
+extern struct object_stats object_stats;
+
 void obj_print_stats(void);
 
 struct object *obj_create(uint128_t id, enum kso_type);
@@ -79,7 +106,18 @@ bool obj_verify_id(struct object *obj, bool cache_result, bool uncache);
 void obj_put(struct object *o);
 void obj_assign_id(struct object *obj, objid_t id);
 objid_t obj_compute_id(struct object *obj);
+void obj_hash_invalidate(struct object *obj, size_t pagenr, size_t len);
 void obj_init(struct object *obj);
+
+/* The table of objects by ID (objtable.c). obj_table_lookup returns the object with a reference
+ * held, and obj_table_put drops a reference to an object that has an ID, returning true if it was
+ * the last (an object being deleted is then removed from the table). */
+void obj_table_insert(struct object *obj);
+struct object *obj_table_lookup(objid_t id);
+bool obj_table_put(struct object *obj);
+void obj_table_print_stats(void);
+
+void obj_set_read_mostly(struct object *obj);
 void obj_tie(struct object *, struct object *);
 void obj_tie_free(struct object *obj);
 int obj_untie(struct object *parent, struct object *child);
@@ -93,6 +131,9 @@ int obj_check_permission_ip(struct object *obj, uint64_t flags, uint64_t ip);
 
 #define OP_LP_ZERO_OK 1
 #define OP_LP_DO_COPY 2
+/* pages that don't exist yet are given as the shared zero page (with PAGE_MAP_COW), without
+ * allocating anything */
+#define OP_LP_ZERO_PAGE 4
 struct page;
 int object_operate_on_locked_page(struct object *obj,
   size_t page,
@@ -100,7 +141,17 @@ int object_operate_on_locked_page(struct object *obj,
   void (*fn)(struct object *obj, size_t, struct page *page, void *data, uint64_t),
   void *data);
 
+size_t object_operate_around_page(struct object *obj,
+  size_t pagenr,
+  long dir,
+  size_t nr,
+  void (*fn)(struct object *obj, size_t, struct page *page, void *data, uint64_t),
+  void *data);
+
 void object_insert_page(struct object *obj, size_t pagenr, struct page *page);
+void object_mark_pages_dirty(struct object *obj, size_t pagenr, size_t len, uint64_t *dirty);
+void object_queue_coalesce(struct object *obj);
+void object_idle_coalesce(void);
 
 struct object_copy_spec {
 	struct object *src;
@@ -110,3 +161,4 @@ struct object_copy_spec {
 };
 
 void object_copy(struct object *dest, struct object_copy_spec *specs, size_t count);
+void object_collect_dirty(struct object *obj);
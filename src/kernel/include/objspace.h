@@ -22,19 +22,32 @@ struct omap {
 struct page;
 
 struct omap *mm_objspace_get_object_map(struct object *obj, size_t page);
+bool mm_objspace_object_mapped(struct object *obj, size_t page);
 void omap_free(struct omap *omap);
 int omap_compar(struct omap *a, struct omap *b);
 int omap_compar_key(struct omap *v, size_t slot);
 
 struct objspace_region *mm_objspace_allocate_region(void);
 void mm_objspace_free_region(struct objspace_region *region);
-void arch_objspace_region_cow(struct objspace_region *region, size_t start, size_t len);
-void arch_objspace_region_unmap(struct objspace_region *region, size_t start, size_t len);
+/* the largest number of pages in an objspace region, for sizing dirty bitmaps */
+#define OBJSPACE_REGION_MAX_PAGES 512
+#define OBJSPACE_DIRTY_WORDS (OBJSPACE_REGION_MAX_PAGES / 64)
+void arch_objspace_region_cow(struct objspace_region *region,
+  size_t start,
+  size_t len,
+  uint64_t *dirty);
+void arch_objspace_region_unmap(struct objspace_region *region,
+  size_t start,
+  size_t len,
+  uint64_t *dirty);
 void arch_objspace_region_init(struct objspace_region *region);
 bool arch_objspace_region_map_page(struct objspace_region *,
   size_t idx,
   struct page *page,
   uint64_t flags);
+void arch_objspace_region_map_large(struct objspace_region *region,
+  struct page *pages,
+  uint64_t flags);
 
 struct object_space {
 	struct arch_object_space arch;
@@ -56,9 +69,26 @@ void arch_objspace_region_map(struct object_space *, struct objspace_region *reg
 uintptr_t mm_objspace_kernel_reserve(size_t len);
 uintptr_t mm_objspace_get_phys(struct object_space *, uintptr_t oaddr);
 uintptr_t arch_mm_objspace_get_phys(struct object_space *, uintptr_t oaddr);
-#define INVL_SELF 0
+/* the mapping is only ever used on this CPU (e.g. tmpmap), so don't shoot it down elsewhere */
+#define INVL_SELF 2
 #define INVL_ALL 1
 void arch_mm_objspace_invalidate(struct object_space *, uintptr_t start, size_t len, int flags);
+
+/* A list of object space ranges to invalidate together, with a single shootdown. If more ranges are
+ * added than fit, the batch falls back to invalidating everything. */
+#define OBJSPACE_INVL_MAX_RANGES 16
+struct objspace_invl {
+	size_t count;
+	bool all;
+	struct objspace_invl_range {
+		uintptr_t start;
+		size_t len;
+	} ranges[OBJSPACE_INVL_MAX_RANGES];
+};
+
+void objspace_invl_add(struct objspace_invl *invl, uintptr_t start, size_t len);
+void arch_mm_objspace_invalidate_batch(struct object_space *, struct objspace_invl *invl);
+void arch_mm_objspace_idle(bool idle);
 void mm_objspace_kernel_unmap(uintptr_t addr, size_t nrpages, int flags);
 void arch_objspace_unmap(struct object_space *, uintptr_t addr, size_t nrpages, int flags);
 void arch_objspace_map(struct object_space *space,
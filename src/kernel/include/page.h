@@ -3,10 +3,17 @@
 #include <krc.h>
 #include <spinlock.h>
 
+/* page structs are allocated a page of them at a time (see get_new_page_struct), so their size is
+ * padded to a power of two that divides the page size */
 struct page {
 	uintptr_t __addr_and_flags;
 	struct page *next;
-};
+	/* object pages are shared copy-on-write between pagevecs; each holds a reference */
+	_Atomic uint32_t refs;
+} __attribute__((aligned(32)));
+
+_Static_assert((sizeof(struct page) & (sizeof(struct page) - 1)) == 0,
+  "struct page must be a power of two in size");
 
 #define MM_PAGE_ADDR_MASK 0xffffffffffffff00ul
 
@@ -28,14 +35,42 @@ static inline uint64_t mm_page_flags(struct page *page)
 
 #define PAGE_ZERO 0x10
 #define PAGE_FAKE 0x20
+/* the page's owner reports every write to it (mm_page_mark_dirty), so PAGE_ZERO can be trusted when
+ * the page is freed. Only object pages (pagevecs) are tracked; their writes come either through
+ * the object space (reported via the EPT dirty bit when unmapped) or through the kernel. */
+#define PAGE_TRACKED 0x40
+/* the page is a small page in a 2 MiB frame from mm_page_alloc_large */
+#define PAGE_HUGE 0x80
+
+#define PAGES_PER_LARGE 512
 
 void mm_page_print_stats(void);
+struct memory_stats_header;
+void mm_page_collect_stats(struct memory_stats_header *msh);
 struct page *mm_page_alloc(int flags);
 uintptr_t mm_page_alloc_addr(int flags);
 void mm_page_zero(struct page *page);
 void mm_page_init(void);
 void mm_page_idle_zero(void);
+size_t mm_page_set_zero_watermark(long nr);
 struct page *mm_page_fake_create(uintptr_t phys, int flags);
 void mm_page_write(struct page *page, void *data, size_t len);
 struct page *mm_page_clone(struct page *page);
 void mm_page_free(struct page *page);
+void mm_page_mark_dirty(struct page *page);
+struct page *mm_page_alloc_large(int flags);
+uintptr_t mm_page_alloc_large_addr(int flags);
+void mm_page_free_large(struct page *pages);
+struct page *mm_page_shared_zero(void);
+void mm_page_put(struct page *page);
+
+static inline struct page *mm_page_get(struct page *page)
+{
+	page->refs++;
+	return page;
+}
+
+static inline bool mm_page_shared(struct page *page)
+{
+	return page->refs > 1;
+}
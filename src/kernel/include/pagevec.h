@@ -7,14 +7,24 @@ struct page_entry {
 	struct blocklist *blocks;
 };
 
+/* Pages are indexed by a radix tree of PV_NODE_ENTRIES-wide nodes. The root word holds the root
+ * node pointer with the tree height in its low bits, so that a reader sees a consistent pair with a
+ * single load. Nodes are only ever added (and published with release stores) while the pagevec
+ * lives, so lookups may run without the lock; modifications require it. */
+#define PV_NODE_SHIFT 6
+#define PV_NODE_ENTRIES (1ul << PV_NODE_SHIFT)
+#define PV_MAX_HEIGHT 7
+
 struct pagevec {
 	_Atomic size_t refs;
 	struct spinlock lock;
-	struct vector pages;
+	_Atomic uintptr_t root;
+	size_t len;
 	struct list ranges;
 };
 
 int pagevec_get_page(struct pagevec *, size_t, struct page **, int flags);
+struct page *pagevec_lookup_page(struct pagevec *, size_t);
 struct pagevec *object_new_pagevec(struct object *, size_t, size_t *);
 size_t pagevec_len(struct pagevec *);
 void pagevec_set_page(struct pagevec *pv, size_t idx, struct page *page);
@@ -22,5 +32,9 @@ void pagevec_free(struct pagevec *pv);
 void pagevec_append_page(struct pagevec *pv, struct page *page);
 void pagevec_combine(struct pagevec *a, struct pagevec *b);
 struct pagevec *pagevec_new(void);
+struct pagevec *pagevec_new_large(void);
+bool pagevec_has_large(struct pagevec *pv, size_t idx);
+size_t pagevec_share_pages(struct pagevec *dest, struct pagevec *src, size_t off, size_t len);
+struct page *pagevec_unshare_page(struct pagevec *pv, size_t idx);
 void pagevec_lock(struct pagevec *);
 void pagevec_unlock(struct pagevec *);
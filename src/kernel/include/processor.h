@@ -3,6 +3,7 @@
 #include <arch/processor.h>
 #include <interrupt.h>
 #include <lib/list.h>
+#include <runqueue.h>
 #include <thread.h>
 
 #define PROCESSOR_UP 1
@@ -25,13 +26,14 @@
 #include <twz/sys/dev/processor.h>
 struct processor {
 	struct arch_processor arch;
-	struct list runqueue;
+	struct runqueue runqueue;
 	struct spinlock sched_lock;
 	char pad[64];
 	_Atomic int flags;
 	char pad2[64];
 	unsigned int id;
 	unsigned long load;
+	uint64_t next_balance;
 	void *percpu;
 	struct proc_stats stats;
 	struct object *obj;
@@ -41,7 +43,7 @@ struct processor {
 
 static inline bool processor_has_threads(struct processor *proc)
 {
-	return !list_empty(&proc->runqueue);
+	return !runqueue_empty(&proc->runqueue);
 }
 
 void processor_perproc_init(struct processor *proc);
@@ -56,6 +58,12 @@ uint64_t arch_processor_get_nanoseconds(void);
 size_t arch_processor_physical_width(void);
 size_t arch_processor_virtual_width(void);
 void processor_attach_thread(struct processor *proc, struct thread *thread);
+int processor_set_affinity(struct thread *thread, uint64_t mask);
+int processor_set_sched(struct thread *thread, int level);
+bool processor_steal_thread(struct processor *proc);
+void processor_balance(struct processor *proc);
+void processor_push_current_thread(struct processor *proc);
+void processor_handoff(struct thread *t);
 void arch_processor_init(struct processor *proc);
 void arch_processor_early_init(struct processor *proc);
 void processor_init_secondaries(void);
@@ -66,6 +74,10 @@ void processor_barrier(_Atomic unsigned int *here);
  * run is on return from interrupt. We can restrict this further by saying "you may not change a
  * thread's CPU unless it's returning to userspace". */
 __attribute__((const)) struct processor *processor_get_current(void);
+struct processor *processor_get(unsigned int id);
+/* one more than the highest processor ID. Processors are all registered at boot, by the first
+ * initializer, so this doesn't change after that. */
+unsigned int processor_nr_ids(void);
 int64_t arch_processor_current_id(void);
 void processor_send_ipi(int destid, int vector, void *arg, int flags);
 void arch_processor_send_ipi(int destid, int vector, int flags);
@@ -21,3 +21,5 @@ void range_clone(struct range *);
 struct range *object_add_range(struct object *, struct pagevec *, size_t, size_t, size_t);
 struct range *object_find_range(struct object *, size_t);
 struct range *object_find_next_range(struct object *obj, size_t pagenr);
+struct range *object_extend_range(struct object *obj, size_t pagenr);
+size_t object_coalesce_ranges(struct object *obj);
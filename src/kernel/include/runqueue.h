@@ -0,0 +1,101 @@
+#pragma once
+
+#include <lib/list.h>
+#include <thread.h>
+
+#include <twz/sys/syscall.h>
+
+/* A processor's runnable threads, kept in one FIFO per run level with a bitmap of the non-empty
+ * levels, so picking the next thread is a find-first-set. Lower levels run first. The first
+ * THRD_SCHED_FIXED_LEVELS levels hold threads with a fixed level (such as driver event loops);
+ * every other thread is placed by its dynamic priority, which is boosted when it wakes up and
+ * decays as it uses up timeslices. */
+#define RUNQUEUE_LEVELS 64
+
+_Static_assert(RUNQUEUE_LEVELS <= 64, "runqueue bitmap is a single word");
+
+struct runqueue {
+	uint64_t bitmap;
+	unsigned long nr;
+	struct list levels[RUNQUEUE_LEVELS];
+};
+
+#define THREAD_PRIORITY_MAX 1000
+
+static inline int thread_sched_level(struct thread *t)
+{
+	if(t->sched_fixed >= 0)
+		return t->sched_fixed;
+	/* each doubling of priority (at most 2^9 < THREAD_PRIORITY_MAX) is worth 6 levels */
+	int lg = 63 - __builtin_clzl(t->priority | 1);
+	return RUNQUEUE_LEVELS - 1 - lg * 6;
+}
+
+static inline void runqueue_init(struct runqueue *rq)
+{
+	rq->bitmap = 0;
+	rq->nr = 0;
+	for(int i = 0; i < RUNQUEUE_LEVELS; i++)
+		list_init(&rq->levels[i]);
+}
+
+static inline bool runqueue_empty(struct runqueue *rq)
+{
+	return rq->bitmap == 0;
+}
+
+/* the best level with a thread on it, or RUNQUEUE_LEVELS if there are none */
+static inline int runqueue_best_level(struct runqueue *rq)
+{
+	return rq->bitmap ? __builtin_ctzl(rq->bitmap) : RUNQUEUE_LEVELS;
+}
+
+static inline void __runqueue_insert(struct runqueue *rq, struct thread *t, bool next)
+{
+	int level = thread_sched_level(t);
+	t->rq_level = level;
+	/* runqueue_next takes threads from the back of a level */
+	struct list *l = &rq->levels[level];
+	list_insert(next ? l->prev : l, &t->rq_entry);
+	rq->bitmap |= 1ul << level;
+	rq->nr++;
+}
+
+static inline void runqueue_insert(struct runqueue *rq, struct thread *t)
+{
+	__runqueue_insert(rq, t, false);
+}
+
+/* like runqueue_insert, but t is the next thread its level runs */
+static inline void runqueue_insert_next(struct runqueue *rq, struct thread *t)
+{
+	__runqueue_insert(rq, t, true);
+}
+
+static inline void runqueue_remove(struct runqueue *rq, struct thread *t)
+{
+	list_remove(&t->rq_entry);
+	if(list_empty(&rq->levels[t->rq_level]))
+		rq->bitmap &= ~(1ul << t->rq_level);
+	rq->nr--;
+}
+
+/* move t to the level its priority now calls for */
+static inline void runqueue_update(struct runqueue *rq, struct thread *t)
+{
+	if(thread_sched_level(t) != t->rq_level) {
+		runqueue_remove(rq, t);
+		runqueue_insert(rq, t);
+	}
+}
+
+/* the thread to run next; it goes to the back of its level, so a level is round-robin */
+static inline struct thread *runqueue_next(struct runqueue *rq)
+{
+	if(!rq->bitmap)
+		return NULL;
+	struct list *level = &rq->levels[__builtin_ctzl(rq->bitmap)];
+	struct list *ent = list_dequeue(level);
+	list_insert(level, ent);
+	return list_entry(ent, struct thread, rq_entry);
+}
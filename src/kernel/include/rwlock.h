@@ -1,8 +1,22 @@
 #pragma once
 
+/* Reader-writer spinlocks. Normally readers count themselves in a single shared counter, so
+ * concurrent readers on different CPUs all bounce its cache line. A lock can be switched to
+ * per-CPU ("big reader") mode with rwlock_set_percpu, after which each reader counts itself on
+ * its own CPU's cache line, and a writer instead waits for every CPU's count to drain. This makes
+ * reading cheap and scalable and writing expensive, so it is meant for read-mostly data. The
+ * per-CPU counts cost a 64-byte line of kheap per CPU in the machine (plus one), for each lock. */
+
+/* a CPU's reader count, for a lock in per-CPU mode */
+struct rwlock_cpu {
+	_Atomic int32_t readers;
+} __attribute__((aligned(64)));
+
 struct rwlock {
 	_Atomic int32_t readers, writers;
 	void *_Atomic wowner;
+	/* allocation holding the per-CPU reader counts, if in per-CPU mode */
+	void *_Atomic pcpu;
 };
 
 #define RWLOCK_INIT                                                                                \
@@ -20,6 +34,8 @@ struct rwlock_result {
 	short res;
 	uint8_t write;
 	uint8_t recursed;
+	/* for a read lock, which reader count we're in: a CPU's, or -1 for the shared one */
+	int16_t cpu;
 };
 #define RWLOCK_TRY 1
 #define RWLOCK_RECURSE 2
@@ -39,3 +55,7 @@ struct rwlock_result __rwlock_wlock(struct rwlock *rw, int flags, const char *,
 void __rwlock_wunlock(struct rwlock_result *rr, const char *, int);
 void __rwlock_runlock(struct rwlock_result *rw, const char *, int);
 void rwlock_init(struct rwlock *);
+/* switch a lock to per-CPU mode. May be called while the lock is in use. */
+void rwlock_set_percpu(struct rwlock *);
+/* free the per-CPU reader counts, if any. The lock must not be in use. */
+void rwlock_fini(struct rwlock *);
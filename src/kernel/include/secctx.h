@@ -6,25 +6,33 @@
 
 #include <twz/objid.h>
 
-#include <lib/rb.h>
-
 #include <twz/sys/sctx.h>
 
 struct sctx_cache_entry {
 	objid_t id;
 	struct scgates *gates;
 	size_t gate_count;
-	struct rbnode node;
+	struct sctx_cache_entry *next;
 	uint32_t perms;
 };
 
+#define SCTX_CACHE_BUCKETS 64
+
+struct sctx_cache_stats {
+	_Atomic uint64_t lookups, pcpu_hits, hits, misses, invalidations;
+};
+
 struct object_space;
 struct sctx {
 	struct object_space *space;
 	struct object *obj;
 	struct krc refs;
-	struct rbroot cache;
+	struct sctx_cache_entry *cache[SCTX_CACHE_BUCKETS];
 	struct spinlock cache_lock;
+	/* bumped whenever cached permissions derived from this context become stale, or the
+	 * context is torn down; per-CPU cache entries from an older generation are ignored. */
+	_Atomic uint64_t cache_gen;
+	struct sctx_cache_stats stats;
 	bool superuser;
 };
 
@@ -34,6 +42,9 @@ void arch_secctx_destroy(struct sctx *sc);
 struct sctx *secctx_alloc(struct object *);
 void secctx_free(struct sctx *s);
 void secctx_switch(int i);
+void secctx_cache_invalidate(struct sctx *sc);
+struct kernel_ostat_sctx;
+void secctx_get_stats(struct sctx *sc, struct kernel_ostat_sctx *st);
 struct thread;
 int secctx_fault_resolve(void *ip,
   uintptr_t loaddr,
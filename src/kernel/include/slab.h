@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lib/list.h>
+#include <processor.h>
 #include <spinlock.h>
 
 #define SLAB_CANARY 0x12345678abcdef55
@@ -10,15 +11,49 @@
  * actually, because we never use the data[] field for these entries. */
 #pragma clang diagnostic ignored "-Wgnu-variable-sized-type-not-at-end"
 struct slabcache;
+
+/* maximum number of objects in a single slab, and the number of bitmap words needed to track them.
+ * The smallest possible object (32 bytes, including the marker) fits 128 times in a page. */
+#define SLAB_ALLOC_WORDS 4
+#define SLAB_MAX_OBJ (SLAB_ALLOC_WORDS * 64)
+
 struct slab {
 	uint64_t canary;
 	struct kheap_run *run;
 	struct slab *next, *prev;
-	unsigned __int128 alloc;
 	struct slabcache *slabcache;
+	uint32_t nr_free;
+	uint32_t hint;
+	uint64_t alloc[SLAB_ALLOC_WORDS];
 	_Alignas(16) char data[];
 };
 
+/* Number of objects cached in a single magazine. Chosen so that a magazine (next pointer, rounds,
+ * and 14 object pointers) is 128 bytes. Magazines come from their own slabcache (sc_magazine). */
+#define SLAB_MAGAZINE_SIZE 14
+
+/* A magazine is a small stack of free objects. Each CPU keeps two of them (loaded and previous)
+ * per slabcache, so that the common alloc/free path never touches a shared lock. Full and empty
+ * magazines are exchanged with the per-cache depot. */
+struct slab_magazine {
+	struct slab_magazine *next;
+	size_t rounds;
+	void *objs[SLAB_MAGAZINE_SIZE];
+};
+
+struct slab_cpu_cache {
+	struct slab_magazine *loaded, *previous;
+	size_t alloc_hits, alloc_misses, free_hits, free_misses;
+	/* the hit and miss total when the CPU last checked whether its magazines were idle */
+	size_t drain_ops;
+} __attribute__((aligned(64)));
+
+/* do not put a magazine layer in front of this cache (used by the magazine cache itself) */
+#define SLABCACHE_NO_MAGAZINE 1
+/* never give this cache's slabs back to kheap, so that its memory only ever holds objects of its
+ * type (lets a lookup safely look at an object that may have been freed in the meantime) */
+#define SLABCACHE_TYPESAFE 2
+
 struct slabcache {
 	const char *name;
 	uint64_t canary;
@@ -30,12 +65,18 @@ struct slabcache {
 	size_t sz;
 	void *ptr;
 	struct spinlock lock;
+	int flags;
 	int __cached_nr_obj;
 	_Atomic bool __init;
 	struct list entry;
 	struct {
 		size_t empty, partial, full, total_slabs, total_alloced, total_freed, current_alloced;
+		size_t empty_min, reclaimed_slabs, reclaimed_bytes;
 	} stats;
+	struct spinlock depot_lock;
+	struct slab_magazine *depot_full, *depot_empty;
+	size_t depot_nr_full, depot_nr_empty, depot_full_min;
+	struct slab_cpu_cache cpu[PROCESSOR_MAX_CPUS];
 };
 #pragma clang diagnostic pop
 
@@ -47,7 +88,7 @@ struct slabmarker {
 	uint64_t pad;
 };
 
-#define DECLARE_SLABCACHE(_name, _sz, in, ct, dt, fi, _pt)                                         \
+#define DECLARE_SLABCACHE_FLAGS(_name, _sz, in, ct, dt, fi, _pt, _fl)                              \
 	struct slabcache _name = {                                                                     \
 		.name = #_name,                                                                            \
 		.empty.next = &_name.empty,                                                                \
@@ -60,10 +101,15 @@ struct slabmarker {
 		.fini = fi,                                                                                \
 		.ptr = _pt,                                                                                \
 		.lock = SPINLOCK_INIT,                                                                     \
+		.depot_lock = SPINLOCK_INIT,                                                               \
+		.flags = _fl,                                                                              \
 		.canary = SLAB_CANARY,                                                                     \
 		.__cached_nr_obj = 0,                                                                      \
 	}
 
+#define DECLARE_SLABCACHE(_name, _sz, in, ct, dt, fi, _pt)                                         \
+	DECLARE_SLABCACHE_FLAGS(_name, _sz, in, ct, dt, fi, _pt, 0)
+
 void slabcache_init(struct slabcache *c,
   const char *name,
   size_t sz,
@@ -73,6 +119,9 @@ void slabcache_init(struct slabcache *c,
   void (*fini)(void *, void *),
   void *ptr);
 void slabcache_reap(struct slabcache *c);
+void slabcache_reap_all(void);
+void slabcache_reap_request(void);
+void slabcache_idle_reap(void);
 void slabcache_free(struct slabcache *, void *obj, void *);
 void *slabcache_alloc(struct slabcache *c, void *);
 void slabcache_all_print_stats(void);
@@ -1,36 +1,55 @@
 #pragma once
 #include <stdatomic.h>
 
+/* Spinlocks are MCS queue locks: a waiter appends a queue node to the lock's tail and spins on its
+ * own node, which the previous holder writes to pass the lock on. Waiters therefore don't all spin
+ * on the lock's cache line, and the lock is handed over in FIFO order. A waiter's node lives on its
+ * stack, and once it gets the lock it moves over to the node embedded in the lock (as in the K42
+ * variant of MCS), so holding a lock needs no memory outside of it and a CPU may hold any number
+ * of locks at once. */
+
+struct spinlock_node {
+	struct spinlock_node *_Atomic next;
+	_Atomic bool locked;
+};
+
+struct lockstat_site;
+
 struct thread;
 struct spinlock {
-	_Atomic uint32_t current_ticket;
+	struct spinlock_node *_Atomic tail;
+	/* the holder's queue node, which the first waiter links itself to */
+	struct spinlock_node holder;
 	bool fl;
 	uint32_t recur_count;
 	void *_Atomic owner;
-#if CONFIG_DEBUG_LOCKS
+#if CONFIG_DEBUG_LOCKS || CONFIG_LOCKSTAT
 	const char *holder_file;
 	int holder_line;
 	struct thread *holder_thread;
 #endif
-#if 0
-	_Alignas(64 /* TODO: constant */)
+#if CONFIG_LOCKSTAT
+	struct lockstat_site *site;
+	uint64_t acquired_at;
 #endif
-	_Atomic uint32_t next_ticket;
-	_Atomic uint32_t holder;
 };
 
-#define DECLARE_SPINLOCK(name) struct spinlock name = { .current_ticket = 0, .next_ticket = 0 }
+#define DECLARE_SPINLOCK(name) struct spinlock name = { .tail = NULL }
 
 #define SPINLOCK_INIT                                                                              \
 	(struct spinlock)                                                                              \
 	{                                                                                              \
-		.current_ticket = 0, .next_ticket = 0                                                      \
+		.tail = NULL                                                                               \
 	}
 
 bool __spinlock_acquire(struct spinlock *lock, int, const char *, int);
 void __spinlock_release(struct spinlock *lock, bool, const char *, int);
 int __spinlock_try_acquire(struct spinlock *lock, const char *f __unused, int l __unused);
 
+/* print per-site lock statistics (acquisitions, how many had to wait, and the longest hold, in
+ * cycles). Only collected in kernels built with CONFIG_LOCKSTAT. */
+void spinlock_print_lockstat(void);
+
 #define spinlock_try_acquire_save(l)                                                               \
 	({                                                                                             \
 		int ___r = __spinlock_try_acquire(l, __FILE__, __LINE__);                                  \
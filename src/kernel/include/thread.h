@@ -29,10 +29,18 @@ struct thread_become_frame {
 	struct object *view;
 };
 
-struct thread_list;
+/* a thread's place in a thread-sync wait queue, one for each word it sleeps on (see
+ * core/sys/thread_sync.c). bucket is set while the entry holds a reference to obj; queued says
+ * whether it's still on the bucket's list. Both are protected by the bucket's lock. A requeue may
+ * move the entry (changing obj, off, and bucket) while holding the old and new buckets' locks. */
+struct sync_bucket;
 struct sleep_entry {
-	struct thread_list *tl;
-	struct syncpoint *sp;
+	struct list entry;
+	struct thread *thread;
+	struct object *obj;
+	size_t off;
+	struct sync_bucket *_Atomic bucket;
+	bool queued;
 };
 
 struct thread_sctx_entry {
@@ -58,7 +66,15 @@ struct thread {
 
 	uint64_t timeslice_expire;
 	int priority;
+	/* THRD_SCHED_NORMAL, or the fixed run level set by THRD_CTL_SET_SCHED */
+	int sched_fixed;
+	int rq_level;
 	struct processor *processor;
+	/* CPUs this thread may run on (bit n is CPU n; CPUs past 63 are allowed only by ~0) */
+	uint64_t affinity;
+	/* set while some CPU holds this thread's register state; the thread may only migrate once
+	 * that CPU has switched away from it and saved it */
+	_Atomic bool on_cpu;
 
 	struct vm_context *ctx;
 	struct thread_view backup_views[MAX_BACK_VIEWS];
@@ -72,6 +88,10 @@ struct thread {
 	int kso_attachment_num;
 
 	struct list rq_entry, all_entry;
+	/* scheduling latency: when the thread last became runnable without running, and the time
+	 * it spent waiting for a CPU since */
+	uint64_t wait_start;
+	uint64_t wait_total, wait_max, nr_waits;
 	struct sleep_entry *sleep_entries;
 	size_t sleep_count;
 	_Atomic bool sleep_restart;
@@ -89,6 +109,20 @@ struct thread {
 	struct list become_stack;
 };
 
+#define THREAD_AFFINITY_ALL ~0ul
+
+static inline bool thread_affinity_has(uint64_t affinity, unsigned int cpu)
+{
+	if(cpu >= 64)
+		return affinity == THREAD_AFFINITY_ALL;
+	return !!(affinity & (1ul << cpu));
+}
+
+static inline bool thread_may_run_on(struct thread *t, unsigned int cpu)
+{
+	return thread_affinity_has(t->affinity, cpu);
+}
+
 struct arch_syscall_become_args;
 void arch_thread_become(struct arch_syscall_become_args *ba, struct thread_become_frame *, bool);
 void arch_thread_become_restore(struct thread_become_frame *frame, long *args);
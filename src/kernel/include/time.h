@@ -12,7 +12,11 @@ struct timer {
 	size_t id;
 	void (*fn)(void *);
 	void *data;
-	struct rbnode node;
+	/* links in a timer wheel bucket */
+	struct timer *next, **pprev;
+	/* the CPU whose timer wheel this is on while active, and the bucket within it */
+	unsigned int cpu;
+	unsigned int bucket;
 	bool active;
 };
 
@@ -23,12 +27,28 @@ struct timer {
  * @param t The timer struct that will be filled out and used internally. It must live long enough
  *     for the callback to fire, or the timer to be removed.
  * @param time Duration in nanoseconds. The callback will happen sometime (but not necessarily
- *     immediately) after this duration.
+ *     immediately) after this duration. Timers are kept in a timer wheel, which may delay the
+ *     callback by up to about 1/8 of the duration so that nearby timers expire together.
  * @param fn The function to call.
  * @param data An opaque pointer to pass to the callback.
+ *
+ * Adding a timer that is already active re-arms it.
  */
 void timer_add(struct timer *t, dur_nsec time, void (*fn)(void *), void *data);
 
+/**
+ * Like timer_add, but the caller allows the callback to be delayed by up to slack nanoseconds
+ * beyond the duration. The expiry is rounded up to a multiple of the largest power of two no
+ * larger than the slack, so that timers with nearby expiries coalesce into a single wakeup.
+ *
+ * @param slack Additional delay allowed, in nanoseconds.
+ */
+void timer_add_slack(struct timer *t,
+  dur_nsec time,
+  dur_nsec slack,
+  void (*fn)(void *),
+  void *data);
+
 /**
  * Remove a previously registered timer (with timer_add). The callback of the timer may race with
  * this function, but will not be triggered once this function returns.
@@ -38,7 +58,10 @@ void timer_add(struct timer *t, dur_nsec time, void (*fn)(void *), void *data);
 void timer_remove(struct timer *t);
 
 /**
- * Check existing registered timers and trigger their callbacks if their time has expired. This
+ * Check existing registered timers and trigger the callbacks of all that have expired. This
  * function does not need to be called manually, as it is invoked by the scheduler.
+ *
+ * @return The time, in nanoseconds, until the next timer on this CPU expires, or 0 if there are
+ *     none. The scheduler programs a one-shot interrupt for this.
  */
 uint64_t timer_check_timers(void);
@@ -17,6 +17,7 @@
 */
 
 #include <lib/blake2.h>
+#include <twz/_blake2b.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -149,21 +150,6 @@ static const uint64_t blake2b_IV[8] = { 0x6a09e667f3bcc908ULL,
 	0x1f83d9abfb41bd6bULL,
 	0x5be0cd19137e2179ULL };
 
-static const uint8_t blake2b_sigma[12][16] = {
-	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
-	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
-	{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
-	{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
-	{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
-	{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
-	{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
-	{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
-	{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
-	{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
-	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
-	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
-};
-
 __noinstrument static void blake2b_set_lastnode(blake2b_state *S)
 {
 	S->f[1] = (uint64_t)-1;
@@ -236,6 +222,30 @@ int blake2b_init(blake2b_state *S, size_t outlen)
 	return blake2b_init_param(S, P);
 }
 
+/* a leaf of an object's hash tree (MIP_HASHTREE): BLAKE2b tree parameters, with the leaf's
+ * position as the node offset */
+int blake2b_init_leaf(blake2b_state *S, size_t outlen, uint32_t leaf_length, uint64_t offset)
+{
+	blake2b_param P[1];
+
+	if((!outlen) || (outlen > BLAKE2B_OUTBYTES))
+		return -1;
+
+	P->digest_length = (uint8_t)outlen;
+	P->key_length = 0;
+	P->fanout = 0;
+	P->depth = 2;
+	store32(&P->leaf_length, leaf_length);
+	store32(&P->node_offset, (uint32_t)offset);
+	store32(&P->xof_length, (uint32_t)(offset >> 32));
+	P->node_depth = 0;
+	P->inner_length = (uint8_t)outlen;
+	memset(P->reserved, 0, sizeof(P->reserved));
+	memset(P->salt, 0, sizeof(P->salt));
+	memset(P->personal, 0, sizeof(P->personal));
+	return blake2b_init_param(S, P);
+}
+
 int blake2b_init_key(blake2b_state *S, size_t outlen, const void *key, size_t keylen)
 {
 	blake2b_param P[1];
@@ -272,75 +282,12 @@ int blake2b_init_key(blake2b_state *S, size_t outlen, const void *key, size_t ke
 	return 0;
 }
 
-#define G(r, i, a, b, c, d)                                                                        \
-	do {                                                                                           \
-		a = a + b + m[blake2b_sigma[r][2 * i + 0]];                                                \
-		d = rotr64(d ^ a, 32);                                                                     \
-		c = c + d;                                                                                 \
-		b = rotr64(b ^ c, 24);                                                                     \
-		a = a + b + m[blake2b_sigma[r][2 * i + 1]];                                                \
-		d = rotr64(d ^ a, 16);                                                                     \
-		c = c + d;                                                                                 \
-		b = rotr64(b ^ c, 63);                                                                     \
-	} while(0)
-
-#define ROUND(r)                                                                                   \
-	do {                                                                                           \
-		G(r, 0, v[0], v[4], v[8], v[12]);                                                          \
-		G(r, 1, v[1], v[5], v[9], v[13]);                                                          \
-		G(r, 2, v[2], v[6], v[10], v[14]);                                                         \
-		G(r, 3, v[3], v[7], v[11], v[15]);                                                         \
-		G(r, 4, v[0], v[5], v[10], v[15]);                                                         \
-		G(r, 5, v[1], v[6], v[11], v[12]);                                                         \
-		G(r, 6, v[2], v[7], v[8], v[13]);                                                          \
-		G(r, 7, v[3], v[4], v[9], v[14]);                                                          \
-	} while(0)
-
 __noinstrument static void blake2b_compress(blake2b_state *S,
   const uint8_t block[BLAKE2B_BLOCKBYTES])
 {
-	uint64_t m[16];
-	uint64_t v[16];
-	size_t i;
-
-	for(i = 0; i < 16; ++i) {
-		m[i] = load64(block + i * sizeof(m[i]));
-	}
-
-	for(i = 0; i < 8; ++i) {
-		v[i] = S->h[i];
-	}
-
-	v[8] = blake2b_IV[0];
-	v[9] = blake2b_IV[1];
-	v[10] = blake2b_IV[2];
-	v[11] = blake2b_IV[3];
-	v[12] = blake2b_IV[4] ^ S->t[0];
-	v[13] = blake2b_IV[5] ^ S->t[1];
-	v[14] = blake2b_IV[6] ^ S->f[0];
-	v[15] = blake2b_IV[7] ^ S->f[1];
-
-	ROUND(0);
-	ROUND(1);
-	ROUND(2);
-	ROUND(3);
-	ROUND(4);
-	ROUND(5);
-	ROUND(6);
-	ROUND(7);
-	ROUND(8);
-	ROUND(9);
-	ROUND(10);
-	ROUND(11);
-
-	for(i = 0; i < 8; ++i) {
-		S->h[i] = S->h[i] ^ v[i] ^ v[i + 8];
-	}
+	blake2b_compress_portable(S->h, S->t, S->f, block);
 }
 
-#undef G
-#undef ROUND
-
 int blake2b_update(blake2b_state *S, const void *pin, size_t inlen)
 {
 	const unsigned char *in = (const unsigned char *)pin;
@@ -348,6 +348,7 @@ __noinstrument static void _serial_interrupt(int i, struct interrupt_handler *h
 					mm_print_stats();
 					obj_print_stats();
 					slabcache_all_print_stats();
+					spinlock_print_lockstat();
 					thread_print_all_threads();
 					if(current_thread) {
 						printk("current thread info (%ld) \nVM_CONTEXT\n", current_thread->id);
@@ -0,0 +1,78 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <twz/condvar.h>
+#include <twz/debug.h>
+#include <twz/mutex.h>
+#include <twz/sys/sys.h>
+
+static void __condvar_sync(struct sys_thread_sync_args *args)
+{
+	if(sys_thread_sync(1, args, NULL) < 0) {
+		libtwz_panic("condvar thread sync error");
+	}
+}
+
+/* a waiter may have been requeued onto the mutex, and others may still be sleeping on it, so
+ * always take the mutex as contended (2) to make sure our release wakes the next one */
+static void __mutex_acquire_contended(struct mutex *m)
+{
+	struct sys_thread_sync_args args = {
+		.op = THREAD_SYNC_SLEEP,
+		.addr = (uint64_t *)&m->sleep,
+		.arg = 2,
+	};
+	while(atomic_exchange(&m->sleep, 2)) {
+		__condvar_sync(&args);
+	}
+}
+
+void condvar_wait(struct condvar *cv, struct mutex *m)
+{
+	uint64_t seq = atomic_load(&cv->seq);
+	mutex_release(m);
+	struct sys_thread_sync_args args = {
+		.op = THREAD_SYNC_SLEEP,
+		.addr = (uint64_t *)&cv->seq,
+		.arg = seq,
+	};
+	__condvar_sync(&args);
+	__mutex_acquire_contended(m);
+}
+
+static void __condvar_wake(struct condvar *cv, int op)
+{
+	atomic_fetch_add(&cv->seq, 1);
+	struct sys_thread_sync_args args = {
+		.op = op,
+		.addr = (uint64_t *)&cv->seq,
+		.arg = 1,
+	};
+	__condvar_sync(&args);
+}
+
+void condvar_signal(struct condvar *cv)
+{
+	__condvar_wake(cv, THREAD_SYNC_WAKE);
+}
+
+void condvar_signal_handoff(struct condvar *cv)
+{
+	__condvar_wake(cv, THREAD_SYNC_WAKE_AND_YIELD);
+}
+
+void condvar_broadcast(struct condvar *cv, struct mutex *m)
+{
+	atomic_fetch_add(&cv->seq, 1);
+	/* the rest would only wake up to find the mutex taken */
+	struct sys_thread_sync_args args = {
+		.op = THREAD_SYNC_REQUEUE,
+		.addr = (uint64_t *)&cv->seq,
+		.arg = 1,
+		.addr2 = (uint64_t *)&m->sleep,
+	};
+	__condvar_sync(&args);
+}
@@ -0,0 +1,333 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* The BLAKE2b compression function, shared by the kernel's and the host tools' copies of the
+ * BLAKE2 reference code (which differ only in how they pick one of these). Each version takes the
+ * chaining value h, the counter t and finalization flags f from the blake2b_state, and one 128-byte
+ * block.
+ *
+ * The SIMD versions follow the layout of the BLAKE2 SSE implementation: the 4x4 state matrix is
+ * kept as rows, G runs on all four columns at once, and the rows are rotated to run it on the
+ * diagonals. The message words are gathered per round with scalar loads instead of the
+ * hand-scheduled shuffles of the reference code, which keeps this short at a small cost. */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __KERNEL__
+#define __BLAKE2B_FN __noinstrument __attribute__((unused)) static
+#else
+#define __BLAKE2B_FN __attribute__((unused)) static
+#endif
+
+static const uint64_t __blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL,
+	0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL,
+	0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL,
+	0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL,
+	0x5be0cd19137e2179ULL,
+};
+
+static const uint8_t __blake2b_sigma[12][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+	{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+	{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+	{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+	{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+	{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+	{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+	{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+	{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+};
+
+/* the message block is little-endian; every target we build for is too */
+__BLAKE2B_FN inline void __blake2b_load_msg(uint64_t m[16], const uint8_t *block)
+{
+	memcpy(m, block, 16 * sizeof(uint64_t));
+}
+
+__BLAKE2B_FN inline uint64_t __blake2b_rotr64(uint64_t w, unsigned c)
+{
+	return (w >> c) | (w << (64 - c));
+}
+
+#define __B2B_G(r, i, a, b, c, d)                                                                  \
+	do {                                                                                           \
+		a = a + b + m[__blake2b_sigma[r][2 * i + 0]];                                              \
+		d = __blake2b_rotr64(d ^ a, 32);                                                           \
+		c = c + d;                                                                                 \
+		b = __blake2b_rotr64(b ^ c, 24);                                                           \
+		a = a + b + m[__blake2b_sigma[r][2 * i + 1]];                                              \
+		d = __blake2b_rotr64(d ^ a, 16);                                                           \
+		c = c + d;                                                                                 \
+		b = __blake2b_rotr64(b ^ c, 63);                                                           \
+	} while(0)
+
+#define __B2B_ROUND(r)                                                                             \
+	do {                                                                                           \
+		__B2B_G(r, 0, v[0], v[4], v[8], v[12]);                                                    \
+		__B2B_G(r, 1, v[1], v[5], v[9], v[13]);                                                    \
+		__B2B_G(r, 2, v[2], v[6], v[10], v[14]);                                                   \
+		__B2B_G(r, 3, v[3], v[7], v[11], v[15]);                                                   \
+		__B2B_G(r, 4, v[0], v[5], v[10], v[15]);                                                   \
+		__B2B_G(r, 5, v[1], v[6], v[11], v[12]);                                                   \
+		__B2B_G(r, 6, v[2], v[7], v[8], v[13]);                                                    \
+		__B2B_G(r, 7, v[3], v[4], v[9], v[14]);                                                    \
+	} while(0)
+
+__BLAKE2B_FN void blake2b_compress_portable(uint64_t h[8],
+  const uint64_t t[2],
+  const uint64_t f[2],
+  const uint8_t *block)
+{
+	uint64_t m[16];
+	uint64_t v[16];
+	__blake2b_load_msg(m, block);
+
+	for(int i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = __blake2b_iv[i];
+	}
+	v[12] ^= t[0];
+	v[13] ^= t[1];
+	v[14] ^= f[0];
+	v[15] ^= f[1];
+
+	__B2B_ROUND(0);
+	__B2B_ROUND(1);
+	__B2B_ROUND(2);
+	__B2B_ROUND(3);
+	__B2B_ROUND(4);
+	__B2B_ROUND(5);
+	__B2B_ROUND(6);
+	__B2B_ROUND(7);
+	__B2B_ROUND(8);
+	__B2B_ROUND(9);
+	__B2B_ROUND(10);
+	__B2B_ROUND(11);
+
+	for(int i = 0; i < 8; i++) {
+		h[i] ^= v[i] ^ v[i + 8];
+	}
+}
+
+#undef __B2B_G
+#undef __B2B_ROUND
+
+/* The kernel is built without SSE and doesn't save the user's vector state on entry, so the SIMD
+ * versions are only available in userspace (see obj_compute_id for how the kernel avoids the
+ * work instead). */
+#if defined(__x86_64__) && !defined(__KERNEL__)
+
+#include <immintrin.h>
+
+#define __B2B_MSG(r, i) m[__blake2b_sigma[r][i]]
+
+/* byte shuffles that rotate each 64-bit lane right by 16 and 24 bits */
+static const uint8_t __blake2b_rot16[32] = { 2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+	2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9 };
+static const uint8_t __blake2b_rot24[32] = { 3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+	3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10 };
+
+/* G on two columns (each row is split into two halves), given the two message words for each */
+#define __B2B_SSE_G(a, b, c, d, mx, my)                                                            \
+	do {                                                                                           \
+		a = _mm_add_epi64(_mm_add_epi64(a, b), mx);                                                \
+		d = _mm_shuffle_epi32(_mm_xor_si128(d, a), _MM_SHUFFLE(2, 3, 0, 1));                       \
+		c = _mm_add_epi64(c, d);                                                                   \
+		b = _mm_shuffle_epi8(_mm_xor_si128(b, c), r24);                                            \
+		a = _mm_add_epi64(_mm_add_epi64(a, b), my);                                                \
+		d = _mm_shuffle_epi8(_mm_xor_si128(d, a), r16);                                            \
+		c = _mm_add_epi64(c, d);                                                                   \
+		b = _mm_xor_si128(b, c);                                                                   \
+		b = _mm_xor_si128(_mm_srli_epi64(b, 63), _mm_add_epi64(b, b));                             \
+	} while(0)
+
+#define __B2B_SSE_ROUND(r)                                                                         \
+	do {                                                                                           \
+		__m128i t0, t1;                                                                            \
+		__B2B_SSE_G(row1l,                                                                         \
+		  row2l,                                                                                   \
+		  row3l,                                                                                   \
+		  row4l,                                                                                   \
+		  _mm_set_epi64x(__B2B_MSG(r, 2), __B2B_MSG(r, 0)),                                        \
+		  _mm_set_epi64x(__B2B_MSG(r, 3), __B2B_MSG(r, 1)));                                       \
+		__B2B_SSE_G(row1h,                                                                         \
+		  row2h,                                                                                   \
+		  row3h,                                                                                   \
+		  row4h,                                                                                   \
+		  _mm_set_epi64x(__B2B_MSG(r, 6), __B2B_MSG(r, 4)),                                        \
+		  _mm_set_epi64x(__B2B_MSG(r, 7), __B2B_MSG(r, 5)));                                       \
+		/* diagonalize */                                                                          \
+		t0 = _mm_alignr_epi8(row2h, row2l, 8);                                                     \
+		t1 = _mm_alignr_epi8(row2l, row2h, 8);                                                     \
+		row2l = t0;                                                                                \
+		row2h = t1;                                                                                \
+		t0 = row3l;                                                                                \
+		row3l = row3h;                                                                             \
+		row3h = t0;                                                                                \
+		t0 = _mm_alignr_epi8(row4h, row4l, 8);                                                     \
+		t1 = _mm_alignr_epi8(row4l, row4h, 8);                                                     \
+		row4l = t1;                                                                                \
+		row4h = t0;                                                                                \
+		__B2B_SSE_G(row1l,                                                                         \
+		  row2l,                                                                                   \
+		  row3l,                                                                                   \
+		  row4l,                                                                                   \
+		  _mm_set_epi64x(__B2B_MSG(r, 10), __B2B_MSG(r, 8)),                                       \
+		  _mm_set_epi64x(__B2B_MSG(r, 11), __B2B_MSG(r, 9)));                                      \
+		__B2B_SSE_G(row1h,                                                                         \
+		  row2h,                                                                                   \
+		  row3h,                                                                                   \
+		  row4h,                                                                                   \
+		  _mm_set_epi64x(__B2B_MSG(r, 14), __B2B_MSG(r, 12)),                                      \
+		  _mm_set_epi64x(__B2B_MSG(r, 15), __B2B_MSG(r, 13)));                                     \
+		/* undiagonalize */                                                                        \
+		t0 = _mm_alignr_epi8(row2l, row2h, 8);                                                     \
+		t1 = _mm_alignr_epi8(row2h, row2l, 8);                                                     \
+		row2l = t0;                                                                                \
+		row2h = t1;                                                                                \
+		t0 = row3l;                                                                                \
+		row3l = row3h;                                                                             \
+		row3h = t0;                                                                                \
+		t0 = _mm_alignr_epi8(row4l, row4h, 8);                                                     \
+		t1 = _mm_alignr_epi8(row4h, row4l, 8);                                                     \
+		row4l = t1;                                                                                \
+		row4h = t0;                                                                                \
+	} while(0)
+
+__attribute__((target("sse4.1"))) __BLAKE2B_FN void blake2b_compress_sse41(uint64_t h[8],
+  const uint64_t t[2],
+  const uint64_t f[2],
+  const uint8_t *block)
+{
+	const __m128i r16 = _mm_loadu_si128((const __m128i *)__blake2b_rot16);
+	const __m128i r24 = _mm_loadu_si128((const __m128i *)__blake2b_rot24);
+	uint64_t m[16];
+	__blake2b_load_msg(m, block);
+
+	__m128i row1l = _mm_loadu_si128((const __m128i *)&h[0]);
+	__m128i row1h = _mm_loadu_si128((const __m128i *)&h[2]);
+	__m128i row2l = _mm_loadu_si128((const __m128i *)&h[4]);
+	__m128i row2h = _mm_loadu_si128((const __m128i *)&h[6]);
+	__m128i row3l = _mm_loadu_si128((const __m128i *)&__blake2b_iv[0]);
+	__m128i row3h = _mm_loadu_si128((const __m128i *)&__blake2b_iv[2]);
+	__m128i row4l = _mm_xor_si128(
+	  _mm_loadu_si128((const __m128i *)&__blake2b_iv[4]), _mm_loadu_si128((const __m128i *)t));
+	__m128i row4h = _mm_xor_si128(
+	  _mm_loadu_si128((const __m128i *)&__blake2b_iv[6]), _mm_loadu_si128((const __m128i *)f));
+
+	__B2B_SSE_ROUND(0);
+	__B2B_SSE_ROUND(1);
+	__B2B_SSE_ROUND(2);
+	__B2B_SSE_ROUND(3);
+	__B2B_SSE_ROUND(4);
+	__B2B_SSE_ROUND(5);
+	__B2B_SSE_ROUND(6);
+	__B2B_SSE_ROUND(7);
+	__B2B_SSE_ROUND(8);
+	__B2B_SSE_ROUND(9);
+	__B2B_SSE_ROUND(10);
+	__B2B_SSE_ROUND(11);
+
+	row1l = _mm_xor_si128(row3l, row1l);
+	row1h = _mm_xor_si128(row3h, row1h);
+	row2l = _mm_xor_si128(row4l, row2l);
+	row2h = _mm_xor_si128(row4h, row2h);
+	_mm_storeu_si128(
+	  (__m128i *)&h[0], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[0]), row1l));
+	_mm_storeu_si128(
+	  (__m128i *)&h[2], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[2]), row1h));
+	_mm_storeu_si128(
+	  (__m128i *)&h[4], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[4]), row2l));
+	_mm_storeu_si128(
+	  (__m128i *)&h[6], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[6]), row2h));
+}
+
+#undef __B2B_SSE_G
+#undef __B2B_SSE_ROUND
+
+/* G on all four columns (or diagonals) at once */
+#define __B2B_AVX2_G(mx, my)                                                                       \
+	do {                                                                                           \
+		row1 = _mm256_add_epi64(_mm256_add_epi64(row1, row2), mx);                                 \
+		row4 = _mm256_shuffle_epi32(_mm256_xor_si256(row4, row1), _MM_SHUFFLE(2, 3, 0, 1));        \
+		row3 = _mm256_add_epi64(row3, row4);                                                       \
+		row2 = _mm256_shuffle_epi8(_mm256_xor_si256(row2, row3), r24);                             \
+		row1 = _mm256_add_epi64(_mm256_add_epi64(row1, row2), my);                                 \
+		row4 = _mm256_shuffle_epi8(_mm256_xor_si256(row4, row1), r16);                             \
+		row3 = _mm256_add_epi64(row3, row4);                                                       \
+		row2 = _mm256_xor_si256(row2, row3);                                                       \
+		row2 = _mm256_xor_si256(_mm256_srli_epi64(row2, 63), _mm256_add_epi64(row2, row2));        \
+	} while(0)
+
+#define __B2B_AVX2_ROUND(r)                                                                        \
+	do {                                                                                           \
+		__B2B_AVX2_G(_mm256_set_epi64x(                                                            \
+		               __B2B_MSG(r, 6), __B2B_MSG(r, 4), __B2B_MSG(r, 2), __B2B_MSG(r, 0)),        \
+		  _mm256_set_epi64x(__B2B_MSG(r, 7), __B2B_MSG(r, 5), __B2B_MSG(r, 3), __B2B_MSG(r, 1)));  \
+		row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(0, 3, 2, 1));                            \
+		row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));                            \
+		row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(2, 1, 0, 3));                            \
+		__B2B_AVX2_G(_mm256_set_epi64x(                                                            \
+		               __B2B_MSG(r, 14), __B2B_MSG(r, 12), __B2B_MSG(r, 10), __B2B_MSG(r, 8)),     \
+		  _mm256_set_epi64x(                                                                       \
+		    __B2B_MSG(r, 15), __B2B_MSG(r, 13), __B2B_MSG(r, 11), __B2B_MSG(r, 9)));               \
+		row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(2, 1, 0, 3));                            \
+		row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));                            \
+		row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(0, 3, 2, 1));                            \
+	} while(0)
+
+__attribute__((target("avx2"))) __BLAKE2B_FN void blake2b_compress_avx2(uint64_t h[8],
+  const uint64_t t[2],
+  const uint64_t f[2],
+  const uint8_t *block)
+{
+	const __m256i r16 = _mm256_loadu_si256((const __m256i *)__blake2b_rot16);
+	const __m256i r24 = _mm256_loadu_si256((const __m256i *)__blake2b_rot24);
+	uint64_t m[16];
+	__blake2b_load_msg(m, block);
+
+	__m256i row1 = _mm256_loadu_si256((const __m256i *)&h[0]);
+	__m256i row2 = _mm256_loadu_si256((const __m256i *)&h[4]);
+	__m256i row3 = _mm256_loadu_si256((const __m256i *)&__blake2b_iv[0]);
+	__m256i row4 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&__blake2b_iv[4]),
+	  _mm256_set_epi64x(f[1], f[0], t[1], t[0]));
+
+	__B2B_AVX2_ROUND(0);
+	__B2B_AVX2_ROUND(1);
+	__B2B_AVX2_ROUND(2);
+	__B2B_AVX2_ROUND(3);
+	__B2B_AVX2_ROUND(4);
+	__B2B_AVX2_ROUND(5);
+	__B2B_AVX2_ROUND(6);
+	__B2B_AVX2_ROUND(7);
+	__B2B_AVX2_ROUND(8);
+	__B2B_AVX2_ROUND(9);
+	__B2B_AVX2_ROUND(10);
+	__B2B_AVX2_ROUND(11);
+
+	row1 = _mm256_xor_si256(row1, row3);
+	row2 = _mm256_xor_si256(row2, row4);
+	_mm256_storeu_si256(
+	  (__m256i *)&h[0], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&h[0]), row1));
+	_mm256_storeu_si256(
+	  (__m256i *)&h[4], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&h[4]), row2));
+}
+
+#undef __B2B_AVX2_G
+#undef __B2B_AVX2_ROUND
+#undef __B2B_MSG
+
+#endif
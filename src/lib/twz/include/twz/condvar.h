@@ -0,0 +1,42 @@
+#pragma once
+
+#ifdef __cplusplus
+#include <atomic>
+extern "C" {
+#else
+#include <stdatomic.h>
+#endif
+
+#include <twz/mutex.h>
+
+/* A condition variable for use with struct mutex. Waiters sleep on a sequence number that every
+ * signal and broadcast bumps. A broadcast wakes only one waiter and requeues the rest onto the
+ * mutex, so they are woken one at a time as the mutex is released, instead of all at once to fight
+ * over it. */
+struct condvar {
+#ifdef __cplusplus
+	std::atomic_uint_least64_t seq;
+#else
+	atomic_uint_least64_t seq;
+#endif
+};
+
+static inline void condvar_init(struct condvar *cv)
+{
+	atomic_store(&cv->seq, 0);
+}
+
+/* release m, wait to be signaled, and acquire m again. Wakeups may be spurious. */
+void condvar_wait(struct condvar *cv, struct mutex *m);
+/* wake up one waiter */
+void condvar_signal(struct condvar *cv);
+/* wake up one waiter, and let it run now on the rest of the caller's timeslice. Meant for a caller
+ * that is about to wait itself, as in a request-response exchange; the caller should not be holding
+ * the mutex the waiter will need. */
+void condvar_signal_handoff(struct condvar *cv);
+/* wake up all waiters, which must be waiting with m */
+void condvar_broadcast(struct condvar *cv, struct mutex *m);
+
+#ifdef __cplusplus
+}
+#endif
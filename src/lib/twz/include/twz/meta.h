@@ -27,9 +27,14 @@ struct metaext {
 
 #define MI_MAGIC 0x54575A4F
 
+#define MI_HASHTREE_LEAF 0x1000
+
 #define MIF_SZ 0x1
 
 #define MIP_HASHDATA 0x1
+/* with MIP_HASHDATA: hash the data as a tree of MI_HASHTREE_LEAF-byte leaves, so that changing a
+ * page only requires rehashing that page */
+#define MIP_HASHTREE 0x2
 #define MIP_DFL_READ 0x4
 #define MIP_DFL_WRITE 0x8
 #define MIP_DFL_EXEC 0x10
@@ -19,6 +19,8 @@ enum object_backing_type {
 #define TWZ_OC_TIED_NONE 0x10000
 #define TWZ_OC_TIED_VIEW 0x20000
 #define TWZ_OC_DMA 0x40000
+#define TWZ_OC_LARGEPAGES 0x80000
+#define TWZ_OC_READMOSTLY 0x100000
 
 #ifndef __KERNEL__
 
@@ -15,6 +15,8 @@ struct memory_stats {
 	std::atomic_uint_least64_t memalloc_free;
 	std::atomic_uint_least64_t pmap_used;
 	std::atomic_uint_least64_t tmpmap_used;
+	std::atomic_uint_least64_t page_alloc;
+	std::atomic_uint_least64_t page_free;
 #else
 	_Atomic uint64_t pages_early_used;
 	_Atomic uint64_t memalloc_nr_objects;
@@ -24,6 +26,36 @@ struct memory_stats {
 	_Atomic uint64_t memalloc_free;
 	_Atomic uint64_t pmap_used;
 	_Atomic uint64_t tmpmap_used;
+	_Atomic uint64_t page_alloc;
+	_Atomic uint64_t page_free;
+#endif
+};
+
+#define MEMORY_STATS_MAX_CPUS 64
+
+/* per-CPU page allocator counters. Refills and drains count batch transfers between a CPU's page
+ * cache and the global page lists. Zero hits and misses count PAGE_ZERO allocations that did or did
+ * not find a pre-zero'd page. Clean frees count pages that were never written and so went straight
+ * back to the zero list. */
+struct page_cpu_stats {
+#ifdef __cplusplus
+	std::atomic_uint_least64_t alloc;
+	std::atomic_uint_least64_t free;
+	std::atomic_uint_least64_t refill;
+	std::atomic_uint_least64_t drain;
+	std::atomic_uint_least64_t zero_hit;
+	std::atomic_uint_least64_t zero_miss;
+	std::atomic_uint_least64_t idle_zeroed;
+	std::atomic_uint_least64_t free_clean;
+#else
+	_Atomic uint64_t alloc;
+	_Atomic uint64_t free;
+	_Atomic uint64_t refill;
+	_Atomic uint64_t drain;
+	_Atomic uint64_t zero_hit;
+	_Atomic uint64_t zero_miss;
+	_Atomic uint64_t idle_zeroed;
+	_Atomic uint64_t free_clean;
 #endif
 };
 
@@ -44,6 +76,7 @@ struct page_stats {
 
 struct memory_stats_header {
 	struct memory_stats stats;
+	struct page_cpu_stats page_cpu_stats[MEMORY_STATS_MAX_CPUS];
 	uint64_t nr_page_groups;
 	struct page_stats page_stats[];
 };
@@ -14,6 +14,13 @@ struct proc_stats {
 	std::atomic_uint_least64_t int_intr;
 	std::atomic_uint_least64_t running;
 	std::atomic_uint_least64_t shootdowns;
+	std::atomic_uint_least64_t shootdown_ipis;
+	std::atomic_uint_least64_t shootdown_avoided;
+	std::atomic_uint_least64_t shootdown_lazy;
+	std::atomic_uint_least64_t migrations;
+	std::atomic_uint_least64_t steals;
+	std::atomic_uint_least64_t pushes;
+	std::atomic_uint_least64_t handoffs;
 #else
 	_Atomic uint64_t thr_switch;
 	_Atomic uint64_t syscalls;
@@ -22,6 +29,18 @@ struct proc_stats {
 	_Atomic uint64_t int_intr;
 	_Atomic uint64_t running;
 	_Atomic uint64_t shootdowns;
+	/* shootdown IPIs this CPU sent, and other CPUs it didn't need to send one to */
+	_Atomic uint64_t shootdown_ipis;
+	_Atomic uint64_t shootdown_avoided;
+	/* shootdowns done on the way out of idle instead of by IPI */
+	_Atomic uint64_t shootdown_lazy;
+	/* threads moved onto this CPU; of those, how many it pulled while idle; and threads it pushed
+	 * to a less loaded CPU */
+	_Atomic uint64_t migrations;
+	_Atomic uint64_t steals;
+	_Atomic uint64_t pushes;
+	/* threads given the rest of a timeslice by a THREAD_SYNC_WAKE_AND_YIELD on this CPU */
+	_Atomic uint64_t handoffs;
 #endif
 };
 
@@ -27,8 +27,10 @@ int twz_object_ctl(twzobj *obj, int cmd, ...);
 /* TODO: make these accessible in this file */
 struct kernel_ostat;
 struct kernel_ostat_page;
+struct kernel_ostat_sctx;
 int twz_object_kstat(twzobj *obj, struct kernel_ostat *st);
 int twz_object_kstat_page(twzobj *obj, size_t pgnr, struct kernel_ostat_page *st);
+int twz_object_kstat_sctx(twzobj *obj, struct kernel_ostat_sctx *st);
 
 #ifdef __cplusplus
 }
@@ -32,6 +32,7 @@
 #define NUM_SYSCALLS 24
 
 #define KCONF_RDRESET 1
+#define KCONF_PAGEZERO_WATERMARK 2
 #define KCONF_ARCH_TSC_PSPERIOD 1001
 
 #define OTIE_UNTIE 1
@@ -45,6 +46,11 @@
 #define TWZ_SYS_OC_ZERONONCE 0x1000
 #define TWZ_SYS_OC_VOLATILE 0x2000
 #define TWZ_SYS_OC_PERSIST_ 0x4000
+/* back the object with 2 MiB frames where possible */
+#define TWZ_SYS_OC_LARGEPAGES 0x80000
+/* optimize the object's contents lock for concurrent readers, at the expense of writers. Costs
+ * the kernel 64 bytes per CPU for as long as the object is in memory. */
+#define TWZ_SYS_OC_READMOSTLY 0x100000
 
 #define TWZ_SYS_OD_IMMEDIATE 1
 
@@ -71,6 +77,10 @@ enum kso_invl_current {
 
 #define THREAD_SYNC_SLEEP 0
 #define THREAD_SYNC_WAKE 1
+/* wake up to arg threads sleeping on addr, and move the rest to sleep on addr2 */
+#define THREAD_SYNC_REQUEUE 2
+/* like WAKE, but the first thread woken runs next, for the rest of the caller's timeslice */
+#define THREAD_SYNC_WAKE_AND_YIELD 3
 
 #define THREAD_SYNC_32BIT 2
 
@@ -78,7 +88,8 @@ struct sys_thread_sync_args {
 	uint64_t *addr;
 	uint64_t arg;
 	uint64_t res;
-	uint64_t __resv;
+	/* THREAD_SYNC_REQUEUE's target; otherwise reserved (zero) */
+	uint64_t *addr2;
 	uint32_t op;
 	uint32_t flags;
 };
@@ -123,6 +134,19 @@ struct sys_thrd_spawn_args {
 #define THRD_CTL_SET_GS 2
 #define THRD_CTL_SET_IOPL 3
 #define THRD_CTL_EXIT 0x100
+/* arg is a mask of CPUs (bit n is CPU n) the calling thread may run on */
+#define THRD_CTL_SET_AFFINITY 0x101
+/* arg points to a uint64_t that receives the calling thread's CPU mask */
+#define THRD_CTL_GET_AFFINITY 0x102
+/* arg is THRD_SCHED_NORMAL, or a fixed run level below THRD_SCHED_FIXED_LEVELS (0 runs first) that
+ * the calling thread keeps no matter how much CPU it uses. Fixed levels run before all others, so
+ * picking one needs a superuser security context (-EPERM otherwise). */
+#define THRD_CTL_SET_SCHED 0x103
+
+#define THRD_SCHED_NORMAL -1
+#define THRD_SCHED_FIXED_LEVELS 8
+/* for device drivers' event loops */
+#define THRD_SCHED_DRIVER 4
 
 #define KACTION_VALID 1
 
@@ -155,6 +179,7 @@ enum kernel_queues {
 
 #define OS_TYPE_OBJ 0
 #define OS_TYPE_PAGE 1
+#define OS_TYPE_SCTX 2
 
 #define OS_FLAGS_PIN 1
 #define OS_FLAGS_KERNEL 2
@@ -182,6 +207,20 @@ struct kernel_ostat_page {
 	uint64_t flags;
 	uint32_t cowcount;
 	uint32_t level;
+	/* per-object: faults taken, and pages mapped ahead of them by fault-around */
+	uint64_t obj_faults;
+	uint64_t obj_fault_around;
+};
+
+/* permission cache behaviour of a security context. pcpu_hits and hits are lookups answered by
+ * the per-CPU cache and the context's own cache, respectively; misses walked the context. */
+struct kernel_ostat_sctx {
+	uint64_t lookups;
+	uint64_t pcpu_hits;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+	uint64_t entries;
 };
 
 struct kernel_create_src {
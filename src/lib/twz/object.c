@@ -119,6 +119,12 @@ int twz_object_create(int flags, objid_t kuid, objid_t src, objid_t *id)
 	if(flags & TWZ_OC_ZERONONCE) {
 		flags = (flags & ~TWZ_OC_ZERONONCE) | TWZ_SYS_OC_ZERONONCE;
 	}
+	if(flags & TWZ_OC_LARGEPAGES) {
+		flags = (flags & ~TWZ_OC_LARGEPAGES) | TWZ_SYS_OC_LARGEPAGES;
+	}
+	if(flags & TWZ_OC_READMOSTLY) {
+		flags = (flags & ~TWZ_OC_READMOSTLY) | TWZ_SYS_OC_READMOSTLY;
+	}
 	// if(flags & TWZ_OC_VOLATILE) {
 	//		flags = (flags & ~TWZ_OC_VOLATILE) | TWZ_SYS_OC_VOLATILE;
 	//	}
@@ -764,3 +770,9 @@ int twz_object_kstat_page(twzobj *obj, size_t pgnr, struct kernel_ostat_page *st
 {
 	return sys_ostat(OS_TYPE_PAGE, twz_object_guid(obj), pgnr, st);
 }
+
+EXTERNAL
+int twz_object_kstat_sctx(twzobj *obj, struct kernel_ostat_sctx *st)
+{
+	return sys_ostat(OS_TYPE_SCTX, twz_object_guid(obj), 0, st);
+}
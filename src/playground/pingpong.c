@@ -0,0 +1,134 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Two threads take turns through a mutex and a pair of condition variables, first signaling
+ * normally and then handing off the rest of the timeslice to the woken thread
+ * (THREAD_SYNC_WAKE_AND_YIELD). Then several waiters are woken by a broadcast, which requeues all
+ * but one of them onto the mutex. */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <twz/condvar.h>
+#include <twz/mutex.h>
+
+#define NR_WAITERS 8
+
+static struct mutex lock;
+static struct condvar turn_cv[2];
+static int turn;
+static bool handoff;
+static long rounds = 100000;
+
+static struct condvar go_cv;
+static bool go;
+static int nr_waiting, nr_done;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pass(int me)
+{
+	int other = !me;
+	mutex_acquire(&lock);
+	while(turn != me)
+		condvar_wait(&turn_cv[me], &lock);
+	turn = other;
+	if(handoff) {
+		mutex_release(&lock);
+		condvar_signal_handoff(&turn_cv[other]);
+	} else {
+		condvar_signal(&turn_cv[other]);
+		mutex_release(&lock);
+	}
+}
+
+static void *pong(void *a)
+{
+	(void)a;
+	for(long i = 0; i < rounds; i++)
+		pass(1);
+	return NULL;
+}
+
+static void pingpong(bool ho)
+{
+	handoff = ho;
+	turn = 0;
+	pthread_t thr;
+	double start = now();
+	pthread_create(&thr, NULL, pong, NULL);
+	for(long i = 0; i < rounds; i++)
+		pass(0);
+	pthread_join(thr, NULL);
+	double t = now() - start;
+	printf("%-10s %ld round trips in %.3fs: %.0f ns per round trip\n",
+	  ho ? "handoff" : "signal",
+	  rounds,
+	  t,
+	  t / rounds * 1e9);
+}
+
+static void *waiter(void *a)
+{
+	(void)a;
+	mutex_acquire(&lock);
+	nr_waiting++;
+	while(!go)
+		condvar_wait(&go_cv, &lock);
+	nr_done++;
+	mutex_release(&lock);
+	return NULL;
+}
+
+static void herd(void)
+{
+	pthread_t thrs[NR_WAITERS];
+	go = false;
+	nr_waiting = nr_done = 0;
+	for(int i = 0; i < NR_WAITERS; i++)
+		pthread_create(&thrs[i], NULL, waiter, NULL);
+	while(true) {
+		mutex_acquire(&lock);
+		int w = nr_waiting;
+		mutex_release(&lock);
+		if(w == NR_WAITERS)
+			break;
+		sched_yield();
+	}
+	double start = now();
+	mutex_acquire(&lock);
+	go = true;
+	condvar_broadcast(&go_cv, &lock);
+	mutex_release(&lock);
+	for(int i = 0; i < NR_WAITERS; i++)
+		pthread_join(thrs[i], NULL);
+	double t = now() - start;
+	printf("broadcast  %d waiters through the mutex in %.0f ns\n", nr_done, t * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc > 1)
+		rounds = strtol(argv[1], NULL, 0);
+	mutex_init(&lock);
+	condvar_init(&turn_cv[0]);
+	condvar_init(&turn_cv[1]);
+	condvar_init(&go_cv);
+
+	pingpong(false);
+	pingpong(true);
+	herd();
+	return 0;
+}
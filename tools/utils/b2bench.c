@@ -0,0 +1,122 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Compare the throughput of the BLAKE2b compression functions, both hashing a buffer in one
+ * stream (as for MIP_HASHDATA) and as 4 KiB tree leaves (MIP_HASHTREE). */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blake2.h"
+
+#define LEAF_SIZE 0x1000
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hash_stream(const unsigned char *buf, size_t len, unsigned char *out)
+{
+	blake2b(out, 32, buf, len, NULL, 0);
+}
+
+static void hash_leaves(const unsigned char *buf, size_t len, unsigned char *out)
+{
+	blake2b_state S;
+	blake2b_init(&S, 32);
+	for(size_t off = 0; off < len; off += LEAF_SIZE) {
+		size_t l = len - off < LEAF_SIZE ? len - off : LEAF_SIZE;
+		blake2b_state L;
+		unsigned char leaf[32];
+		blake2b_init_leaf(&L, 32, LEAF_SIZE, off / LEAF_SIZE);
+		blake2b_update(&L, buf + off, l);
+		blake2b_final(&L, leaf, 32);
+		blake2b_update(&S, leaf, 32);
+	}
+	blake2b_final(&S, out, 32);
+}
+
+static double run(void (*fn)(const unsigned char *, size_t, unsigned char *),
+  const unsigned char *buf,
+  size_t len,
+  int iters,
+  unsigned char *out)
+{
+	double best = 0;
+	for(int i = 0; i < iters; i++) {
+		double start = now();
+		fn(buf, len, out);
+		double t = now() - start;
+		if(i == 0 || t < best)
+			best = t;
+	}
+	return len / best / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+	size_t len = 64 * 1024 * 1024;
+	int iters = 5;
+	int c;
+	while((c = getopt(argc, argv, "s:n:")) != EOF) {
+		switch(c) {
+			case 's':
+				len = strtoull(optarg, NULL, 0);
+				break;
+			case 'n':
+				iters = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: b2bench [-s bytes] [-n iterations]\n");
+				return 1;
+		}
+	}
+
+	unsigned char *buf = malloc(len);
+	if(!buf)
+		err(1, "malloc");
+	for(size_t i = 0; i < len; i++)
+		buf[i] = (unsigned char)(i * 2654435761u >> 13);
+
+	static const struct {
+		enum blake2b_impl impl;
+		const char *name;
+	} impls[] = {
+		{ BLAKE2B_IMPL_PORTABLE, "portable" },
+		{ BLAKE2B_IMPL_SSE41, "sse4.1" },
+		{ BLAKE2B_IMPL_AVX2, "avx2" },
+	};
+
+	unsigned char ref_stream[32], ref_tree[32];
+	printf("%zu bytes, best of %d\n", len, iters);
+	printf("%-10s %12s %12s\n", "impl", "stream MB/s", "tree MB/s");
+	for(size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		if(blake2b_select_impl(impls[i].impl) < 0) {
+			printf("%-10s (not supported by this CPU)\n", impls[i].name);
+			continue;
+		}
+		unsigned char stream[32], tree[32];
+		double s = run(hash_stream, buf, len, iters, stream);
+		double t = run(hash_leaves, buf, len, iters, tree);
+		printf("%-10s %12.1f %12.1f\n", impls[i].name, s, t);
+		if(i == 0) {
+			memcpy(ref_stream, stream, 32);
+			memcpy(ref_tree, tree, 32);
+		} else if(memcmp(ref_stream, stream, 32) || memcmp(ref_tree, tree, 32)) {
+			errx(1, "%s: digest differs from the portable implementation", impls[i].name);
+		}
+	}
+	free(buf);
+	return 0;
+}
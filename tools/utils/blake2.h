@@ -142,6 +142,18 @@ int blake2b_init_key( blake2b_state *S, size_t outlen, const void *key, size_t k
 int blake2b_init_param( blake2b_state *S, const blake2b_param *P );
 int blake2b_update( blake2b_state *S, const void *in, size_t inlen );
 int blake2b_final( blake2b_state *S, void *out, size_t outlen );
+int blake2b_init_leaf( blake2b_state *S, size_t outlen, uint32_t leaf_length, uint64_t offset );
+
+/* Which BLAKE2b compression function to use. The default (AUTO) is the fastest one the CPU
+ * supports; the others are for comparing them. Returns -1 if the CPU can't run it. */
+enum blake2b_impl {
+	BLAKE2B_IMPL_AUTO,
+	BLAKE2B_IMPL_PORTABLE,
+	BLAKE2B_IMPL_SSE41,
+	BLAKE2B_IMPL_AVX2,
+};
+int blake2b_select_impl( enum blake2b_impl impl );
+const char *blake2b_impl_name( void );
 
 int blake2sp_init( blake2sp_state *S, size_t outlen );
 int blake2sp_init_key( blake2sp_state *S, size_t outlen, const void *key, size_t keylen );
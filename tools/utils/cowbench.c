@@ -0,0 +1,407 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Measure copy-on-write through the kernel's range and page code (core/obj/range.c, pageop.c and
+ * pagevec.c, built here against the stub kernel in kstub/). A source object is populated, copied
+ * into a destination the way object_copy shares its ranges (after which the idle loop coalesces
+ * the destination's ranges), and then pages of the destination are written. Each write is the
+ * fault the object space fault handler would take: object_operate_on_locked_page with
+ * OP_LP_DO_COPY. Reported are the time a write fault takes (the median, the median of the first
+ * one after each copy, and the 99th percentile; the host's preemption makes the mean and the worst
+ * case meaningless), the pages copied, and how many ranges the two objects' range trees hold after
+ * the copy and after the writes.
+ *
+ * The source is populated either by write faults in page order (as a process fills its heap, or a
+ * loader a segment), or as one range over one pagevec (as a large-page object is). Pages come
+ * from a stub page allocator that backs each with 4 KB of host memory, so that copying one costs
+ * what it would. Afterwards, every page of both objects is checked: the source must be as it was,
+ * and the destination must have the source's contents plus its own writes. */
+
+#include <__mm_bits.h>
+#include <err.h>
+#include <lib/rb.h>
+#include <memory.h>
+#include <object.h>
+#include <page.h>
+#include <pagevec.h>
+#include <processor.h>
+#include <range.h>
+#include <slab.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* object pages start after the null page */
+#define FIRST_PAGE 1
+/* the byte of each page that the destination's writes change */
+#define WRITE_OFF 8
+
+struct object_stats object_stats = {};
+
+static size_t pages_cloned;
+
+static void *page_data(struct page *page)
+{
+	return (void *)mm_page_addr(page);
+}
+
+/* frames are handed out from, and freed back to, a list refilled in chunks of memory that have
+ * already been touched, so that the host's allocator and page faults stay out of the timings */
+#define FRAME_CHUNK 256
+static struct page *free_frames;
+
+static void refill_frames(void)
+{
+	struct page *pages = aligned_alloc(_Alignof(struct page), FRAME_CHUNK * sizeof(*pages));
+	char *data = aligned_alloc(0x1000, FRAME_CHUNK * 0x1000);
+	if(!pages || !data)
+		err(1, "aligned_alloc");
+	memset(pages, 0, FRAME_CHUNK * sizeof(*pages));
+	memset(data, 0, FRAME_CHUNK * 0x1000);
+	for(size_t i = 0; i < FRAME_CHUNK; i++) {
+		pages[i].__addr_and_flags = (uintptr_t)(data + i * 0x1000);
+		pages[i].next = free_frames;
+		free_frames = &pages[i];
+	}
+}
+
+struct page *mm_page_alloc(int flags)
+{
+	if(!free_frames)
+		refill_frames();
+	struct page *page = free_frames;
+	free_frames = page->next;
+	if(flags & PAGE_ZERO)
+		memset(page_data(page), 0, 0x1000);
+	page->__addr_and_flags = mm_page_addr(page) | (flags & PAGE_TRACKED);
+	page->next = NULL;
+	page->refs = 1;
+	return page;
+}
+
+void mm_page_free(struct page *page)
+{
+	page->next = free_frames;
+	free_frames = page;
+}
+
+void mm_page_put(struct page *page)
+{
+	if(--page->refs == 0)
+		mm_page_free(page);
+}
+
+struct page *mm_page_clone(struct page *page)
+{
+	struct page *newpage = mm_page_alloc(0);
+	memcpy(page_data(newpage), page_data(page), 0x1000);
+	pages_cloned++;
+	return newpage;
+}
+
+struct page *mm_page_shared_zero(void)
+{
+	static struct page *zero;
+	if(!zero)
+		zero = mm_page_alloc(PAGE_ZERO);
+	return zero;
+}
+
+void mm_page_mark_dirty(struct page *page)
+{
+}
+
+struct page *mm_page_alloc_large(int flags)
+{
+	return NULL;
+}
+
+void mm_page_free_large(struct page *pages)
+{
+	errx(1, "no large pages here");
+}
+
+/* the objects here live for one run, and aren't hashed */
+void obj_put(struct object *o)
+{
+}
+
+void obj_hash_invalidate(struct object *obj, size_t pagenr, size_t len)
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t nr_pages = 1024;
+
+static void obj_setup(struct object *obj)
+{
+	*obj = (struct object){ .rwlock = RWLOCK_INIT, .range_tree = RBINIT };
+	krc_init(&obj->refs);
+}
+
+static void obj_teardown(struct object *obj)
+{
+	struct rbnode *node;
+	while((node = rb_first(&obj->range_tree))) {
+		struct range *range = rb_entry(node, struct range, node);
+		rb_delete(node, &obj->range_tree);
+		range_toss(range);
+		range_free(range);
+	}
+}
+
+static size_t nr_ranges(struct object *obj)
+{
+	size_t count = 0;
+	for(struct rbnode *node = rb_first(&obj->range_tree); node; node = rb_next(node))
+		count++;
+	return count;
+}
+
+/* the fault callback, standing in for mapping the page; a write must get a private page */
+static void write_page(struct object *obj,
+  size_t pagenr,
+  struct page *page,
+  void *data,
+  uint64_t fl)
+{
+	if((fl & PAGE_MAP_COW) || page->refs > 1)
+		errx(1, "page %zu: write fault was given a shared page", pagenr);
+	((unsigned char *)page_data(page))[WRITE_OFF] = 0xff;
+}
+
+static void stamp_page(struct object *obj,
+  size_t pagenr,
+  struct page *page,
+  void *data,
+  uint64_t fl)
+{
+	*(uint64_t *)page_data(page) = pagenr;
+}
+
+static void populate_faulted(struct object *src)
+{
+	for(size_t pg = FIRST_PAGE; pg < FIRST_PAGE + nr_pages; pg++)
+		object_operate_on_locked_page(src, pg, OP_LP_DO_COPY, stamp_page, NULL);
+}
+
+static void populate_one_range(struct object *src)
+{
+	struct pagevec *pv = pagevec_new();
+	for(size_t i = 0; i < nr_pages; i++) {
+		struct page *page = mm_page_alloc(PAGE_ZERO | PAGE_TRACKED);
+		*(uint64_t *)page_data(page) = FIRST_PAGE + i;
+		pagevec_set_page(pv, i, page);
+	}
+	pv->len = nr_pages;
+	object_add_range(src, pv, FIRST_PAGE, nr_pages, 0);
+}
+
+/* share src's ranges with dest at the same pages, as object_copy (cow_range) does */
+static void copy_object(struct object *dest, struct object *src)
+{
+	struct rwlock_result dres = rwlock_wlock(&dest->rwlock, 0);
+	struct rwlock_result sres = rwlock_wlock(&src->rwlock, 0);
+	for(struct rbnode *node = rb_first(&src->range_tree); node; node = rb_next(node)) {
+		struct range *range = rb_entry(node, struct range, node);
+		object_add_range(dest, range->pv, range->start, range->len, range->pv_offset);
+	}
+	rwlock_wunlock(&sres);
+	/* what object_idle_coalesce would do for dest, once object_copy queued it */
+	object_coalesce_ranges(dest);
+	rwlock_wunlock(&dres);
+}
+
+static void check(struct object *obj, bool *written)
+{
+	for(size_t pg = FIRST_PAGE; pg < FIRST_PAGE + nr_pages; pg++) {
+		struct range *range = object_find_range(obj, pg);
+		struct page *page = range ? pagevec_lookup_page(range->pv, range_pv_idx(range, pg)) : NULL;
+		if(!page)
+			errx(1, "page %zu is missing", pg);
+		unsigned char *data = page_data(page);
+		if(*(uint64_t *)data != pg || data[WRITE_OFF] != (written && written[pg] ? 0xff : 0))
+			errx(1, "page %zu has the wrong contents", pg);
+	}
+}
+
+struct pattern {
+	const char *name;
+	const char *desc;
+	size_t nr;
+	size_t *pages;
+};
+
+static struct pattern patterns[] = {
+	{ .name = "all", .desc = "every page, in order" },
+	{ .name = "random", .desc = "a tenth as many writes as pages, to random pages" },
+	{ .name = "one", .desc = "a single page in the middle" },
+};
+
+static void make_patterns(void)
+{
+	struct pattern *p = &patterns[0];
+	p->nr = nr_pages;
+	p->pages = malloc(p->nr * sizeof(*p->pages));
+	for(size_t i = 0; i < p->nr; i++)
+		p->pages[i] = FIRST_PAGE + i;
+
+	p = &patterns[1];
+	p->nr = nr_pages / 10 ? nr_pages / 10 : 1;
+	p->pages = malloc(p->nr * sizeof(*p->pages));
+	for(size_t i = 0; i < p->nr; i++)
+		p->pages[i] = FIRST_PAGE + random() % nr_pages;
+
+	p = &patterns[2];
+	p->nr = 1;
+	p->pages = malloc(sizeof(*p->pages));
+	p->pages[0] = FIRST_PAGE + nr_pages / 2;
+
+	for(size_t i = 0; i < array_len(patterns); i++) {
+		if(!patterns[i].pages)
+			err(1, "malloc");
+	}
+}
+
+struct result {
+	double median_ns, first_ns, p99_ns;
+	double copied;
+	double ranges_copy, ranges_end;
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static struct result run(struct pattern *p, void (*populate)(struct object *), int rounds)
+{
+	struct result res = {};
+	bool *written = calloc(FIRST_PAGE + nr_pages, sizeof(*written));
+	if(!written)
+		err(1, "calloc");
+	for(size_t i = 0; i < p->nr; i++)
+		written[p->pages[i]] = true;
+	double *samples = malloc(rounds * p->nr * sizeof(*samples));
+	double *firsts = malloc(rounds * sizeof(*firsts));
+	if(!samples || !firsts)
+		err(1, "malloc");
+	for(int r = 0; r < rounds; r++) {
+		struct object src, dest;
+		obj_setup(&src);
+		obj_setup(&dest);
+		populate(&src);
+		copy_object(&dest, &src);
+		res.ranges_copy += nr_ranges(&src) + nr_ranges(&dest);
+
+		size_t cloned = pages_cloned;
+		for(size_t i = 0; i < p->nr; i++) {
+			double start = now();
+			object_operate_on_locked_page(&dest, p->pages[i], OP_LP_DO_COPY, write_page, NULL);
+			samples[r * p->nr + i] = (now() - start) * 1e9;
+		}
+		firsts[r] = samples[r * p->nr];
+		res.copied += pages_cloned - cloned;
+		res.ranges_end += nr_ranges(&src) + nr_ranges(&dest);
+
+		check(&src, NULL);
+		check(&dest, written);
+		obj_teardown(&dest);
+		obj_teardown(&src);
+	}
+	qsort(samples, rounds * p->nr, sizeof(*samples), cmp_double);
+	qsort(firsts, rounds, sizeof(*firsts), cmp_double);
+	res.median_ns = samples[rounds * p->nr / 2];
+	res.first_ns = firsts[rounds / 2];
+	res.p99_ns = samples[rounds * p->nr * 99 / 100];
+	free(samples);
+	free(firsts);
+	free(written);
+	res.copied /= rounds;
+	res.ranges_copy /= rounds;
+	res.ranges_end /= rounds;
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 20;
+	int c;
+	srandom(1);
+	while((c = getopt(argc, argv, "n:r:s:")) != EOF) {
+		switch(c) {
+			case 'n':
+				nr_pages = strtol(optarg, NULL, 0);
+				break;
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+			case 's':
+				srandom(atoi(optarg));
+				break;
+			default:
+				fprintf(stderr, "usage: cowbench [-n pages] [-r rounds] [-s seed]\n");
+				return 1;
+		}
+	}
+	/* a range can't cover more of a pagevec than this */
+	if(nr_pages < 1 || nr_pages > PAGEVEC_MAX_IDX || rounds < 1)
+		errx(1, "bad arguments");
+
+	kstub_cpu = 0;
+	kalloc_system_init();
+	make_patterns();
+
+	struct {
+		const char *name;
+		void (*populate)(struct object *);
+	} layouts[] = {
+		{ "faulted", populate_faulted },
+		{ "one range", populate_one_range },
+	};
+
+	printf("%zu page objects, %d rounds; the destination writes:\n", nr_pages, rounds);
+	for(size_t i = 0; i < array_len(patterns); i++)
+		printf("  %-8s %s\n", patterns[i].name, patterns[i].desc);
+	printf("%-10s %-8s %7s %10s %9s %9s %8s %13s %13s\n",
+	  "source",
+	  "writes",
+	  "faults",
+	  "median ns",
+	  "first ns",
+	  "p99 ns",
+	  "copied",
+	  "ranges (copy)",
+	  "ranges (end)");
+	for(size_t l = 0; l < array_len(layouts); l++) {
+		for(size_t i = 0; i < array_len(patterns); i++) {
+			struct pattern *p = &patterns[i];
+			struct result r = run(p, layouts[l].populate, rounds);
+			printf("%-10s %-8s %7zu %10.0f %9.0f %9.0f %8.0f %13.0f %13.0f\n",
+			  layouts[l].name,
+			  p->name,
+			  p->nr,
+			  r.median_ns,
+			  r.first_ns,
+			  r.p99_ns,
+			  r.copied,
+			  r.ranges_copy,
+			  r.ranges_end);
+		}
+	}
+	return 0;
+}
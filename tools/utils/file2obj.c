@@ -94,8 +94,9 @@ static void usage(void)
 	fprintf(stderr,
 	  "usage: file2obj [-z] -i input-file -o output-file -p pflags [-k kuid] [-f FOT_SPEC]...\n");
 	fprintf(stderr, "-z: use zero for nonce\n");
-	fprintf(
-	  stderr, "valid pflags include R (dfl read), W, X, U (dfl use), H (hash data), D (delete)\n");
+	fprintf(stderr,
+	  "valid pflags include R (dfl read), W, X, U (dfl use), H (hash data), T (hash data as a "
+	  "tree of pages), D (delete)\n");
 	fprintf(stderr, "FOT_SPEC ::= <fotentry> ':' <flags> ':' IDNAME\n");
 	fprintf(stderr, "IDNAME ::= ID | NAME\n");
 	fprintf(
@@ -260,6 +261,10 @@ int main(int argc, char **argv)
 						case 'H':
 							pflags |= MIP_HASHDATA;
 							break;
+						case 't':
+						case 'T':
+							pflags |= MIP_HASHDATA | MIP_HASHTREE;
+							break;
 						case 'd':
 						case 'D':
 							pflags |= MIP_DFL_DEL;
@@ -0,0 +1,301 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Replay an allocation trace against the kernel's kalloc (core/mm/kalloc.c, on top of slab2.c and
+ * the stub kernel in kstub/), and report how fast it runs and how much memory the live objects
+ * take at the peak, compared with the eight power-of-two bins kalloc used to have. The replay is
+ * then run again with checking on: every object is filled with a pattern that must survive
+ * krealloc, and memory that kalloc or krealloc was asked to zero must read as zero, including what
+ * a shrink left behind before an in-place grow.
+ *
+ * A trace has one operation per line, where an id names a live object:
+ *   a <id> <size> [z]   kalloc (z: with KALLOC_ZERO)
+ *   r <id> <size> [z]   krealloc
+ *   f <id>              kfree
+ * Without a trace file, a synthetic one is generated, with mostly small objects, some buffers of
+ * up to a few pages, a few large ones, and vectors that grow and shrink by krealloc. */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../src/kernel/core/mm/kalloc.c"
+#include "kstub/kstub.h"
+
+struct op {
+	char type;
+	bool zero;
+	uint32_t id;
+	size_t size;
+};
+
+struct obj {
+	unsigned char *p;
+	size_t size;
+};
+
+static struct op *ops;
+static size_t nr_ops, max_ops;
+static struct obj *objs;
+static uint32_t nr_ids;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_op(char type, uint32_t id, size_t size, bool zero)
+{
+	if(nr_ops == max_ops) {
+		max_ops = max_ops ? max_ops * 2 : 4096;
+		ops = realloc(ops, max_ops * sizeof(*ops));
+		if(!ops)
+			err(1, "realloc");
+	}
+	ops[nr_ops++] = (struct op){ .type = type, .id = id, .size = size, .zero = zero };
+	if(id >= nr_ids)
+		nr_ids = id + 1;
+}
+
+static void load_trace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if(!f)
+		err(1, "%s", path);
+	char line[128];
+	size_t ln = 0;
+	while(fgets(line, sizeof(line), f)) {
+		ln++;
+		char type, z = 0;
+		unsigned long id, size = 0;
+		int n = sscanf(line, " %c %lu %lu %c", &type, &id, &size, &z);
+		if(n < 2 || (type != 'f' && n < 3) || !strchr("arf", type))
+			errx(1, "%s:%zu: bad operation", path, ln);
+		add_op(type, id, size, z == 'z');
+	}
+	fclose(f);
+}
+
+static size_t random_size(void)
+{
+	int r = random() % 100;
+	if(r < 60)
+		return 8 + random() % 120;
+	if(r < 85)
+		return 128 + random() % 896;
+	if(r < 97)
+		return 1024 + random() % 7168;
+	return 8192 + random() % 57344;
+}
+
+static void gen_trace(size_t nr, uint32_t max_live)
+{
+	uint32_t *live = malloc(max_live * sizeof(*live));
+	size_t *sizes = malloc(max_live * sizeof(*sizes));
+	uint32_t nr_live = 0, next_id = 0;
+	if(!live || !sizes)
+		err(1, "malloc");
+	while(nr_ops < nr) {
+		int r = random() % 100;
+		if(nr_live && (nr_live == max_live || r < 35)) {
+			uint32_t i = random() % nr_live;
+			add_op('f', live[i], 0, false);
+			live[i] = live[--nr_live];
+			sizes[i] = sizes[nr_live];
+		} else if(nr_live && r < 50) {
+			/* vectors mostly grow by half (up to 256KB), and sometimes get trimmed */
+			uint32_t i = random() % nr_live;
+			bool grow = random() % 4 && sizes[i] < 256 * 1024;
+			size_t sz = grow ? sizes[i] + sizes[i] / 2 + 1 : sizes[i] / 2 + 1;
+			add_op('r', live[i], sz, random() % 2);
+			sizes[i] = sz;
+		} else {
+			size_t sz = random_size();
+			add_op('a', next_id, sz, random() % 2);
+			live[nr_live] = next_id++;
+			sizes[nr_live++] = sz;
+		}
+	}
+	free(live);
+	free(sizes);
+}
+
+/* bytes an object takes in an allocator; kalloc (and slabs) add a 16 byte header each */
+static size_t footprint_new(size_t size)
+{
+	int class = get_class(size + sizeof(struct header));
+	if(class == -1)
+		return align_up(size + offsetof(struct large_header, hdr) + sizeof(struct header),
+		  mm_page_size(0));
+	return caches[class].sz;
+}
+
+static size_t footprint_old(size_t size)
+{
+	size += 16;
+	for(int i = 0; i < 8; i++) {
+		size_t binsz = (1ul << (i + 4)) + 16;
+		if(binsz > size)
+			return binsz + sizeof(struct slabmarker);
+	}
+	return align_up(size, mm_page_size(0));
+}
+
+static unsigned char pattern(uint32_t id, size_t off)
+{
+	return (id * 31 + off) | 1;
+}
+
+static void check(uint32_t id, size_t from, size_t to, bool zero)
+{
+	unsigned char *p = objs[id].p;
+	for(size_t i = from; i < to; i++) {
+		if(p[i] != (zero ? 0 : pattern(id, i)))
+			errx(1, "object %u: byte %zu is %x", id, i, p[i]);
+	}
+}
+
+static void fill(uint32_t id, size_t from, size_t to)
+{
+	for(size_t i = from; i < to; i++)
+		objs[id].p[i] = pattern(id, i);
+}
+
+struct result {
+	double secs;
+	size_t peak_req, peak_new, peak_old, peak_pages;
+};
+
+static void replay(bool checking, struct result *res)
+{
+	size_t req = 0, fp_new = 0, fp_old = 0;
+	*res = (struct result){};
+	double start = now();
+	for(size_t i = 0; i < nr_ops; i++) {
+		struct op *op = &ops[i];
+		struct obj *o = &objs[op->id];
+		int flags = op->zero ? KALLOC_ZERO : 0;
+		size_t old = o->size;
+		switch(op->type) {
+			case 'a':
+				if(o->p)
+					errx(1, "op %zu: object %u is already allocated", i, op->id);
+				o->p = kalloc(op->size, flags);
+				break;
+			case 'r':
+				o->p = krealloc(o->p, op->size, flags);
+				if(checking)
+					check(op->id, 0, old < op->size ? old : op->size, false);
+				break;
+			case 'f':
+				if(!o->p)
+					errx(1, "op %zu: object %u is not allocated", i, op->id);
+				if(checking)
+					check(op->id, 0, old, false);
+				kfree(o->p);
+				o->p = NULL;
+				break;
+		}
+		o->size = op->type == 'f' ? 0 : op->size;
+		if(checking && o->size > old) {
+			if(op->zero)
+				check(op->id, op->type == 'a' ? 0 : old, o->size, true);
+			fill(op->id, op->type == 'a' ? 0 : old, o->size);
+		}
+
+		if(old) {
+			req -= old;
+			fp_new -= footprint_new(old);
+			fp_old -= footprint_old(old);
+		}
+		if(o->size) {
+			req += o->size;
+			fp_new += footprint_new(o->size);
+			fp_old += footprint_old(o->size);
+		}
+		if(req > res->peak_req) {
+			res->peak_req = req;
+			res->peak_new = fp_new;
+			res->peak_old = fp_old;
+		}
+		if(kstub_kheap_pages > res->peak_pages)
+			res->peak_pages = kstub_kheap_pages;
+	}
+	res->secs = now() - start;
+
+	for(uint32_t id = 0; id < nr_ids; id++) {
+		if(objs[id].p)
+			kfree(objs[id].p);
+		objs[id] = (struct obj){};
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	size_t nr = 500000;
+	long live = 10000;
+	int c;
+	srandom(1);
+	while((c = getopt(argc, argv, "f:n:l:s:")) != EOF) {
+		switch(c) {
+			case 'f':
+				path = optarg;
+				break;
+			case 'n':
+				nr = strtol(optarg, NULL, 0);
+				break;
+			case 'l':
+				live = strtol(optarg, NULL, 0);
+				break;
+			case 's':
+				srandom(atoi(optarg));
+				break;
+			default:
+				fprintf(stderr,
+				  "usage: kallocbench [-f trace] [-n ops] [-l max live objects] [-s seed]\n");
+				return 1;
+		}
+	}
+	if(nr == 0 || live <= 0)
+		errx(1, "bad arguments");
+
+	if(path)
+		load_trace(path);
+	else
+		gen_trace(nr, live);
+	objs = calloc(nr_ids, sizeof(*objs));
+	if(!objs)
+		err(1, "calloc");
+
+	/* one CPU, so that kalloc's slabs have their magazines */
+	kstub_cpu = 0;
+	kalloc_system_init();
+
+	struct result r;
+	replay(false, &r);
+	printf("%zu ops, %u objects: %.1f Mops/s\n", nr_ops, nr_ids, nr_ops / r.secs / 1e6);
+	printf("at the peak, %zu KB requested:\n", r.peak_req / 1024);
+	printf("  %-28s %10zu KB (%.1f%% overhead)\n",
+	  "size classes",
+	  r.peak_new / 1024,
+	  (r.peak_new - r.peak_req) * 100.0 / r.peak_req);
+	printf("  %-28s %10zu KB (%.1f%% overhead)\n",
+	  "power-of-two bins",
+	  r.peak_old / 1024,
+	  (r.peak_old - r.peak_req) * 100.0 / r.peak_req);
+	printf("  %-28s %10zu KB\n", "kheap (size classes, peak)", r.peak_pages * mm_page_size(0) / 1024);
+
+	replay(true, &r);
+	printf("contents and zeroing checked\n");
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Host implementations of the kernel services that the allocator sources call. kheap hands out
+ * zeroed, page-aligned runs from malloc (as the kernel's does from the page allocator), and keeps
+ * count of the pages it has outstanding. */
+
+#include <kheap.h>
+#include <memory.h>
+#include <time.h>
+
+#include "kstub.h"
+
+_Thread_local int kstub_cpu = -1;
+
+_Atomic size_t kstub_kheap_pages = 0;
+
+struct kheap_run *kheap_allocate(size_t len)
+{
+	size_t sz = align_up(len, mm_page_size(0));
+	struct kheap_run *run = malloc(sizeof(*run));
+	if(!run || posix_memalign(&run->start, mm_page_size(0), sz))
+		panic("kheap: out of memory allocating %lx bytes", len);
+	memset(run->start, 0, sz);
+	run->nr_pages = sz / mm_page_size(0);
+	kstub_kheap_pages += run->nr_pages;
+	return run;
+}
+
+void kheap_free(struct kheap_run *run)
+{
+	kstub_kheap_pages -= run->nr_pages;
+	free(run->start);
+	free(run);
+}
+
+uint64_t clksrc_get_nanoseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
@@ -0,0 +1,10 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+/* pages currently allocated from the stub kheap */
+extern _Atomic size_t kstub_kheap_pages;
@@ -0,0 +1,13 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+static inline size_t mm_page_size(const int level)
+{
+	static const size_t __pagesizes[3] = { 0x1000, 2 * 1024 * 1024, 1024 * 1024 * 1024 };
+	return __pagesizes[level];
+}
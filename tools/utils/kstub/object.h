@@ -0,0 +1,71 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+/* The parts of struct object that the object table (core/obj/objtable.c) and the range and page
+ * code (core/obj/range.c and pageop.c) touch. obj_put and obj_hash_invalidate are up to whoever
+ * links those in. */
+
+/* the kernel's object.h brings these in too */
+#include <kalloc.h>
+#include <krc.h>
+#include <lib/list.h>
+#include <lib/rb.h>
+#include <memory.h>
+#include <rwlock.h>
+
+typedef unsigned __int128 objid_t;
+
+#define OF_DELETE 0x80
+#define OF_PAGER 0x200
+#define OF_LARGEPAGES 0x800
+#define OF_COALESCE 0x1000
+
+struct object {
+	objid_t id;
+	struct krc refs;
+	_Atomic uint64_t flags;
+
+	struct rwlock rwlock;
+	struct rbroot range_tree;
+	struct object *_Atomic hnext;
+	struct list coalesce_entry;
+};
+
+/* as in the kernel's object.h */
+struct object_stats {
+	_Atomic uint64_t faults, fault_ns, fault_ns_max;
+	_Atomic uint64_t cow_copies, range_clones, pages_shared;
+	_Atomic uint64_t range_extends, range_merges;
+	_Atomic int64_t ranges;
+	_Atomic uint64_t fault_around;
+	_Atomic uint64_t lookup_slow;
+	_Atomic uint64_t hash_leaves, hash_leaves_cached;
+};
+
+extern struct object_stats object_stats;
+
+void obj_put(struct object *o);
+void obj_hash_invalidate(struct object *obj, size_t pagenr, size_t len);
+
+void obj_table_insert(struct object *obj);
+struct object *obj_table_lookup(objid_t id);
+bool obj_table_put(struct object *obj);
+void obj_table_print_stats(void);
+
+#define OP_LP_ZERO_OK 1
+#define OP_LP_DO_COPY 2
+#define OP_LP_ZERO_PAGE 4
+struct page;
+int object_operate_on_locked_page(struct object *obj,
+  size_t page,
+  int flags,
+  void (*fn)(struct object *obj, size_t, struct page *page, void *data, uint64_t),
+  void *data);
+
+void object_queue_coalesce(struct object *obj);
+void object_idle_coalesce(void);
@@ -0,0 +1,42 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+/* Each thread is one "CPU": kstub_cpu is its id (or -1, for a thread that isn't one), and per-CPU
+ * variables are thread-local. Interrupts don't exist, and a thread never runs another CPU's
+ * code, so disabling them is a no-op. */
+
+#define PROCESSOR_MAX_CPUS 256
+
+extern _Thread_local int kstub_cpu;
+
+#define DECLARE_PER_CPU(type, name) _Thread_local type __per_cpu_var_##name
+#define per_cpu_get(name) (&__per_cpu_var_##name)
+
+static inline int64_t arch_processor_current_id(void)
+{
+	return kstub_cpu;
+}
+
+static inline bool arch_interrupt_set(bool on __unused)
+{
+	return false;
+}
+
+/* there is no scheduler, so nothing runs from an idle loop */
+#define PROCESSOR_HASWORK 1
+
+struct processor {
+	uint64_t flags;
+};
+
+#define current_processor ((struct processor *)NULL)
+
+static inline bool processor_has_threads(struct processor *proc __unused)
+{
+	return false;
+}
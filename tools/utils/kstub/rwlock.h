@@ -0,0 +1,69 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+/* Object contents locks, for the single-threaded tools that build the range and page code. Locks
+ * are never contended, so these only check that they are taken and dropped in the right modes. */
+
+struct rwlock {
+	int32_t readers, writers;
+};
+
+#define RWLOCK_INIT                                                                                \
+	(struct rwlock)                                                                                \
+	{                                                                                              \
+		.readers = 0, .writers = 0                                                                 \
+	}
+
+#define RWLOCK_GOT 0
+#define RWLOCK_TIMEOUT 1
+
+struct rwlock_result {
+	struct rwlock *lock;
+	short res;
+	uint8_t write;
+};
+#define RWLOCK_TRY 1
+#define RWLOCK_RECURSE 2
+
+static inline struct rwlock_result rwlock_rlock(struct rwlock *rw, int flags __unused)
+{
+	assert(!rw->writers);
+	rw->readers++;
+	return (struct rwlock_result){ .lock = rw, .res = RWLOCK_GOT };
+}
+
+static inline struct rwlock_result rwlock_wlock(struct rwlock *rw, int flags __unused)
+{
+	assert(!rw->writers && !rw->readers);
+	rw->writers++;
+	return (struct rwlock_result){ .lock = rw, .res = RWLOCK_GOT, .write = 1 };
+}
+
+static inline void rwlock_runlock(struct rwlock_result *rr)
+{
+	assert(!rr->write && rr->lock->readers > 0);
+	rr->lock->readers--;
+}
+
+static inline void rwlock_wunlock(struct rwlock_result *rr)
+{
+	assert(rr->write && rr->lock->writers == 1);
+	rr->lock->writers--;
+}
+
+static inline struct rwlock_result rwlock_upgrade(struct rwlock_result *rr, int flags)
+{
+	rwlock_runlock(rr);
+	return rwlock_wlock(rr->lock, flags);
+}
+
+static inline struct rwlock_result rwlock_downgrade(struct rwlock_result *rr)
+{
+	rwlock_wunlock(rr);
+	return rwlock_rlock(rr->lock, 0);
+}
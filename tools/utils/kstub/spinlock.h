@@ -0,0 +1,60 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <processor.h>
+#include <sched.h>
+
+/* a test-and-test-and-set lock; there may be more threads than CPUs, so waiters yield. A thread is
+ * told apart by the address of its kstub_cpu, so that it can take a lock recursively. */
+struct spinlock {
+	_Atomic bool locked;
+	bool fl;
+	_Atomic(int *) owner;
+	uint32_t recur_count;
+};
+
+#define DECLARE_SPINLOCK(name) struct spinlock name = { .locked = false }
+
+#define SPINLOCK_INIT                                                                              \
+	(struct spinlock)                                                                              \
+	{                                                                                              \
+		.locked = false                                                                            \
+	}
+
+static inline bool __spinlock_acquire(struct spinlock *l, bool recur)
+{
+	if(recur && atomic_load_explicit(&l->owner, memory_order_relaxed) == &kstub_cpu) {
+		l->recur_count++;
+		return false;
+	}
+	while(atomic_exchange_explicit(&l->locked, true, memory_order_acquire)) {
+		while(atomic_load_explicit(&l->locked, memory_order_relaxed))
+			sched_yield();
+	}
+	atomic_store_explicit(&l->owner, &kstub_cpu, memory_order_relaxed);
+	return false;
+}
+
+static inline bool spinlock_acquire(struct spinlock *l)
+{
+	return __spinlock_acquire(l, false);
+}
+
+static inline void spinlock_release(struct spinlock *l, bool fl __unused)
+{
+	if(l->recur_count) {
+		l->recur_count--;
+		return;
+	}
+	atomic_store_explicit(&l->owner, NULL, memory_order_relaxed);
+	atomic_store_explicit(&l->locked, false, memory_order_release);
+}
+
+#define spinlock_acquire_save(l) (l)->fl = spinlock_acquire(l)
+#define spinlock_release_restore(l) spinlock_release(l, (l)->fl)
+#define spinlock_acquire_save_recur(l) (l)->fl = __spinlock_acquire(l, true)
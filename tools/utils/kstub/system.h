@@ -0,0 +1,65 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Just enough of the kernel's environment to build some of its allocator sources on the host, for
+ * the hosted benchmarks. This file is force-included in place of the kernel's system.h, the other
+ * headers in this directory shadow their kernel counterparts, and the rest of the kernel's headers
+ * are searched after the host's own (so that <string.h> and friends are libc's). Each benchmark
+ * thread stands in for one CPU (see processor.h). */
+
+#pragma once
+
+/* the benchmarks that include this need the GNU extensions (CPU affinity) */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define likely(x) __builtin_expect(x, 1)
+#define unlikely(x) __builtin_expect(x, 0)
+
+static inline unsigned long long __round_up_pow2(unsigned int a)
+{
+	return ((a & (a - 1)) == 0) ? a : 1ull << (sizeof(a) * 8 - __builtin_clz(a));
+}
+
+#define align_down(x, s) ({ (x) & ~(s - 1); })
+
+#define align_up(x, s)                                                                             \
+	({                                                                                             \
+		typeof(x) __y = (x);                                                                       \
+		size_t __sz = (s);                                                                         \
+		((__y - 1) & ~(__sz - 1)) + __sz;                                                          \
+	})
+
+#define is_aligned(x, s) ({ (uintptr_t)(x) % (uintptr_t)(s) == 0; })
+
+#define ___concat(x, y) x##y
+#define __concat(x, y) ___concat(x, y)
+
+#define array_len(x) (sizeof((x)) / sizeof((x)[0]))
+
+#define container_of(ptr, type, member)                                                            \
+	({                                                                                             \
+		const typeof(((type *)0)->member) *__mptr = (ptr);                                         \
+		(type *)((char *)__mptr - offsetof(type, member));                                         \
+	})
+
+#define __unused __attribute__((unused))
+#define __packed __attribute__((packed))
+
+#define printk(...) printf(__VA_ARGS__)
+
+#define panic(msg, ...)                                                                            \
+	({                                                                                             \
+		fprintf(stderr, "panic: %s:%d: " msg "\n", __FILE__, __LINE__, ##__VA_ARGS__);           \
+		abort();                                                                                   \
+	})
@@ -0,0 +1,372 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Stress the kernel's object table (core/obj/objtable.c, built here against the stub kernel in
+ * kstub/) with lookups from many threads, while writer threads fill it up (so that it grows under
+ * the readers) and keep creating and deleting objects (so that lookups race with objects being
+ * freed and their memory reused). Every lookup that returns an object checks that it has the ID
+ * that was asked for, and a lookup of an object that is known to be in the table must find it.
+ *
+ * Lookup throughput is compared with running the same table behind one global lock, as the old
+ * red-black tree was. Each run happens in a child process, so that it starts from an empty
+ * table. */
+
+#include <err.h>
+#include <kalloc.h>
+#include <object.h>
+#include <pthread.h>
+#include <sched.h>
+#include <slab.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define MAX_CHURN 4096
+
+struct object_stats object_stats = {};
+
+/* object memory is type-stable, as it is in the kernel */
+static DECLARE_SLABCACHE_FLAGS(sc_objs,
+  sizeof(struct object),
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  SLABCACHE_TYPESAFE);
+
+static struct spinlock global_lock = SPINLOCK_INIT;
+static bool use_global_lock;
+
+static void obj_release(struct object *o)
+{
+	if(o->flags & OF_DELETE)
+		slabcache_free(&sc_objs, o, NULL);
+}
+
+/* as in core/obj/object.c */
+void obj_put(struct object *o)
+{
+	if(krc_put_unless_one(&o->refs))
+		return;
+	if(!o->id) {
+		if(krc_put(&o->refs))
+			obj_release(o);
+		return;
+	}
+	if(obj_table_put(o))
+		obj_release(o);
+}
+
+static struct object *create(objid_t id)
+{
+	struct object *o = slabcache_alloc(&sc_objs, NULL);
+	/* as obj_init and __obj_alloc do it: the ID is cleared before the count is set */
+	o->flags = 0;
+	o->id = 0;
+	krc_init(&o->refs);
+	o->id = id;
+	if(use_global_lock)
+		spinlock_acquire_save(&global_lock);
+	obj_table_insert(o);
+	if(use_global_lock)
+		spinlock_release_restore(&global_lock);
+	return o;
+}
+
+static void delete(struct object *o)
+{
+	atomic_fetch_or(&o->flags, OF_DELETE);
+	if(use_global_lock)
+		spinlock_acquire_save(&global_lock);
+	obj_put(o);
+	if(use_global_lock)
+		spinlock_release_restore(&global_lock);
+}
+
+static struct object *lookup(objid_t id)
+{
+	if(use_global_lock)
+		spinlock_acquire_save(&global_lock);
+	struct object *o = obj_table_lookup(id);
+	if(use_global_lock)
+		spinlock_release_restore(&global_lock);
+	return o;
+}
+
+static void put(struct object *o)
+{
+	if(use_global_lock)
+		spinlock_acquire_save(&global_lock);
+	obj_put(o);
+	if(use_global_lock)
+		spinlock_release_restore(&global_lock);
+}
+
+struct thread {
+	pthread_t thread;
+	int cpu;
+	/* lookups, or objects created */
+	uint64_t ops;
+} __attribute__((aligned(64)));
+
+static int nr_writers = 1;
+/* churn objects each writer keeps alive; the fewer, the sooner a deleted object's memory is reused
+ * while lookups may still be looking at it */
+static int churn_live = 4;
+/* once the stable objects are in (as fast as the writers can), the churn creates (and deletes)
+ * per second of each writer, so that the writers take the same share of the machine whatever the
+ * readers do; 0 for as fast as they can */
+static long writer_rate = 100000;
+static uint64_t nr_stable = 10000;
+static _Atomic bool go, stop;
+/* stable objects are never deleted; present[id] is set once one has been inserted */
+static _Atomic bool *present;
+/* one past the largest churn ID handed out so far */
+static _Atomic uint64_t churn_next;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pin(int cpu)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu % ncpus, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	kstub_cpu = cpu;
+}
+
+static void *writer_main(void *arg)
+{
+	struct thread *t = arg;
+	pin(t->cpu);
+	struct object *live[MAX_CHURN] = {};
+	uint64_t stable = t->cpu + 1;
+	size_t n = 0;
+	while(!atomic_load(&go))
+		sched_yield();
+	double start = 0;
+	uint64_t churned = 0;
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		if(writer_rate && stable > nr_stable) {
+			if(!churned++)
+				start = now();
+			double ahead = (double)churned / writer_rate - (now() - start);
+			if(ahead > 1e-4) {
+				struct timespec ts = { .tv_nsec = ahead * 1e9 };
+				nanosleep(&ts, NULL);
+			}
+		}
+		if(stable <= nr_stable) {
+			create(stable);
+			atomic_store(&present[stable], true);
+			stable += nr_writers;
+		}
+		struct object **slot = &live[n++ % churn_live];
+		if(*slot)
+			delete(*slot);
+		*slot = create(nr_stable + 1 + atomic_fetch_add(&churn_next, 1));
+		t->ops++;
+	}
+	for(int i = 0; i < churn_live; i++) {
+		if(live[i])
+			delete(live[i]);
+	}
+	return NULL;
+}
+
+static void *reader_main(void *arg)
+{
+	struct thread *t = arg;
+	pin(t->cpu);
+	uint64_t seed = t->cpu * 0x9e3779b97f4a7c15ul + 1;
+	while(!atomic_load(&go))
+		sched_yield();
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		uint64_t r = seed >> 33;
+		uint64_t id;
+		bool must_find = false;
+		if(r % 2) {
+			id = r % nr_stable + 1;
+			must_find = atomic_load(&present[id]);
+		} else {
+			/* recent churn objects, which may be created or deleted at any moment */
+			uint64_t next = atomic_load_explicit(&churn_next, memory_order_relaxed);
+			uint64_t window = churn_live * nr_writers * 2;
+			id = nr_stable + 1 + (next > window ? next - window : 0) + r % window;
+		}
+		struct object *o = lookup(id);
+		t->ops++;
+		if(!o) {
+			if(must_find)
+				errx(1, "object %lu is in the table, but the lookup missed it", (unsigned long)id);
+			continue;
+		}
+		if(o->id != id)
+			errx(1, "looked up object %lu, got %lu", (unsigned long)id, (unsigned long)o->id);
+		put(o);
+	}
+	return NULL;
+}
+
+struct result {
+	double mlookups;
+	uint64_t slow, creates;
+};
+
+static void run_child(int nr, int ms, struct result *res)
+{
+	static struct thread readers[MAX_THREADS], writers[MAX_THREADS];
+	present = calloc(nr_stable + 1, sizeof(*present));
+	if(!present)
+		err(1, "calloc");
+	for(int i = 0; i < nr_writers; i++) {
+		writers[i] = (struct thread){ .cpu = i };
+		if(pthread_create(&writers[i].thread, NULL, writer_main, &writers[i]))
+			errx(1, "pthread_create");
+	}
+	for(int i = 0; i < nr; i++) {
+		readers[i] = (struct thread){ .cpu = nr_writers + i };
+		if(pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]))
+			errx(1, "pthread_create");
+	}
+	go = true;
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000l };
+	nanosleep(&ts, NULL);
+	stop = true;
+	uint64_t lookups = 0;
+	for(int i = 0; i < nr; i++) {
+		pthread_join(readers[i].thread, NULL);
+		lookups += readers[i].ops;
+	}
+	for(int i = 0; i < nr_writers; i++) {
+		pthread_join(writers[i].thread, NULL);
+		res->creates += writers[i].ops;
+	}
+
+	res->mlookups = lookups / (ms / 1e3) / 1e6;
+	res->slow = object_stats.lookup_slow;
+
+	/* everything that was inserted must still be found, and nothing else */
+	for(uint64_t id = 1; id <= nr_stable; id++) {
+		struct object *o = obj_table_lookup(id);
+		if(!!o != atomic_load(&present[id]))
+			errx(1, "object %lu: lookup %s after the run", (unsigned long)id, o ? "hit" : "missed");
+		if(o)
+			obj_put(o);
+	}
+	for(uint64_t id = nr_stable + 1; id <= nr_stable + churn_next; id++) {
+		if(obj_table_lookup(id))
+			errx(1, "deleted object %lu is still in the table", (unsigned long)id);
+	}
+}
+
+static struct result run(int nr, int ms, bool global)
+{
+	struct result *res =
+	  mmap(NULL, sizeof(*res), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(res == MAP_FAILED)
+		err(1, "mmap");
+	*res = (struct result){};
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == -1)
+		err(1, "fork");
+	if(pid == 0) {
+		use_global_lock = global;
+		run_child(nr, ms, res);
+		exit(0);
+	}
+	int status;
+	if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+		errx(1, "run with %d readers failed", nr);
+	struct result r = *res;
+	munmap(res, sizeof(*res));
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max = ncpus > 0 ? ncpus : 1;
+	int ms = 1000;
+	int c;
+	while((c = getopt(argc, argv, "t:d:w:n:r:c:")) != EOF) {
+		switch(c) {
+			case 't':
+				max = atoi(optarg);
+				break;
+			case 'd':
+				ms = atoi(optarg);
+				break;
+			case 'w':
+				nr_writers = atoi(optarg);
+				break;
+			case 'n':
+				nr_stable = strtol(optarg, NULL, 0);
+				break;
+			case 'r':
+				writer_rate = strtol(optarg, NULL, 0);
+				break;
+			case 'c':
+				churn_live = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr,
+				  "usage: objbench [-t max readers] [-d ms] [-w writers] [-n objects] "
+				  "[-r writes/s] [-c churn objects]\n");
+				return 1;
+		}
+	}
+	if(max < 1 || nr_writers < 1 || max + nr_writers > MAX_THREADS || ms <= 0 || nr_stable < 1
+	   || writer_rate < 0 || churn_live < 1 || churn_live > MAX_CHURN)
+		errx(1, "bad arguments");
+
+	kalloc_system_init();
+	printf("%ld cpus, %d ms per run, %d writers at %ld creates/s, %lu objects\n",
+	  ncpus,
+	  ms,
+	  nr_writers,
+	  writer_rate,
+	  (unsigned long)nr_stable);
+	printf("%-8s %12s %12s %12s %12s %12s\n",
+	  "readers",
+	  "table Ml/s",
+	  "slow",
+	  "creates",
+	  "1-lock Ml/s",
+	  "creates");
+	for(int nr = 1;; nr = nr * 2 > max && nr < max ? max : nr * 2) {
+		struct result t = run(nr, ms, false);
+		struct result g = run(nr, ms, true);
+		printf("%-8d %12.2f %12lu %12lu %12.2f %12lu\n",
+		  nr,
+		  t.mlookups,
+		  (unsigned long)t.slow,
+		  (unsigned long)t.creates,
+		  g.mlookups,
+		  (unsigned long)g.creates);
+		if(nr >= max)
+			break;
+	}
+	return 0;
+}
@@ -66,7 +66,19 @@ objid_t compute_objid(char *base)
 	blake2b_update(&S, &mi->p_flags, sizeof(mi->p_flags));
 	blake2b_update(&S, &mi->kuid, sizeof(mi->kuid));
 	if(mi->p_flags & MIP_HASHDATA) {
-		blake2b_update(&S, base + OBJ_NULLPAGE_SIZE, mi->sz);
+		if(mi->p_flags & MIP_HASHTREE) {
+			for(size_t off = 0; off < mi->sz; off += MI_HASHTREE_LEAF) {
+				size_t len = mi->sz - off < MI_HASHTREE_LEAF ? mi->sz - off : MI_HASHTREE_LEAF;
+				blake2b_state L;
+				unsigned char leaf[32];
+				blake2b_init_leaf(&L, 32, MI_HASHTREE_LEAF, off / MI_HASHTREE_LEAF);
+				blake2b_update(&L, base + OBJ_NULLPAGE_SIZE + off, len);
+				blake2b_final(&L, leaf, 32);
+				blake2b_update(&S, leaf, 32);
+			}
+		} else {
+			blake2b_update(&S, base + OBJ_NULLPAGE_SIZE, mi->sz);
+		}
 		size_t ml = OBJ_METAPAGE_SIZE + sizeof(struct fotentry) * mi->fotentries;
 		blake2b_update(&S, base + OBJ_MAXSIZE - ml, ml);
 	}
@@ -0,0 +1,279 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Replay page fault patterns against the kernel's pagevec (core/obj/pagevec.c, a radix tree, built
+ * here against the stub kernel in kstub/), and against the dense vector of page entries that it
+ * replaced, reproduced below on top of the kernel's lib/vector.h. For each pattern, a number of
+ * objects (of the maximum object size) each fault in their pages, which allocates them, and then
+ * look every page up again. Reported are the time per fault and per lookup, and how much kernel
+ * heap each object's page index takes. Pages themselves come from a stub page allocator, and
+ * aren't counted. */
+
+#include <err.h>
+#include <kalloc.h>
+#include <lib/vector.h>
+#include <memory.h>
+#include <object.h>
+#include <page.h>
+#include <pagevec.h>
+#include <processor.h>
+#include <slab.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <twz/obj.h>
+#include <unistd.h>
+
+#include "kstub/kstub.h"
+
+#define OBJ_PAGES (OBJ_MAXSIZE / 0x1000)
+/* the metadata page, at the very end of every object */
+#define META_PAGE (OBJ_PAGES - 1)
+
+struct page *mm_page_alloc(int flags)
+{
+	struct page *page = aligned_alloc(_Alignof(struct page), sizeof(*page));
+	if(!page)
+		err(1, "aligned_alloc");
+	*page = (struct page){ .__addr_and_flags = flags & PAGE_TRACKED, .refs = 1 };
+	return page;
+}
+
+void mm_page_put(struct page *page)
+{
+	if(--page->refs == 0)
+		free(page);
+}
+
+struct page *mm_page_clone(struct page *page)
+{
+	return mm_page_alloc(mm_page_flags(page));
+}
+
+struct page *mm_page_alloc_large(int flags)
+{
+	return NULL;
+}
+
+void mm_page_free_large(struct page *pages)
+{
+	errx(1, "no large pages here");
+}
+
+/* the page index before the radix tree: a vector grown to cover the highest page touched */
+static struct page *dense_get_page(struct vector *pages, size_t idx)
+{
+	struct page_entry *entry = vector_get(pages, idx);
+	if(!entry || !entry->page) {
+		struct page_entry newentry = { .page = mm_page_alloc(PAGE_ZERO | PAGE_TRACKED) };
+		vector_set_grow(pages, idx, &newentry);
+		return newentry.page;
+	}
+	return entry->page;
+}
+
+static struct page *dense_lookup_page(struct vector *pages, size_t idx)
+{
+	struct page_entry *entry = vector_get(pages, idx);
+	return entry ? entry->page : NULL;
+}
+
+static void dense_free(struct vector *pages)
+{
+	for(size_t i = 0; i < pages->length; i++) {
+		struct page_entry *entry = vector_get(pages, i);
+		if(entry->page)
+			mm_page_put(entry->page);
+	}
+	vector_destroy(pages);
+}
+
+struct pattern {
+	const char *name;
+	const char *desc;
+	size_t nr;
+	size_t *pages;
+};
+
+static void add_page(struct pattern *p, size_t page)
+{
+	p->pages = realloc(p->pages, (p->nr + 1) * sizeof(*p->pages));
+	if(!p->pages)
+		err(1, "realloc");
+	p->pages[p->nr++] = page;
+}
+
+static struct pattern patterns[] = {
+	{ .name = "seq", .desc = "the first 1024 data pages, in order" },
+	{ .name = "seq+meta", .desc = "the metadata page, then 256 data pages in order" },
+	{ .name = "random", .desc = "1024 random pages anywhere in the object" },
+	{ .name = "sparse", .desc = "every 4096th page" },
+	{ .name = "meta", .desc = "the first data page and the metadata page" },
+};
+
+static void make_patterns(void)
+{
+	for(size_t i = 1; i <= 1024; i++)
+		add_page(&patterns[0], i);
+	add_page(&patterns[1], META_PAGE);
+	for(size_t i = 1; i <= 256; i++)
+		add_page(&patterns[1], i);
+	for(size_t i = 0; i < 1024; i++)
+		add_page(&patterns[2], 1 + random() % (OBJ_PAGES - 1));
+	for(size_t i = 1; i < OBJ_PAGES; i += 4096)
+		add_page(&patterns[3], i);
+	add_page(&patterns[4], 1);
+	add_page(&patterns[4], META_PAGE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct result {
+	double fault_ns, lookup_ns, kb;
+};
+
+/* hand back what the slab caches are holding on to from the previous replay, so that the kernel
+ * heap a replay uses shows up as new kheap pages */
+static size_t heap_pages(void)
+{
+	slabcache_reap_request();
+	slabcache_idle_reap();
+	slabcache_reap_all();
+	slabcache_reap_all();
+	return kstub_kheap_pages;
+}
+
+static struct result replay_radix(struct pattern *p, int nr_objs)
+{
+	struct pagevec **pvs = calloc(nr_objs, sizeof(*pvs));
+	size_t before = heap_pages();
+	double start = now();
+	for(int o = 0; o < nr_objs; o++) {
+		pvs[o] = pagevec_new();
+		for(size_t i = 0; i < p->nr; i++) {
+			struct page *page;
+			pagevec_lock(pvs[o]);
+			pagevec_get_page(pvs[o], p->pages[i], &page, GET_PAGE_BLOCK);
+			pagevec_unlock(pvs[o]);
+		}
+	}
+	double mid = now();
+	for(int o = 0; o < nr_objs; o++) {
+		for(size_t i = 0; i < p->nr; i++) {
+			if(!pagevec_lookup_page(pvs[o], p->pages[i]))
+				errx(1, "%s: page %zu missing", p->name, p->pages[i]);
+		}
+	}
+	double end = now();
+	struct result r = {
+		.fault_ns = (mid - start) * 1e9 / (nr_objs * p->nr),
+		.lookup_ns = (end - mid) * 1e9 / (nr_objs * p->nr),
+		.kb = (double)(kstub_kheap_pages - before) * mm_page_size(0) / 1024 / nr_objs,
+	};
+	for(int o = 0; o < nr_objs; o++)
+		pagevec_free(pvs[o]);
+	free(pvs);
+	return r;
+}
+
+static struct result replay_dense(struct pattern *p, int nr_objs)
+{
+	struct vector *vecs = calloc(nr_objs, sizeof(*vecs));
+	size_t before = heap_pages();
+	double start = now();
+	for(int o = 0; o < nr_objs; o++) {
+		vector_init(&vecs[o], sizeof(struct page_entry), _Alignof(struct page_entry));
+		for(size_t i = 0; i < p->nr; i++)
+			dense_get_page(&vecs[o], p->pages[i]);
+	}
+	double mid = now();
+	for(int o = 0; o < nr_objs; o++) {
+		for(size_t i = 0; i < p->nr; i++) {
+			if(!dense_lookup_page(&vecs[o], p->pages[i]))
+				errx(1, "%s: page %zu missing", p->name, p->pages[i]);
+		}
+	}
+	double end = now();
+	struct result r = {
+		.fault_ns = (mid - start) * 1e9 / (nr_objs * p->nr),
+		.lookup_ns = (end - mid) * 1e9 / (nr_objs * p->nr),
+		.kb = (double)(kstub_kheap_pages - before) * mm_page_size(0) / 1024 / nr_objs,
+	};
+	for(int o = 0; o < nr_objs; o++)
+		dense_free(&vecs[o]);
+	free(vecs);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_objs = 64;
+	int c;
+	srandom(1);
+	while((c = getopt(argc, argv, "o:s:")) != EOF) {
+		switch(c) {
+			case 'o':
+				nr_objs = atoi(optarg);
+				break;
+			case 's':
+				srandom(atoi(optarg));
+				break;
+			default:
+				fprintf(stderr, "usage: pvbench [-o objects per pattern] [-s seed]\n");
+				return 1;
+		}
+	}
+	if(nr_objs < 1)
+		errx(1, "bad arguments");
+
+	kstub_cpu = 0;
+	kalloc_system_init();
+	make_patterns();
+
+	printf("%d objects of %lu pages per pattern\n", nr_objs, (unsigned long)OBJ_PAGES);
+	for(size_t i = 0; i < array_len(patterns); i++)
+		printf("  %-10s %s\n", patterns[i].name, patterns[i].desc);
+	printf("%-10s %7s | %10s %10s %10s | %10s %10s %10s\n",
+	  "",
+	  "",
+	  "radix",
+	  "",
+	  "",
+	  "dense",
+	  "",
+	  "");
+	printf("%-10s %7s | %10s %10s %10s | %10s %10s %10s\n",
+	  "pattern",
+	  "faults",
+	  "ns/fault",
+	  "ns/lookup",
+	  "KB/object",
+	  "ns/fault",
+	  "ns/lookup",
+	  "KB/object");
+	for(size_t i = 0; i < array_len(patterns); i++) {
+		struct pattern *p = &patterns[i];
+		struct result r = replay_radix(p, nr_objs);
+		struct result d = replay_dense(p, nr_objs);
+		printf("%-10s %7zu | %10.0f %10.1f %10.1f | %10.0f %10.1f %10.1f\n",
+		  p->name,
+		  p->nr,
+		  r.fault_ns,
+		  r.lookup_ns,
+		  r.kb,
+		  d.fault_ns,
+		  d.lookup_ns,
+		  d.kb);
+	}
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Compare the read throughput of the kernel's reader-writer lock with a single shared reader count
+ * against per-CPU reader counts (rwlock_set_percpu), as the number of reading threads grows. The
+ * two protocols are reproduced here from core/rwlock.c, with one thread standing in for each CPU.
+ * Optionally, each thread also takes the lock for writing once every so many reads. */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+
+struct rw_cpu {
+	_Atomic int32_t readers;
+} __attribute__((aligned(64)));
+
+struct rw {
+	_Atomic int32_t readers, writers;
+	struct rw_cpu *pcpu;
+} __attribute__((aligned(64)));
+
+static struct rw lock;
+static struct rw_cpu pcpu[MAX_THREADS];
+
+static void relax(void)
+{
+	/* the threads may outnumber the CPUs, so don't spin on a waiter that isn't running */
+	sched_yield();
+}
+
+static _Atomic int32_t *reader_count(int cpu)
+{
+	return lock.pcpu ? &lock.pcpu[cpu].readers : &lock.readers;
+}
+
+static void rlock(int cpu)
+{
+	_Atomic int32_t *count = reader_count(cpu);
+	while(1) {
+		atomic_fetch_add(count, 1);
+		if(atomic_load(&lock.writers) == 0)
+			return;
+		atomic_fetch_sub(count, 1);
+		while(atomic_load(&lock.writers))
+			relax();
+	}
+}
+
+static void runlock(int cpu)
+{
+	atomic_fetch_sub(reader_count(cpu), 1);
+}
+
+static bool has_readers(int nr)
+{
+	if(atomic_load(&lock.readers))
+		return true;
+	if(lock.pcpu) {
+		for(int i = 0; i < nr; i++) {
+			if(atomic_load(&lock.pcpu[i].readers))
+				return true;
+		}
+	}
+	return false;
+}
+
+static void wlock(int nr)
+{
+	while(atomic_fetch_add(&lock.writers, 1)) {
+		atomic_fetch_sub(&lock.writers, 1);
+		while(atomic_load(&lock.writers))
+			relax();
+	}
+	while(has_readers(nr))
+		relax();
+}
+
+static void wunlock(void)
+{
+	atomic_fetch_sub(&lock.writers, 1);
+}
+
+struct worker {
+	pthread_t thread;
+	int cpu, nr;
+	uint64_t write_every;
+	uint64_t reads, writes;
+} __attribute__((aligned(64)));
+
+static _Atomic bool go, stop;
+/* the data the lock protects */
+static volatile uint64_t data[8];
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu % ncpus, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	while(!atomic_load(&go))
+		relax();
+	uint64_t sum = 0;
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		if(w->write_every && w->reads % w->write_every == w->write_every - 1) {
+			wlock(w->nr);
+			data[w->writes % 8]++;
+			wunlock();
+			w->writes++;
+		}
+		rlock(w->cpu);
+		sum += data[w->reads % 8];
+		runlock(w->cpu);
+		w->reads++;
+	}
+	return (void *)(uintptr_t)sum;
+}
+
+/* millions of reads per second, over all threads */
+static double run(int nr, bool percpu, int ms, long write_every, uint64_t *writes)
+{
+	static struct worker workers[MAX_THREADS];
+	lock.pcpu = percpu ? pcpu : NULL;
+	go = stop = false;
+	for(int i = 0; i < nr; i++) {
+		workers[i] = (struct worker){ .cpu = i, .nr = nr, .write_every = write_every };
+		if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+			errx(1, "pthread_create");
+	}
+	go = true;
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000l };
+	nanosleep(&ts, NULL);
+	stop = true;
+	uint64_t reads = 0;
+	*writes = 0;
+	for(int i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		reads += workers[i].reads;
+		*writes += workers[i].writes;
+	}
+	if(lock.readers || lock.writers || has_readers(nr))
+		errx(1, "lock not released");
+	return reads / (ms / 1e3) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max = ncpus > 0 ? ncpus : 1;
+	int ms = 1000;
+	long write_every = 0;
+	int c;
+	while((c = getopt(argc, argv, "t:d:w:")) != EOF) {
+		switch(c) {
+			case 't':
+				max = atoi(optarg);
+				break;
+			case 'd':
+				ms = atoi(optarg);
+				break;
+			case 'w':
+				write_every = strtol(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: rwbench [-t max threads] [-d ms] [-w reads per write]\n");
+				return 1;
+		}
+	}
+	if(max < 1 || max > MAX_THREADS || ms <= 0 || write_every < 0)
+		errx(1, "bad arguments");
+
+	printf("%ld cpus, %d ms per run", ncpus, ms);
+	if(write_every)
+		printf(", a write every %ld reads per thread", write_every);
+	printf("\n%-8s %14s %14s %10s\n", "threads", "shared Mr/s", "per-cpu Mr/s", "writes");
+	for(int nr = 1;; nr = nr * 2 > max && nr < max ? max : nr * 2) {
+		uint64_t sw, pw;
+		double s = run(nr, false, ms, write_every, &sw);
+		double p = run(nr, true, ms, write_every, &pw);
+		printf("%-8d %14.1f %14.1f %10lu\n", nr, s, p, (unsigned long)(sw + pw));
+		if(nr >= max)
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * SPDX-FileCopyrightText: 2021 Daniel Bittman <danielbittman1@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Measure the kernel's slab allocator (core/mm/slab2.c, built here against the stub kernel in
+ * kstub/) with and without its per-CPU magazine layer, as the number of allocating threads grows.
+ * Each thread stands in for one CPU, and repeatedly allocates a batch of objects, writes to them,
+ * and frees them again. After each magazine run, the tool also reports how much memory the cache
+ * still holds once the depots are reaped, before and after every CPU drains its own magazines (as
+ * it would from its idle loop), and checks that every object made it back to its slab. */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <memory.h>
+#include <pthread.h>
+#include <sched.h>
+#include <slab.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kstub/kstub.h"
+
+#define MAX_THREADS 64
+#define MAX_BATCH 1024
+
+static struct slabcache sc_mag, sc_nomag;
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	struct slabcache *sc;
+	uint64_t ops;
+} __attribute__((aligned(64)));
+
+static int batch = 8;
+static _Atomic bool go, stop;
+/* after a run, threads drain their magazines one at a time, in the order of this counter */
+static _Atomic int drain_turn;
+static _Atomic int stopped;
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu % ncpus, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	kstub_cpu = w->cpu;
+	void *objs[MAX_BATCH];
+	while(!atomic_load(&go))
+		sched_yield();
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for(int i = 0; i < batch; i++) {
+			objs[i] = slabcache_alloc(w->sc, NULL);
+			*(volatile uint64_t *)objs[i] = w->ops + i;
+		}
+		for(int i = batch - 1; i >= 0; i--)
+			slabcache_free(w->sc, objs[i], NULL);
+		w->ops += batch * 2;
+	}
+	atomic_fetch_add(&stopped, 1);
+
+	while(atomic_load(&drain_turn) != w->cpu)
+		sched_yield();
+	/* an idle reap that kheap asked for drains this CPU's magazines no matter what */
+	slabcache_reap_request();
+	slabcache_idle_reap();
+	atomic_fetch_add(&drain_turn, 1);
+	return NULL;
+}
+
+/* give back whatever the depots and empty slabs are holding; it takes two passes for the depot
+ * and slab hysteresis to let go of everything that is idle */
+static size_t reap_pages(void)
+{
+	slabcache_reap_all();
+	slabcache_reap_all();
+	return kstub_kheap_pages;
+}
+
+/* millions of operations (allocations plus frees) per second, over all threads */
+static double run(struct slabcache *sc, int nr, int ms, size_t *before, size_t *after)
+{
+	static struct worker workers[MAX_THREADS];
+	go = stop = false;
+	drain_turn = -1;
+	stopped = 0;
+	for(int i = 0; i < nr; i++) {
+		workers[i] = (struct worker){ .cpu = i, .sc = sc };
+		if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+			errx(1, "pthread_create");
+	}
+	go = true;
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000l };
+	nanosleep(&ts, NULL);
+	stop = true;
+
+	while(atomic_load(&stopped) != nr)
+		sched_yield();
+	*before = reap_pages();
+	drain_turn = 0;
+	for(int i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	uint64_t ops = 0;
+	for(int i = 0; i < nr; i++)
+		ops += workers[i].ops;
+	*after = reap_pages();
+
+	if(sc->stats.total_alloced != sc->stats.total_freed)
+		errx(1,
+		  "%s: %zu objects allocated from slabs, but %zu freed",
+		  sc->name,
+		  sc->stats.total_alloced,
+		  sc->stats.total_freed);
+	return ops / (ms / 1e3) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max = ncpus > 0 ? ncpus : 1;
+	int ms = 1000;
+	long size = 64;
+	int c;
+	while((c = getopt(argc, argv, "t:d:s:b:")) != EOF) {
+		switch(c) {
+			case 't':
+				max = atoi(optarg);
+				break;
+			case 'd':
+				ms = atoi(optarg);
+				break;
+			case 's':
+				size = strtol(optarg, NULL, 0);
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr,
+				  "usage: slabbench [-t max threads] [-d ms] [-s object size] [-b batch]\n");
+				return 1;
+		}
+	}
+	if(max < 1 || max > MAX_THREADS || ms <= 0 || size < 8 || size > 2048 || batch < 1
+	   || batch > MAX_BATCH)
+		errx(1, "bad arguments");
+
+	slabcache_init(&sc_mag, "magazine", size, NULL, NULL, NULL, NULL, NULL);
+	slabcache_init(&sc_nomag, "no-magazine", size, NULL, NULL, NULL, NULL, NULL);
+	sc_nomag.flags = SLABCACHE_NO_MAGAZINE;
+
+	printf("%ld cpus, %d ms per run, %ld byte objects, batches of %d\n", ncpus, ms, size, batch);
+	printf("%-8s %14s %14s %14s %14s\n",
+	  "threads",
+	  "magazine Mo/s",
+	  "slab Mo/s",
+	  "reaped KB",
+	  "drained KB");
+	for(int nr = 1;; nr = nr * 2 > max && nr < max ? max : nr * 2) {
+		size_t before, after, dummy;
+		double m = run(&sc_mag, nr, ms, &before, &after);
+		double s = run(&sc_nomag, nr, ms, &dummy, &dummy);
+		printf("%-8d %14.1f %14.1f %14zu %14zu\n",
+		  nr,
+		  m,
+		  s,
+		  before * mm_page_size(0) / 1024,
+		  after * mm_page_size(0) / 1024);
+		if(nr >= max)
+			break;
+	}
+	return 0;
+}